@@ -0,0 +1,187 @@
+/*
+ * NAF compressor
+ * Copyright (c) 2018-2021 Kirill Kryukov
+ * See README.md and LICENSE files of this repository
+ */
+
+/*
+ * Codecs other than zstd, selectable for sequence and quality ("--seq-codec", "--qual-codec").
+ * "store" keeps the data as is.
+ * "lz4" splits the data into blocks, each compressed independently in LZ4 block format.
+ * "cm" (only for 4-bit sequence) uses the same blocks, each compressed independently with a context model (see "cm.c").
+ * "fqz" (only for qualities) also uses the same blocks, compressed with a quality model and rANS (see "fqz.c").
+ * Each block is written as: original size (4 bytes), stored size (4 bytes), stored data, with sizes in little-endian.
+ * A block that can't be made smaller is stored as is, with stored size equal to original size.
+ * "store" and "lz4" decode at close to memory speed, for data that is decompressed often and is cheap to keep larger.
+ * "cm" and "fqz" are the opposite: they are slower, but make their data much smaller than zstd can.
+ */
+
+#define codec_block_size (4u * 1024 * 1024)
+#define codec_block_bound (codec_block_size + codec_block_size / 255u + 16u + 8u)
+
+#define lz4_min_match 4
+#define lz4_last_literals 5
+#define lz4_match_find_limit 12
+#define lz4_max_offset 65535
+#define lz4_hash_log 14
+
+
+static int parse_codec_name(const char *name, const char *option)
+{
+    if (!strcmp(name, "zstd")) { return codec_zstd; }
+    if (!strcmp(name, "store")) { return codec_store; }
+    if (!strcmp(name, "lz4")) { return codec_lz4; }
+    if (!strcmp(name, "cm")) { return codec_cm; }
+    if (!strcmp(name, "fqz")) { return codec_fqz; }
+    die("unknown codec \"%s\" for '%s', should be one of: zstd, store, lz4 or %s\n", name, option,
+        strcmp(option, "--seq-codec") ? "fqz" : "cm");
+}
+
+
+static const char* codec_name(int codec)
+{
+    return (codec == codec_store) ? "store" : (codec == codec_lz4) ? "lz4" : (codec == codec_cm) ? "cm" : (codec == codec_fqz) ? "fqz" : "zstd";
+}
+
+
+static inline unsigned int lz4_read32(const unsigned char *p)
+{
+    unsigned int v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+
+static inline unsigned lz4_hash(unsigned int v)
+{
+    return (v * 2654435761u) >> (32 - lz4_hash_log);
+}
+
+
+/*
+ * Returns the number of equal bytes at "q" and "r", stopping at "limit".
+ */
+static inline size_t lz4_count(const unsigned char *q, const unsigned char *r, const unsigned char *limit)
+{
+    const unsigned char *start = q;
+    while (q + 8 <= limit)
+    {
+        unsigned long long a, b;
+        memcpy(&a, q, 8);
+        memcpy(&b, r, 8);
+        if (a != b) { return (size_t)(q - start) + ((unsigned)__builtin_ctzll(a ^ b) >> 3); }
+        q += 8;
+        r += 8;
+    }
+    while (q < limit && *q == *r) { q++; r++; }
+    return (size_t)(q - start);
+}
+
+
+static inline unsigned char* lz4_put_length(unsigned char *out, size_t len)
+{
+    for (; len >= 255; len -= 255) { *out++ = 255; }
+    *out++ = (unsigned char)len;
+    return out;
+}
+
+
+static inline unsigned char* lz4_put_sequence(unsigned char *out, const unsigned char *literals, size_t n_literals,
+                                              size_t offset, size_t match_len)
+{
+    unsigned char *token = out++;
+    *token = (unsigned char)((n_literals >= 15 ? 15 : n_literals) << 4);
+    if (n_literals >= 15) { out = lz4_put_length(out, n_literals - 15); }
+    memcpy(out, literals, n_literals);
+    out += n_literals;
+
+    if (match_len == 0) { return out; }
+
+    *out++ = (unsigned char)(offset & 255);
+    *out++ = (unsigned char)(offset >> 8);
+    size_t m = match_len - lz4_min_match;
+    *token |= (unsigned char)(m >= 15 ? 15 : m);
+    if (m >= 15) { out = lz4_put_length(out, m - 15); }
+    return out;
+}
+
+
+/*
+ * Compresses "size" bytes (at most "codec_block_size") from "src" into "dst", which must have "codec_block_bound" bytes.
+ * Uses greedy matching with a single-entry hash table, skipping faster through data that does not match.
+ * Returns the compressed size.
+ */
+static size_t lz4_compress_block(const unsigned char *src, size_t size, unsigned char *dst)
+{
+    static unsigned int table[1u << lz4_hash_log];
+
+    assert(size <= codec_block_size);
+
+    unsigned char *out = dst;
+    const unsigned char *anchor = src;
+
+    if (size > lz4_match_find_limit)
+    {
+        memset(table, 0, sizeof(table));
+        const unsigned char *match_limit = src + size - lz4_match_find_limit;
+        const unsigned char *copy_limit = src + size - lz4_last_literals;
+        const unsigned char *p = src + 1;
+        unsigned misses = 0;
+
+        while (p < match_limit)
+        {
+            unsigned int v = lz4_read32(p);
+            unsigned h = lz4_hash(v);
+            const unsigned char *ref = src + table[h];
+            table[h] = (unsigned int)(p - src);
+
+            if (ref >= p || (size_t)(p - ref) > lz4_max_offset || lz4_read32(ref) != v)
+            {
+                p += 1 + (misses++ >> 6);
+                continue;
+            }
+            misses = 0;
+
+            while (p > anchor && ref > src && p[-1] == ref[-1]) { p--; ref--; }
+
+            const unsigned char *q = p + lz4_min_match;
+            q += lz4_count(q, ref + lz4_min_match, copy_limit);
+
+            out = lz4_put_sequence(out, anchor, (size_t)(p - anchor), (size_t)(p - ref), (size_t)(q - p));
+            anchor = q;
+
+            if (q < match_limit) { table[lz4_hash(lz4_read32(q - 2))] = (unsigned int)(q - 2 - src); }
+            p = q;
+        }
+    }
+
+    out = lz4_put_sequence(out, anchor, (size_t)(src + size - anchor), 0, 0);
+    return (size_t)(out - dst);
+}
+
+
+static bool has_non_zstd_codecs(void)
+{
+    return seq_codec != codec_zstd || (store_qual && qual_codec != codec_zstd);
+}
+
+
+/*
+ * Payload: number of entries, and for each part not compressed with zstd: its bit in the flags byte, and codec id.
+ */
+static void write_codecs_extension(FILE *F)
+{
+    unsigned long long n = 0;
+    unsigned char parts[2], codecs[2];
+    if (seq_codec != codec_zstd) { parts[n] = 0x02; codecs[n] = (unsigned char)seq_codec; n++; }
+    if (store_qual && qual_codec != codec_zstd) { parts[n] = 0x01; codecs[n] = (unsigned char)qual_codec; n++; }
+
+    write_variable_length_encoded_number(F, ext_codecs);
+    write_variable_length_encoded_number(F, 1 + n * 2);
+    write_variable_length_encoded_number(F, n);
+    for (unsigned long long i = 0; i < n; i++)
+    {
+        write_variable_length_encoded_number(F, parts[i]);
+        write_variable_length_encoded_number(F, codecs[i]);
+    }
+}
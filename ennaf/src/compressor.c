@@ -4,6 +4,24 @@
  * See README.md and LICENSE files of this repository
  */
 
+/*
+ * With "--target-speed", each stream measures the processing speed over every block of its input,
+ * and raises or lowers its own compression level between blocks.
+ * Speed is the amount of the stream's own data compressed per second of processor time spent compressing it,
+ * so neither other streams nor waiting for slow input count.
+ * The speed last seen at each level is remembered, so that a level known to be too slow is not retried
+ * until the memory is cleared, which happens periodically, to follow changes in the input.
+ * Levels range from -5 to 19, extended to include the level requested by the user.
+ * A level change takes effect only at the start of a zstd frame, so the stream ends its current frame first.
+ * A part then consists of several frames, which is recorded in the "Frames" extension record.
+ */
+
+#define adaptive_block_size (4ull * 1000 * 1000)
+#define adaptive_memory_n_blocks 32
+
+static int adaptive_min_level = -5;
+static int adaptive_max_level = 19;
+
 static ZSTD_CStream* create_zstd_cstream(int level, int window_size_log)
 {
     ZSTD_CStream *s = ZSTD_createCStream();
@@ -41,10 +59,31 @@ static void compressor_init(compressor_t *w, const char *name, int window_size_l
 
     w->allocated = COMPRESSED_BUFFER_SIZE;
     w->buf = (unsigned char *) malloc_or_die(w->allocated);
-    w->cstream = create_zstd_cstream(compression_level, window_size_log);
+    w->name = name;
+    w->level = compression_level;
+    w->adaptive = (target_speed > 0.0 && w->codec == codec_zstd);
+    if (w->adaptive)
+    {
+        if (w->level < adaptive_min_level) { adaptive_min_level = w->level; }
+        if (w->level > adaptive_max_level) { adaptive_max_level = w->level; }
+        size_t n_levels = (size_t)(adaptive_max_level - adaptive_min_level + 1);
+        w->level_speeds = (double *) malloc_or_die(sizeof(double) * n_levels);
+        for (size_t i = 0; i < n_levels; i++) { w->level_speeds[i] = 0.0; }
+    }
+    if (w->codec == codec_zstd)
+    {
+        w->cstream = create_zstd_cstream(w->level, window_size_log);
+        if (w->prefix != NULL) { ZSTD_TRY(ZSTD_CCtx_refPrefix(w->cstream, w->prefix, w->prefix_size)); }
+    }
+    else if (w->codec == codec_lz4 || w->codec == codec_cm || w->codec == codec_fqz)
+    {
+        w->block = (unsigned char *) malloc_or_die(codec_block_size);
+        w->block_out = (unsigned char *) malloc_or_die(codec_block_bound);
+    }
     w->path = (char *) malloc_or_die(temp_path_length + 1);
     snprintf(w->path, temp_path_length, "%s/%s.%s", temp_dir, temp_prefix, name);
     if (verbose) { msg("Temp %s file: \"%s\"\n", name, w->path); }
+    if (verbose && w->codec != codec_zstd) { msg("Codec for %s: %s\n", name, codec_name(w->codec)); }
 }
 
 
@@ -61,16 +100,17 @@ static inline void compressor_create_file(compressor_t *w)
 }
 
 
-static void compressor_end_stream(compressor_t *w)
+/*
+ * Appends "size" bytes of already encoded data to the compressed output of the stream.
+ */
+static void compressor_put_bytes(compressor_t *w, const unsigned char *data, size_t size)
 {
     assert(w != NULL);
+    assert(w->buf != NULL);
 
-    if (w->cstream != NULL)
+    while (size > 0)
     {
-        assert(w->buf != NULL);
-        assert(w->fill <= w->allocated);
-
-        if (w->fill + zstd_stream_recommended_out_buffer_size > w->allocated)
+        if (w->fill >= w->allocated)
         {
             compressor_create_file(w);
             fwrite_or_die(w->buf, 1, w->fill, w->file);
@@ -78,14 +118,108 @@ static void compressor_end_stream(compressor_t *w)
             w->fill = 0;
         }
 
-        ZSTD_outBuffer output = { w->buf + w->fill, w->allocated - w->fill, 0 };
-        size_t const remainingToFlush = ZSTD_endStream(w->cstream, &output);
-        if (remainingToFlush != 0) { die("can't end zstd stream\n"); }
-        w->fill += output.pos;
-        w->compressed_size += output.pos;
-        w->cstream = NULL;
+        size_t n = (size < w->allocated - w->fill) ? size : w->allocated - w->fill;
+        memcpy(w->buf + w->fill, data, n);
+        w->fill += n;
+        w->compressed_size += n;
+        data += n;
+        size -= n;
+    }
+}
+
+
+/*
+ * Compresses the collected block of an "lz4", "cm" or "fqz" stream, and appends it to the output,
+ * or appends it unchanged if compression does not make it smaller.
+ */
+static void compressor_flush_block(compressor_t *w)
+{
+    assert(w != NULL);
+    assert(w->codec == codec_lz4 || w->codec == codec_cm || w->codec == codec_fqz);
+    assert(w->block != NULL);
+    assert(w->block_out != NULL);
+
+    size_t size = w->block_fill;
+    size_t stored_size = (w->codec == codec_cm) ? cm_compress_block(w->block, size, w->block_out + 8, codec_block_bound - 8)
+                       : (w->codec == codec_fqz) ? fqz_compress_block(w->block, size, w->block_out + 8, codec_block_bound - 8)
+                       : lz4_compress_block(w->block, size, w->block_out + 8);
+    const unsigned char *stored = w->block_out + 8;
+    if (stored_size == 0 || stored_size >= size) { stored = w->block; stored_size = size; }
+
+    unsigned char header[8];
+    for (unsigned i = 0; i < 4; i++)
+    {
+        header[i] = (unsigned char)(size >> (i * 8));
+        header[i + 4] = (unsigned char)(stored_size >> (i * 8));
+    }
+    compressor_put_bytes(w, header, 8);
+    compressor_put_bytes(w, stored, stored_size);
+    w->block_fill = 0;
+}
+
+
+static void compress_with_codec(compressor_t *w, const unsigned char *data, size_t size)
+{
+    assert(w != NULL);
+
+    if (w->codec == codec_store)
+    {
+        compressor_put_bytes(w, data, size);
+        return;
+    }
+
+    while (size > 0)
+    {
+        size_t n = (size < codec_block_size - w->block_fill) ? size : codec_block_size - w->block_fill;
+        memcpy(w->block + w->block_fill, data, n);
+        w->block_fill += n;
+        data += n;
+        size -= n;
+        if (w->block_fill == codec_block_size) { compressor_flush_block(w); }
+    }
+}
+
+
+static void compressor_end_frame(compressor_t *w)
+{
+    assert(w != NULL);
+    assert(w->cstream != NULL);
+    assert(w->buf != NULL);
+    assert(w->fill <= w->allocated);
+
+    if (w->fill + zstd_stream_recommended_out_buffer_size > w->allocated)
+    {
+        compressor_create_file(w);
+        fwrite_or_die(w->buf, 1, w->fill, w->file);
+        w->written += w->fill;
+        w->fill = 0;
+    }
+
+    ZSTD_outBuffer output = { w->buf + w->fill, w->allocated - w->fill, 0 };
+    size_t const remainingToFlush = ZSTD_endStream(w->cstream, &output);
+    if (remainingToFlush != 0) { die("can't end zstd stream\n"); }
+    w->fill += output.pos;
+    w->compressed_size += output.pos;
+
+    // Prefix is used only by one frame, so it's referenced again for the next one.
+    if (w->prefix != NULL) { ZSTD_TRY(ZSTD_CCtx_refPrefix(w->cstream, w->prefix, w->prefix_size)); }
+}
+
+
+static void compressor_end_stream(compressor_t *w)
+{
+    assert(w != NULL);
+
+    if (w->cstream != NULL || w->codec != codec_zstd)
+    {
+        if (w->cstream != NULL)
+        {
+            compressor_end_frame(w);
+            w->cstream = NULL;
+        }
+        if (w->block_fill > 0) { compressor_flush_block(w); }
 
-        if (keep_temp_files)
+        if (keep_temp_files && w->buf != NULL)
         {
             compressor_create_file(w);
             fwrite_or_die(w->buf, 1, w->fill, w->file);
@@ -101,6 +235,9 @@ static void compressor_done(compressor_t *w)
     assert(w != NULL);
 
     if (w->buf != NULL) { free(w->buf); w->buf = NULL; }
+    if (w->level_speeds != NULL) { free(w->level_speeds); w->level_speeds = NULL; }
+    if (w->block != NULL) { free(w->block); w->block = NULL; }
+    if (w->block_out != NULL) { free(w->block_out); w->block_out = NULL; }
 
     if (w->file != NULL)
     {
@@ -116,6 +253,53 @@ static void compressor_done(compressor_t *w)
 }
 
 
+/*
+ * Called after each block of input of an adaptive stream.
+ * Lowers the level if processing is slower than the target speed,
+ * or raises it if there is enough headroom, and the next level is not known to be too slow.
+ * Level 0 is skipped, as zstd treats it as the default level.
+ */
+static void compressor_adapt_level(compressor_t *w)
+{
+    assert(w != NULL);
+    assert(w->adaptive);
+    assert(w->level_speeds != NULL);
+
+    double seconds = (double)w->block_clock / CLOCKS_PER_SEC;
+    double speed = (seconds > 0.0) ? (double)(w->uncompressed_size - w->block_start_size) / 1000000.0 / seconds : target_speed * 2.0;
+
+    w->block_start_size = w->uncompressed_size;
+    w->block_clock = 0;
+
+    w->n_blocks++;
+    if (w->n_blocks % adaptive_memory_n_blocks == 0)
+    {
+        for (int i = 0; i <= adaptive_max_level - adaptive_min_level; i++) { w->level_speeds[i] = 0.0; }
+    }
+    w->level_speeds[w->level - adaptive_min_level] = speed;
+
+    int lower = (w->level == 1) ? -1 : w->level - 1;
+    int higher = (w->level == -1) ? 1 : w->level + 1;
+    int level = w->level;
+    if (speed < target_speed)
+    {
+        if (lower >= adaptive_min_level) { level = lower; }
+    }
+    else if (speed > target_speed * 1.2 && higher <= adaptive_max_level)
+    {
+        double higher_speed = w->level_speeds[higher - adaptive_min_level];
+        if (higher_speed == 0.0 || higher_speed >= target_speed) { level = higher; }
+    }
+    if (level == w->level) { return; }
+
+    compressor_end_frame(w);
+    w->multi_frame = true;
+    ZSTD_TRY(ZSTD_CCtx_setParameter(w->cstream, ZSTD_c_compressionLevel, level));
+    if (verbose) { msg("%s: %.1f MB/s, changing compression level from %d to %d\n", w->name, speed, w->level, level); }
+    w->level = level;
+}
+
+
 __attribute__((always_inline))
 static inline void compress(compressor_t *w, const void *data, size_t size)
 {
@@ -123,6 +307,14 @@ static inline void compress(compressor_t *w, const void *data, size_t size)
     assert(data != NULL);
     assert(w->buf != NULL);
 
+    if (w->codec != codec_zstd)
+    {
+        compress_with_codec(w, (const unsigned char *)data, size);
+        w->uncompressed_size += size;
+        return;
+    }
+
+    clock_t start = w->adaptive ? clock() : 0;
     ZSTD_inBuffer input = { data, size, 0 };
     while (input.pos < input.size)
     {
@@ -144,30 +336,75 @@ static inline void compress(compressor_t *w, const void *data, size_t size)
     }
 
     w->uncompressed_size += size;
+    if (w->adaptive) { w->block_clock += clock() - start; }
+
+    if (w->adaptive && w->uncompressed_size - w->block_start_size >= adaptive_block_size) { compressor_adapt_level(w); }
 }
 
 
-static void write_compressed_data(FILE *F, compressor_t *w)
+/*
+ * Size of the compressed data of the stream, as stored: zstd magic number is not stored, other codecs are stored in full.
+ */
+static unsigned long long compressed_data_size(const compressor_t *w)
+{
+    assert(w != NULL);
+
+    size_t skip = (w->codec == codec_zstd) ? 4 : 0;
+    if (w->compressed_size < skip) { die("compression failed\n"); }
+    return w->compressed_size - skip;
+}
+
+
+static void write_compressed_data_without_size(FILE *F, compressor_t *w)
 {
     assert(F != NULL);
     assert(w != NULL);
     assert(w->buf != NULL);
 
-    if (w->compressed_size < 4) { die("compression failed\n"); }
-
-    write_variable_length_encoded_number(F, w->compressed_size - 4);
+    size_t skip = (w->codec == codec_zstd) ? 4 : 0;
+    if (w->compressed_size < skip) { die("compression failed\n"); }
 
     if (w->file == NULL)
     {
         if (w->fill > 0)
         {
-            if (w->fill < 4) { die("compression failed\n"); }
-            fwrite_or_die(w->buf + 4, 1, w->fill - 4, F);
+            if (w->fill < skip) { die("compression failed\n"); }
+            fwrite_or_die(w->buf + skip, 1, w->fill - skip, F);
         }
     }
     else
     {
-        copy_file_to_out(w->file, w->path, 4, w->written - 4);
+        copy_file_to_out(w->file, w->path, skip, w->written - skip);
         if (w->fill > 0) { fwrite_or_die(w->buf, 1, w->fill, F); }
     }
 }
+
+
+static void write_compressed_data(FILE *F, compressor_t *w)
+{
+    write_variable_length_encoded_number(F, compressed_data_size(w));
+    write_compressed_data_without_size(F, w);
+}
+
+
+/*
+ * Parts consisting of several zstd frames, marked with the same bits as in the header flags.
+ * Exceptions of 2-bit encoding and homopolymer runs are counted with the sequence.
+ */
+static unsigned multi_frame_parts(void)
+{
+    return (IDS.multi_frame << 5) | (COMM.multi_frame << 4) | (LEN.multi_frame << 3) | (MASK.multi_frame << 2) |
+           ((SEQ.multi_frame || EXC.multi_frame || RUNS.multi_frame) << 1) | QUAL.multi_frame;
+}
+
+
+/*
+ * Frames record: flags of parts that consist of several zstd frames.
+ * Flags are below 128, so they take a single byte in variable length encoding.
+ */
+static void write_frames_extension(FILE *F)
+{
+    write_variable_length_encoded_number(F, ext_frames);
+    write_variable_length_encoded_number(F, 1);
+    write_variable_length_encoded_number(F, multi_frame_parts());
+}
@@ -0,0 +1,192 @@
+/*
+ * NAF compressor
+ * Copyright (c) 2018-2021 Kirill Kryukov
+ * See README.md and LICENSE files of this repository
+ */
+
+/*
+ * Deduplication of identical sequences ("--dedup").
+ * Sequence of each record is collected in full, and looked up among the sequences seen so far.
+ * A new sequence is encoded into SEQ as usual, and remembered. A repeated sequence is not encoded,
+ * instead the record is added to the list of duplicates, along with the record number of its first occurrence.
+ * The list is compressed and stored in the "Duplicates" extension record.
+ * Lengths and mask are stored for all records as usual, only the SEQ stream skips the duplicates.
+ *
+ * Remembered sequences are kept in memory, so that a hash match is confirmed by comparing the actual sequences.
+ * Their total size is limited: once the limit is reached, new sequences are no longer remembered,
+ * though matches with the already remembered ones are still found.
+ * The same limit bounds the memory that unnaf needs for replaying the duplicates.
+ */
+
+#define dedup_max_remembered_size (1024ull * 1024 * 1024)
+#define dedup_initial_table_size 65536
+
+typedef struct
+{
+    unsigned long long hash;
+    unsigned long long record;
+    size_t offset;
+    size_t length;
+}
+dedup_entry_t;
+
+static byte_buffer_t dedup_record = { 0, 0, NULL };
+static byte_buffer_t dedup_remembered = { 0, 0, NULL };
+static byte_buffer_t dedup_list = { 0, 0, NULL };
+
+static dedup_entry_t *dedup_table = NULL;
+static size_t dedup_table_size = 0;
+static size_t dedup_table_fill = 0;
+
+static unsigned long long dedup_n_duplicates = 0;
+static unsigned long long dedup_last_duplicate = 0;
+
+
+static void init_dedup(void)
+{
+    dedup_table_size = dedup_initial_table_size;
+    dedup_table = (dedup_entry_t *) malloc_or_die(sizeof(dedup_entry_t) * dedup_table_size);
+    memset(dedup_table, 0, sizeof(dedup_entry_t) * dedup_table_size);
+}
+
+
+static void free_dedup(void)
+{
+    if (dedup_record.data != NULL) { free(dedup_record.data); dedup_record.data = NULL; }
+    if (dedup_remembered.data != NULL) { free(dedup_remembered.data); dedup_remembered.data = NULL; }
+    if (dedup_list.data != NULL) { free(dedup_list.data); dedup_list.data = NULL; }
+    if (dedup_table != NULL) { free(dedup_table); dedup_table = NULL; }
+}
+
+
+static inline unsigned long long dedup_hash(const unsigned char *str, size_t size)
+{
+    unsigned long long h = 0x9E3779B97F4A7C15ull ^ (unsigned long long)size;
+    const unsigned char *p = str, *end8 = str + (size & ~(size_t)7);
+    for (; p < end8; p += 8)
+    {
+        unsigned long long w;
+        memcpy(&w, p, 8);
+        h = (h ^ w) * 0xFF51AFD7ED558CCDull;
+        h ^= h >> 32;
+    }
+    for (const unsigned char *end = str + size; p < end; p++) { h = (h ^ *p) * 0xC4CEB9FE1A85EC53ull; }
+    h ^= h >> 29;
+    h *= 0xBF58476D1CE4E5B9ull;
+    h ^= h >> 32;
+    return h;
+}
+
+
+static void dedup_grow_table(void)
+{
+    size_t new_size = dedup_table_size * 2;
+    dedup_entry_t *new_table = (dedup_entry_t *) malloc_or_die(sizeof(dedup_entry_t) * new_size);
+    memset(new_table, 0, sizeof(dedup_entry_t) * new_size);
+
+    for (size_t i = 0; i < dedup_table_size; i++)
+    {
+        if (dedup_table[i].length == 0) { continue; }
+        size_t k = (size_t)dedup_table[i].hash & (new_size - 1);
+        while (new_table[k].length != 0) { k = (k + 1) & (new_size - 1); }
+        new_table[k] = dedup_table[i];
+    }
+
+    free(dedup_table);
+    dedup_table = new_table;
+    dedup_table_size = new_size;
+}
+
+
+/*
+ * Looks up the sequence of record "record" among remembered sequences.
+ * Returns the record number of its first occurrence, or "record" itself if it's new, remembering it if there is room.
+ */
+static unsigned long long dedup_find_or_add(const unsigned char *str, size_t size, unsigned long long record)
+{
+    unsigned long long hash = dedup_hash(str, size);
+    size_t k = (size_t)hash & (dedup_table_size - 1);
+    while (dedup_table[k].length != 0)
+    {
+        if (dedup_table[k].hash == hash && dedup_table[k].length == size &&
+            memcmp(dedup_remembered.data + dedup_table[k].offset, str, size) == 0)
+        {
+            return dedup_table[k].record;
+        }
+        k = (k + 1) & (dedup_table_size - 1);
+    }
+
+    if (dedup_remembered.size + size > dedup_max_remembered_size) { return record; }
+
+    dedup_table[k].hash = hash;
+    dedup_table[k].record = record;
+    dedup_table[k].offset = dedup_remembered.size;
+    dedup_table[k].length = size;
+    byte_buffer_put_bytes(&dedup_remembered, str, size);
+
+    dedup_table_fill++;
+    if (dedup_table_fill * 2 >= dedup_table_size) { dedup_grow_table(); }
+    return record;
+}
+
+
+/*
+ * Encodes the collected sequence of record "record", or stores it as duplicate.
+ * Empty sequences are never treated as duplicates, as they have nothing to encode anyway.
+ */
+static void dedup_encode_record(unsigned long long record)
+{
+    const unsigned char *str = dedup_record.data;
+    size_t size = dedup_record.size;
+    dedup_record.size = 0;
+    if (size == 0) { return; }
+
+    if (!no_mask) { extract_mask(str, size); }
+
+    unsigned long long first = dedup_find_or_add(str, size, record);
+    if (first == record)
+    {
+        if (store_2bit) { encode_dna_2bit(str, size); }
+        else { encode_dna(str, size); }
+        return;
+    }
+
+    byte_buffer_put_number(&dedup_list, record - dedup_last_duplicate);
+    byte_buffer_put_number(&dedup_list, record - first);
+    dedup_last_duplicate = record;
+    dedup_n_duplicates++;
+    seq_size_deduplicated += size;
+    if (store_stats) { stats_add_bytes(3, str, size); }
+}
+
+
+/*
+ * Payload: number of duplicates, their total length, size of the list, and the list compressed by zstd (without magic number).
+ * The list has a pair of numbers for each duplicate: its distance from the previous duplicate (or from 0 for the first one),
+ * and its distance back to the first occurrence of the same sequence.
+ */
+static void write_dedup_extension(FILE *F)
+{
+    assert(dedup_sequences);
+
+    size_t bound = ZSTD_compressBound(dedup_list.size);
+    unsigned char *compressed = (unsigned char *) malloc_or_die(bound);
+    size_t compressed_size = ZSTD_compress(compressed, bound, dedup_list.data, dedup_list.size, compression_level);
+    if (ZSTD_isError(compressed_size)) { die("can't compress list of duplicates: %s\n", ZSTD_getErrorName(compressed_size)); }
+    assert(compressed_size > 4);
+
+    size_t size = variable_length_encoded_number_size(dedup_n_duplicates)
+                + variable_length_encoded_number_size(seq_size_deduplicated)
+                + variable_length_encoded_number_size(dedup_list.size)
+                + compressed_size - 4;
+
+    write_variable_length_encoded_number(F, ext_dedup);
+    write_variable_length_encoded_number(F, size);
+    write_variable_length_encoded_number(F, dedup_n_duplicates);
+    write_variable_length_encoded_number(F, seq_size_deduplicated);
+    write_variable_length_encoded_number(F, dedup_list.size);
+    fwrite_or_die(compressed + 4, 1, compressed_size - 4, F);
+
+    free(compressed);
+    if (verbose) { msg("Deduplication: %llu duplicate sequences, %llu bases not stored\n", dedup_n_duplicates, seq_size_deduplicated); }
+}
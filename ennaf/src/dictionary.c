@@ -0,0 +1,168 @@
+/*
+ * NAF compressor
+ * Copyright (c) 2018-2021 Kirill Kryukov
+ * See README.md and LICENSE files of this repository
+ */
+
+/*
+ * Dictionary for sequence ids and comments.
+ * Either trained on the first headers of the input ("--train-dict N"), and then stored in the file,
+ * or loaded from a file ("--dict FILE"), in which case only its id is stored, and unnaf needs the same file.
+ * The dictionary must be attached before the first data enters IDS and COMM streams,
+ * so these streams wait until either of them is first flushed.
+ *
+ * A trained dictionary is stored compressed, and its size is scaled to the training data, to keep its cost low.
+ * Within a single file zstd learns the headers from the stream itself, so a stored dictionary often costs
+ * more than it saves. It is stored anyway, as requested, with a warning in this case.
+ * Dictionaries pay off when shared by many small files ("--save-dict", then "--dict").
+ */
+
+#define names_dict_min_capacity 1024
+#define names_dict_max_capacity 16384
+
+
+static void load_names_dictionary_file(void)
+{
+    assert(dict_file_path != NULL);
+    assert(names_dict == NULL);
+
+    FILE *F = fopen(dict_file_path, "rb");
+    if (F == NULL) { die("can't open dictionary file \"%s\"\n", dict_file_path); }
+    if (fseek(F, 0, SEEK_END) != 0) { die("can't read dictionary file \"%s\"\n", dict_file_path); }
+    long size = ftell(F);
+    if (size <= 0) { die("empty or unreadable dictionary file \"%s\"\n", dict_file_path); }
+    if (fseek(F, 0, SEEK_SET) != 0) { die("can't read dictionary file \"%s\"\n", dict_file_path); }
+
+    names_dict = (unsigned char *) malloc_or_die((size_t)size);
+    fread_or_die(names_dict, 1, (size_t)size, F);
+    fclose_or_die(F);
+
+    names_dict_size = (size_t)size;
+    names_dict_id = ZSTD_getDictID_fromDict(names_dict, names_dict_size);
+    names_dict_is_embedded = false;
+    if (verbose) { msg("Loaded dictionary \"%s\": %zu bytes, id %u\n", dict_file_path, names_dict_size, names_dict_id); }
+}
+
+
+/*
+ * Appends up to "max_n" zero-terminated non-empty strings from "str" to the sample list.
+ */
+static size_t add_dictionary_samples(const unsigned char *str, size_t size, unsigned long long max_n,
+                                     unsigned char *samples, size_t samples_size, size_t *sample_sizes, unsigned *n_samples)
+{
+    const unsigned char *p = str, *end = str + size;
+    for (unsigned long long n = 0; p < end && n < max_n; n++)
+    {
+        const unsigned char *e = memchr(p, 0, (size_t)(end - p));
+        if (e == NULL) { break; }
+        size_t len = (size_t)(e - p);
+        if (len > 0)
+        {
+            memcpy(samples + samples_size, p, len);
+            samples_size += len;
+            sample_sizes[(*n_samples)++] = len;
+        }
+        p = e + 1;
+    }
+    return samples_size;
+}
+
+
+static void train_names_dictionary(const unsigned char *ids, size_t ids_size, const unsigned char *comments, size_t comments_size)
+{
+    assert(names_dict == NULL);
+
+    unsigned char *samples = (unsigned char *) malloc_or_die(ids_size + comments_size + 1);
+    unsigned long long max_samples = dict_train_n_headers * 2;
+    if (max_samples > ids_size + comments_size) { max_samples = ids_size + comments_size; }
+    size_t *sample_sizes = (size_t *) malloc_or_die(sizeof(size_t) * (size_t)(max_samples + 1));
+    unsigned n_samples = 0;
+    size_t samples_size = add_dictionary_samples(ids, ids_size, dict_train_n_headers, samples, 0, sample_sizes, &n_samples);
+    samples_size = add_dictionary_samples(comments, comments_size, dict_train_n_headers, samples, samples_size, sample_sizes, &n_samples);
+
+    // Recommended dictionary size is about 1/100 of the training data.
+    size_t capacity = samples_size / 100;
+    if (capacity < names_dict_min_capacity) { capacity = names_dict_min_capacity; }
+    if (capacity > names_dict_max_capacity) { capacity = names_dict_max_capacity; }
+
+    names_dict = (unsigned char *) malloc_or_die(capacity);
+    size_t size = ZDICT_trainFromBuffer(names_dict, capacity, samples, sample_sizes, n_samples);
+
+    if (ZDICT_isError(size))
+    {
+        warn("can't train dictionary (%s), compressing ids and comments without it\n", ZDICT_getErrorName(size));
+        free(samples);
+        free(sample_sizes);
+        free(names_dict);
+        names_dict = NULL;
+        return;
+    }
+
+    names_dict_size = size;
+    names_dict_id = ZDICT_getDictID(names_dict, names_dict_size);
+    names_dict_is_embedded = true;
+
+    size_t packed_bound = ZSTD_compressBound(names_dict_size);
+    names_dict_packed = (unsigned char *) malloc_or_die(packed_bound);
+    names_dict_packed_size = ZSTD_compress(names_dict_packed, packed_bound, names_dict, names_dict_size, ZSTD_maxCLevel());
+    if (ZSTD_isError(names_dict_packed_size)) { die("can't compress dictionary: %s\n", ZSTD_getErrorName(names_dict_packed_size)); }
+
+    if (verbose) { msg("Trained dictionary on %u samples (%zu bytes): %zu bytes (%zu compressed), id %u\n", n_samples, samples_size, names_dict_size, names_dict_packed_size, names_dict_id); }
+
+    if (dict_save_path != NULL)
+    {
+        FILE *F = fopen(dict_save_path, "wb");
+        if (F == NULL) { die("can't create dictionary file \"%s\"\n", dict_save_path); }
+        fwrite_or_die(names_dict, 1, names_dict_size, F);
+        fclose_or_die(F);
+    }
+
+    size_t bound = ZSTD_compressBound(samples_size);
+    unsigned char *test_buffer = (unsigned char *) malloc_or_die(bound);
+    ZSTD_CCtx *cctx = ZSTD_createCCtx();
+    if (cctx == NULL) { die("can't create compression context\n"); }
+    size_t plain_size = ZSTD_compressCCtx(cctx, test_buffer, bound, samples, samples_size, compression_level);
+    size_t dict_compressed_size = ZSTD_compress_usingDict(cctx, test_buffer, bound, samples, samples_size,
+                                                          names_dict, names_dict_size, compression_level);
+    ZSTD_freeCCtx(cctx);
+    free(test_buffer);
+    free(samples);
+    free(sample_sizes);
+
+    if (!ZSTD_isError(plain_size) && !ZSTD_isError(dict_compressed_size) && dict_compressed_size + names_dict_packed_size >= plain_size)
+    {
+        warn("stored dictionary costs more than it saves on the training headers, consider '--save-dict' and '--dict'\n");
+    }
+}
+
+
+static void attach_names_dictionary(void)
+{
+    if (names_dict == NULL) { return; }
+
+    names_cdict = ZSTD_createCDict(names_dict, names_dict_size, compression_level);
+    if (names_cdict == NULL) { die("can't create compression dictionary\n"); }
+    ZSTD_TRY(ZSTD_CCtx_refCDict(IDS.cstream, names_cdict));
+    ZSTD_TRY(ZSTD_CCtx_refCDict(COMM.cstream, names_cdict));
+
+    // Level of dictionary compression is set by the dictionary, so these streams don't adapt it.
+    IDS.adaptive = false;
+    COMM.adaptive = false;
+}
+
+
+static void write_dictionary_extension(FILE *F)
+{
+    assert(names_dict != NULL);
+
+    size_t embedded_size = names_dict_is_embedded ? names_dict_packed_size : 0;
+    size_t size = variable_length_encoded_number_size(names_dict_id)
+                + variable_length_encoded_number_size(embedded_size)
+                + embedded_size;
+
+    write_variable_length_encoded_number(F, ext_dictionary);
+    write_variable_length_encoded_number(F, size);
+    write_variable_length_encoded_number(F, names_dict_id);
+    write_variable_length_encoded_number(F, embedded_size);
+    if (embedded_size > 0) { fwrite_or_die(names_dict_packed, 1, embedded_size, F); }
+}
@@ -21,9 +21,48 @@ static void init_encoders(void)
 
     length_units = (unsigned int *) malloc_or_die(sizeof(unsigned int) * length_units_buffer_n_units);
 
+    length_bytes = (unsigned char *) malloc_or_die(length_bytes_buffer_size);
+    length_bytes_end = length_bytes + length_bytes_buffer_size;
+    length_bytes_pos = length_bytes;
+
     mask_units = (unsigned char *) malloc_or_die(mask_units_buffer_size);
     mask_units_end = mask_units + mask_units_buffer_size;
     mask_units_pos = mask_units;
+
+    exception_units = (unsigned char *) malloc_or_die(exception_units_buffer_size);
+    exception_units_end = exception_units + exception_units_buffer_size;
+    exception_units_pos = exception_units;
+
+    hpc_units = (unsigned char *) malloc_or_die(hpc_units_buffer_size);
+    hpc_units_end = hpc_units + hpc_units_buffer_size;
+    hpc_units_pos = hpc_units;
+
+    // 2-bit codes of A, C, G, T. Any other nucleotide code is marked with bit 8, and is stored as exception.
+    for (unsigned i = 0; i < 256; i++)
+    {
+        unsigned char code = nuc_code[i];
+        nuc_2bit[i] = (code == 8) ? 0 : (code == 4) ? 1 : (code == 2) ? 2 : (code == 1) ? 3 : 256;
+    }
+
+    // 4-bit encoded byte for each pair of characters, indexed by the pair read from memory as 16-bit number.
+    for (unsigned a = 0; a < 256; a++)
+    {
+        for (unsigned b = 0; b < 256; b++)
+        {
+            unsigned char pair_bytes[2] = { (unsigned char)a, (unsigned char)b };
+            unsigned short pair;
+            memcpy(&pair, pair_bytes, 2);
+            nuc_pair_code[pair] = nuc_code[a] | (unsigned char)(nuc_code[b] * 16);
+        }
+    }
+}
+
+
+__attribute__((always_inline))
+static inline void compress_4bit_buffer(size_t size)
+{
+    if (store_stats) { stats_add_bytes(0, out_4bit_buffer, size); }
+    compress(&SEQ, out_4bit_buffer, size);
 }
 
 
@@ -42,21 +81,32 @@ static void encode_dna(const unsigned char *str, size_t size)
         *out_4bit_pos++ |= (unsigned char)(nuc_code[*p] * 16);
         if (out_4bit_pos >= out_4bit_buffer + out_4bit_buffer_size)
         {
-            compress(&SEQ, out_4bit_buffer, out_4bit_buffer_size);
+            compress_4bit_buffer(out_4bit_buffer_size);
             out_4bit_pos = out_4bit_buffer;
         }
         parity = false;
         p++;
     }
 
-    const unsigned char *end1 = p + ( (unsigned long long)(end - p) & ~1ull );
-    for (; p < end1; p += 2)
+    // Pairs are encoded in spans that fit in the output buffer, so that the buffer is checked once per span.
+    while (end - p >= 2)
     {
-        *out_4bit_pos++ = nuc_code[*p] | 
-                          (unsigned char)(nuc_code[*(p+1)] * 16);
+        size_t n = (size_t)(end - p) / 2;
+        size_t space = (size_t)(out_4bit_buffer + out_4bit_buffer_size - out_4bit_pos);
+        if (n > space) { n = space; }
+
+        for (size_t i = 0; i < n; i++)
+        {
+            unsigned short pair;
+            memcpy(&pair, p + i * 2, 2);
+            out_4bit_pos[i] = nuc_pair_code[pair];
+        }
+        p += n * 2;
+        out_4bit_pos += n;
+
         if (out_4bit_pos >= out_4bit_buffer + out_4bit_buffer_size)
         {
-            compress(&SEQ, out_4bit_buffer, out_4bit_buffer_size);
+            compress_4bit_buffer(out_4bit_buffer_size);
             out_4bit_pos = out_4bit_buffer;
         }
     }
@@ -69,12 +119,432 @@ static void encode_dna(const unsigned char *str, size_t size)
 }
 
 
+/*
+ * Appends "n" nucleotides that are already 4-bit encoded, two per byte, starting from the low half of the first byte.
+ */
+static void encode_packed_dna(const unsigned char *packed, unsigned long long n)
+{
+    assert(packed != NULL || n == 0);
+    assert(out_4bit_buffer != NULL);
+    assert(out_4bit_pos != NULL);
+
+    const unsigned char *p = packed;
+    if (n > 0 && parity)
+    {
+        // Each output byte then takes the high half of one input byte and the low half of the next one.
+        *out_4bit_pos++ |= (unsigned char)((*p & 15) << 4);
+        if (out_4bit_pos >= out_4bit_buffer + out_4bit_buffer_size)
+        {
+            compress_4bit_buffer(out_4bit_buffer_size);
+            out_4bit_pos = out_4bit_buffer;
+        }
+        parity = false;
+        n--;
+
+        while (n >= 2)
+        {
+            size_t k = (n / 2 < (unsigned long long)(out_4bit_buffer + out_4bit_buffer_size - out_4bit_pos))
+                       ? (size_t)(n / 2) : (size_t)(out_4bit_buffer + out_4bit_buffer_size - out_4bit_pos);
+            for (size_t i = 0; i < k; i++) { out_4bit_pos[i] = (unsigned char)((p[i] >> 4) | (p[i + 1] << 4)); }
+            p += k;
+            out_4bit_pos += k;
+            n -= 2 * k;
+
+            if (out_4bit_pos >= out_4bit_buffer + out_4bit_buffer_size)
+            {
+                compress_4bit_buffer(out_4bit_buffer_size);
+                out_4bit_pos = out_4bit_buffer;
+            }
+        }
+
+        if (n > 0)
+        {
+            *out_4bit_pos = (unsigned char)(*p >> 4);
+            parity = true;
+        }
+        return;
+    }
+
+    while (n >= 2)
+    {
+        size_t k = (n / 2 < (unsigned long long)(out_4bit_buffer + out_4bit_buffer_size - out_4bit_pos))
+                   ? (size_t)(n / 2) : (size_t)(out_4bit_buffer + out_4bit_buffer_size - out_4bit_pos);
+        memcpy(out_4bit_pos, p, k);
+        p += k;
+        out_4bit_pos += k;
+        n -= 2 * k;
+
+        if (out_4bit_pos >= out_4bit_buffer + out_4bit_buffer_size)
+        {
+            compress_4bit_buffer(out_4bit_buffer_size);
+            out_4bit_pos = out_4bit_buffer;
+        }
+    }
+
+    if (n > 0)
+    {
+        *out_4bit_pos = (unsigned char)(*p & 15);
+        parity = true;
+    }
+}
+
+
+__attribute__((always_inline))
+static inline void compress_2bit_buffer(size_t size)
+{
+    if (store_stats) { stats_add_bytes(2, out_4bit_buffer, size); }
+    compress(&SEQ, out_4bit_buffer, size);
+}
+
+
+/*
+ * Stores "a" in variable length encoding at "p" (which must have room for 10 bytes), returns the position after it.
+ */
+static inline unsigned char* put_variable_length_encoded_number(unsigned char *p, unsigned long long a)
+{
+    unsigned char vle_buffer[10];
+    unsigned char *b = vle_buffer + 10;
+    *--b = (unsigned char)(a & 127ull);
+    a >>= 7;
+    while (a > 0)
+    {
+        *--b = (unsigned char)(128ull | (a & 127ull));
+        a >>= 7;
+    }
+    size_t len = (size_t)(vle_buffer + 10 - b);
+    memcpy(p, b, len);
+    return p + len;
+}
+
+
+static void put_exception_number(unsigned long long a)
+{
+    exception_units_pos = put_variable_length_encoded_number(exception_units_pos, a);
+}
+
+
+/*
+ * Exception list of 2-bit encoded sequence consists of runs of identical non-ACGT codes.
+ * Each run is stored as: distance from the end of previous run, run length (both in variable length encoding),
+ * and the 4-bit nucleotide code (one byte).
+ */
+static void flush_exception_run(void)
+{
+    assert(exception_units != NULL);
+    assert(EXC.cstream != NULL);
+
+    if (exception_run_length == 0) { return; }
+
+    if (exception_units_end - exception_units_pos < 21)
+    {
+        compress(&EXC, exception_units, (size_t)(exception_units_pos - exception_units));
+        exception_units_pos = exception_units;
+    }
+
+    put_exception_number(exception_run_start - exception_prev_run_end);
+    put_exception_number(exception_run_length);
+    *exception_units_pos++ = exception_run_code;
+
+    if (store_stats) { stats_2bit_exception_counts[exception_run_code] += exception_run_length; }
+
+    exception_prev_run_end = exception_run_start + exception_run_length;
+    exception_run_length = 0;
+}
+
+
+__attribute__ ((cold))
+static void add_exception(unsigned char code, unsigned long long pos)
+{
+    if (exception_run_length != 0 && code == exception_run_code && pos == exception_run_start + exception_run_length)
+    {
+        exception_run_length++;
+        return;
+    }
+
+    flush_exception_run();
+    exception_run_code = code;
+    exception_run_start = pos;
+    exception_run_length = 1;
+}
+
+
+__attribute__((always_inline))
+static inline void put_2bit_nucleotide(unsigned char c)
+{
+    unsigned v = nuc_2bit[c];
+    if (v & 256u) { add_exception(nuc_code[c], out_2bit_n_bases); v = 0; }
+
+    if (out_2bit_phase == 0) { *out_4bit_pos = (unsigned char)v; }
+    else { *out_4bit_pos |= (unsigned char)(v << (out_2bit_phase * 2)); }
+    out_2bit_n_bases++;
+    out_2bit_phase = (out_2bit_phase + 1) & 3;
+
+    if (out_2bit_phase == 0)
+    {
+        out_4bit_pos++;
+        if (out_4bit_pos >= out_4bit_buffer + out_4bit_buffer_size)
+        {
+            compress_2bit_buffer(out_4bit_buffer_size);
+            out_4bit_pos = out_4bit_buffer;
+        }
+    }
+}
+
+
+/*
+ * Packs 4 nucleotides per byte, first nucleotide in the lowest bits.
+ * Groups of 4 pure ACGT nucleotides are packed with a single check, others go through exception handling.
+ */
+static void encode_dna_2bit(const unsigned char *str, size_t size)
+{
+    assert(str != NULL);
+    assert(out_4bit_buffer != NULL);
+    assert(out_4bit_pos != NULL);
+    assert(SEQ.cstream != NULL);
+
+    const unsigned char *end = str + size;
+    const unsigned char *p = str;
+
+    while (p < end && out_2bit_phase != 0) { put_2bit_nucleotide(*p++); }
+
+    const unsigned char *end4 = p + ( (size_t)(end - p) & ~(size_t)3 );
+    for (; p < end4; p += 4)
+    {
+        unsigned v0 = nuc_2bit[p[0]], v1 = nuc_2bit[p[1]], v2 = nuc_2bit[p[2]], v3 = nuc_2bit[p[3]];
+        if ((v0 | v1 | v2 | v3) & 256u)
+        {
+            put_2bit_nucleotide(p[0]);
+            put_2bit_nucleotide(p[1]);
+            put_2bit_nucleotide(p[2]);
+            put_2bit_nucleotide(p[3]);
+            continue;
+        }
+
+        *out_4bit_pos++ = (unsigned char)(v0 | (v1 << 2) | (v2 << 4) | (v3 << 6));
+        out_2bit_n_bases += 4;
+        if (out_4bit_pos >= out_4bit_buffer + out_4bit_buffer_size)
+        {
+            compress_2bit_buffer(out_4bit_buffer_size);
+            out_4bit_pos = out_4bit_buffer;
+        }
+    }
+
+    while (p < end) { put_2bit_nucleotide(*p++); }
+}
+
+
+/*
+ * Sequence encoding record: encoding type, then (for 2-bit encoding) the compressed exception list,
+ * stored as its original size, compressed size, and compressed data.
+ */
+static void write_seq_encoding_extension(FILE *F)
+{
+    assert(store_2bit);
+
+    size_t size = variable_length_encoded_number_size(seq_encoding_2bit)
+                + variable_length_encoded_number_size(EXC.uncompressed_size)
+                + variable_length_encoded_number_size(EXC.compressed_size - 4)
+                + EXC.compressed_size - 4;
+
+    write_variable_length_encoded_number(F, ext_seq_encoding);
+    write_variable_length_encoded_number(F, size);
+    write_variable_length_encoded_number(F, seq_encoding_2bit);
+    write_variable_length_encoded_number(F, EXC.uncompressed_size);
+    write_compressed_data(F, &EXC);
+
+    if (verbose) { msg("2-bit sequence exceptions: %llu bytes, compressed: %llu bytes\n", EXC.uncompressed_size, EXC.compressed_size - 4); }
+}
+
+
+/*
+ * Homopolymer compression ("--hpc"): each run of identical nucleotide codes is stored in the sequence part
+ * as a single nucleotide, and its length is stored in the runs stream.
+ * Each run length L is stored as bytes: as many 255 as needed, followed by the remainder (L - 1) % 255.
+ * Runs are not interrupted by sequence boundaries: sequence is stored as a single stream, divided only by lengths.
+ */
+__attribute__ ((cold))
+static void put_long_hpc_run(unsigned long long len)
+{
+    for (unsigned long long a = len - 1; ; a -= 255)
+    {
+        if (hpc_units_pos >= hpc_units_end)
+        {
+            compress(&RUNS, hpc_units, (size_t)(hpc_units_pos - hpc_units));
+            hpc_units_pos = hpc_units;
+        }
+        *hpc_units_pos++ = (unsigned char)((a < 255) ? a : 255);
+        if (a < 255) { break; }
+    }
+}
+
+
+__attribute__((always_inline))
+static inline void put_hpc_run(unsigned char code, unsigned long long len)
+{
+    if (store_stats) { stats_hpc_run_counts[code] += len - 1; }
+    if (len <= 255 && hpc_units_pos < hpc_units_end) { *hpc_units_pos++ = (unsigned char)(len - 1); }
+    else { put_long_hpc_run(len); }
+}
+
+
+/*
+ * Collapses homopolymer runs in "str" in place, keeping the first nucleotide of each run,
+ * and passes the collapsed sequence to the 4-bit or 2-bit encoder.
+ * Runs are found without branching on the data: each nucleotide is compared with the previous one,
+ * and the comparison result advances the output position, so that only the first nucleotide of a run is kept.
+ * Run lengths are then computed from run start positions.
+ * The last run may continue in the next call, so its length is stored only once it ends.
+ */
+static void encode_dna_hpc(unsigned char *str, size_t size)
+{
+    assert(hpc_units != NULL);
+    assert(RUNS.cstream != NULL);
+
+    if (size > hpc_starts_allocated)
+    {
+        if (hpc_starts != NULL) { free(hpc_starts); }
+        hpc_starts = (size_t *) malloc_or_die(sizeof(size_t) * size);
+        hpc_starts_allocated = size;
+    }
+
+    unsigned prev = hpc_run_code;
+    size_t n = 0;
+    for (size_t i = 0; i < size; i++)
+    {
+        unsigned code = nuc_code[str[i]];
+        hpc_starts[n] = i;
+        str[n] = str[i];
+        n += (code != prev);
+        prev = code;
+    }
+
+    if (n == 0) { hpc_run_length += size; return; }
+
+    if (hpc_run_length > 0) { put_hpc_run(hpc_run_code, hpc_run_length + hpc_starts[0]); }
+    for (size_t k = 0; k + 1 < n; k++) { put_hpc_run(nuc_code[str[k]], hpc_starts[k + 1] - hpc_starts[k]); }
+    hpc_run_code = nuc_code[str[n - 1]];
+    hpc_run_length = size - hpc_starts[n - 1];
+
+    hpc_n_bases += n;
+    if (store_2bit) { encode_dna_2bit(str, n); }
+    else { encode_dna(str, n); }
+}
+
+
+static void finish_hpc(void)
+{
+    if (hpc_run_length > 0) { put_hpc_run(hpc_run_code, hpc_run_length); hpc_run_length = 0; }
+    if (hpc_units_pos > hpc_units)
+    {
+        compress(&RUNS, hpc_units, (size_t)(hpc_units_pos - hpc_units));
+        hpc_units_pos = hpc_units;
+    }
+}
+
+
+/*
+ * Homopolymers record: number of stored nucleotides, then the compressed runs stream,
+ * stored as its original size, compressed size, and compressed data.
+ */
+static void write_hpc_extension(FILE *F)
+{
+    assert(store_hpc);
+
+    size_t size = variable_length_encoded_number_size(hpc_n_bases)
+                + variable_length_encoded_number_size(RUNS.uncompressed_size)
+                + variable_length_encoded_number_size(RUNS.compressed_size - 4)
+                + RUNS.compressed_size - 4;
+
+    write_variable_length_encoded_number(F, ext_homopolymers);
+    write_variable_length_encoded_number(F, size);
+    write_variable_length_encoded_number(F, hpc_n_bases);
+    write_variable_length_encoded_number(F, RUNS.uncompressed_size);
+    write_compressed_data(F, &RUNS);
+
+    if (verbose) { msg("Homopolymers: %llu of %llu nucleotides stored, runs: %llu bytes, compressed: %llu bytes\n",
+                       hpc_n_bases, seq_size_original, RUNS.uncompressed_size, RUNS.compressed_size - 4); }
+}
+
+
+static void put_length_number(unsigned long long a)
+{
+    if (length_bytes_end - length_bytes_pos < 10)
+    {
+        compress(&LEN, length_bytes, (size_t)(length_bytes_pos - length_bytes));
+        length_bytes_pos = length_bytes;
+    }
+
+    length_bytes_pos = put_variable_length_encoded_number(length_bytes_pos, a);
+}
+
+
+/*
+ * Compact lengths ("--compact-lengths"): one variable length number per sequence.
+ * As long as all lengths are equal, they are only counted. If they stay equal until the end,
+ * the lengths part remains empty, and the length is stored in the lengths encoding record instead.
+ */
+static void add_compact_length(unsigned long long len)
+{
+    if (lengths_are_constant)
+    {
+        if (n_constant_lengths == 0 || len == constant_length)
+        {
+            constant_length = len;
+            n_constant_lengths++;
+            return;
+        }
+
+        lengths_are_constant = false;
+        for (unsigned long long i = 0; i < n_constant_lengths; i++) { put_length_number(constant_length); }
+    }
+
+    put_length_number(len);
+}
+
+
+static void write_lengths_encoding_extension(FILE *F)
+{
+    assert(compact_lengths);
+
+    unsigned long long encoding = lengths_are_constant ? lengths_encoding_constant : lengths_encoding_numbers;
+    size_t size = variable_length_encoded_number_size(encoding)
+                + (lengths_are_constant ? variable_length_encoded_number_size(constant_length) : 0);
+
+    write_variable_length_encoded_number(F, ext_lengths_encoding);
+    write_variable_length_encoded_number(F, size);
+    write_variable_length_encoded_number(F, encoding);
+    if (lengths_are_constant) { write_variable_length_encoded_number(F, constant_length); }
+
+    if (verbose)
+    {
+        if (lengths_are_constant) { msg("All %llu sequences have length %llu\n", n_constant_lengths, constant_length); }
+        else { msg("Compact lengths: %llu bytes\n", LEN.uncompressed_size); }
+    }
+}
+
+
+static void write_mask_encoding_extension(FILE *F)
+{
+    assert(compact_mask);
+
+    write_variable_length_encoded_number(F, ext_mask_encoding);
+    write_variable_length_encoded_number(F, variable_length_encoded_number_size(mask_encoding_numbers));
+    write_variable_length_encoded_number(F, mask_encoding_numbers);
+}
+
+
 static void add_length(size_t len)
 {
     assert(length_units != NULL);
     assert(length_unit_index < length_units_buffer_n_units);
     assert(LEN.cstream != NULL);
 
+    if (store_stats) { stats_add_length(len); }
+    if (store_qual && qual_codec == codec_fqz) { fqz_add_read_length(len); }
+    if (store_qual && transpose_qualities) { transposer_add_length(&qual_transposer, len); }
+    if (transpose_sequences) { transposer_add_length(&seq_transposer, len); }
+    if (compact_lengths) { add_compact_length(len); return; }
+
     while (len >= 0xFFFFFFFFull)
     {
         length_units[length_unit_index++] = 0xFFFFFFFFu;
@@ -103,6 +573,17 @@ static void add_mask(unsigned long long len)
     assert(mask_units_pos < mask_units_end);
     assert(MASK.cstream != NULL);
 
+    if (compact_mask)
+    {
+        if (mask_units_end - mask_units_pos < 10)
+        {
+            compress(&MASK, mask_units, (size_t)(mask_units_pos - mask_units));
+            mask_units_pos = mask_units;
+        }
+        mask_units_pos = put_variable_length_encoded_number(mask_units_pos, len);
+        return;
+    }
+
     while (len >= 255ull)
     {
         *mask_units_pos++ = 255;
@@ -123,6 +604,37 @@ static void add_mask(unsigned long long len)
 }
 
 
+/*
+ * Returns the end of the run of masked (lower case) or unmasked characters that starts at "c".
+ * Runs are skipped 8 characters at a time, until a word has a character of the other case.
+ */
+__attribute__((always_inline))
+static inline const unsigned char* case_run_end(const unsigned char *c, const unsigned char *end, bool masked)
+{
+    if (masked)
+    {
+        for (; end - c >= 8; c += 8)
+        {
+            unsigned long long w;
+            memcpy(&w, c, 8);
+            if ((w - 0x6060606060606060ull) & ~w & 0x8080808080808080ull) { break; }
+        }
+        while (c < end && *c >= 96) { c++; }
+    }
+    else
+    {
+        for (; end - c >= 8; c += 8)
+        {
+            unsigned long long w;
+            memcpy(&w, c, 8);
+            if (((w + 0x2020202020202020ull) | w) & 0x8080808080808080ull) { break; }
+        }
+        while (c < end && *c < 96) { c++; }
+    }
+    return c;
+}
+
+
 static void extract_mask(const unsigned char *seq, size_t len)
 {
     assert(seq != NULL);
@@ -138,14 +650,24 @@ static void extract_mask(const unsigned char *seq, size_t len)
             mask_on = !mask_on;
         }
 
-        const unsigned char *start = c;
-        if (mask_on) { while (c < end && *c >= 96) { c++; } }
-        else { while (c < end && *c < 96) { c++; } }
-        mask_len += (unsigned long long)(c - start);
+        const unsigned char *run_end = case_run_end(c, end, mask_on);
+        mask_len += (unsigned long long)(run_end - c);
+        if (mask_on) { stats_masked_length += (unsigned long long)(run_end - c); }
+        c = run_end;
     }
 }
 
 
+/*
+ * Converts protein sequence to upper case, after its case was saved by "extract_mask".
+ * Uses the same condition as "extract_mask", so that unnaf restores every byte exactly, even unexpected ones.
+ */
+static void uppercase_masked_protein(unsigned char *seq, size_t len)
+{
+    for (size_t i = 0; i < len; i++) { seq[i] = (unsigned char)(seq[i] - ((seq[i] >= 96) << 5)); }
+}
+
+
 /*
  * Copies the content of an already open file into output stream.
  * Starts from "start", copies exactly "expected_size" bytes.
@@ -34,6 +34,9 @@ static bool force_stdout = false;
 static bool created_output_file = false;
 
 static int compression_level = 1;
+static double target_speed = 0.0;
+static unsigned parse_threads = 1;
+static unsigned long long input_size_read = 0ull;
 static int sequence_window_size_log = 0;
 
 static char *temp_dir = NULL;
@@ -53,16 +56,58 @@ enum { seq_type_dna, seq_type_rna, seq_type_protein, seq_type_text };
 static int in_seq_type = seq_type_dna;
 static const char *in_seq_type_name = "DNA";
 
+enum { ext_stats = 1, ext_seq_encoding = 2, ext_dictionary = 3, ext_id_encoding = 4, ext_lengths_encoding = 5,
+       ext_mask_encoding = 6, ext_dedup = 7, ext_codecs = 8, ext_quality_binning = 9,
+       ext_quality_layout = 10, ext_seq_layout = 11, ext_homopolymers = 12, ext_reference = 13,
+       ext_order = 14, ext_frames = 15 };
+enum { seq_encoding_4bit = 0, seq_encoding_2bit = 1 };
+enum { id_encoding_plain = 0, id_encoding_tokens = 1 };
+enum { lengths_encoding_units = 0, lengths_encoding_numbers = 1, lengths_encoding_constant = 2 };
+enum { mask_encoding_units = 0, mask_encoding_numbers = 1 };
+enum { codec_zstd = 0, codec_store = 1, codec_lz4 = 2, codec_cm = 3, codec_fqz = 4 };
+enum { qual_binning_none = 0, qual_binning_illumina8 = 1, qual_binning_custom = 2 };
+enum { layout_normal = 0, layout_transposed = 1 };
+
 static bool store_title = false;
 static bool store_mask  = true;
 static bool store_qual  = false;
+static bool store_stats = false;
+static bool store_2bit  = false;
+static bool tokenize_ids = false;
+static bool compact_lengths = false;
+static bool compact_mask = false;
+static bool dedup_sequences = false;
+static bool transpose_qualities = false;
+static bool transpose_sequences = false;
+static bool store_hpc = false;
+static bool reorder_records = false;
+static bool reorder_reads = false;
+static unsigned long long reorder_memory = 0;
+static int seq_codec = codec_zstd;
+static int qual_codec = codec_zstd;
+static int qual_binning = qual_binning_none;
+
+static char *dict_file_path = NULL;
+static char *dict_save_path = NULL;
+static unsigned long long dict_train_n_headers = 0;
+static bool names_dict_pending = false;
+static unsigned char *names_dict = NULL;
+static size_t names_dict_size = 0;
+static unsigned char *names_dict_packed = NULL;
+static size_t names_dict_packed_size = 0;
+static unsigned names_dict_id = 0;
+static bool names_dict_is_embedded = false;
+static ZSTD_CDict *names_cdict = NULL;
 
 static bool parity = false;
 static unsigned char* out_4bit_buffer = NULL;
 static unsigned char* out_4bit_pos = NULL;
 
 static unsigned long long seq_size_original  = 0ull;
+static unsigned long long qual_size_original = 0ull;
+static unsigned long long seq_size_deduplicated = 0ull;
 static unsigned long long longest_line_length = 0ull;
+static size_t fasta_line_width = 0;   // Width of the last FASTA sequence line taken on the fast path.
 
 static bool line_length_is_specified = false;
 static unsigned long long requested_line_length = 0ull;
@@ -74,6 +119,14 @@ static unsigned char* file_copy_buffer = NULL;
 static unsigned int *length_units = NULL;
 static unsigned int length_unit_index = 0;
 
+#define length_bytes_buffer_size 16384
+static unsigned char *length_bytes = NULL;
+static unsigned char *length_bytes_end = NULL;
+static unsigned char *length_bytes_pos = NULL;
+static bool lengths_are_constant = true;
+static unsigned long long constant_length = 0;
+static unsigned long long n_constant_lengths = 0;
+
 #define mask_units_buffer_size 16384
 static unsigned char *mask_units = NULL;
 static unsigned char *mask_units_end = NULL;
@@ -93,6 +146,29 @@ static bool abort_on_unexpected_code = false;
 static bool assume_well_formed_input = false;
 
 static size_t out_4bit_buffer_size = 0;
+static unsigned out_2bit_phase = 0;
+static unsigned long long out_2bit_n_bases = 0;
+static unsigned short nuc_2bit[256];
+static unsigned char nuc_pair_code[65536];
+
+#define exception_units_buffer_size 16384
+static unsigned char *exception_units = NULL;
+static unsigned char *exception_units_end = NULL;
+static unsigned char *exception_units_pos = NULL;
+static unsigned long long exception_run_start = 0;
+static unsigned long long exception_run_length = 0;
+static unsigned long long exception_prev_run_end = 0;
+static unsigned char exception_run_code = 0;
+
+#define hpc_units_buffer_size 16384
+static unsigned char *hpc_units = NULL;
+static unsigned char *hpc_units_end = NULL;
+static unsigned char *hpc_units_pos = NULL;
+static unsigned long long hpc_run_length = 0;
+static unsigned long long hpc_n_bases = 0;
+static unsigned char hpc_run_code = 16;     // Code of the unfinished run, or 16 before the first one.
+static size_t *hpc_starts = NULL;
+static size_t hpc_starts_allocated = 0;
 static size_t zstd_stream_recommended_out_buffer_size = 0;
 
 typedef struct {
@@ -105,23 +181,54 @@ typedef struct {
     FILE *file;
     char *path;
     unsigned char *buf;
+    const char *name;
+    int level;
+    bool adaptive;
+    unsigned long long block_start_size;
+    clock_t block_clock;
+    bool multi_frame;
+    unsigned long long n_blocks;
+    double *level_speeds;
+    int codec;
+    unsigned char *block;
+    size_t block_fill;
+    unsigned char *block_out;
+    const unsigned char *prefix;
+    size_t prefix_size;
 } compressor_t;
 
-compressor_t IDS  = { 0, 0, 0, 0, 0, NULL, NULL, NULL, NULL };
-compressor_t COMM = { 0, 0, 0, 0, 0, NULL, NULL, NULL, NULL };
-compressor_t LEN  = { 0, 0, 0, 0, 0, NULL, NULL, NULL, NULL };
-compressor_t MASK = { 0, 0, 0, 0, 0, NULL, NULL, NULL, NULL };
-compressor_t SEQ  = { 0, 0, 0, 0, 0, NULL, NULL, NULL, NULL };
-compressor_t QUAL = { 0, 0, 0, 0, 0, NULL, NULL, NULL, NULL };
+compressor_t IDS  = { 0, 0, 0, 0, 0, NULL, NULL, NULL, NULL, NULL, 0, false, 0, 0, 0, 0, NULL, codec_zstd, NULL, 0, NULL, NULL, 0 };
+compressor_t COMM = { 0, 0, 0, 0, 0, NULL, NULL, NULL, NULL, NULL, 0, false, 0, 0, 0, 0, NULL, codec_zstd, NULL, 0, NULL, NULL, 0 };
+compressor_t LEN  = { 0, 0, 0, 0, 0, NULL, NULL, NULL, NULL, NULL, 0, false, 0, 0, 0, 0, NULL, codec_zstd, NULL, 0, NULL, NULL, 0 };
+compressor_t MASK = { 0, 0, 0, 0, 0, NULL, NULL, NULL, NULL, NULL, 0, false, 0, 0, 0, 0, NULL, codec_zstd, NULL, 0, NULL, NULL, 0 };
+compressor_t SEQ  = { 0, 0, 0, 0, 0, NULL, NULL, NULL, NULL, NULL, 0, false, 0, 0, 0, 0, NULL, codec_zstd, NULL, 0, NULL, NULL, 0 };
+compressor_t QUAL = { 0, 0, 0, 0, 0, NULL, NULL, NULL, NULL, NULL, 0, false, 0, 0, 0, 0, NULL, codec_zstd, NULL, 0, NULL, NULL, 0 };
+compressor_t EXC  = { 0, 0, 0, 0, 0, NULL, NULL, NULL, NULL, NULL, 0, false, 0, 0, 0, 0, NULL, codec_zstd, NULL, 0, NULL, NULL, 0 };
+compressor_t RUNS = { 0, 0, 0, 0, 0, NULL, NULL, NULL, NULL, NULL, 0, false, 0, 0, 0, 0, NULL, codec_zstd, NULL, 0, NULL, NULL, 0 };
+compressor_t ORDER = { 0, 0, 0, 0, 0, NULL, NULL, NULL, NULL, NULL, 0, false, 0, 0, 0, 0, NULL, codec_zstd, NULL, 0, NULL, NULL, 0 };
 
 static bool success = false;
 
 
 #include "utils.c"
 #include "files.c"
+#include "codecs.c"
+#include "cm.c"
+#include "fqz.c"
 #include "compressor.c"
+#include "stats.c"
+#include "dictionary.c"
+#include "tokenizer.c"
+#include "transpose.c"
 #include "encoders.c"
+#include "dedup.c"
+#include "reference.c"
+#include "seqtype.c"
+#include "reorder.c"
+#include "qual-bins.c"
 #include "process.c"
+#include "parallel.c"
+#include "extensions.c"
 
 
 #define FREE(p) \
@@ -136,6 +243,13 @@ static void done(void)
     compressor_done(&MASK);
     compressor_done(&SEQ);
     compressor_done(&QUAL);
+    compressor_done(&EXC);
+    compressor_done(&RUNS);
+    compressor_done(&ORDER);
+    cm_free();
+    fqz_free();
+    transposer_free(&qual_transposer);
+    transposer_free(&seq_transposer);
 
     FREE(name.data);
     FREE(comment.data);
@@ -146,7 +260,20 @@ static void done(void)
     FREE(out_4bit_buffer);
     FREE(file_copy_buffer);
     FREE(length_units);
+    FREE(length_bytes);
     FREE(mask_units);
+    FREE(exception_units);
+    FREE(hpc_units);
+    FREE(hpc_starts);
+    FREE(stats_length_table);
+    FREE(names_dict);
+    FREE(names_dict_packed);
+    free_id_tokenizer();
+    free_dedup();
+    free_reference();
+    free_reorder();
+    free_sample();
+    if (names_cdict != NULL) { ZSTD_freeCDict(names_cdict); names_cdict = NULL; }
 
     close_output_file();
     close_input_file();
@@ -226,6 +353,28 @@ static void set_compression_level(char *str)
 }
 
 
+static void set_target_speed(char *str)
+{
+    assert(str != NULL);
+
+    char *end;
+    double a = strtod(str, &end);
+    if (*end != '\0' || end == str || !(a > 0.0)) { die("invalid value of --target-speed, should be a positive number of MB/s\n"); }
+    target_speed = a;
+}
+
+
+static void set_threads(char *str)
+{
+    assert(str != NULL);
+
+    char *end;
+    long a = strtol(str, &end, 10);
+    if (*end != '\0' || end == str || a < 1 || a > 256) { die("invalid value of --threads, should be from 1 to 256\n"); }
+    parse_threads = (unsigned)a;
+}
+
+
 static void set_line_length(char *str)
 {
     assert(str != NULL);
@@ -244,6 +393,65 @@ static void set_line_length(char *str)
 }
 
 
+static void set_dict_file_path(char *new_path)
+{
+    assert(new_path != NULL);
+
+    if (dict_file_path != NULL) { die("double --dict parameter\n"); }
+    if (*new_path == '\0') { die("empty --dict parameter\n"); }
+    dict_file_path = new_path;
+}
+
+
+static void set_ref_path(char *new_path)
+{
+    assert(new_path != NULL);
+
+    if (ref_path != NULL) { die("double --ref parameter\n"); }
+    if (*new_path == '\0') { die("empty --ref parameter\n"); }
+    ref_path = new_path;
+}
+
+
+static void set_dict_save_path(char *new_path)
+{
+    assert(new_path != NULL);
+
+    if (dict_save_path != NULL) { die("double --save-dict parameter\n"); }
+    if (*new_path == '\0') { die("empty --save-dict parameter\n"); }
+    dict_save_path = new_path;
+}
+
+
+static void set_reorder_memory(char *str)
+{
+    assert(str != NULL);
+
+    char *end;
+    long long a = strtoll(str, &end, 10);
+    unsigned long long unit = 1;
+    if (*end == 'K') { unit = 1024ull; end++; }
+    else if (*end == 'M') { unit = 1024ull * 1024; end++; }
+    else if (*end == 'G') { unit = 1024ull * 1024 * 1024; end++; }
+    if (*end != '\0' || end == str || a < 1 || (unsigned long long)a > (~0ull >> 1) / unit)
+    {
+        die("invalid value of --reorder-memory, should be a positive number of bytes, optionally followed by K, M or G\n");
+    }
+    reorder_memory = (unsigned long long)a * unit;
+}
+
+
+static void set_dict_train_n_headers(char *str)
+{
+    assert(str != NULL);
+
+    char *end;
+    long long a = strtoll(str, &end, 10);
+    if (*end != '\0' || a < 1) { die("invalid value of --train-dict, should be a positive number of headers\n"); }
+    dict_train_n_headers = (unsigned long long) a;
+}
+
+
 static void set_sequence_window_size_log(char *str)
 {
     assert(str != NULL);
@@ -337,6 +545,11 @@ static void show_help(void)
         "  -c                 - Write to standard output\n"
         "  -#, --level #      - Use compression level # (from %d to %d, default: 1)\n"
         "  --long N           - Use window of size 2^N for sequence stream (from %d to %d)\n"
+        "  --target-speed N   - Adjust compression level to process at least N MB of input per second\n"
+        "  --threads N        - Parse input in N threads (default: 1)\n"
+        "  --seq-codec C      - Compress sequence with codec C: zstd (default), store, lz4 or cm\n"
+        "  --qual-codec C     - Compress qualities with codec C: zstd (default), store, lz4 or fqz\n"
+        "  --qual-bins B      - Bin qualities (lossy) with scheme B: illumina8, or a list like 2-9:6,10-19:15\n"
         "  --temp-dir DIR     - Use DIR as temporary directory\n"
         "  --name NAME        - Use NAME as prefix for temporary files\n"
         "  --title TITLE      - Store TITLE as dataset title\n"
@@ -346,11 +559,28 @@ static void show_help(void)
         "  --rna              - Input sequence is RNA\n"
         "  --protein          - Input sequence is protein\n"
         "  --text             - Input sequence is text\n"
+        "  --auto-type        - Detect sequence type from the beginning of input\n"
         "  --strict           - Fail on unexpected input characters\n"
         "  --line-length N    - Override line length to N\n"
         "  --verbose          - Verbose mode\n"
         "  --keep-temp-files  - Keep temporary files\n"
         "  --no-mask          - Don't store mask\n"
+        "  --stats            - Store summary statistics\n"
+        "  --2bit             - Store ACGT at 2 bits per base, other codes as exceptions\n"
+        "  --tokenize-ids     - Split ids into fields, and store each field as a column\n"
+        "  --compact-lengths  - Store lengths as variable length numbers, or once if all equal\n"
+        "  --compact-mask     - Store mask intervals as variable length numbers\n"
+        "  --dedup            - Store repeated sequences as references to their first occurrence\n"
+        "  --qual-transpose   - Store qualities of equal length reads column by column\n"
+        "  --msa              - Store equal length sequences (alignment) column by column\n"
+        "  --hpc              - Store homopolymer runs as single nucleotides, and run lengths separately\n"
+        "  --ref FILE         - Compress sequence using the sequence of NAF FILE as reference\n"
+        "  --reorder          - Store similar sequences next to each other, and their original order separately\n"
+        "  --reorder-reads    - Store reads sharing a minimizer next to each other, and their original order separately\n"
+        "  --reorder-memory N - Sort reads for --reorder-reads in at most N bytes of memory (K, M, G suffixes allowed, default: 1G)\n"
+        "  --train-dict N     - Train and store dictionary for ids and comments on first N headers\n"
+        "  --dict FILE        - Use dictionary from FILE for ids and comments\n"
+        "  --save-dict FILE   - Save dictionary trained with --train-dict to FILE\n"
         "  -h, --help         - Show help\n"
         "  -V, --version      - Show version\n",
         min_level, max_level, ZSTD_WINDOWLOG_MIN, ZSTD_WINDOWLOG_MAX);
@@ -375,6 +605,16 @@ static void parse_command_line(int argc, char **argv)
                     if (!strcmp(argv[i], "--level")) { i++; set_compression_level(argv[i]); continue; }
                     if (!strcmp(argv[i], "--line-length")) { i++; set_line_length(argv[i]); continue; }
                     if (!strcmp(argv[i], "--long")) { i++; set_sequence_window_size_log(argv[i]); continue; }
+                    if (!strcmp(argv[i], "--target-speed")) { i++; set_target_speed(argv[i]); continue; }
+                    if (!strcmp(argv[i], "--threads")) { i++; set_threads(argv[i]); continue; }
+                    if (!strcmp(argv[i], "--seq-codec")) { i++; seq_codec = parse_codec_name(argv[i], "--seq-codec"); continue; }
+                    if (!strcmp(argv[i], "--qual-codec")) { i++; qual_codec = parse_codec_name(argv[i], "--qual-codec"); continue; }
+                    if (!strcmp(argv[i], "--qual-bins")) { i++; set_quality_binning(argv[i]); continue; }
+                    if (!strcmp(argv[i], "--dict")) { i++; set_dict_file_path(argv[i]); continue; }
+                    if (!strcmp(argv[i], "--train-dict")) { i++; set_dict_train_n_headers(argv[i]); continue; }
+                    if (!strcmp(argv[i], "--save-dict")) { i++; set_dict_save_path(argv[i]); continue; }
+                    if (!strcmp(argv[i], "--ref")) { i++; set_ref_path(argv[i]); continue; }
+                    if (!strcmp(argv[i], "--reorder-memory")) { i++; set_reorder_memory(argv[i]); continue; }
 
                     // Deprecated, undocumented.
                     if (!strcmp(argv[i], "--out")) { i++; set_output_file_path(argv[i]); continue; }
@@ -387,12 +627,24 @@ static void parse_command_line(int argc, char **argv)
                 if (!strcmp(argv[i], "--binary-stderr")) { if (!binary_stderr) { binary_stderr = true; change_stderr_to_binary(); } continue; }
                 if (!strcmp(argv[i], "--keep-temp-files")) { keep_temp_files = true; continue; }
                 if (!strcmp(argv[i], "--no-mask")) { no_mask = true; continue; }
+                if (!strcmp(argv[i], "--stats")) { store_stats = true; continue; }
+                if (!strcmp(argv[i], "--2bit")) { store_2bit = true; continue; }
+                if (!strcmp(argv[i], "--tokenize-ids")) { tokenize_ids = true; continue; }
+                if (!strcmp(argv[i], "--compact-lengths")) { compact_lengths = true; continue; }
+                if (!strcmp(argv[i], "--compact-mask")) { compact_mask = true; continue; }
+                if (!strcmp(argv[i], "--dedup")) { dedup_sequences = true; continue; }
+                if (!strcmp(argv[i], "--qual-transpose")) { transpose_qualities = true; continue; }
+                if (!strcmp(argv[i], "--msa")) { transpose_sequences = true; continue; }
+                if (!strcmp(argv[i], "--hpc")) { store_hpc = true; continue; }
+                if (!strcmp(argv[i], "--reorder")) { reorder_records = true; continue; }
+                if (!strcmp(argv[i], "--reorder-reads")) { reorder_reads = true; continue; }
                 if (!strcmp(argv[i], "--fasta")) { set_input_format_from_command_line("fasta"); continue; }
                 if (!strcmp(argv[i], "--fastq")) { set_input_format_from_command_line("fastq"); continue; }
-                if (!strcmp(argv[i], "--dna")) { in_seq_type = seq_type_dna; continue; }
-                if (!strcmp(argv[i], "--rna")) { in_seq_type = seq_type_rna; continue; }
-                if (!strcmp(argv[i], "--protein")) { in_seq_type = seq_type_protein; continue; }
-                if (!strcmp(argv[i], "--text")) { in_seq_type = seq_type_text; continue; }
+                if (!strcmp(argv[i], "--dna")) { in_seq_type = seq_type_dna; auto_detect_seq_type = false; continue; }
+                if (!strcmp(argv[i], "--rna")) { in_seq_type = seq_type_rna; auto_detect_seq_type = false; continue; }
+                if (!strcmp(argv[i], "--protein")) { in_seq_type = seq_type_protein; auto_detect_seq_type = false; continue; }
+                if (!strcmp(argv[i], "--text")) { in_seq_type = seq_type_text; auto_detect_seq_type = false; continue; }
+                if (!strcmp(argv[i], "--auto-type")) { auto_detect_seq_type = true; continue; }
                 if (!strcmp(argv[i], "--well-formed")) { assume_well_formed_input = true; continue; }
                 if (!strcmp(argv[i], "--strict")) { abort_on_unexpected_code = true; continue; }
             }
@@ -427,22 +679,38 @@ static void parse_command_line(int argc, char **argv)
     {
         die("'--well-formed' and '--strict' can't be used together\n");
     }
-}
 
+    if (dict_file_path != NULL && dict_train_n_headers != 0)
+    {
+        die("'--dict' and '--train-dict' can't be used together\n");
+    }
 
-int main(int argc, char **argv)
-{
-    atexit(done);
-    init_encoders();
+    if (dict_save_path != NULL && dict_train_n_headers == 0)
+    {
+        die("'--save-dict' requires '--train-dict'\n");
+    }
 
-    parse_command_line(argc, argv);
-    if (in_file_path == NULL && isatty(fileno(stdin)))
+    if (reorder_memory != 0 && !reorder_reads)
     {
-        err("no input specified, use \"ennaf -h\" for help\n");
-        exit(0);
+        die("'--reorder-memory' requires '--reorder-reads'\n");
     }
+    if (reorder_memory == 0) { reorder_memory = reorder_default_memory; }
+}
 
-    if (no_mask || in_seq_type >= seq_type_protein) { store_mask = false; }
+
+/*
+ * Checks options that depend on sequence type, and prepares to parse the sequence.
+ */
+static void set_sequence_type(void)
+{
+    if (no_mask || in_seq_type == seq_type_text) { store_mask = false; }
+    if (store_2bit && in_seq_type >= seq_type_protein) { die("'--2bit' can be used only with DNA or RNA input\n"); }
+    if (dedup_sequences && in_seq_type >= seq_type_protein) { die("'--dedup' can be used only with DNA or RNA input\n"); }
+    if (store_hpc && in_seq_type >= seq_type_protein) { die("'--hpc' can be used only with DNA or RNA input\n"); }
+    if (ref_path != NULL && in_seq_type >= seq_type_protein) { die("'--ref' can be used only with DNA or RNA input\n"); }
+    if (reorder_records && in_seq_type >= seq_type_protein) { die("'--reorder' can be used only with DNA or RNA input\n"); }
+    if (reorder_reads && in_seq_type >= seq_type_protein) { die("'--reorder-reads' can be used only with DNA or RNA input\n"); }
+    if (seq_codec == codec_cm && (store_2bit || in_seq_type >= seq_type_protein)) { die("'cm' sequence codec can be used only with DNA or RNA input, without '--2bit'\n"); }
 
     if (in_seq_type == seq_type_dna)
     {
@@ -468,13 +736,50 @@ int main(int argc, char **argv)
         in_seq_type_name = "text";
         unexpected_seq_char_replacement = '?';
     }
+}
+
+
+int main(int argc, char **argv)
+{
+    atexit(done);
+    init_encoders();
+
+    parse_command_line(argc, argv);
+    if (in_file_path == NULL && isatty(fileno(stdin)))
+    {
+        err("no input specified, use \"ennaf -h\" for help\n");
+        exit(0);
+    }
+
+    if (dedup_sequences && transpose_sequences) { die("'--dedup' and '--msa' can't be used together\n"); }
+    if (store_hpc && (dedup_sequences || transpose_sequences)) { die("'--hpc' can't be used with '--dedup' or '--msa'\n"); }
+    if (ref_path != NULL && (store_2bit || store_hpc || transpose_sequences || seq_codec != codec_zstd))
+    {
+        die("'--ref' can be used only with zstd sequence codec, without '--2bit', '--hpc' or '--msa'\n");
+    }
+    if (sequence_window_size_log != 0 && seq_codec != codec_zstd) { die("'--long' can be used only with zstd sequence codec\n"); }
+    if (qual_codec == codec_cm) { die("'cm' codec can be used only for sequence\n"); }
+    if (seq_codec == codec_fqz) { die("'fqz' codec can be used only for qualities\n"); }
+    if (!auto_detect_seq_type) { set_sequence_type(); }
 
     detect_temp_directory();
     detect_input_format_from_input_file_extension();
 
     open_input_file();
     confirm_input_format();
+    if (auto_detect_seq_type)
+    {
+        detect_sequence_type();
+        set_sequence_type();
+        if (verbose) { msg("Detected sequence type: %s\n", in_seq_type_name); }
+    }
     store_qual = (in_format_from_input == in_format_fastq);
+    if (qual_binning != qual_binning_none && !store_qual) { die("'--qual-bins' can be used only with FASTQ input\n"); }
+    if (transpose_qualities && !store_qual) { die("'--qual-transpose' can be used only with FASTQ input\n"); }
+    if (transpose_qualities && qual_codec == codec_fqz) { die("'--qual-transpose' can't be used with 'fqz' quality codec\n"); }
+    if (transpose_sequences && store_qual) { die("'--msa' can be used only with FASTA input\n"); }
+    if (reorder_records && store_qual) { die("'--reorder' can be used only with FASTA input\n"); }
+    if (reorder_reads && in_format_from_input == in_format_fasta) { die("'--reorder-reads' can be used only with FASTQ input\n"); }
     if (in_seq_type == seq_type_text && in_format_from_input == in_format_fasta) { is_unexpected_arr['>'] = true; }
 
     if (!force_stdout && out_file_path == NULL && isatty(fileno(stdout)))
@@ -502,12 +807,34 @@ int main(int argc, char **argv)
     compressor_init(&COMM, "comments", 0);
     compressor_init(&LEN, "lengths", 0);
     if (store_mask) { compressor_init(&MASK, "mask", 0); }
+    SEQ.codec = seq_codec;
+    QUAL.codec = qual_codec;
+    if (ref_path != NULL)
+    {
+        load_reference();
+        SEQ.prefix = ref_prefix;
+        SEQ.prefix_size = ref_prefix_size;
+        if (sequence_window_size_log < reference_window_log()) { sequence_window_size_log = reference_window_log(); }
+    }
     compressor_init(&SEQ, "sequence", sequence_window_size_log);
     if (store_qual) { compressor_init(&QUAL, "quality", 0); }
+    if (store_2bit) { compressor_init(&EXC, "exceptions", 0); }
+    if (store_hpc) { compressor_init(&RUNS, "runs", 0); }
+    if (tokenize_ids) { init_id_tokenizer(); }
+    if (dedup_sequences) { init_dedup(); }
+
+    if (dict_file_path != NULL) { load_names_dictionary_file(); attach_names_dictionary(); }
+    names_dict_pending = (dict_train_n_headers != 0);
 
+    if ((reorder_records && in_format_from_input == in_format_fasta) ||
+        (reorder_reads && in_format_from_input == in_format_fastq)) { prepare_reordering(); }
     process();
+    if (reading_reordered_input) { finish_reordering(); }
     close_input_file();
 
+    if (transpose_sequences) { transposer_finish(&seq_transposer); }
+    if (store_qual && transpose_qualities) { transposer_finish(&qual_transposer); }
+
     if (mask_len > 0) { add_mask(mask_len); }
 
     if (length_unit_index > 0)
@@ -516,24 +843,55 @@ int main(int argc, char **argv)
         length_unit_index = 0;
     }
 
+    if (length_bytes_pos > length_bytes)
+    {
+        compress(&LEN, length_bytes, (size_t)(length_bytes_pos - length_bytes));
+        length_bytes_pos = length_bytes;
+    }
+
     if (mask_units_pos > mask_units)
     {
         compress(&MASK, mask_units, (size_t)(mask_units_pos - mask_units));
         mask_units_pos = mask_units;
     }
 
-    if (parity) { out_4bit_pos++; }
-    if (out_4bit_pos > out_4bit_buffer)
+    if (store_hpc) { finish_hpc(); }
+
+    if (store_2bit)
     {
-        compress(&SEQ, out_4bit_buffer, (size_t)(out_4bit_pos - out_4bit_buffer));
+        if (out_2bit_phase != 0) { out_4bit_pos++; }
+        if (out_4bit_pos > out_4bit_buffer)
+        {
+            compress_2bit_buffer((size_t)(out_4bit_pos - out_4bit_buffer));
+        }
+
+        flush_exception_run();
+        if (exception_units_pos > exception_units)
+        {
+            compress(&EXC, exception_units, (size_t)(exception_units_pos - exception_units));
+            exception_units_pos = exception_units;
+        }
+    }
+    else
+    {
+        if (parity) { out_4bit_pos++; }
+        if (out_4bit_pos > out_4bit_buffer)
+        {
+            compress_4bit_buffer((size_t)(out_4bit_pos - out_4bit_buffer));
+        }
     }
 
+    if (tokenize_ids) { finish_id_tokenizer(); }
+
     compressor_end_stream(&IDS);
     compressor_end_stream(&COMM);
     compressor_end_stream(&LEN);
     compressor_end_stream(&MASK);
     compressor_end_stream(&SEQ);
     compressor_end_stream(&QUAL);
+    compressor_end_stream(&EXC);
+    compressor_end_stream(&RUNS);
+    compressor_end_stream(&ORDER);
 
     fwrite_or_die(naf_magic_number, 1, 3, OUT);
 
@@ -542,14 +900,16 @@ int main(int argc, char **argv)
     if (in_seq_type == seq_type_dna) { fputc_or_die(1, OUT); }
     else { fputc_or_die(2, OUT); fputc_or_die(in_seq_type, OUT); }
 
-    fputc_or_die( (0           << 7) |   // extended format
-                  (store_title << 6) |   // title
-                  (1           << 5) |   // ids
-                  (1           << 4) |   // comments
-                  (1           << 3) |   // lengths
-                  (store_mask  << 2) |   // mask
-                  (1           << 1) |   // sequence
-                   store_qual          , OUT);
+    bool extended_format = (count_extensions() > 0);
+
+    fputc_or_die( (extended_format << 7) |   // extended format
+                  (store_title     << 6) |   // title
+                  (1               << 5) |   // ids
+                  (1               << 4) |   // comments
+                  (1               << 3) |   // lengths
+                  (store_mask      << 2) |   // mask
+                  (1               << 1) |   // sequence
+                   store_qual              , OUT);
     fputc_or_die(' ', OUT);
 
     unsigned long long out_line_length = line_length_is_specified ? requested_line_length : longest_line_length;
@@ -557,6 +917,8 @@ int main(int argc, char **argv)
     write_variable_length_encoded_number(OUT, out_line_length);
     write_variable_length_encoded_number(OUT, n_sequences);
 
+    if (extended_format) { write_extensions(OUT); }
+
     if (store_title)
     {
         size_t title_length = strlen(dataset_title);
@@ -597,4 +959,4 @@ int main(int argc, char **argv)
     success = true;
 
     return 0;
-}
+}
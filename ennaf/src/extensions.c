@@ -0,0 +1,56 @@
+/*
+ * NAF compressor
+ * Copyright (c) 2018-2021 Kirill Kryukov
+ * See README.md and LICENSE files of this repository
+ */
+
+/*
+ * Extended format.
+ * When the extended format flag is set, the header is followed by the list of extension records:
+ *   Number of records
+ *   Each record: Type, Size, Payload
+ * Type and Size are in variable length encoding. Payload is "Size" bytes of type-specific data.
+ */
+
+
+static unsigned long long count_extensions(void)
+{
+    unsigned long long n = 0;
+    if (store_stats) { n++; }
+    if (store_2bit) { n++; }
+    if (names_dict != NULL) { n++; }
+    if (tokenize_ids) { n++; }
+    if (compact_lengths) { n++; }
+    if (compact_mask && store_mask) { n++; }
+    if (dedup_sequences) { n++; }
+    if (has_non_zstd_codecs()) { n++; }
+    if (qual_binning != qual_binning_none) { n++; }
+    if (transpose_qualities) { n++; }
+    if (transpose_sequences) { n++; }
+    if (store_hpc) { n++; }
+    if (ref_path != NULL) { n++; }
+    if ((reorder_records || reorder_reads) && !reorder_is_identity) { n++; }
+    if (multi_frame_parts() != 0) { n++; }
+    return n;
+}
+
+
+static void write_extensions(FILE *F)
+{
+    write_variable_length_encoded_number(F, count_extensions());
+    if (store_stats) { write_stats_extension(F); }
+    if (store_2bit) { write_seq_encoding_extension(F); }
+    if (names_dict != NULL) { write_dictionary_extension(F); }
+    if (tokenize_ids) { write_id_encoding_extension(F); }
+    if (compact_lengths) { write_lengths_encoding_extension(F); }
+    if (compact_mask && store_mask) { write_mask_encoding_extension(F); }
+    if (dedup_sequences) { write_dedup_extension(F); }
+    if (has_non_zstd_codecs()) { write_codecs_extension(F); }
+    if (qual_binning != qual_binning_none) { write_quality_binning_extension(F); }
+    if (transpose_qualities) { write_layout_extension(F, ext_quality_layout, &qual_transposer); }
+    if (transpose_sequences) { write_layout_extension(F, ext_seq_layout, &seq_transposer); }
+    if (store_hpc) { write_hpc_extension(F); }
+    if (ref_path != NULL) { write_reference_extension(F); }
+    if ((reorder_records || reorder_reads) && !reorder_is_identity) { write_order_extension(F); }
+    if (multi_frame_parts() != 0) { write_frames_extension(F); }
+}
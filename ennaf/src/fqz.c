@@ -0,0 +1,225 @@
+/*
+ * NAF compressor
+ * Copyright (c) 2018-2021 Kirill Kryukov
+ * See README.md and LICENSE files of this repository
+ */
+
+/*
+ * Quality codec ("--qual-codec fqz"), modeled after fqzcomp.
+ * Each quality value is coded with an adaptive frequency model, selected by the context of:
+ * two previous qualities of the same read, position in the read, and the amount of change in the read so far.
+ * Qualities are mapped to symbols 0..n-1 by sorted order, where n is the number of distinct values in the block.
+ * Frequencies are kept as cumulative tables summing to 2^15, adapting towards each coded symbol,
+ * quickly at first and then slower, as the context sees more data.
+ * Symbols are coded with two interleaved rANS states, to let the decoder overlap work on consecutive symbols.
+ * rANS codes in reverse order, so the encoder first runs the model forward, remembering each symbol's frequency range.
+ * Read boundaries come from read lengths, which the decoder knows from the "Lengths" part.
+ * The model starts from scratch in each block, so blocks can be decoded independently.
+ * Stored block: number of symbols minus 1 (1 byte), the symbols (1 byte each), rANS states (2 x 4 bytes), rANS data.
+ * This model must be exactly the same as in unnaf.
+ */
+
+#define fqz_scale_bits 15
+#define fqz_total (1 << fqz_scale_bits)
+#define fqz_rans_low (1u << 23)
+#define fqz_n_positions 12
+#define fqz_n_deltas 4
+#define fqz_max_q2 16
+#define fqz_min_rate 3
+#define fqz_max_rate 7
+#define fqz_rate_step 8
+
+static const unsigned char fqz_delta_bucket[16] = { 0, 1, 1, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3 };
+
+static unsigned fqz_n = 0;
+static unsigned fqz_n_q2 = 0;
+static unsigned short *fqz_cdfs = NULL;
+static unsigned char *fqz_counts = NULL;
+static size_t fqz_allocated_contexts = 0;
+static size_t fqz_allocated_cdfs = 0;
+
+static unsigned fqz_q1 = 0, fqz_q2 = 0, fqz_delta = 0;
+static unsigned long long fqz_pos = 0;
+
+static unsigned long long *fqz_read_lengths = NULL;
+static size_t fqz_n_read_lengths = 0;
+static size_t fqz_read_lengths_allocated = 0;
+static size_t fqz_read_index = 0;
+
+static unsigned short *fqz_starts = NULL;
+static unsigned short *fqz_freqs = NULL;
+static unsigned char *fqz_rans_buffer = NULL;
+
+
+static void fqz_free(void)
+{
+    if (fqz_cdfs != NULL) { free(fqz_cdfs); fqz_cdfs = NULL; }
+    if (fqz_counts != NULL) { free(fqz_counts); fqz_counts = NULL; }
+    if (fqz_read_lengths != NULL) { free(fqz_read_lengths); fqz_read_lengths = NULL; }
+    if (fqz_starts != NULL) { free(fqz_starts); fqz_starts = NULL; }
+    if (fqz_freqs != NULL) { free(fqz_freqs); fqz_freqs = NULL; }
+    if (fqz_rans_buffer != NULL) { free(fqz_rans_buffer); fqz_rans_buffer = NULL; }
+}
+
+
+/*
+ * Called for each read, in order, with the length of its quality string.
+ */
+static void fqz_add_read_length(unsigned long long len)
+{
+    if (fqz_n_read_lengths >= fqz_read_lengths_allocated)
+    {
+        size_t new_allocated = fqz_read_lengths_allocated ? fqz_read_lengths_allocated * 2 : 4096;
+        unsigned long long *new_lengths = (unsigned long long *) malloc_or_die(sizeof(unsigned long long) * new_allocated);
+        if (fqz_n_read_lengths > 0) { memcpy(new_lengths, fqz_read_lengths, sizeof(unsigned long long) * fqz_n_read_lengths); }
+        if (fqz_read_lengths != NULL) { free(fqz_read_lengths); }
+        fqz_read_lengths = new_lengths;
+        fqz_read_lengths_allocated = new_allocated;
+    }
+    fqz_read_lengths[fqz_n_read_lengths++] = len;
+}
+
+
+static void fqz_reset(unsigned n)
+{
+    fqz_n = n;
+    fqz_n_q2 = (n < fqz_max_q2) ? n : fqz_max_q2;
+
+    size_t n_contexts = (size_t)n * fqz_n_q2 * fqz_n_positions * fqz_n_deltas;
+    if (n_contexts > fqz_allocated_contexts)
+    {
+        if (fqz_counts != NULL) { free(fqz_counts); }
+        fqz_counts = (unsigned char *) malloc_or_die(n_contexts);
+        fqz_allocated_contexts = n_contexts;
+    }
+    if (n_contexts * (n + 1) > fqz_allocated_cdfs)
+    {
+        if (fqz_cdfs != NULL) { free(fqz_cdfs); }
+        fqz_cdfs = (unsigned short *) malloc_or_die(sizeof(unsigned short) * n_contexts * (n + 1));
+        fqz_allocated_cdfs = n_contexts * (n + 1);
+    }
+
+    for (unsigned i = 0; i <= n; i++) { fqz_cdfs[i] = (unsigned short)(i * fqz_total / n); }
+    for (size_t c = 1; c < n_contexts; c++) { memcpy(fqz_cdfs + c * (n + 1), fqz_cdfs, sizeof(unsigned short) * (n + 1)); }
+    memset(fqz_counts, 0, n_contexts);
+}
+
+
+static inline void fqz_start_read(void)
+{
+    fqz_q1 = 0;
+    fqz_q2 = 0;
+    fqz_delta = 0;
+    fqz_pos = 0;
+}
+
+
+static inline size_t fqz_context(void)
+{
+    unsigned q2 = (fqz_n_q2 == fqz_n) ? fqz_q2 : fqz_q2 * fqz_n_q2 / fqz_n;
+    unsigned pos = (fqz_pos < 160) ? (unsigned)(fqz_pos >> 4) : (fqz_pos < 512) ? 10 : 11;
+    unsigned delta = fqz_delta_bucket[(fqz_delta < 15) ? fqz_delta : 15];
+    return (((size_t)fqz_q1 * fqz_n_q2 + q2) * fqz_n_positions + pos) * fqz_n_deltas + delta;
+}
+
+
+/*
+ * Moves the cumulative table towards the one where every symbol other than "s" has frequency 1.
+ * Frequencies never drop below 1 with this rounding.
+ */
+static inline void fqz_update(size_t context, unsigned short *cdf, unsigned s)
+{
+    unsigned count = fqz_counts[context];
+    unsigned rate = fqz_min_rate + count / fqz_rate_step;
+    if (rate >= fqz_max_rate) { rate = fqz_max_rate; }
+    else { fqz_counts[context] = (unsigned char)(count + 1); }
+
+    int n = (int)fqz_n;
+    for (int i = 1; i <= (int)s; i++) { int v = cdf[i]; cdf[i] = (unsigned short)(v + ((i - v) >> rate)); }
+    for (int i = (int)s + 1; i < n; i++) { int v = cdf[i]; cdf[i] = (unsigned short)(v + ((fqz_total - (n - i) - v) >> rate)); }
+}
+
+
+static inline void fqz_advance(unsigned s)
+{
+    if (fqz_pos != 0) { fqz_delta += (s > fqz_q1) ? s - fqz_q1 : fqz_q1 - s; }
+    fqz_q2 = fqz_q1;
+    fqz_q1 = s;
+    fqz_pos++;
+}
+
+
+/*
+ * Compresses "size" bytes (at most "codec_block_size") of qualities from "src" into "dst" of "dst_capacity" bytes.
+ * Returns the compressed size, or 0 if it did not fit.
+ */
+static size_t fqz_compress_block(const unsigned char *src, size_t size, unsigned char *dst, size_t dst_capacity)
+{
+    assert(size <= codec_block_size);
+
+    if (fqz_starts == NULL)
+    {
+        fqz_starts = (unsigned short *) malloc_or_die(sizeof(unsigned short) * codec_block_size);
+        fqz_freqs = (unsigned short *) malloc_or_die(sizeof(unsigned short) * codec_block_size);
+        fqz_rans_buffer = (unsigned char *) malloc_or_die(codec_block_size * 2 + 16);
+    }
+
+    bool used[256] = { false };
+    for (size_t i = 0; i < size; i++) { used[src[i]] = true; }
+    unsigned char symbols[256], map[256];
+    unsigned n = 0;
+    for (unsigned c = 0; c < 256; c++) { if (used[c]) { map[c] = (unsigned char)n; symbols[n++] = (unsigned char)c; } }
+    if (n == 0 || 1 + n + 8 > dst_capacity) { return 0; }
+
+    // Reads that ended in earlier blocks are not needed anymore.
+    if (fqz_read_index > 0)
+    {
+        fqz_n_read_lengths -= fqz_read_index;
+        memmove(fqz_read_lengths, fqz_read_lengths + fqz_read_index, sizeof(unsigned long long) * fqz_n_read_lengths);
+        fqz_read_index = 0;
+    }
+
+    fqz_reset(n);
+    unsigned long long pos = fqz_pos;
+    fqz_start_read();
+    fqz_pos = pos;
+
+    for (size_t i = 0; i < size; i++)
+    {
+        while (fqz_read_index < fqz_n_read_lengths && fqz_pos == fqz_read_lengths[fqz_read_index])
+        {
+            fqz_read_index++;
+            fqz_start_read();
+        }
+
+        unsigned s = map[src[i]];
+        size_t context = fqz_context();
+        unsigned short *cdf = fqz_cdfs + context * (n + 1);
+        fqz_starts[i] = cdf[s];
+        fqz_freqs[i] = (unsigned short)(cdf[s + 1] - cdf[s]);
+        fqz_update(context, cdf, s);
+        fqz_advance(s);
+    }
+
+    unsigned char *end = fqz_rans_buffer + codec_block_size * 2 + 16, *p = end;
+    unsigned x[2] = { fqz_rans_low, fqz_rans_low };
+    for (size_t i = size; i-- > 0; )
+    {
+        unsigned *xs = &x[i & 1];
+        unsigned freq = fqz_freqs[i];
+        unsigned x_max = ((fqz_rans_low >> fqz_scale_bits) << 8) * freq;
+        while (*xs >= x_max) { *--p = (unsigned char)(*xs & 255); *xs >>= 8; }
+        *xs = ((*xs / freq) << fqz_scale_bits) + (*xs % freq) + fqz_starts[i];
+    }
+    for (int k = 1; k >= 0; k--)
+    {
+        for (int b = 3; b >= 0; b--) { *--p = (unsigned char)(x[k] >> (b * 8)); }
+    }
+
+    size_t rans_size = (size_t)(end - p);
+    if (1 + n + rans_size > dst_capacity) { return 0; }
+    dst[0] = (unsigned char)(n - 1);
+    memcpy(dst + 1, symbols, n);
+    memcpy(dst + 1 + n, p, rans_size);
+    return 1 + n + rans_size;
+}
@@ -0,0 +1,609 @@
+/*
+ * NAF compressor
+ * Copyright (c) 2018-2021 Kirill Kryukov
+ * See README.md and LICENSE files of this repository
+ */
+
+/*
+ * Parallel parsing ("--threads N").
+ * Input is read in batches of N chunks of about "parse_chunk_size" bytes each. Each chunk starts at the beginning
+ * of a line (FASTA) or of a record (FASTQ), and is parsed in its own thread into separate buffers of ids, comments,
+ * lengths, qualities, mask runs and 4-bit encoded sequence. The main thread then passes these buffers to the streams
+ * chunk by chunk, record by record, in the same order as the serial parser does, so the output is the same.
+ * While the main thread is passing one batch, the threads are parsing the next one.
+ *
+ * Threads parse only regular input: ids and comments without unexpected characters, sequence lines of expected
+ * characters only, every line ending with '\n', no empty lines, FASTQ records of exactly 4 lines.
+ * At the first chunk that has anything else, the rest of the input, starting from that chunk, is given back to
+ * the serial parser, which may then start in the middle of a FASTA record.
+ *
+ * Used for DNA and RNA stored in 4-bit encoding (not with "--2bit", "--hpc", "--dedup", "--msa", "--reorder",
+ * "--reorder-reads" or "--target-speed").
+ */
+
+#define parse_chunk_size (4ull * 1024 * 1024)
+
+typedef struct
+{
+    const unsigned char *data;
+    size_t size;
+    bool is_regular;
+    unsigned long long lead_length;     // FASTA sequence before the first name line, continuing the previous record.
+    unsigned long long n_records;
+    unsigned long long *lengths;        // FASTA: The last length continues in the next chunks.
+    size_t lengths_allocated;
+    byte_buffer_t ids;                  // Zero-terminated.
+    byte_buffer_t comments;             // Zero-terminated.
+    byte_buffer_t quals;
+    byte_buffer_t seq;                  // Two nucleotides per byte, first in the low half.
+    unsigned long long n_nucleotides;
+    bool parity;
+    unsigned long long *mask_runs;      // Alternately unmasked and masked, starting with unmasked.
+    size_t n_mask_runs;
+    size_t mask_runs_allocated;
+    bool mask_on;
+    unsigned long long mask_len;
+    unsigned long long longest_line_length;
+    pthread_t thread;
+    bool has_thread;
+}
+parse_chunk_t;
+
+typedef struct
+{
+    unsigned char *data;
+    size_t allocated;
+    size_t filled;                      // Bytes read.
+    size_t size;                        // Bytes divided into chunks. The rest is carried over to the next batch.
+    parse_chunk_t *chunks;
+    unsigned n_chunks;
+}
+parse_batch_t;
+
+static parse_batch_t parse_batches[2];
+static bool parse_input_ended = false;
+static bool parse_record_is_open = false;
+static unsigned long long parse_open_record_length = 0;
+
+
+static void chunk_add_length(parse_chunk_t *ch, unsigned long long len)
+{
+    if (ch->n_records >= ch->lengths_allocated)
+    {
+        ch->lengths_allocated = ch->lengths_allocated ? ch->lengths_allocated * 2 : 65536;
+        ch->lengths = (unsigned long long *) realloc_or_die(ch->lengths, sizeof(unsigned long long) * ch->lengths_allocated);
+    }
+    ch->lengths[ch->n_records++] = len;
+}
+
+
+static void chunk_add_mask_run(parse_chunk_t *ch, unsigned long long len)
+{
+    if (ch->n_mask_runs >= ch->mask_runs_allocated)
+    {
+        ch->mask_runs_allocated = ch->mask_runs_allocated ? ch->mask_runs_allocated * 2 : 65536;
+        ch->mask_runs = (unsigned long long *) realloc_or_die(ch->mask_runs, sizeof(unsigned long long) * ch->mask_runs_allocated);
+    }
+    ch->mask_runs[ch->n_mask_runs++] = len;
+}
+
+
+/*
+ * Same as "extract_mask" followed by "encode_dna", but into the buffers of the chunk.
+ */
+static void chunk_put_sequence(parse_chunk_t *ch, const unsigned char *p, size_t n)
+{
+    if (store_mask)
+    {
+        const unsigned char *end = p + n;
+        for (const unsigned char *c = p; c < end; )
+        {
+            if (ch->mask_on != (*c >= 96))
+            {
+                chunk_add_mask_run(ch, ch->mask_len);
+                ch->mask_len = 0;
+                ch->mask_on = !ch->mask_on;
+            }
+            const unsigned char *run_end = case_run_end(c, end, ch->mask_on);
+            ch->mask_len += (unsigned long long)(run_end - c);
+            c = run_end;
+        }
+    }
+
+    byte_buffer_reserve(&ch->seq, n / 2 + 1);
+    unsigned char *out = ch->seq.data + ch->seq.size;
+    ch->n_nucleotides += n;
+    if (n > 0 && ch->parity)
+    {
+        out[-1] |= (unsigned char)(nuc_code[*p] * 16);
+        ch->parity = false;
+        p++;
+        n--;
+    }
+    for (; n >= 2; p += 2, n -= 2)
+    {
+        unsigned short pair;
+        memcpy(&pair, p, 2);
+        *out++ = nuc_pair_code[pair];
+    }
+    if (n > 0)
+    {
+        *out++ = nuc_code[*p];
+        ch->parity = true;
+    }
+    ch->seq.size = (size_t)(out - ch->seq.data);
+}
+
+
+/*
+ * Returns the length of the sequence line starting at "p",
+ * or 0 if the line is empty, has unexpected characters, or does not end with '\n' before "end".
+ */
+static size_t chunk_sequence_line_length(const unsigned char *p, const unsigned char *end)
+{
+    const unsigned char *eol = (const unsigned char *) memchr(p, '\n', (size_t)(end - p));
+    if (eol == NULL) { return 0; }
+    bool unexpected = false;
+    for (const unsigned char *c = p; c < eol; c++) { unexpected |= is_unexpected_arr[*c]; }
+    return unexpected ? 0 : (size_t)(eol - p);
+}
+
+
+/*
+ * Parses the name line following the '>' or '@' at "p".
+ * Returns the start of the next line, or NULL if the name line is not regular.
+ */
+static const unsigned char* chunk_parse_name_line(parse_chunk_t *ch, const unsigned char *p, const unsigned char *end)
+{
+    const unsigned char *eol = (const unsigned char *) memchr(p, '\n', (size_t)(end - p));
+    if (eol == NULL) { return NULL; }
+
+    const unsigned char *c = p;
+    while (c < eol && !is_unexpected_text_arr[*c]) { c++; }
+    if (c > p) { byte_buffer_put_bytes(&ch->ids, p, (size_t)(c - p)); }
+    byte_buffer_put_byte(&ch->ids, '\0');
+
+    if (c < eol)
+    {
+        if (*c != ' ') { return NULL; }
+        const unsigned char *comment = ++c;
+        while (c < eol && !is_unexpected_comment_arr[*c]) { c++; }
+        if (c < eol) { return NULL; }
+        if (eol > comment) { byte_buffer_put_bytes(&ch->comments, comment, (size_t)(eol - comment)); }
+    }
+    byte_buffer_put_byte(&ch->comments, '\0');
+
+    return eol + 1;
+}
+
+
+static void parse_fasta_chunk(parse_chunk_t *ch)
+{
+    const unsigned char *p = ch->data;
+    const unsigned char *end = ch->data + ch->size;
+    bool in_record = false;
+    unsigned long long length = 0;
+
+    while (p < end)
+    {
+        if (*p == '>')
+        {
+            if (in_record) { chunk_add_length(ch, length); }
+            else { ch->lead_length = length; }
+            in_record = true;
+            length = 0;
+
+            p = chunk_parse_name_line(ch, p + 1, end);
+            if (p == NULL) { return; }
+        }
+        else
+        {
+            size_t s = chunk_sequence_line_length(p, end);
+            if (s == 0) { return; }
+            chunk_put_sequence(ch, p, s);
+            if (s > ch->longest_line_length) { ch->longest_line_length = s; }
+            length += s;
+            p += s + 1;
+        }
+    }
+
+    if (in_record) { chunk_add_length(ch, length); }
+    else { ch->lead_length = length; }
+    ch->is_regular = true;
+}
+
+
+static void parse_fastq_chunk(parse_chunk_t *ch)
+{
+    const unsigned char *p = ch->data;
+    const unsigned char *end = ch->data + ch->size;
+
+    while (p < end)
+    {
+        if (*p != '@') { return; }
+        p = chunk_parse_name_line(ch, p + 1, end);
+        if (p == NULL) { return; }
+
+        size_t s = chunk_sequence_line_length(p, end);
+        if (s == 0) { return; }
+        const unsigned char *sequence = p;
+        p += s + 1;
+
+        // The '+' line is empty in well-formed input, otherwise it may repeat the name.
+        if (p >= end || *p != '+') { return; }
+        const unsigned char *c = p + 1;
+        while (c < end && !is_unexpected_comment_arr[*c]) { c++; }
+        if (c >= end || *c != '\n' || (assume_well_formed_input && c != p + 1)) { return; }
+        p = c + 1;
+
+        if ((size_t)(end - p) <= s || p[s] != '\n') { return; }
+        bool unexpected = false;
+        for (size_t i = 0; i < s; i++) { unexpected |= is_unexpected_qual_arr[p[i]]; }
+        if (unexpected) { return; }
+
+        chunk_put_sequence(ch, sequence, s);
+        byte_buffer_put_bytes(&ch->quals, p, s);
+        chunk_add_length(ch, s);
+        if (s > ch->longest_line_length) { ch->longest_line_length = s; }
+        p += s + 1;
+    }
+
+    ch->is_regular = true;
+}
+
+
+static void* parse_chunk(void *arg)
+{
+    parse_chunk_t *ch = (parse_chunk_t *) arg;
+
+    ch->is_regular = false;
+    ch->lead_length = 0;
+    ch->n_records = 0;
+    ch->ids.size = 0;
+    ch->comments.size = 0;
+    ch->quals.size = 0;
+    ch->seq.size = 0;
+    ch->n_nucleotides = 0;
+    ch->parity = false;
+    ch->n_mask_runs = 0;
+    ch->mask_on = false;
+    ch->mask_len = 0;
+    ch->longest_line_length = 0;
+
+    if (in_format_from_input == in_format_fasta) { parse_fasta_chunk(ch); }
+    else { parse_fastq_chunk(ch); }
+
+    if (store_mask) { chunk_add_mask_run(ch, ch->mask_len); }
+    return NULL;
+}
+
+
+/*
+ * Checks that a FASTQ record starts at "i": '@' at the beginning of a line, and '+' at the beginning of the third line.
+ * The '+' check tells it from a quality line starting with '@'.
+ */
+static bool is_fastq_record_start(const unsigned char *data, size_t i, size_t filled)
+{
+    if (i >= filled || data[i] != '@' || (i > 0 && data[i - 1] != '\n')) { return false; }
+    const unsigned char *end = data + filled;
+    const unsigned char *eol = (const unsigned char *) memchr(data + i, '\n', filled - i);
+    if (eol == NULL) { return false; }
+    eol = (const unsigned char *) memchr(eol + 1, '\n', (size_t)(end - eol - 1));
+    return (eol != NULL && eol + 1 < end && eol[1] == '+');
+}
+
+
+/*
+ * Returns the first chunk boundary at or after "from" and before "limit", or "limit" if there is none.
+ */
+static size_t next_chunk_boundary(const parse_batch_t *b, size_t from, size_t limit)
+{
+    assert(from > 0);
+
+    for (size_t i = from - 1; i < limit; )
+    {
+        const unsigned char *eol = (const unsigned char *) memchr(b->data + i, '\n', limit - i);
+        if (eol == NULL || (size_t)(eol - b->data) + 1 >= limit) { break; }
+        i = (size_t)(eol - b->data) + 1;
+        if (in_format_from_input == in_format_fasta || is_fastq_record_start(b->data, i, b->filled)) { return i; }
+    }
+    return limit;
+}
+
+
+/*
+ * Returns the last chunk boundary in the data read into the batch, or 0 if there is none.
+ */
+static size_t last_chunk_boundary(const parse_batch_t *b)
+{
+    for (size_t i = b->filled; i > 0; i--)
+    {
+        if (b->data[i - 1] == '\n')
+        {
+            if (in_format_from_input == in_format_fasta || is_fastq_record_start(b->data, i, b->filled)) { return i; }
+        }
+    }
+    return 0;
+}
+
+
+/*
+ * Reads the next batch. The first "carry_size" bytes are already in place.
+ */
+static void read_batch(parse_batch_t *b, size_t carry_size)
+{
+    size_t want = carry_size + parse_threads * parse_chunk_size;
+    assert(b->allocated >= want);
+
+    b->filled = carry_size;
+    while (b->filled < want && !parse_input_ended)
+    {
+        size_t n = read_input(b->data + b->filled, want - b->filled);
+        if (n == 0) { parse_input_ended = true; }
+        b->filled += n;
+        input_size_read += n;
+    }
+    b->size = parse_input_ended ? b->filled : last_chunk_boundary(b);
+
+    b->n_chunks = 0;
+    size_t start = 0;
+    for (unsigned i = 0; i < parse_threads && start < b->size; i++)
+    {
+        size_t target = b->size / parse_threads * (i + 1);
+        size_t end = (i == parse_threads - 1) ? b->size : next_chunk_boundary(b, (target > start) ? target : start + 1, b->size);
+        parse_chunk_t *ch = &b->chunks[b->n_chunks++];
+        ch->data = b->data + start;
+        ch->size = end - start;
+        start = end;
+    }
+}
+
+
+static void reserve_batch(parse_batch_t *b, size_t carry_size)
+{
+    size_t want = carry_size + parse_threads * parse_chunk_size;
+    if (b->allocated < want)
+    {
+        b->data = (unsigned char *) realloc_or_die(b->data, want);
+        b->allocated = want;
+    }
+}
+
+
+static void start_batch(parse_batch_t *b)
+{
+    for (unsigned i = 0; i < b->n_chunks; i++)
+    {
+        parse_chunk_t *ch = &b->chunks[i];
+        ch->has_thread = (pthread_create(&ch->thread, NULL, &parse_chunk, ch) == 0);
+        if (!ch->has_thread) { parse_chunk(ch); }
+    }
+}
+
+
+static void finish_batch(parse_batch_t *b)
+{
+    for (unsigned i = 0; i < b->n_chunks; i++)
+    {
+        parse_chunk_t *ch = &b->chunks[i];
+        if (ch->has_thread) { pthread_join(ch->thread, NULL); ch->has_thread = false; }
+    }
+}
+
+
+static void close_parsed_record(void)
+{
+    add_length(parse_open_record_length);
+    n_sequences++;
+    parse_record_is_open = false;
+    parse_open_record_length = 0;
+}
+
+
+static void put_mask_run(bool masked, unsigned long long len)
+{
+    if (len == 0) { return; }
+    if (mask_on != masked)
+    {
+        add_mask(mask_len);
+        mask_len = 0;
+        mask_on = masked;
+    }
+    mask_len += len;
+    if (masked) { stats_masked_length += len; }
+}
+
+
+/*
+ * Passes the parsed chunk to the streams.
+ */
+static void stitch_chunk(const parse_chunk_t *ch)
+{
+    assert(seq.length == 0);
+
+    for (size_t i = 0; i < ch->n_mask_runs; i++) { put_mask_run((i & 1) != 0, ch->mask_runs[i]); }
+    encode_packed_dna(ch->seq.data, ch->n_nucleotides);
+    seq_size_original += ch->n_nucleotides;
+
+    const unsigned char *id = ch->ids.data;
+    const unsigned char *comm = ch->comments.data;
+    const unsigned char *q = ch->quals.data;
+    if (in_format_from_input == in_format_fasta)
+    {
+        assert(parse_record_is_open || ch->lead_length == 0);
+        parse_open_record_length += ch->lead_length;
+    }
+
+    for (unsigned long long r = 0; r < ch->n_records; r++)
+    {
+        if (parse_record_is_open) { close_parsed_record(); }
+
+        size_t id_size = strlen((const char *) id) + 1;
+        str_append_bytes(&name, id, id_size);
+        id += id_size;
+
+        size_t comm_size = strlen((const char *) comm) + 1;
+        str_append_bytes(&comment, comm, comm_size);
+        comm += comm_size;
+
+        if (in_format_from_input == in_format_fasta)
+        {
+            parse_record_is_open = true;
+            parse_open_record_length = ch->lengths[r];
+        }
+        else
+        {
+            str_append_bytes(&qual, q, ch->lengths[r]);
+            q += ch->lengths[r];
+            add_length(ch->lengths[r]);
+            n_sequences++;
+        }
+    }
+
+    if (ch->longest_line_length > longest_line_length) { longest_line_length = ch->longest_line_length; }
+}
+
+
+/*
+ * Gives the input starting at "from" in batch "b" back to the serial parser, followed by the input of batch "next"
+ * (which starts with what "b" carried over), if it was already read, and by what remains of the sample.
+ */
+static void process_rest_serially(const parse_batch_t *b, size_t from, const parse_batch_t *next)
+{
+    const unsigned char *tail = next ? next->data : b->data + b->size;
+    size_t tail_size = next ? next->filled : b->filled - b->size;
+    size_t sample_size = in_sample_end - in_sample_pos;
+    size_t size = b->size - from + tail_size + sample_size;
+
+    unsigned char *rest = (unsigned char *) malloc_or_die(size);
+    memcpy(rest, b->data + from, b->size - from);
+    memcpy(rest + b->size - from, tail, tail_size);
+    if (sample_size != 0) { memcpy(rest + size - sample_size, in_sample + in_sample_pos, sample_size); }
+
+    // The bytes read so far will be counted again when the serial parser reads them.
+    input_size_read -= size - sample_size;
+
+    free_sample();
+    in_sample = rest;
+    in_sample_pos = 0;
+    in_sample_end = size;
+    in_begin = 0;
+    in_end = 0;
+
+    if (verbose) { msg("Parsing the rest of input in 1 thread\n"); }
+
+    if (in_format_from_input == in_format_fasta)
+    {
+        bool resume = (rest[0] != '>');
+        if (resume) { assert(parse_record_is_open); }
+        else
+        {
+            if (parse_record_is_open) { close_parsed_record(); }
+            in_sample_pos = 1;
+            input_size_read++;
+        }
+
+        if (assume_well_formed_input) { process_well_formed_fasta(resume, parse_open_record_length); }
+        else { process_non_well_formed_fasta(resume, parse_open_record_length); }
+        parse_record_is_open = false;
+    }
+    else
+    {
+        assert(rest[0] == '@');
+        in_sample_pos = 1;
+        input_size_read++;
+        if (assume_well_formed_input) { process_well_formed_fastq(); }
+        else { process_non_well_formed_fastq(); }
+    }
+}
+
+
+static bool can_process_in_parallel(void)
+{
+    return (seq.writer == &seq_writer_masked_4bit || seq.writer == &seq_writer_nonmasked_4bit) &&
+           !reading_reordered_input && !(target_speed > 0.0);
+}
+
+
+static void free_parse_batches(void)
+{
+    for (unsigned i = 0; i < 2; i++)
+    {
+        parse_batch_t *b = &parse_batches[i];
+        for (unsigned k = 0; k < parse_threads && b->chunks != NULL; k++)
+        {
+            parse_chunk_t *ch = &b->chunks[k];
+            if (ch->lengths != NULL) { free(ch->lengths); }
+            if (ch->mask_runs != NULL) { free(ch->mask_runs); }
+            if (ch->ids.data != NULL) { free(ch->ids.data); }
+            if (ch->comments.data != NULL) { free(ch->comments.data); }
+            if (ch->quals.data != NULL) { free(ch->quals.data); }
+            if (ch->seq.data != NULL) { free(ch->seq.data); }
+        }
+        if (b->chunks != NULL) { free(b->chunks); b->chunks = NULL; }
+        if (b->data != NULL) { free(b->data); b->data = NULL; }
+    }
+}
+
+
+/*
+ * Parses the input after the '>' or '@' of the first record, which was already read.
+ */
+static void process_in_parallel(void)
+{
+    parse_batch_t *cur = &parse_batches[0];
+    parse_batch_t *next = &parse_batches[1];
+    for (unsigned i = 0; i < 2; i++)
+    {
+        parse_batches[i].chunks = (parse_chunk_t *) malloc_or_die(sizeof(parse_chunk_t) * parse_threads);
+        memset(parse_batches[i].chunks, 0, sizeof(parse_chunk_t) * parse_threads);
+    }
+
+    if (verbose) { msg("Parsing input in %u threads\n", parse_threads); }
+
+    size_t carry_size = 1 + in_end - in_begin;
+    reserve_batch(cur, carry_size);
+    cur->data[0] = (in_format_from_input == in_format_fasta) ? '>' : '@';
+    memcpy(cur->data + 1, in_buffer + in_begin, in_end - in_begin);
+    in_begin = in_end;
+    read_batch(cur, carry_size);
+    start_batch(cur);
+
+    for (;;)
+    {
+        // A batch with no chunk boundary has a line or record too long for the threads.
+        if (cur->size == 0)
+        {
+            if (cur->filled != 0) { process_rest_serially(cur, 0, NULL); }
+            break;
+        }
+
+        bool have_next = (cur->size < cur->filled || !parse_input_ended);
+        if (have_next)
+        {
+            carry_size = cur->filled - cur->size;
+            reserve_batch(next, carry_size);
+            memcpy(next->data, cur->data + cur->size, carry_size);
+            read_batch(next, carry_size);
+            start_batch(next);
+        }
+
+        finish_batch(cur);
+        unsigned n_regular = 0;
+        while (n_regular < cur->n_chunks && cur->chunks[n_regular].is_regular) { stitch_chunk(&cur->chunks[n_regular++]); }
+        if (n_regular < cur->n_chunks)
+        {
+            if (have_next) { finish_batch(next); }
+            process_rest_serially(cur, (size_t)(cur->chunks[n_regular].data - cur->data), have_next ? next : NULL);
+            break;
+        }
+
+        if (!have_next) { break; }
+        parse_batch_t *t = cur;
+        cur = next;
+        next = t;
+    }
+
+    if (parse_record_is_open) { close_parsed_record(); }
+    free_parse_batches();
+}
@@ -9,14 +9,22 @@
 #define INEOF 256
 
 
+static void prepare_names_dictionary(void);
+static bool can_process_in_parallel(void);
+static void process_in_parallel(void);
+
+
 static void name_writer(unsigned char *str, size_t size)
 {
-    compress(&IDS, str, size);
+    if (names_dict_pending) { prepare_names_dictionary(); }
+    if (tokenize_ids) { tokenize_ids_chunk(str, size); }
+    else { compress(&IDS, str, size); }
 }
 
 
 static void comm_writer(unsigned char *str, size_t size)
 {
+    if (names_dict_pending) { prepare_names_dictionary(); }
     compress(&COMM, str, size);
 }
 
@@ -36,9 +44,50 @@ static void seq_writer_nonmasked_4bit(unsigned char *str, size_t size)
 }
 
 
+static void seq_writer_masked_2bit(unsigned char *str, size_t size)
+{
+    seq_size_original += size;
+    extract_mask(str, size);
+    encode_dna_2bit(str, size);
+}
+
+
+static void seq_writer_nonmasked_2bit(unsigned char *str, size_t size)
+{
+    seq_size_original += size;
+    encode_dna_2bit(str, size);
+}
+
+
+static void seq_writer_masked_hpc(unsigned char *str, size_t size)
+{
+    seq_size_original += size;
+    extract_mask(str, size);
+    encode_dna_hpc(str, size);
+}
+
+
+static void seq_writer_nonmasked_hpc(unsigned char *str, size_t size)
+{
+    seq_size_original += size;
+    encode_dna_hpc(str, size);
+}
+
+
+static void seq_writer_masked_protein(unsigned char *str, size_t size)
+{
+    seq_size_original += size;
+    extract_mask(str, size);
+    uppercase_masked_protein(str, size);
+    if (store_stats) { stats_add_bytes(1, str, size); }
+    compress(&SEQ, str, size);
+}
+
+
 static void seq_writer_masked_text(unsigned char *str, size_t size)
 {
     seq_size_original += size;
+    if (store_stats) { stats_add_bytes(1, str, size); }
     compress(&SEQ, str, size);
 }
 
@@ -47,16 +96,60 @@ static void seq_writer_nonmasked_text(unsigned char *str, size_t size)
 {
     seq_size_original += size;
     for (size_t i = 0; i < size; i++) { str[i] = (unsigned char) toupper(str[i]); }
+    if (store_stats) { stats_add_bytes(1, str, size); }
     compress(&SEQ, str, size);
 }
 
 
-static void qual_writer(unsigned char *str, size_t size)
+/*
+ * Alignment mode ("--msa"): mask is extracted in the original order, then the sequence goes to the transposer,
+ * which passes it in transposed order to the encoder ("seq_transposer.sink").
+ */
+static void seq_writer_transposed(unsigned char *str, size_t size)
+{
+    seq_size_original += size;
+    if (store_mask)
+    {
+        extract_mask(str, size);
+        if (in_seq_type == seq_type_protein) { uppercase_masked_protein(str, size); }
+    }
+    else if (no_mask && in_seq_type >= seq_type_protein)
+    {
+        for (size_t i = 0; i < size; i++) { str[i] = (unsigned char) toupper(str[i]); }
+    }
+    transposer_put(&seq_transposer, str, size);
+}
+
+
+static void compress_text_sequence(const unsigned char *str, size_t size)
+{
+    if (store_stats) { stats_add_bytes(1, str, size); }
+    compress(&SEQ, str, size);
+}
+
+
+static void compress_qualities(const unsigned char *str, size_t size)
 {
     compress(&QUAL, str, size);
 }
 
 
+static void seq_writer_dedup(unsigned char *str, size_t size)
+{
+    seq_size_original += size;
+    byte_buffer_put_bytes(&dedup_record, str, size);
+}
+
+
+static void qual_writer(unsigned char *str, size_t size)
+{
+    qual_size_original += size;
+    if (qual_binning != qual_binning_none) { bin_qualities(str, size); }
+    if (transpose_qualities) { transposer_put(&qual_transposer, str, size); }
+    else { compress(&QUAL, str, size); }
+}
+
+
 typedef struct
 {
     size_t length;
@@ -72,6 +165,28 @@ static string_t seq     = { 0, NULL, NULL };
 static string_t qual    = { 0, NULL, &qual_writer };
 
 
+/*
+ * Completes the sequence of the current record in deduplication mode, and passes it to the deduplicator.
+ */
+static void dedup_sequence(void)
+{
+    if (seq.length != 0) { seq.writer(seq.data, seq.length); seq.length = 0; }
+    dedup_encode_record(n_sequences);
+}
+
+
+/*
+ * Trains the dictionary on the ids and comments collected so far, right before the first of them is compressed.
+ */
+static void prepare_names_dictionary(void)
+{
+    names_dict_pending = false;
+    // Tokenized ids don't resemble the raw ids, so the dictionary is trained only on comments then.
+    train_names_dictionary(name.data, tokenize_ids ? 0 : name.length, comment.data, comment.length);
+    attach_names_dictionary();
+}
+
+
 static void report_unexpected_char_stats(unsigned long long *n, const char *seq_type_name)
 {
     unsigned long long total = 0;
@@ -146,7 +261,8 @@ static inline void refill_in_buffer(void)
     assert(in_buffer != NULL);
 
     in_begin = 0;
-    in_end = fread(in_buffer, 1, in_buffer_size, IN);
+    in_end = reading_reordered_input ? read_reordered_input(in_buffer, in_buffer_size) : read_input(in_buffer, in_buffer_size);
+    input_size_read += in_end;
 }
 
 
@@ -311,23 +427,103 @@ static inline void str_append_char(string_t *str, unsigned char c)
 }
 
 
-static void process_well_formed_fasta(void)
+/*
+ * Appends "size" bytes to "str", writing it out whenever it fills, as "in_get_until" does.
+ */
+static inline void str_append_bytes(string_t *str, const unsigned char *data, size_t size)
+{
+    while (str->length + size >= UNCOMPRESSED_BUFFER_SIZE)
+    {
+        size_t s1 = UNCOMPRESSED_BUFFER_SIZE - str->length;
+        memcpy(str->data + str->length, data, s1);
+        str->writer(str->data, UNCOMPRESSED_BUFFER_SIZE);
+        str->length = 0;
+        data += s1;
+        size -= s1;
+    }
+    memcpy(str->data + str->length, data, size);
+    str->length += size;
+}
+
+
+/*
+ * Speculative well-formed parsing of FASTA sequence lines, starting at the beginning of a line.
+ * Takes the complete lines available in the input buffer, as long as each consists only of expected characters,
+ * and ends with '\n'. Such lines are verified first, then copied as a whole.
+ * Stops before the first other line (name line, empty line, line with spaces, '\r' or unexpected characters,
+ * or line not complete in the buffer), which is then parsed character by character.
+ * Result is the same as when parsing all lines character by character.
+ * Lines usually have the same width, so first the '\n' is expected right after the width of the previous line.
+ * Since '\n' is not an expected character, verifying the line also ensures that it has no earlier '\n'.
+ */
+static inline void in_get_verified_sequence_lines(unsigned long long *old_len)
+{
+    while (in_begin < in_end)
+    {
+        const unsigned char *line = in_buffer + in_begin;
+        size_t s = fasta_line_width;
+        if (s == 0 || in_end - in_begin <= s || line[s] != '\n')
+        {
+            const unsigned char *eol = (const unsigned char *) memchr(line, '\n', in_end - in_begin);
+            if (eol == NULL || eol == line) { break; }
+            s = (size_t)(eol - line);
+        }
+        bool unexpected = false;
+        for (size_t i = 0; i < s; i++) { unexpected |= is_unexpected_arr[line[i]]; }
+        if (unexpected) { break; }
+
+        if (seq.length + s >= UNCOMPRESSED_BUFFER_SIZE)
+        {
+            size_t s1 = UNCOMPRESSED_BUFFER_SIZE - seq.length;
+            memcpy(seq.data + seq.length, line, s1);
+            seq.writer(seq.data, UNCOMPRESSED_BUFFER_SIZE);
+            memcpy(seq.data, line + s1, s - s1);
+            seq.length = s - s1;
+        }
+        else
+        {
+            memcpy(seq.data + seq.length, line, s);
+            seq.length += s;
+        }
+        in_begin += s + 1;
+
+        if (s != fasta_line_width)
+        {
+            fasta_line_width = s;
+            if (s > longest_line_length) { longest_line_length = s; }
+        }
+        *old_len += s;
+    }
+}
+
+
+/*
+ * FASTA parsers start right after the '>' of the first record.
+ * With "resume", they start instead at the beginning of a sequence line of a record, whose name, comment and
+ * first "resumed_length" characters of sequence were already processed (by "process_in_parallel").
+ */
+static void process_well_formed_fasta(bool resume, unsigned long long resumed_length)
 {
     unsigned c;
     do {
-        c = in_get_until(is_well_formed_space_arr, &name);
-        str_append_char(&name, '\0');
+        if (resume) { resume = false; c = '\n'; }
+        else
+        {
+            c = in_get_until(is_well_formed_space_arr, &name);
+            str_append_char(&name, '\0');
 
-        if (c == ' ') { c = in_get_until_specific_char('\n', &comment); }
-        str_append_char(&comment, '\0');
+            if (c == ' ') { c = in_get_until_specific_char('\n', &comment); }
+            str_append_char(&comment, '\0');
+        }
 
-        unsigned long long old_total_seq_size = seq_size_original + seq.length;
+        unsigned long long old_total_seq_size = seq_size_original + seq.length - resumed_length;
+        resumed_length = 0;
         if (c != INEOF)
         {
             if (in_peek_char() == '>') { in_begin++; } // Empty sequence.
             else
             {
-                unsigned long long old_len = old_total_seq_size;
+                unsigned long long old_len = seq_size_original + seq.length;
                 while ( (c = in_get_until_specific_char('\n', &seq)) != INEOF)
                 {
                     unsigned long long new_len = seq_size_original + seq.length;
@@ -349,42 +545,50 @@ static void process_well_formed_fasta(void)
         }
 
         add_length(seq_size_original + seq.length - old_total_seq_size);
+        if (dedup_sequences) { dedup_sequence(); }
         n_sequences++;
     }
     while (c != INEOF);
 }
 
 
-static void process_non_well_formed_fasta(void)
+static void process_non_well_formed_fasta(bool resume, unsigned long long resumed_length)
 {
     unsigned c;
     do {
-        // At this point the '>' was already read, so we immediately proceed to read the name.
-        while ( (c = in_get_until(is_unexpected_text_arr, &name)) != INEOF )
+        if (resume) { resume = false; c = '\n'; }
+        else
         {
-            if (is_space_arr[c]) { break; }
-            else { unexpected_id_char(c); str_append_char(&seq, unexpected_name_char_replacement); }
-        }
-        str_append_char(&name, '\0');
+            // At this point the '>' was already read, so we immediately proceed to read the name.
+            while ( (c = in_get_until(is_unexpected_text_arr, &name)) != INEOF )
+            {
+                if (is_space_arr[c]) { break; }
+                else { unexpected_id_char(c); str_append_char(&seq, unexpected_name_char_replacement); }
+            }
+            str_append_char(&name, '\0');
 
-        if (c != INEOF && !is_eol_arr[c])
-        {
-            while ( (c = in_get_until(is_unexpected_comment_arr, &comment)) != INEOF )
+            if (c != INEOF && !is_eol_arr[c])
             {
-                if (is_eol_arr[c]) { break; }
-                else { unexpected_comment_char(c); str_append_char(&comment, unexpected_name_char_replacement); }
+                while ( (c = in_get_until(is_unexpected_comment_arr, &comment)) != INEOF )
+                {
+                    if (is_eol_arr[c]) { break; }
+                    else { unexpected_comment_char(c); str_append_char(&comment, unexpected_name_char_replacement); }
+                }
             }
+            str_append_char(&comment, '\0');
         }
-        str_append_char(&comment, '\0');
 
-        unsigned long long old_total_seq_size = seq_size_original + seq.length;
+        unsigned long long old_total_seq_size = seq_size_original + seq.length - resumed_length;
+        resumed_length = 0;
         if (c != INEOF)
         {
             if (in_peek_char() == '>') { in_begin++; } // Empty sequence.
             else
             {
-                unsigned long long old_len = old_total_seq_size;
-                while ( (c = in_get_until(is_unexpected_arr, &seq)) != INEOF)
+                unsigned long long old_len = seq_size_original + seq.length;
+                in_get_verified_sequence_lines(&old_len);
+                if (in_peek_char() == '>') { in_begin++; c = '>'; }
+                else while ( (c = in_get_until(is_unexpected_arr, &seq)) != INEOF)
                 {
                     if (is_eol_arr[c])
                     {
@@ -392,6 +596,7 @@ static void process_non_well_formed_fasta(void)
                         if (new_len - old_len > longest_line_length) { longest_line_length = new_len - old_len; }
                         old_len = new_len;
 
+                        in_get_verified_sequence_lines(&old_len);
                         c = in_get_char();
                         if (!is_unexpected_arr[c]) { str_append_char(&seq, (unsigned char)c); continue; }
                         else if (c == '>' || c == INEOF) { break; }
@@ -421,6 +626,7 @@ static void process_non_well_formed_fasta(void)
         }
 
         add_length(seq_size_original + seq.length - old_total_seq_size);
+        if (dedup_sequences) { dedup_sequence(); }
         n_sequences++;
     }
     while (c != INEOF);
@@ -454,14 +660,15 @@ static void process_well_formed_fastq(void)
         c = in_get_char();
         if (c != '\n') { die("not well-formed FASTQ input\n"); }
 
-        old_len = QUAL.uncompressed_size + qual.length;
+        old_len = qual_size_original + qual.length;
         c = in_get_until_specific_char('\n', &qual);
-        if (QUAL.uncompressed_size + qual.length - old_len != read_length)
+        if (qual_size_original + qual.length - old_len != read_length)
         {
             die("quality length of sequence %llu doesn't match sequence length\n", n_sequences + 1);
         }
 
         add_length(read_length);
+        if (dedup_sequences) { dedup_sequence(); }
         n_sequences++;
 
         c = in_get_char();
@@ -519,7 +726,7 @@ static void process_non_well_formed_fastq(void)
         do { c = in_get_char(); } while (is_eol_arr[c]);
         if (c == INEOF) { die("truncated FASTQ input: last sequence has no quality\n"); }
 
-        old_len = QUAL.uncompressed_size + qual.length;
+        old_len = qual_size_original + qual.length;
         str_append_char(&qual, (unsigned char)c);
         while ( (c = in_get_until(is_unexpected_qual_arr, &qual)) != INEOF)
         {
@@ -527,7 +734,7 @@ static void process_non_well_formed_fastq(void)
             else if (is_space_arr[c]) {}
             else { unexpected_quality_char(c); str_append_char(&qual, unexpected_qual_char_replacement); }
         }
-        unsigned long long qual_length = QUAL.uncompressed_size + qual.length - old_len;
+        unsigned long long qual_length = qual_size_original + qual.length - old_len;
         if (qual_length != read_length)
         {
             die("quality length of sequence %llu (%llu) doesn't match sequence length (%llu)\n",
@@ -535,6 +742,7 @@ static void process_non_well_formed_fastq(void)
         }
 
         add_length(read_length);
+        if (dedup_sequences) { dedup_sequence(); }
         n_sequences++;
 
         do { c = in_get_char(); } while (is_eol_arr[c]);
@@ -593,22 +801,33 @@ static void process(void)
     seq.data     = (unsigned char *) malloc_or_die(UNCOMPRESSED_BUFFER_SIZE);
 
     seq.writer = no_mask ? ((in_seq_type < seq_type_protein) ? &seq_writer_nonmasked_4bit : &seq_writer_nonmasked_text)
-                         : ((in_seq_type < seq_type_protein) ? &seq_writer_masked_4bit : &seq_writer_masked_text);
+                         : ((in_seq_type < seq_type_protein) ? &seq_writer_masked_4bit :
+                            (in_seq_type == seq_type_protein) ? &seq_writer_masked_protein : &seq_writer_masked_text);
+    if (store_2bit) { seq.writer = no_mask ? &seq_writer_nonmasked_2bit : &seq_writer_masked_2bit; }
+    if (store_hpc) { seq.writer = no_mask ? &seq_writer_nonmasked_hpc : &seq_writer_masked_hpc; }
+    if (dedup_sequences) { seq.writer = &seq_writer_dedup; }
+    if (transpose_sequences)
+    {
+        seq.writer = &seq_writer_transposed;
+        seq_transposer.sink = (in_seq_type >= seq_type_protein) ? &compress_text_sequence : store_2bit ? &encode_dna_2bit : &encode_dna;
+    }
+    qual_transposer.sink = &compress_qualities;
+    if (in_format_from_input == in_format_fastq) { qual.data = (unsigned char *) malloc_or_die(UNCOMPRESSED_BUFFER_SIZE); }
 
-    if (in_format_from_input == in_format_fasta)
+    if (parse_threads > 1 && can_process_in_parallel()) { process_in_parallel(); }
+    else if (in_format_from_input == in_format_fasta)
     {
-        if (assume_well_formed_input) { process_well_formed_fasta(); }
-        else { process_non_well_formed_fasta(); }
+        if (assume_well_formed_input) { process_well_formed_fasta(false, 0); }
+        else { process_non_well_formed_fasta(false, 0); }
     }
     else if (in_format_from_input == in_format_fastq)
     {
-        qual.data = (unsigned char *) malloc_or_die(UNCOMPRESSED_BUFFER_SIZE);
         if (assume_well_formed_input) { process_well_formed_fastq(); }
         else { process_non_well_formed_fastq(); }
-        if (qual.length != 0) { qual.writer(qual.data, qual.length); qual.length = 0; }
     }
     else { assert(0); }
 
+    if (qual.length != 0) { qual.writer(qual.data, qual.length); qual.length = 0; }
     if (name.length != 0) { name.writer(name.data, name.length); name.length = 0; }
     if (comment.length != 0) { comment.writer(comment.data, comment.length); comment.length = 0; }
     if (seq.length != 0) { seq.writer(seq.data, seq.length); seq.length = 0; }
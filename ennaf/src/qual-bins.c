@@ -0,0 +1,127 @@
+/*
+ * NAF compressor
+ * Copyright (c) 2018-2021 Kirill Kryukov
+ * See README.md and LICENSE files of this repository
+ */
+
+/*
+ * Lossy quality binning ("--qual-bins").
+ * Each bin is a range of Phred scores, replaced by a single representative score before compression.
+ * Scores outside of all bins are kept as is.
+ * "illumina8" is Illumina's 8-level scheme, except that scores 0-2 are kept, since they mark no-calls.
+ * A custom scheme is a comma-separated list of bins, each written as "LOW-HIGH:VALUE".
+ * Binning is done with a table indexed by quality character, built once from the list of bins.
+ */
+
+#define qual_max_score 93
+#define qual_max_bins (qual_max_score + 1)
+
+typedef struct
+{
+    unsigned low;
+    unsigned high;
+    unsigned value;
+}
+qual_bin_t;
+
+static const qual_bin_t illumina8_bins[] = { { 3, 9, 6 }, { 10, 19, 15 }, { 20, 24, 22 }, { 25, 29, 27 },
+                                              { 30, 34, 33 }, { 35, 39, 37 }, { 40, qual_max_score, 40 } };
+
+static qual_bin_t qual_bins[qual_max_bins];
+static unsigned qual_n_bins = 0;
+static unsigned char qual_bin_table[256];
+
+
+static unsigned parse_quality_score(const char **p, const char *str)
+{
+    if (**p < '0' || **p > '9') { die("can't parse quality bins \"%s\"\n", str); }
+    unsigned score = 0;
+    while (**p >= '0' && **p <= '9')
+    {
+        score = score * 10 + (unsigned)(**p - '0');
+        if (score > qual_max_score) { die("quality score in \"%s\" is larger than %d\n", str, qual_max_score); }
+        (*p)++;
+    }
+    return score;
+}
+
+
+static void parse_custom_quality_bins(const char *str)
+{
+    const char *p = str;
+    for (;;)
+    {
+        if (qual_n_bins >= qual_max_bins) { die("too many quality bins in \"%s\"\n", str); }
+        qual_bin_t *bin = &qual_bins[qual_n_bins];
+        bin->low = parse_quality_score(&p, str);
+        if (*p++ != '-') { die("can't parse quality bins \"%s\"\n", str); }
+        bin->high = parse_quality_score(&p, str);
+        if (*p++ != ':') { die("can't parse quality bins \"%s\"\n", str); }
+        bin->value = parse_quality_score(&p, str);
+        if (bin->low > bin->high) { die("empty quality bin %u-%u\n", bin->low, bin->high); }
+        for (unsigned i = 0; i < qual_n_bins; i++)
+        {
+            if (bin->low <= qual_bins[i].high && qual_bins[i].low <= bin->high) { die("overlapping quality bins in \"%s\"\n", str); }
+        }
+        qual_n_bins++;
+        if (*p == '\0') { break; }
+        if (*p++ != ',') { die("can't parse quality bins \"%s\"\n", str); }
+    }
+}
+
+
+static void set_quality_binning(const char *str)
+{
+    if (!strcmp(str, "illumina8"))
+    {
+        qual_binning = qual_binning_illumina8;
+        qual_n_bins = sizeof(illumina8_bins) / sizeof(illumina8_bins[0]);
+        memcpy(qual_bins, illumina8_bins, sizeof(illumina8_bins));
+    }
+    else
+    {
+        qual_binning = qual_binning_custom;
+        parse_custom_quality_bins(str);
+    }
+
+    for (unsigned c = 0; c < 256; c++) { qual_bin_table[c] = (unsigned char)c; }
+    for (unsigned i = 0; i < qual_n_bins; i++)
+    {
+        for (unsigned q = qual_bins[i].low; q <= qual_bins[i].high; q++) { qual_bin_table[q + 33] = (unsigned char)(qual_bins[i].value + 33); }
+    }
+}
+
+
+static inline void bin_qualities(unsigned char *str, size_t size)
+{
+    for (size_t i = 0; i < size; i++) { str[i] = qual_bin_table[str[i]]; }
+}
+
+
+/*
+ * Payload: scheme (1 = illumina8, 2 = custom), number of bins, and for each bin: low score, high score, value.
+ */
+static void write_quality_binning_extension(FILE *F)
+{
+    assert(qual_binning != qual_binning_none);
+
+    size_t size = variable_length_encoded_number_size((unsigned long long)qual_binning)
+                + variable_length_encoded_number_size(qual_n_bins);
+    for (unsigned i = 0; i < qual_n_bins; i++)
+    {
+        size += variable_length_encoded_number_size(qual_bins[i].low)
+              + variable_length_encoded_number_size(qual_bins[i].high)
+              + variable_length_encoded_number_size(qual_bins[i].value);
+    }
+
+    write_variable_length_encoded_number(F, ext_quality_binning);
+    write_variable_length_encoded_number(F, size);
+    write_variable_length_encoded_number(F, (unsigned long long)qual_binning);
+    write_variable_length_encoded_number(F, qual_n_bins);
+    for (unsigned i = 0; i < qual_n_bins; i++)
+    {
+        write_variable_length_encoded_number(F, qual_bins[i].low);
+        write_variable_length_encoded_number(F, qual_bins[i].high);
+        write_variable_length_encoded_number(F, qual_bins[i].value);
+    }
+}
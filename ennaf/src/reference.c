@@ -0,0 +1,255 @@
+/*
+ * NAF compressor
+ * Copyright (c) 2018-2021 Kirill Kryukov
+ * See README.md and LICENSE files of this repository
+ */
+
+/*
+ * Reference-based compression ("--ref FILE").
+ * Sequence of the reference NAF file is decoded into 4-bit encoding, and used as zstd prefix of the sequence part,
+ * so that regions shared with the reference are stored as long distance matches into it.
+ * 4-bit encoded sequence can match the reference only in the same phase (even or odd nucleotide position),
+ * which flips after every odd-length insertion or deletion. Therefore, if the maximum zstd window allows,
+ * the prefix also includes a copy of the reference shifted by one nucleotide.
+ * The reference must have its sequence stored in plain 4-bit encoding, compressed with zstd.
+ */
+
+static char *ref_path = NULL;
+static FILE *REF = NULL;
+static unsigned char *ref_prefix = NULL;
+static size_t ref_prefix_size = 0;
+static unsigned long long ref_seq_length = 0;
+static unsigned long long ref_fingerprint = 0;
+static bool ref_has_shifted_copy = false;
+
+
+static void free_reference(void)
+{
+    if (REF != NULL) { fclose(REF); REF = NULL; }
+    if (ref_prefix != NULL) { free(ref_prefix); ref_prefix = NULL; }
+}
+
+
+__attribute__ ((cold))
+__attribute__ ((noreturn))
+static void unsupported_reference(const char *reason)
+{
+    die("can't use \"%s\" as reference: %s\n", ref_path, reason);
+}
+
+
+static unsigned char read_reference_byte(void)
+{
+    int c = fgetc(REF);
+    if (c == EOF) { unsupported_reference("truncated file"); }
+    return (unsigned char)c;
+}
+
+
+static unsigned long long read_reference_number(void)
+{
+    unsigned long long a = 0;
+    unsigned char c;
+    do {
+        if (a & (127ull << 57)) { unsupported_reference("corrupted file"); }
+        c = read_reference_byte();
+        a = (a << 7) | (c & 127);
+    }
+    while (c & 128);
+    return a;
+}
+
+
+static void skip_reference_bytes(unsigned long long n)
+{
+    if (fseek(REF, (long)n, SEEK_CUR) != 0) { unsupported_reference("truncated file"); }
+}
+
+
+static void skip_reference_part(void)
+{
+    read_reference_number();
+    skip_reference_bytes(read_reference_number());
+}
+
+
+/*
+ * Fingerprint of the reference 4-bit encoded sequence, stored in the reference record, and verified by unnaf.
+ */
+static unsigned long long compute_reference_fingerprint(const unsigned char *data, size_t size)
+{
+    unsigned long long h = 0x9E3779B97F4A7C15ull ^ (unsigned long long)size;
+    const unsigned char *p = data, *end8 = data + (size & ~(size_t)7);
+    for (; p < end8; p += 8)
+    {
+        unsigned long long w;
+        memcpy(&w, p, 8);
+        h = (h ^ w) * 0xFF51AFD7ED558CCDull;
+        h ^= h >> 32;
+    }
+    for (const unsigned char *end = data + size; p < end; p++) { h = (h ^ *p) * 0xC4CEB9FE1A85EC53ull; }
+    h ^= h >> 29;
+    h *= 0xBF58476D1CE4E5B9ull;
+    h ^= h >> 32;
+    return h;
+}
+
+
+/*
+ * Window for the sequence part has to reach from any position back over the whole prefix, with some margin.
+ */
+static unsigned long long reference_window_size(unsigned long long prefix_size)
+{
+    return prefix_size + prefix_size / 4 + (1ull << 20);
+}
+
+
+/*
+ * Extension records of the reference are skipped, unless they change how its sequence is stored.
+ */
+static void skip_reference_extensions(void)
+{
+    unsigned long long n = read_reference_number();
+    for (unsigned long long i = 0; i < n; i++)
+    {
+        unsigned long long type = read_reference_number();
+        unsigned long long size = read_reference_number();
+        if (type == ext_codecs)
+        {
+            long start = ftell(REF);
+            unsigned long long n_codecs = read_reference_number();
+            for (unsigned long long k = 0; k < n_codecs; k++)
+            {
+                unsigned long long part = read_reference_number();
+                unsigned long long codec = read_reference_number();
+                if (part == 0x02 && codec != codec_zstd) { unsupported_reference("its sequence is not compressed with zstd"); }
+            }
+            if (start < 0 || (unsigned long long)(ftell(REF) - start) != size) { unsupported_reference("corrupted file"); }
+            continue;
+        }
+        if (type == ext_seq_encoding || type == ext_dedup || type == ext_seq_layout || type == ext_homopolymers || type == ext_reference)
+        {
+            unsupported_reference("its sequence is not stored in plain 4-bit encoding");
+        }
+        if (type > ext_reference && type != ext_frames) { unsupported_reference("unsupported extension record"); }
+        skip_reference_bytes(size);
+    }
+}
+
+
+/*
+ * Decompresses "compressed_size" bytes of the reference sequence part into "dest" of "size" bytes.
+ */
+static void decompress_reference_sequence(unsigned long long compressed_size, unsigned char *dest, size_t size)
+{
+    ZSTD_DStream *stream = ZSTD_createDStream();
+    if (stream == NULL) { die("can't create reference decompression stream\n"); }
+    ZSTD_TRY(ZSTD_DCtx_setParameter(stream, ZSTD_d_windowLogMax, ZSTD_WINDOWLOG_MAX));
+
+    size_t in_size = ZSTD_DStreamInSize();
+    unsigned char *in = (unsigned char *) malloc_or_die(in_size);
+    in[0] = 0x28; in[1] = 0xB5; in[2] = 0x2F; in[3] = 0xFD;
+    size_t in_fill = 4;
+
+    ZSTD_outBuffer out = { dest, size, 0 };
+    unsigned long long remaining = compressed_size;
+    size_t r = 1;
+    while (remaining > 0 || in_fill > 0)
+    {
+        size_t n = (remaining < in_size - in_fill) ? (size_t)remaining : in_size - in_fill;
+        if (fread(in + in_fill, 1, n, REF) != n) { unsupported_reference("truncated file"); }
+        remaining -= n;
+
+        ZSTD_inBuffer input = { in, in_fill + n, 0 };
+        r = ZSTD_decompressStream(stream, &out, &input);
+        if (ZSTD_isError(r)) { die("can't decompress reference sequence: %s\n", ZSTD_getErrorName(r)); }
+        if (input.pos == 0 && out.pos == out.size) { unsupported_reference("sequence is longer than stated"); }
+        in_fill = input.size - input.pos;
+        memmove(in, in + input.pos, in_fill);
+    }
+    if (r != 0 || out.pos != size) { unsupported_reference("corrupted sequence"); }
+
+    free(in);
+    ZSTD_freeDStream(stream);
+}
+
+
+/*
+ * Loads the reference sequence, and prepares the prefix.
+ */
+static void load_reference(void)
+{
+    assert(ref_path != NULL);
+
+    REF = fopen(ref_path, "rb");
+    if (REF == NULL) { die("can't open reference \"%s\"\n", ref_path); }
+
+    unsigned char magic[3];
+    if (fread(magic, 1, 3, REF) != 3 || memcmp(magic, naf_magic_number, 3) != 0) { unsupported_reference("not a NAF file"); }
+    unsigned char version = read_reference_byte();
+    if (version < 1 || version > 2) { unsupported_reference("unknown version of NAF format"); }
+    if (version > 1 && read_reference_byte() != seq_type_rna) { unsupported_reference("it's not DNA or RNA"); }
+
+    unsigned char flags = read_reference_byte();
+    read_reference_byte();
+    read_reference_number();
+    read_reference_number();
+    if (!(flags & 0x02)) { unsupported_reference("it has no sequence"); }
+
+    if (flags & 0x80) { skip_reference_extensions(); }
+    if (flags & 0x40) { skip_reference_bytes(read_reference_number()); }
+    if (flags & 0x20) { skip_reference_part(); }
+    if (flags & 0x10) { skip_reference_part(); }
+    if (flags & 0x08) { skip_reference_part(); }
+    if (flags & 0x04) { skip_reference_part(); }
+
+    ref_seq_length = read_reference_number();
+    unsigned long long compressed_size = read_reference_number();
+    if (ref_seq_length == 0) { unsupported_reference("its sequence is empty"); }
+
+    unsigned long long size = (ref_seq_length + 1) / 2;
+    if (reference_window_size(size) > (1ull << ZSTD_WINDOWLOG_MAX)) { unsupported_reference("its sequence is too long"); }
+    ref_has_shifted_copy = (reference_window_size(size * 2) <= (1ull << ZSTD_WINDOWLOG_MAX));
+    ref_prefix_size = (size_t)(ref_has_shifted_copy ? size * 2 : size);
+    ref_prefix = (unsigned char *) malloc_or_die(ref_prefix_size);
+
+    decompress_reference_sequence(compressed_size, ref_prefix, (size_t)size);
+    fclose(REF);
+    REF = NULL;
+
+    ref_fingerprint = compute_reference_fingerprint(ref_prefix, (size_t)size);
+
+    if (ref_has_shifted_copy)
+    {
+        unsigned char *shifted = ref_prefix + size;
+        for (size_t i = 0; i + 1 < size; i++) { shifted[i] = (unsigned char)((ref_prefix[i] >> 4) | (ref_prefix[i + 1] << 4)); }
+        shifted[size - 1] = ref_prefix[size - 1] >> 4;
+    }
+
+    if (verbose) { msg("Reference: %llu nucleotides, prefix: %zu bytes\n", ref_seq_length, ref_prefix_size); }
+}
+
+
+static int reference_window_log(void)
+{
+    int log = ZSTD_WINDOWLOG_MIN;
+    while (log < ZSTD_WINDOWLOG_MAX && (1ull << log) < reference_window_size(ref_prefix_size)) { log++; }
+    return log;
+}
+
+
+/*
+ * Reference record: reference fingerprint, reference sequence length, and prefix layout (1 = with shifted copy).
+ */
+static void write_reference_extension(FILE *F)
+{
+    size_t size = variable_length_encoded_number_size(ref_fingerprint)
+                + variable_length_encoded_number_size(ref_seq_length)
+                + variable_length_encoded_number_size(ref_has_shifted_copy);
+
+    write_variable_length_encoded_number(F, ext_reference);
+    write_variable_length_encoded_number(F, size);
+    write_variable_length_encoded_number(F, ref_fingerprint);
+    write_variable_length_encoded_number(F, ref_seq_length);
+    write_variable_length_encoded_number(F, ref_has_shifted_copy);
+}
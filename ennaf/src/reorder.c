@@ -0,0 +1,890 @@
+/*
+ * NAF compressor
+ * Copyright (c) 2018-2021 Kirill Kryukov
+ * See README.md and LICENSE files of this repository
+ */
+
+/*
+ * Reordering of records by similarity ("--reorder" for FASTA, "--reorder-reads" for FASTQ).
+ * Before compression, the input is scanned once: the position of each record in the input is noted,
+ * and a sketch of its sequence is computed. The sketch is a one permutation MinHash of the k-mers of the sequence:
+ * each k-mer hash goes to one of the bins according to its top bits, and each bin keeps the smallest hash.
+ * The number of bins in which two sketches agree estimates the similarity of the two sequences.
+ *
+ * Records are then ordered by a greedy nearest neighbor tour: starting with the first record,
+ * the next record is always the most similar unvisited one. Candidates for the next record are found by
+ * locality sensitive hashing: bins are grouped into bands, and records whose sketches agree in a whole band are candidates.
+ * Records of each band are sorted by the band's hash, and unvisited ones are kept in a linked list in that order.
+ * When the current record has no unvisited candidates, the tour continues with the first unvisited record of the input.
+ *
+ * Reads of FASTQ input are too many and too short for such tour. Instead, each read gets the minimizer of its sequence
+ * (its k-mer with the smallest hash), and reads are sorted by minimizer hash, so that reads sharing a minimizer
+ * (e.g., overlapping reads from the same region) are stored next to each other. Reads with the same minimizer
+ * are sorted by decreasing minimizer position, which puts them in the order of their start in the sequenced region.
+ * Only the position and the key of each read are kept, not the reads themselves. Reads are collected in memory
+ * up to the limit set by "--reorder-memory", then sorted and written to a temporary file as a sorted run.
+ * Runs are merged at the end, at most "reorder_merge_fan_in" at a time, so the memory use doesn't depend on the number of reads.
+ * When all reads fit within the limit, they are sorted in memory without a temporary file.
+ *
+ * The input is then parsed as usual, except that records are read from their positions, in the new order.
+ * Input that is not a regular file (e.g., a pipe) is first copied into a temporary file while scanning.
+ * The original number of each stored record is kept in the "Order" extension record.
+ * Its list is compressed as the records are read, so it is not held in memory either.
+ */
+
+#define reorder_k 20
+#define reorder_n_bins 64
+#define reorder_n_bands 16
+#define reorder_band_size (reorder_n_bins / reorder_n_bands)
+#define reorder_max_band_neighbors 8
+#define reorder_empty_bin 0xFFFFFFFFu
+#define reorder_none 0xFFFFFFFFu
+#define reorder_scan_buffer_size (1024 * 1024)
+#define reorder_default_memory (1024ull * 1024 * 1024)
+#define reorder_merge_fan_in 64
+#define reorder_merge_buffer_n_reads 4096
+#define reorder_list_flush_size 65536
+
+typedef struct
+{
+    unsigned long long start;
+    unsigned long long size;
+    bool needs_eol;                     // Record doesn't end with end-of-line, so one is added when reading it.
+}
+reorder_range_t;
+
+typedef struct
+{
+    unsigned long long key;
+    unsigned record;
+}
+reorder_band_entry_t;
+
+typedef struct
+{
+    unsigned long long key;
+    unsigned long long record;
+    unsigned long long start;
+    unsigned long long size;
+}
+reorder_read_t;
+
+typedef struct
+{
+    unsigned long long offset;          // Position of the run in the temporary file, in reads.
+    unsigned long long n;
+}
+reorder_run_t;
+
+typedef struct
+{
+    reorder_run_t run;
+    unsigned long long next;            // Next read of the run to be loaded into the buffer.
+    reorder_read_t *buffer;
+    size_t pos;
+    size_t fill;
+}
+reorder_cursor_t;
+
+typedef struct
+{
+    unsigned *records;                  // Records sorted by band hash.
+    unsigned *groups;                   // For each entry, position of the first entry with the same hash.
+    unsigned *next;                     // Linked list of unvisited entries.
+    unsigned *prev;
+    unsigned *positions;                // Entry of each record, or "reorder_none" if the band of its sketch is incomplete.
+}
+reorder_band_t;
+
+static unsigned char reorder_nuc[256];
+
+static reorder_range_t *reorder_ranges = NULL;
+static unsigned *reorder_sketches = NULL;
+static size_t reorder_n_records = 0;
+static size_t reorder_allocated = 0;
+static unsigned long long *reorder_tour = NULL;
+static bool reorder_is_identity = true;
+
+static reorder_read_t *reorder_reads_buffer = NULL;     // Reads of the current run, or all reads, if they fit.
+static size_t reorder_reads_allocated = 0;
+static size_t reorder_reads_fill = 0;
+static size_t reorder_reads_pos = 0;
+static bool reorder_last_needs_eol = false;
+
+static FILE *reorder_runs_file = NULL;
+static char *reorder_runs_path = NULL;
+static unsigned long long reorder_runs_file_n_reads = 0;
+static reorder_run_t *reorder_runs = NULL;
+static size_t reorder_n_runs = 0;
+static size_t reorder_runs_allocated = 0;
+static reorder_cursor_t reorder_cursors[reorder_merge_fan_in];
+static size_t reorder_heap[reorder_merge_fan_in];
+static size_t reorder_heap_size = 0;
+static bool reorder_merging = false;
+
+static byte_buffer_t reorder_list = { 0, 0, NULL };
+static unsigned long long reorder_prev_record = ~0ull;
+static unsigned long long reorder_n_moved = 0;
+
+static bool reorder_at_line_start = true;
+static bool reorder_in_header = false;
+static unsigned reorder_fastq_line = 0;
+static unsigned long long reorder_read_pos = 0;
+static unsigned long long reorder_min_hash = 0;
+static unsigned long long reorder_kmer = 0;
+static unsigned reorder_n_valid = 0;
+static unsigned char reorder_last_char = '\n';
+
+static FILE *reorder_source = NULL;
+static char *reorder_spool_path = NULL;
+static unsigned long long reorder_base = 0;
+static unsigned long long reorder_source_pos = 0;
+static size_t reorder_next = 0;
+static unsigned long long reorder_remaining = 0;
+static bool reorder_pending_eol = false;
+static bool reading_reordered_input = false;
+
+
+static void reorder_end_merge(void)
+{
+    for (size_t i = 0; i < reorder_merge_fan_in; i++)
+    {
+        if (reorder_cursors[i].buffer != NULL) { free(reorder_cursors[i].buffer); reorder_cursors[i].buffer = NULL; }
+    }
+    reorder_heap_size = 0;
+    reorder_merging = false;
+}
+
+
+static void free_reorder(void)
+{
+    if (reorder_ranges != NULL) { free(reorder_ranges); reorder_ranges = NULL; }
+    if (reorder_sketches != NULL) { free(reorder_sketches); reorder_sketches = NULL; }
+    if (reorder_tour != NULL) { free(reorder_tour); reorder_tour = NULL; }
+    if (reorder_reads_buffer != NULL) { free(reorder_reads_buffer); reorder_reads_buffer = NULL; }
+    if (reorder_runs != NULL) { free(reorder_runs); reorder_runs = NULL; }
+    if (reorder_list.data != NULL) { free(reorder_list.data); reorder_list.data = NULL; }
+    reorder_end_merge();
+    if (reorder_runs_path != NULL)
+    {
+        if (reorder_runs_file != NULL) { fclose(reorder_runs_file); reorder_runs_file = NULL; }
+        if (!keep_temp_files && remove(reorder_runs_path) != 0) { err("can't remove temporary file \"%s\"\n", reorder_runs_path); }
+        free(reorder_runs_path);
+        reorder_runs_path = NULL;
+    }
+    if (reorder_spool_path != NULL)
+    {
+        if (reorder_source != NULL) { fclose(reorder_source); reorder_source = NULL; }
+        if (!keep_temp_files && remove(reorder_spool_path) != 0) { err("can't remove temporary file \"%s\"\n", reorder_spool_path); }
+        free(reorder_spool_path);
+        reorder_spool_path = NULL;
+    }
+}
+
+
+static inline unsigned long long reorder_hash(unsigned long long x)
+{
+    x ^= x >> 31;
+    x *= 0x7FB5D329728EA185ull;
+    x ^= x >> 27;
+    x *= 0x81DADEF4BC2DD44Dull;
+    x ^= x >> 33;
+    return x;
+}
+
+
+static void reorder_end_record(unsigned long long end, bool needs_eol)
+{
+    if (reorder_n_records == 0) { return; }
+    if (in_format_from_input == in_format_fastq)
+    {
+        reorder_read_t *r = &reorder_reads_buffer[reorder_reads_fill - 1];
+        r->size = end - r->start;
+        reorder_last_needs_eol = needs_eol;
+        return;
+    }
+    reorder_range_t *r = &reorder_ranges[reorder_n_records - 1];
+    r->size = end - r->start;
+    r->needs_eol = needs_eol;
+}
+
+
+static int compare_reads(const void *a, const void *b)
+{
+    const reorder_read_t *x = (const reorder_read_t *)a, *y = (const reorder_read_t *)b;
+    if (x->key != y->key) { return (x->key > y->key) - (x->key < y->key); }
+    return (x->record > y->record) - (x->record < y->record);
+}
+
+
+static inline bool reorder_read_is_before(const reorder_read_t *x, const reorder_read_t *y)
+{
+    return x->key < y->key || (x->key == y->key && x->record < y->record);
+}
+
+
+static void reorder_add_run(unsigned long long offset, unsigned long long n)
+{
+    if (reorder_n_runs >= reorder_runs_allocated)
+    {
+        reorder_runs_allocated = reorder_runs_allocated ? reorder_runs_allocated * 2 : 64;
+        reorder_runs = (reorder_run_t *) realloc_or_die(reorder_runs, sizeof(reorder_run_t) * reorder_runs_allocated);
+    }
+    reorder_runs[reorder_n_runs].offset = offset;
+    reorder_runs[reorder_n_runs].n = n;
+    reorder_n_runs++;
+}
+
+
+/*
+ * Appends "n" reads to the temporary file of sorted runs.
+ */
+static void reorder_write_reads(const reorder_read_t *reads, size_t n)
+{
+    if (reorder_runs_file == NULL)
+    {
+        reorder_runs_path = (char *) malloc_or_die(temp_path_length + 1);
+        snprintf(reorder_runs_path, temp_path_length, "%s/%s.%s", temp_dir, temp_prefix, "keys");
+        if (verbose) { msg("Temp keys file: \"%s\"\n", reorder_runs_path); }
+        reorder_runs_file = fopen(reorder_runs_path, "wb+");
+        if (reorder_runs_file == NULL) { die("can't create temporary file \"%s\"\n", reorder_runs_path); }
+    }
+
+    if (fseek(reorder_runs_file, (long)(reorder_runs_file_n_reads * sizeof(reorder_read_t)), SEEK_SET) != 0)
+    {
+        die("can't seek in temporary file \"%s\"\n", reorder_runs_path);
+    }
+    fwrite_or_die(reads, sizeof(reorder_read_t), n, reorder_runs_file);
+    reorder_runs_file_n_reads += n;
+}
+
+
+/*
+ * Sorts the reads collected in memory, and writes them out as a new run.
+ */
+static void reorder_spill_reads(void)
+{
+    qsort(reorder_reads_buffer, reorder_reads_fill, sizeof(reorder_read_t), &compare_reads);
+    reorder_add_run(reorder_runs_file_n_reads, reorder_reads_fill);
+    reorder_write_reads(reorder_reads_buffer, reorder_reads_fill);
+    reorder_reads_fill = 0;
+}
+
+
+/*
+ * Adds a FASTQ read, first writing out the collected reads if the memory limit is reached.
+ * Record can start only at the beginning of a line, so the previous read is complete at this point.
+ */
+static void reorder_add_read(unsigned long long start)
+{
+    size_t max_reads = (size_t)(reorder_memory / sizeof(reorder_read_t));
+    if (max_reads < 2) { max_reads = 2; }
+
+    if (reorder_reads_fill >= reorder_reads_allocated)
+    {
+        if (reorder_reads_allocated >= max_reads) { reorder_spill_reads(); }
+        else
+        {
+            size_t new_allocated = reorder_reads_allocated ? reorder_reads_allocated * 2 : 1024;
+            if (new_allocated > max_reads) { new_allocated = max_reads; }
+            reorder_reads_buffer = (reorder_read_t *) realloc_or_die(reorder_reads_buffer, sizeof(reorder_read_t) * new_allocated);
+            reorder_reads_allocated = new_allocated;
+        }
+    }
+
+    reorder_read_t *r = &reorder_reads_buffer[reorder_reads_fill++];
+    r->key = ~0ull;
+    r->record = reorder_n_records;
+    r->start = start;
+    r->size = 0;
+}
+
+
+/*
+ * Each FASTA record has a sketch, while each FASTQ read has a sort key.
+ */
+static void reorder_start_record(unsigned long long start)
+{
+    // Record can start only at the beginning of a line, so the previous record always ends with end-of-line.
+    reorder_end_record(start, false);
+
+    if (in_format_from_input == in_format_fastq) { reorder_add_read(start); }
+    else
+    {
+        if (reorder_n_records >= reorder_allocated)
+        {
+            size_t new_allocated = reorder_allocated ? reorder_allocated * 2 : 1024;
+            if (new_allocated >= reorder_none) { die("too many sequences for reordering\n"); }
+            reorder_ranges = (reorder_range_t *) realloc_or_die(reorder_ranges, sizeof(reorder_range_t) * new_allocated);
+            reorder_sketches = (unsigned *) realloc_or_die(reorder_sketches, sizeof(unsigned) * reorder_n_bins * new_allocated);
+            reorder_allocated = new_allocated;
+        }
+        reorder_ranges[reorder_n_records].start = start;
+        memset(reorder_sketches + reorder_n_records * reorder_n_bins, 0xFF, sizeof(unsigned) * reorder_n_bins);
+    }
+    reorder_n_records++;
+    reorder_n_valid = 0;
+    reorder_read_pos = 0;
+    reorder_min_hash = ~0ull;
+}
+
+
+/*
+ * Scans a chunk of input starting at offset "pos", noting record starts, and adding k-mers to the current sketch.
+ * Codes in "reorder_nuc": 0..3 for nucleotides, 4 for end-of-line, 5 for other spaces, 6 for anything else.
+ * End-of-line and spaces don't interrupt k-mers, other characters do.
+ */
+static void reorder_scan_fasta_chunk(const unsigned char *data, size_t size, unsigned long long pos)
+{
+    const unsigned long long kmer_mask = (1ull << (reorder_k * 2)) - 1;
+    unsigned *sketch = reorder_n_records ? reorder_sketches + (reorder_n_records - 1) * reorder_n_bins : NULL;
+
+    for (size_t i = 0; i < size; i++)
+    {
+        unsigned char c = data[i];
+        if (reorder_in_header)
+        {
+            if (is_eol_arr[c]) { reorder_in_header = false; reorder_at_line_start = true; }
+            continue;
+        }
+        if (c == '>' && reorder_at_line_start)
+        {
+            reorder_start_record(pos + i);
+            sketch = reorder_sketches + (reorder_n_records - 1) * reorder_n_bins;
+            reorder_in_header = true;
+            reorder_at_line_start = false;
+            continue;
+        }
+
+        unsigned code = reorder_nuc[c];
+        reorder_at_line_start = (code == 4);
+        if (code < 4)
+        {
+            reorder_kmer = ((reorder_kmer << 2) | code) & kmer_mask;
+            if (++reorder_n_valid >= reorder_k && sketch != NULL)
+            {
+                unsigned long long h = reorder_hash(reorder_kmer);
+                unsigned bin = (unsigned)(h >> 58);
+                unsigned value = (unsigned)h;
+                if (value < sketch[bin]) { sketch[bin] = value; }
+            }
+        }
+        else if (code == 6) { reorder_n_valid = 0; }
+    }
+
+    if (size > 0) { reorder_last_char = data[size - 1]; }
+}
+
+
+/*
+ * Scans a chunk of FASTQ input starting at offset "pos", noting read starts, and finding the minimizer of each read.
+ * Reads consist of four non-empty lines (name, sequence, '+', qualities), empty lines are skipped, same as by the parser.
+ * Key of a read has the top bits of its minimizer hash, and the complement of the minimizer position in the low 16 bits.
+ */
+static void reorder_scan_fastq_chunk(const unsigned char *data, size_t size, unsigned long long pos)
+{
+    const unsigned long long kmer_mask = (1ull << (reorder_k * 2)) - 1;
+
+    for (size_t i = 0; i < size; i++)
+    {
+        unsigned char c = data[i];
+        if (is_eol_arr[c])
+        {
+            if (!reorder_at_line_start) { reorder_fastq_line = (reorder_fastq_line + 1) & 3; reorder_at_line_start = true; }
+            continue;
+        }
+        if (reorder_at_line_start)
+        {
+            reorder_at_line_start = false;
+            if (reorder_fastq_line == 0) { reorder_start_record(pos + i); }
+        }
+        if (reorder_fastq_line != 1) { continue; }
+
+        unsigned code = reorder_nuc[c];
+        if (code == 5) { continue; }
+        reorder_read_pos++;
+        if (code < 4)
+        {
+            reorder_kmer = ((reorder_kmer << 2) | code) & kmer_mask;
+            if (++reorder_n_valid >= reorder_k)
+            {
+                unsigned long long h = reorder_hash(reorder_kmer);
+                if (h < reorder_min_hash)
+                {
+                    unsigned long long p = (reorder_read_pos < 0xFFFF) ? reorder_read_pos : 0xFFFF;
+                    reorder_min_hash = h;
+                    reorder_reads_buffer[reorder_reads_fill - 1].key = (h & ~0xFFFFull) | (0xFFFF - p);
+                }
+            }
+        }
+        else { reorder_n_valid = 0; }
+    }
+
+    if (size > 0) { reorder_last_char = data[size - 1]; }
+}
+
+
+static void reorder_scan_chunk(const unsigned char *data, size_t size, unsigned long long pos)
+{
+    if (in_format_from_input == in_format_fastq) { reorder_scan_fastq_chunk(data, size, pos); }
+    else { reorder_scan_fasta_chunk(data, size, pos); }
+}
+
+
+/*
+ * Reads the rest of the input, starting with the '>' or '@' of the first record, which is already in "in_buffer".
+ * Regular input file is read again later from the noted positions, other input is copied into a temporary file.
+ */
+static void reorder_scan_input(void)
+{
+    assert(in_begin > 0 && (in_buffer[in_begin - 1] == '>' || in_buffer[in_begin - 1] == '@'));
+
+    for (unsigned i = 0; i < 256; i++) { reorder_nuc[i] = is_space_arr[i] ? (is_eol_arr[i] ? 4 : 5) : 6; }
+    reorder_nuc['A'] = reorder_nuc['a'] = 0;
+    reorder_nuc['C'] = reorder_nuc['c'] = 1;
+    reorder_nuc['G'] = reorder_nuc['g'] = 2;
+    reorder_nuc['T'] = reorder_nuc['t'] = reorder_nuc['U'] = reorder_nuc['u'] = 3;
+
+    struct stat st;
+    bool is_regular_file = (fstat(fileno(IN), &st) == 0 && S_ISREG(st.st_mode));
+    if (is_regular_file)
+    {
+        reorder_source = IN;
+        reorder_base = input_size_read - (in_end - (in_begin - 1));
+    }
+    else
+    {
+        reorder_spool_path = (char *) malloc_or_die(temp_path_length + 1);
+        snprintf(reorder_spool_path, temp_path_length, "%s/%s.%s", temp_dir, temp_prefix, "input");
+        if (verbose) { msg("Temp input file: \"%s\"\n", reorder_spool_path); }
+        reorder_source = fopen(reorder_spool_path, "wb+");
+        if (reorder_source == NULL) { die("can't create temporary file \"%s\"\n", reorder_spool_path); }
+        reorder_base = 0;
+    }
+
+    const unsigned char *first = in_buffer + in_begin - 1;
+    size_t first_size = in_end - (in_begin - 1);
+    if (!is_regular_file) { fwrite_or_die(first, 1, first_size, reorder_source); }
+    reorder_scan_chunk(first, first_size, 0);
+    unsigned long long pos = first_size;
+
+    unsigned char *buffer = (unsigned char *) malloc_or_die(reorder_scan_buffer_size);
+    size_t size;
+    while ( (size = read_input(buffer, reorder_scan_buffer_size)) > 0 )
+    {
+        if (!is_regular_file) { fwrite_or_die(buffer, 1, size, reorder_source); }
+        reorder_scan_chunk(buffer, size, pos);
+        pos += size;
+    }
+    free(buffer);
+    if (ferror(IN)) { die("can't read input\n"); }
+    reorder_end_record(pos, !is_eol_arr[reorder_last_char]);
+
+    reorder_source_pos = pos;
+    in_begin = 0;
+    in_end = 0;
+}
+
+
+static int compare_band_entries(const void *a, const void *b)
+{
+    const reorder_band_entry_t *x = (const reorder_band_entry_t *)a, *y = (const reorder_band_entry_t *)b;
+    if (x->key != y->key) { return (x->key > y->key) - (x->key < y->key); }
+    return (x->record > y->record) - (x->record < y->record);
+}
+
+
+static void reorder_build_band(reorder_band_t *band, unsigned b)
+{
+    size_t n = reorder_n_records;
+    reorder_band_entry_t *entries = (reorder_band_entry_t *) malloc_or_die(sizeof(reorder_band_entry_t) * (n + 1));
+    size_t m = 0;
+    for (size_t r = 0; r < n; r++)
+    {
+        const unsigned *bins = reorder_sketches + r * reorder_n_bins + b * reorder_band_size;
+        unsigned long long key = b;
+        bool complete = true;
+        for (unsigned i = 0; i < reorder_band_size; i++)
+        {
+            if (bins[i] == reorder_empty_bin) { complete = false; break; }
+            key = reorder_hash(key ^ ((unsigned long long)bins[i] << 20));
+        }
+        if (complete) { entries[m].key = key; entries[m].record = (unsigned)r; m++; }
+    }
+    qsort(entries, m, sizeof(reorder_band_entry_t), &compare_band_entries);
+
+    band->records = (unsigned *) malloc_or_die(sizeof(unsigned) * (m + 1));
+    band->groups = (unsigned *) malloc_or_die(sizeof(unsigned) * (m + 1));
+    band->next = (unsigned *) malloc_or_die(sizeof(unsigned) * (m + 1));
+    band->prev = (unsigned *) malloc_or_die(sizeof(unsigned) * (m + 1));
+    band->positions = (unsigned *) malloc_or_die(sizeof(unsigned) * n);
+    for (size_t r = 0; r < n; r++) { band->positions[r] = reorder_none; }
+
+    for (size_t p = 0; p < m; p++)
+    {
+        band->records[p] = entries[p].record;
+        band->groups[p] = (p > 0 && entries[p].key == entries[p - 1].key) ? band->groups[p - 1] : (unsigned)p;
+        band->next[p] = (p + 1 < m) ? (unsigned)(p + 1) : reorder_none;
+        band->prev[p] = (p > 0) ? (unsigned)(p - 1) : reorder_none;
+        band->positions[entries[p].record] = (unsigned)p;
+    }
+    free(entries);
+}
+
+
+static void reorder_free_band(reorder_band_t *band)
+{
+    free(band->records);
+    free(band->groups);
+    free(band->next);
+    free(band->prev);
+    free(band->positions);
+}
+
+
+static void reorder_unlink(reorder_band_t *band, unsigned record)
+{
+    unsigned p = band->positions[record];
+    if (p == reorder_none) { return; }
+    if (band->prev[p] != reorder_none) { band->next[band->prev[p]] = band->next[p]; }
+    if (band->next[p] != reorder_none) { band->prev[band->next[p]] = band->prev[p]; }
+}
+
+
+static unsigned reorder_similarity(size_t a, size_t b)
+{
+    const unsigned *x = reorder_sketches + a * reorder_n_bins, *y = reorder_sketches + b * reorder_n_bins;
+    unsigned n = 0;
+    for (unsigned i = 0; i < reorder_n_bins; i++) { n += (x[i] == y[i] && x[i] != reorder_empty_bin); }
+    return n;
+}
+
+
+/*
+ * Builds the tour: "reorder_tour" lists the original numbers of records in the new order.
+ */
+static void reorder_plan_tour(void)
+{
+    size_t n = reorder_n_records;
+    reorder_tour = (unsigned long long *) malloc_or_die(sizeof(unsigned long long) * (n + 1));
+    if (n < 3)
+    {
+        for (size_t i = 0; i < n; i++) { reorder_tour[i] = i; }
+        return;
+    }
+
+    reorder_band_t bands[reorder_n_bands];
+    for (unsigned b = 0; b < reorder_n_bands; b++) { reorder_build_band(&bands[b], b); }
+
+    bool *visited = (bool *) malloc_or_die(sizeof(bool) * n);
+    size_t *checked = (size_t *) malloc_or_die(sizeof(size_t) * n);
+    for (size_t i = 0; i < n; i++) { visited[i] = false; checked[i] = 0; }
+
+    size_t current = 0, first_unvisited = 1;
+    visited[0] = true;
+    reorder_tour[0] = 0;
+
+    for (size_t step = 1; step < n; step++)
+    {
+        size_t best = n;
+        unsigned best_similarity = 0;
+
+        for (unsigned b = 0; b < reorder_n_bands; b++)
+        {
+            const reorder_band_t *band = &bands[b];
+            unsigned p = band->positions[current];
+            if (p == reorder_none) { continue; }
+
+            for (int dir = 0; dir < 2; dir++)
+            {
+                const unsigned *link = dir ? band->prev : band->next;
+                unsigned q = link[p];
+                for (unsigned k = 0; k < reorder_max_band_neighbors && q != reorder_none && band->groups[q] == band->groups[p]; k++, q = link[q])
+                {
+                    size_t r = band->records[q];
+                    if (checked[r] == step) { continue; }
+                    checked[r] = step;
+                    unsigned s = reorder_similarity(current, r);
+                    if (s > best_similarity || (s == best_similarity && r < best)) { best = r; best_similarity = s; }
+                }
+            }
+        }
+
+        for (unsigned b = 0; b < reorder_n_bands; b++) { reorder_unlink(&bands[b], (unsigned)current); }
+
+        if (best == n)
+        {
+            while (visited[first_unvisited]) { first_unvisited++; }
+            best = first_unvisited;
+        }
+
+        visited[best] = true;
+        reorder_tour[step] = best;
+        current = best;
+    }
+
+    free(visited);
+    free(checked);
+    for (unsigned b = 0; b < reorder_n_bands; b++) { reorder_free_band(&bands[b]); }
+}
+
+
+static bool reorder_cursor_refill(reorder_cursor_t *c)
+{
+    unsigned long long left = c->run.n - c->next;
+    if (left == 0) { return false; }
+
+    size_t n = (left < reorder_merge_buffer_n_reads) ? (size_t)left : reorder_merge_buffer_n_reads;
+    if (fseek(reorder_runs_file, (long)((c->run.offset + c->next) * sizeof(reorder_read_t)), SEEK_SET) != 0)
+    {
+        die("can't seek in temporary file \"%s\"\n", reorder_runs_path);
+    }
+    fread_or_die(c->buffer, sizeof(reorder_read_t), n, reorder_runs_file);
+    c->next += n;
+    c->pos = 0;
+    c->fill = n;
+    return true;
+}
+
+
+static inline const reorder_read_t* reorder_heap_read(size_t i)
+{
+    const reorder_cursor_t *c = &reorder_cursors[reorder_heap[i]];
+    return &c->buffer[c->pos];
+}
+
+
+static void reorder_heap_sift_down(size_t i)
+{
+    for (;;)
+    {
+        size_t smallest = i, left = i * 2 + 1, right = i * 2 + 2;
+        if (left < reorder_heap_size && reorder_read_is_before(reorder_heap_read(left), reorder_heap_read(smallest))) { smallest = left; }
+        if (right < reorder_heap_size && reorder_read_is_before(reorder_heap_read(right), reorder_heap_read(smallest))) { smallest = right; }
+        if (smallest == i) { return; }
+        size_t t = reorder_heap[i]; reorder_heap[i] = reorder_heap[smallest]; reorder_heap[smallest] = t;
+        i = smallest;
+    }
+}
+
+
+/*
+ * Starts merging "n" runs (at most "reorder_merge_fan_in"), beginning with run "first".
+ */
+static void reorder_start_merge(size_t first, size_t n)
+{
+    assert(n <= reorder_merge_fan_in);
+    fflush_or_die(reorder_runs_file);
+
+    reorder_heap_size = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        reorder_cursor_t *c = &reorder_cursors[i];
+        c->run = reorder_runs[first + i];
+        c->next = 0;
+        if (c->buffer == NULL) { c->buffer = (reorder_read_t *) malloc_or_die(sizeof(reorder_read_t) * reorder_merge_buffer_n_reads); }
+        if (reorder_cursor_refill(c)) { reorder_heap[reorder_heap_size++] = i; }
+    }
+    for (size_t i = reorder_heap_size; i > 0; i--) { reorder_heap_sift_down(i - 1); }
+    reorder_merging = true;
+}
+
+
+static bool reorder_merge_next(reorder_read_t *r)
+{
+    if (reorder_heap_size == 0) { return false; }
+
+    reorder_cursor_t *c = &reorder_cursors[reorder_heap[0]];
+    *r = c->buffer[c->pos++];
+    if (c->pos >= c->fill && !reorder_cursor_refill(c)) { reorder_heap[0] = reorder_heap[--reorder_heap_size]; }
+    reorder_heap_sift_down(0);
+    return true;
+}
+
+
+/*
+ * Merges "n" runs starting with run "first" into a new run at the end of the file.
+ */
+static void reorder_merge_runs(size_t first, size_t n)
+{
+    reorder_read_t *out = (reorder_read_t *) malloc_or_die(sizeof(reorder_read_t) * reorder_merge_buffer_n_reads);
+    size_t fill = 0;
+    unsigned long long offset = reorder_runs_file_n_reads, total = 0;
+
+    reorder_start_merge(first, n);
+    reorder_read_t r;
+    while (reorder_merge_next(&r))
+    {
+        out[fill++] = r;
+        if (fill == reorder_merge_buffer_n_reads) { reorder_write_reads(out, fill); total += fill; fill = 0; }
+    }
+    if (fill > 0) { reorder_write_reads(out, fill); total += fill; }
+    reorder_end_merge();
+    free(out);
+
+    reorder_add_run(offset, total);
+}
+
+
+/*
+ * Orders reads by their keys, keeping the original order of reads with equal keys.
+ * If the reads were written out as several runs, they are merged, and the last merge is done while reading the input.
+ */
+static void reorder_sort_reads(void)
+{
+    if (reorder_n_runs == 0)
+    {
+        qsort(reorder_reads_buffer, reorder_reads_fill, sizeof(reorder_read_t), &compare_reads);
+        reorder_reads_pos = 0;
+        return;
+    }
+
+    if (reorder_reads_fill > 0) { reorder_spill_reads(); }
+    free(reorder_reads_buffer);
+    reorder_reads_buffer = NULL;
+    reorder_reads_allocated = 0;
+
+    size_t first = 0;
+    while (reorder_n_runs - first > reorder_merge_fan_in)
+    {
+        reorder_merge_runs(first, reorder_merge_fan_in);
+        first += reorder_merge_fan_in;
+    }
+    if (verbose) { msg("Merging %zu sorted runs of read keys\n", reorder_n_runs - first); }
+    reorder_start_merge(first, reorder_n_runs - first);
+}
+
+
+/*
+ * Called after detecting the input format: scans the input and decides the order of records.
+ * After that the input is read in the new order by "read_reordered_input".
+ */
+static void prepare_reordering(void)
+{
+    reorder_scan_input();
+    if (in_format_from_input == in_format_fastq) { reorder_sort_reads(); }
+    else { reorder_plan_tour(); }
+
+    if (reorder_sketches != NULL) { free(reorder_sketches); reorder_sketches = NULL; }
+
+    compressor_init(&ORDER, "order", 0);
+    ORDER.adaptive = false;
+    reading_reordered_input = true;
+}
+
+
+/*
+ * Adds the original number of the next stored record to the list kept in the "Order" extension record.
+ */
+static void reorder_add_to_list(unsigned long long record)
+{
+    long long delta = (long long)(record - reorder_prev_record - 1);
+    byte_buffer_put_number(&reorder_list, ((unsigned long long)delta << 1) ^ (unsigned long long)(delta >> 63));
+    reorder_n_moved += (record != reorder_next);
+    reorder_prev_record = record;
+
+    if (reorder_list.size >= reorder_list_flush_size)
+    {
+        compress(&ORDER, reorder_list.data, reorder_list.size);
+        reorder_list.size = 0;
+    }
+}
+
+
+/*
+ * Called after all records are read: finishes the list of original numbers.
+ */
+static void finish_reordering(void)
+{
+    if (reorder_list.size > 0)
+    {
+        compress(&ORDER, reorder_list.data, reorder_list.size);
+        reorder_list.size = 0;
+    }
+    reorder_end_merge();
+
+    reorder_is_identity = (reorder_n_moved == 0);
+    if (verbose) { msg("Reordering: %zu sequences, %llu moved\n", reorder_n_records, reorder_n_moved); }
+}
+
+
+/*
+ * Finds the next record in the new order.
+ */
+static bool reorder_next_record(unsigned long long *record, unsigned long long *start, unsigned long long *size, bool *needs_eol)
+{
+    if (reorder_next >= reorder_n_records) { return false; }
+
+    if (in_format_from_input == in_format_fastq)
+    {
+        reorder_read_t r;
+        if (reorder_merging) { if (!reorder_merge_next(&r)) { die("can't read sorted read keys\n"); } }
+        else { r = reorder_reads_buffer[reorder_reads_pos++]; }
+        *record = r.record;
+        *start = r.start;
+        *size = r.size;
+        *needs_eol = (r.record == reorder_n_records - 1) && reorder_last_needs_eol;
+    }
+    else
+    {
+        const reorder_range_t *r = &reorder_ranges[reorder_tour[reorder_next]];
+        *record = reorder_tour[reorder_next];
+        *start = r->start;
+        *size = r->size;
+        *needs_eol = r->needs_eol;
+    }
+    return true;
+}
+
+
+/*
+ * Reads the next portion of input, consisting of records in the new order, into "buffer".
+ * The '>' or '@' of the first record is not included, since format detection already consumed it.
+ * Returns the number of bytes placed in the buffer, or 0 at the end of input.
+ */
+static size_t read_reordered_input(unsigned char *buffer, size_t size)
+{
+    size_t n = 0;
+    while (n < size)
+    {
+        if (reorder_remaining == 0)
+        {
+            if (reorder_pending_eol) { buffer[n++] = '\n'; reorder_pending_eol = false; continue; }
+
+            unsigned long long record, start, record_size;
+            if (!reorder_next_record(&record, &start, &record_size, &reorder_pending_eol)) { break; }
+            reorder_add_to_list(record);
+            start += (reorder_next == 0);
+            reorder_remaining = record_size - (reorder_next == 0);
+            reorder_next++;
+
+            if (start != reorder_source_pos)
+            {
+                if (fseek(reorder_source, (long)(reorder_base + start), SEEK_SET) != 0) { die("can't seek in input\n"); }
+                reorder_source_pos = start;
+            }
+            continue;
+        }
+
+        size_t k = (reorder_remaining < size - n) ? (size_t)reorder_remaining : size - n;
+        if (fread(buffer + n, 1, k, reorder_source) != k) { die("can't read input\n"); }
+        n += k;
+        reorder_remaining -= k;
+        reorder_source_pos += k;
+    }
+    return n;
+}
+
+
+/*
+ * Order record: size of the list, and the list compressed by zstd (without magic number).
+ * The list has one number for each stored record: its original number, relative to the one of the previous stored record,
+ * minus one (so that records kept in the original order have zeros), in zigzag encoding.
+ */
+static void write_order_extension(FILE *F)
+{
+    write_variable_length_encoded_number(F, ext_order);
+    write_variable_length_encoded_number(F, variable_length_encoded_number_size(ORDER.uncompressed_size) + compressed_data_size(&ORDER));
+    write_variable_length_encoded_number(F, ORDER.uncompressed_size);
+    write_compressed_data_without_size(F, &ORDER);
+}
@@ -0,0 +1,110 @@
+/*
+ * NAF compressor
+ * Copyright (c) 2018-2021 Kirill Kryukov
+ * See README.md and LICENSE files of this repository
+ */
+
+/*
+ * Detection of sequence type ("--auto-type").
+ * After detecting the input format, the beginning of the input is read ahead into a sample, and the characters
+ * of its sequence lines are counted. The first of DNA, RNA and protein that expects all of these characters
+ * is selected, or text if none does. Spaces and end-of-line characters are not counted.
+ * The sample is then returned to the parser by "read_input", before the rest of the input.
+ * Characters found only past the sample are handled as usual for the selected type.
+ */
+
+#define auto_type_sample_size (4ull * 1000 * 1000)
+
+static bool auto_detect_seq_type = false;
+
+static unsigned char *in_sample = NULL;
+static size_t in_sample_pos = 0;
+static size_t in_sample_end = 0;
+
+static unsigned long long auto_type_counts[256];
+static unsigned long long auto_type_line = 0;
+static bool auto_type_at_line_start = false;
+static bool auto_type_in_sequence = false;
+
+
+static void free_sample(void)
+{
+    if (in_sample != NULL) { free(in_sample); in_sample = NULL; }
+}
+
+
+/*
+ * Reads the next portion of input into "buffer", first from the sample, then from the input file.
+ */
+static size_t read_input(unsigned char *buffer, size_t size)
+{
+    if (in_sample_pos < in_sample_end)
+    {
+        size_t n = (in_sample_end - in_sample_pos < size) ? in_sample_end - in_sample_pos : size;
+        memcpy(buffer, in_sample + in_sample_pos, n);
+        in_sample_pos += n;
+        return n;
+    }
+    return fread(buffer, 1, size, IN);
+}
+
+
+/*
+ * Counts the characters of sequence lines. Starts in the name line of the first record, whose '>' or '@' is read.
+ * For FASTA, every line not starting with '>' is a sequence line. For FASTQ, every 4th line starting from the second one.
+ */
+static void count_sample_chars(const unsigned char *data, size_t size)
+{
+    bool is_fastq = (in_format_from_input == in_format_fastq);
+    for (size_t i = 0; i < size; i++)
+    {
+        unsigned char c = data[i];
+        if (c == '\n')
+        {
+            auto_type_line++;
+            auto_type_at_line_start = true;
+            if (is_fastq) { auto_type_in_sequence = ((auto_type_line & 3) == 1); }
+            continue;
+        }
+        if (auto_type_at_line_start)
+        {
+            auto_type_at_line_start = false;
+            if (!is_fastq) { auto_type_in_sequence = (c != '>'); }
+        }
+        if (auto_type_in_sequence && !is_space_arr[c]) { auto_type_counts[c]++; }
+    }
+}
+
+
+static bool sample_has_unexpected_chars(const bool *unexpected_arr)
+{
+    for (unsigned c = 0; c < 256; c++)
+    {
+        if (auto_type_counts[c] != 0 && unexpected_arr[c]) { return true; }
+    }
+    return false;
+}
+
+
+static void detect_sequence_type(void)
+{
+    assert(in_sample == NULL);
+    if (in_format_from_input == in_format_unknown) { return; }
+
+    in_sample = (unsigned char *) malloc_or_die(auto_type_sample_size);
+    while (in_sample_end < auto_type_sample_size)
+    {
+        size_t n = fread(in_sample + in_sample_end, 1, auto_type_sample_size - in_sample_end, IN);
+        if (n == 0) { break; }
+        in_sample_end += n;
+    }
+    if (ferror(IN)) { die("can't read input\n"); }
+
+    count_sample_chars(in_buffer + in_begin, in_end - in_begin);
+    count_sample_chars(in_sample, in_sample_end);
+
+    if (!sample_has_unexpected_chars(is_unexpected_dna_arr)) { in_seq_type = seq_type_dna; }
+    else if (!sample_has_unexpected_chars(is_unexpected_rna_arr)) { in_seq_type = seq_type_rna; }
+    else if (!sample_has_unexpected_chars(is_unexpected_protein_arr)) { in_seq_type = seq_type_protein; }
+    else { in_seq_type = seq_type_text; }
+}
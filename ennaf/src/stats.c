@@ -0,0 +1,217 @@
+/*
+ * NAF compressor
+ * Copyright (c) 2018-2021 Kirill Kryukov
+ * See README.md and LICENSE files of this repository
+ */
+
+/*
+ * Summary statistics, collected during compression and stored in the "Statistics" extension record.
+ * Lengths are collected into a hash table of distinct lengths, which keeps memory bounded
+ * by the number of distinct lengths rather than by the number of sequences.
+ */
+
+typedef struct {
+    unsigned long long length;
+    unsigned long long count;
+} length_count_t;
+
+static length_count_t *stats_length_table = NULL;
+static size_t stats_length_table_size = 0;
+static size_t stats_length_table_fill = 0;
+
+static unsigned long long stats_total_length = 0;
+static unsigned long long stats_min_length = 0;
+static unsigned long long stats_max_length = 0;
+static unsigned long long stats_masked_length = 0;
+
+// Index 0 of the first dimension is for 4-bit encoded bytes, 1 for text characters, 2 for 2-bit encoded bytes,
+// 3 for nucleotide characters of duplicate sequences, which are not encoded ("--dedup").
+// 4 sub-tables per histogram, same as for character counting in unnaf.
+static unsigned long long stats_byte_hist[4][4][256];
+
+// Nucleotides stored as exceptions of 2-bit encoding, by 4-bit code. In the 2-bit stream they appear as 'A'.
+static unsigned long long stats_2bit_exception_counts[16];
+static unsigned long long stats_hpc_run_counts[16];
+
+
+static inline size_t stats_length_slot(length_count_t *table, size_t size, unsigned long long len)
+{
+    size_t i = (size_t)((len * 0x9E3779B97F4A7C15ull) >> 20) & (size - 1);
+    while (table[i].count != 0 && table[i].length != len) { i = (i + 1) & (size - 1); }
+    return i;
+}
+
+
+static void stats_grow_length_table(void)
+{
+    size_t new_size = stats_length_table_size ? stats_length_table_size * 2 : 1024;
+    length_count_t *new_table = (length_count_t *) malloc_or_die(sizeof(length_count_t) * new_size);
+    memset(new_table, 0, sizeof(length_count_t) * new_size);
+
+    for (size_t i = 0; i < stats_length_table_size; i++)
+    {
+        if (stats_length_table[i].count != 0)
+        {
+            new_table[stats_length_slot(new_table, new_size, stats_length_table[i].length)] = stats_length_table[i];
+        }
+    }
+
+    if (stats_length_table != NULL) { free(stats_length_table); }
+    stats_length_table = new_table;
+    stats_length_table_size = new_size;
+}
+
+
+static void stats_add_length(unsigned long long len)
+{
+    if (n_sequences == 0 || len < stats_min_length) { stats_min_length = len; }
+    if (len > stats_max_length) { stats_max_length = len; }
+    stats_total_length += len;
+
+    if (stats_length_table_fill * 2 >= stats_length_table_size) { stats_grow_length_table(); }
+    size_t i = stats_length_slot(stats_length_table, stats_length_table_size, len);
+    if (stats_length_table[i].count == 0) { stats_length_table[i].length = len; stats_length_table_fill++; }
+    stats_length_table[i].count++;
+}
+
+
+static inline void stats_add_bytes(unsigned text, const unsigned char *data, size_t size)
+{
+    unsigned long long (*hist)[256] = stats_byte_hist[text];
+    const unsigned char *p = data;
+    const unsigned char *end4 = data + (size & ~(size_t)3);
+    for (; p < end4; p += 4)
+    {
+        hist[0][p[0]]++;
+        hist[1][p[1]]++;
+        hist[2][p[2]]++;
+        hist[3][p[3]]++;
+    }
+    for (const unsigned char *end = data + size; p < end; p++) { hist[0][*p]++; }
+}
+
+
+static int compare_length_counts_descending(const void *a, const void *b)
+{
+    unsigned long long x = ((const length_count_t *)a)->length;
+    unsigned long long y = ((const length_count_t *)b)->length;
+    return (x < y) ? 1 : (x > y) ? -1 : 0;
+}
+
+
+static unsigned long long stats_n50(void)
+{
+    if (stats_length_table_fill == 0) { return 0; }
+
+    length_count_t *list = (length_count_t *) malloc_or_die(sizeof(length_count_t) * stats_length_table_fill);
+    size_t n = 0;
+    for (size_t i = 0; i < stats_length_table_size; i++)
+    {
+        if (stats_length_table[i].count != 0) { list[n++] = stats_length_table[i]; }
+    }
+    qsort(list, n, sizeof(length_count_t), &compare_length_counts_descending);
+
+    unsigned long long n50 = 0, sum = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        sum += list[i].length * list[i].count;
+        if (sum * 2 >= stats_total_length) { n50 = list[i].length; break; }
+    }
+
+    free(list);
+    return n50;
+}
+
+
+/*
+ * Folds byte histograms into character counts.
+ * The padding half-byte at the end of an odd-length 4-bit sequence is excluded.
+ */
+static void stats_character_counts(unsigned long long *counts)
+{
+    static const unsigned char code_to_nuc[16] = {'-','T','G','K','C','Y','S','B','A','W','R','D','M','H','V','N'};
+    static const unsigned char code_2bit_to_nuc[4] = {'A','C','G','T'};
+
+    memset(counts, 0, sizeof(unsigned long long) * 256);
+    for (unsigned b = 0; b < 256; b++)
+    {
+        unsigned long long n4 = stats_byte_hist[0][0][b] + stats_byte_hist[0][1][b] + stats_byte_hist[0][2][b] + stats_byte_hist[0][3][b];
+        counts[code_to_nuc[b & 15]] += n4;
+        counts[code_to_nuc[b >> 4]] += n4;
+
+        unsigned long long n2 = stats_byte_hist[2][0][b] + stats_byte_hist[2][1][b] + stats_byte_hist[2][2][b] + stats_byte_hist[2][3][b];
+        for (unsigned k = 0; k < 8; k += 2) { counts[code_2bit_to_nuc[(b >> k) & 3]] += n2; }
+
+        counts[b] += stats_byte_hist[1][0][b] + stats_byte_hist[1][1][b] + stats_byte_hist[1][2][b] + stats_byte_hist[1][3][b];
+
+        unsigned long long nd = stats_byte_hist[3][0][b] + stats_byte_hist[3][1][b] + stats_byte_hist[3][2][b] + stats_byte_hist[3][3][b];
+        counts[code_to_nuc[nuc_code[b]]] += nd;
+    }
+
+    if (in_seq_type < seq_type_protein)
+    {
+        unsigned long long n_encoded = store_hpc ? hpc_n_bases : seq_size_original - seq_size_deduplicated;
+        if (store_2bit)
+        {
+            // Padding at the end of the last byte, and exceptions, were counted as 'A'.
+            counts['A'] -= (4 - (n_encoded & 3ull)) & 3ull;
+            for (unsigned c = 0; c < 16; c++)
+            {
+                counts['A'] -= stats_2bit_exception_counts[c];
+                counts[code_to_nuc[c]] += stats_2bit_exception_counts[c];
+            }
+        }
+        else if (n_encoded & 1ull) { counts['-']--; }
+
+        // Only the first nucleotide of each homopolymer run was counted.
+        for (unsigned c = 0; c < 16; c++) { counts[code_to_nuc[c]] += stats_hpc_run_counts[c]; }
+
+        if (in_seq_type == seq_type_rna) { counts['U'] += counts['T']; counts['T'] = 0; }
+    }
+}
+
+
+static size_t variable_length_encoded_number_size(unsigned long long a)
+{
+    size_t len = 1;
+    while (a >>= 7) { len++; }
+    return len;
+}
+
+
+static void write_stats_extension(FILE *F)
+{
+    unsigned long long counts[256];
+    stats_character_counts(counts);
+
+    unsigned long long n50 = stats_n50();
+    unsigned long long n_chars = 0;
+    for (unsigned i = 0; i < 256; i++) { if (counts[i] != 0) { n_chars++; } }
+
+    size_t size = variable_length_encoded_number_size(stats_total_length)
+                + variable_length_encoded_number_size(stats_min_length)
+                + variable_length_encoded_number_size(stats_max_length)
+                + variable_length_encoded_number_size(n50)
+                + variable_length_encoded_number_size(stats_masked_length)
+                + variable_length_encoded_number_size(n_chars);
+    for (unsigned i = 0; i < 256; i++) { if (counts[i] != 0) { size += 1 + variable_length_encoded_number_size(counts[i]); } }
+
+    write_variable_length_encoded_number(F, ext_stats);
+    write_variable_length_encoded_number(F, size);
+    write_variable_length_encoded_number(F, stats_total_length);
+    write_variable_length_encoded_number(F, stats_min_length);
+    write_variable_length_encoded_number(F, stats_max_length);
+    write_variable_length_encoded_number(F, n50);
+    write_variable_length_encoded_number(F, stats_masked_length);
+    write_variable_length_encoded_number(F, n_chars);
+    for (unsigned i = 0; i < 256; i++)
+    {
+        if (counts[i] != 0)
+        {
+            fputc_or_die((int)i, F);
+            write_variable_length_encoded_number(F, counts[i]);
+        }
+    }
+
+    if (verbose) { msg("Statistics: %llu sequences, total length %llu, N50 %llu\n", n_sequences, stats_total_length, n50); }
+}
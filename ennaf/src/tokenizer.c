@@ -0,0 +1,436 @@
+/*
+ * NAF compressor
+ * Copyright (c) 2018-2021 Kirill Kryukov
+ * See README.md and LICENSE files of this repository
+ */
+
+/*
+ * Tokenized encoding of sequence ids ("--tokenize-ids").
+ * Ids are collected into blocks. Each id is split on delimiter characters into tokens.
+ * The sequence of delimiters forms the pattern of the id. Ids of the same pattern share columns, one per token.
+ * Each column is stored as a whole, using the cheapest applicable type:
+ * constant, number (delta from previous value), small set of values (enum), or plain text.
+ * The resulting block is written into the IDS stream, which is compressed by zstd as usual.
+ * Ids that don't fit into the pattern table, or are too long, are stored as plain text.
+ */
+
+#define id_block_max_names 32768
+#define id_block_max_size (4u * 1024 * 1024)
+#define id_max_tokens 16
+#define id_max_patterns 16
+#define id_max_name_length 65534
+#define id_max_enum_values 32
+#define id_max_number_digits 18
+#define id_raw_pattern 255
+
+enum { id_column_const = 0, id_column_number = 1, id_column_enum = 2, id_column_text = 3 };
+
+typedef struct
+{
+    unsigned n_delimiters;
+    unsigned char delimiters[id_max_tokens - 1];
+}
+id_pattern_t;
+
+typedef struct
+{
+    size_t size;
+    size_t allocated;
+    unsigned char *data;
+}
+byte_buffer_t;
+
+static bool is_id_delimiter[256];
+
+static unsigned char *id_block = NULL;
+static size_t id_block_size = 0;
+static size_t id_block_allocated = 0;
+static unsigned id_block_n_names = 0;
+
+static size_t *id_name_starts = NULL;
+static unsigned char *id_name_patterns = NULL;
+static unsigned short *id_token_starts = NULL;
+
+static id_pattern_t id_patterns[id_max_patterns];
+static unsigned id_n_patterns = 0;
+
+static byte_buffer_t id_out = { 0, 0, NULL };
+static byte_buffer_t id_column = { 0, 0, NULL };
+
+static unsigned long long ids_size_original = 0;
+
+
+static void init_id_tokenizer(void)
+{
+    memset(is_id_delimiter, 0, sizeof(is_id_delimiter));
+    for (const char *p = ":_/-.|#=,"; *p; p++) { is_id_delimiter[(unsigned char)*p] = true; }
+
+    id_block_allocated = UNCOMPRESSED_BUFFER_SIZE;
+    id_block = (unsigned char *) malloc_or_die(id_block_allocated);
+    id_name_starts = (size_t *) malloc_or_die(sizeof(size_t) * (id_block_max_names + 1));
+    id_name_patterns = (unsigned char *) malloc_or_die(id_block_max_names);
+    id_token_starts = (unsigned short *) malloc_or_die(sizeof(unsigned short) * (id_max_tokens + 1) * id_block_max_names);
+    id_name_starts[0] = 0;
+}
+
+
+static void free_id_tokenizer(void)
+{
+    if (id_block != NULL) { free(id_block); id_block = NULL; }
+    if (id_name_starts != NULL) { free(id_name_starts); id_name_starts = NULL; }
+    if (id_name_patterns != NULL) { free(id_name_patterns); id_name_patterns = NULL; }
+    if (id_token_starts != NULL) { free(id_token_starts); id_token_starts = NULL; }
+    if (id_out.data != NULL) { free(id_out.data); id_out.data = NULL; }
+    if (id_column.data != NULL) { free(id_column.data); id_column.data = NULL; }
+}
+
+
+static void byte_buffer_reserve(byte_buffer_t *b, size_t n)
+{
+    if (b->size + n <= b->allocated) { return; }
+    size_t new_allocated = b->allocated ? b->allocated : 65536;
+    while (new_allocated < b->size + n) { new_allocated *= 2; }
+    unsigned char *new_data = (unsigned char *) malloc_or_die(new_allocated);
+    if (b->size > 0) { memcpy(new_data, b->data, b->size); }
+    if (b->data != NULL) { free(b->data); }
+    b->data = new_data;
+    b->allocated = new_allocated;
+}
+
+
+static inline void byte_buffer_put_byte(byte_buffer_t *b, unsigned char c)
+{
+    byte_buffer_reserve(b, 1);
+    b->data[b->size++] = c;
+}
+
+
+static inline void byte_buffer_put_bytes(byte_buffer_t *b, const unsigned char *data, size_t size)
+{
+    byte_buffer_reserve(b, size);
+    memcpy(b->data + b->size, data, size);
+    b->size += size;
+}
+
+
+static inline void byte_buffer_put_number(byte_buffer_t *b, unsigned long long a)
+{
+    unsigned char vle_buffer[10];
+    unsigned char *p = vle_buffer + 10;
+    *--p = (unsigned char)(a & 127ull);
+    a >>= 7;
+    while (a > 0)
+    {
+        *--p = (unsigned char)(128ull | (a & 127ull));
+        a >>= 7;
+    }
+    byte_buffer_put_bytes(b, p, (size_t)(vle_buffer + 10 - p));
+}
+
+
+static inline void byte_buffer_put_string(byte_buffer_t *b, const unsigned char *str, size_t len)
+{
+    byte_buffer_reserve(b, len + 1);
+    memcpy(b->data + b->size, str, len);
+    b->data[b->size + len] = 0;
+    b->size += len + 1;
+}
+
+
+/*
+ * Splits name "i" of the current block into tokens, and assigns it a pattern.
+ */
+static void tokenize_id(unsigned i)
+{
+    const unsigned char *name = id_block + id_name_starts[i];
+    size_t len = id_name_starts[i + 1] - id_name_starts[i] - 1;
+    unsigned short *starts = id_token_starts + (size_t)i * (id_max_tokens + 1);
+
+    id_pattern_t pattern;
+    pattern.n_delimiters = 0;
+    starts[0] = 0;
+
+    if (len > id_max_name_length) { id_name_patterns[i] = id_raw_pattern; return; }
+
+    for (size_t k = 0; k < len; k++)
+    {
+        if (is_id_delimiter[name[k]])
+        {
+            if (pattern.n_delimiters >= id_max_tokens - 1) { id_name_patterns[i] = id_raw_pattern; return; }
+            pattern.delimiters[pattern.n_delimiters++] = name[k];
+            starts[pattern.n_delimiters] = (unsigned short)(k + 1);
+        }
+    }
+    starts[pattern.n_delimiters + 1] = (unsigned short)(len + 1);
+
+    // Most ids have the same pattern as the previous one.
+    unsigned p = (i > 0 && id_name_patterns[i - 1] != id_raw_pattern) ? id_name_patterns[i - 1] : 0;
+    for (unsigned n = 0; n < id_n_patterns; n++, p = (p + 1) % id_n_patterns)
+    {
+        if (id_patterns[p].n_delimiters == pattern.n_delimiters &&
+            memcmp(id_patterns[p].delimiters, pattern.delimiters, pattern.n_delimiters) == 0)
+        {
+            id_name_patterns[i] = (unsigned char)p;
+            return;
+        }
+    }
+
+    if (id_n_patterns < id_max_patterns)
+    {
+        id_patterns[id_n_patterns] = pattern;
+        id_name_patterns[i] = (unsigned char)id_n_patterns;
+        id_n_patterns++;
+    }
+    else { id_name_patterns[i] = id_raw_pattern; }
+}
+
+
+static inline const unsigned char* id_token(unsigned i, unsigned t, size_t *len)
+{
+    const unsigned short *starts = id_token_starts + (size_t)i * (id_max_tokens + 1);
+    *len = (size_t)(starts[t + 1] - starts[t] - 1);
+    return id_block + id_name_starts[i] + starts[t];
+}
+
+
+static inline size_t number_prefix_length(const unsigned char *s, size_t len)
+{
+    size_t k = 0;
+    while (k < len && (s[k] < '0' || s[k] > '9')) { k++; }
+    return k;
+}
+
+
+static inline unsigned long long parse_id_number(const unsigned char *s, size_t len)
+{
+    unsigned long long a = 0;
+    for (size_t k = 0; k < len; k++) { a = a * 10 + (unsigned)(s[k] - '0'); }
+    return a;
+}
+
+
+/*
+ * Chooses the type of column "t" of pattern "p", and writes it to "id_column".
+ * Number column: all values are digits (at most 18), optionally after a common non-digit prefix.
+ * Numbers either have no leading zeros (width 0), or all have the same number of digits (zero-padded to width).
+ */
+static void encode_id_column(unsigned p, unsigned t)
+{
+    const unsigned char *first = NULL, *prefix = NULL;
+    size_t first_len = 0, prefix_len = 0, width = 0;
+    bool is_const = true, is_number = true, is_canonical = true, is_fixed_width = true, is_enum = true;
+    const unsigned char *values[id_max_enum_values];
+    size_t value_lengths[id_max_enum_values];
+    unsigned n_values = 0;
+
+    for (unsigned i = 0; i < id_block_n_names; i++)
+    {
+        if (id_name_patterns[i] != p) { continue; }
+
+        size_t len;
+        const unsigned char *s = id_token(i, t, &len);
+
+        if (first == NULL)
+        {
+            first = s;
+            first_len = len;
+            prefix = s;
+            prefix_len = number_prefix_length(s, len);
+            width = len - prefix_len;
+        }
+        else if (is_const && (len != first_len || memcmp(s, first, len) != 0)) { is_const = false; }
+
+        if (is_number)
+        {
+            size_t digits = len - prefix_len;
+            if (len < prefix_len || digits == 0 || digits > id_max_number_digits || memcmp(s, prefix, prefix_len) != 0) { is_number = false; }
+            else
+            {
+                for (size_t k = prefix_len; k < len; k++) { if (s[k] < '0' || s[k] > '9') { is_number = false; break; } }
+                if (digits > 1 && s[prefix_len] == '0') { is_canonical = false; }
+                if (digits != width) { is_fixed_width = false; }
+                if (!is_canonical && !is_fixed_width) { is_number = false; }
+            }
+        }
+
+        if (is_enum)
+        {
+            unsigned v = 0;
+            while (v < n_values && (value_lengths[v] != len || memcmp(values[v], s, len) != 0)) { v++; }
+            if (v == n_values)
+            {
+                if (n_values == id_max_enum_values) { is_enum = false; }
+                else { values[n_values] = s; value_lengths[n_values] = len; n_values++; }
+            }
+        }
+    }
+
+    id_column.size = 0;
+
+    if (is_const)
+    {
+        byte_buffer_put_byte(&id_out, id_column_const);
+        byte_buffer_put_string(&id_column, first, first_len);
+    }
+    else if (is_number)
+    {
+        byte_buffer_put_byte(&id_out, id_column_number);
+        byte_buffer_put_string(&id_column, prefix, prefix_len);
+        byte_buffer_put_number(&id_column, is_canonical ? 0 : width);
+
+        unsigned long long prev = 0;
+        for (unsigned i = 0; i < id_block_n_names; i++)
+        {
+            if (id_name_patterns[i] != p) { continue; }
+            size_t len;
+            const unsigned char *s = id_token(i, t, &len);
+            unsigned long long a = parse_id_number(s + prefix_len, len - prefix_len);
+            long long delta = (long long)(a - prev);
+            byte_buffer_put_number(&id_column, ((unsigned long long)delta << 1) ^ (unsigned long long)(delta >> 63));
+            prev = a;
+        }
+    }
+    else if (is_enum)
+    {
+        byte_buffer_put_byte(&id_out, id_column_enum);
+        byte_buffer_put_number(&id_column, n_values);
+        for (unsigned v = 0; v < n_values; v++) { byte_buffer_put_string(&id_column, values[v], value_lengths[v]); }
+
+        for (unsigned i = 0; i < id_block_n_names; i++)
+        {
+            if (id_name_patterns[i] != p) { continue; }
+            size_t len;
+            const unsigned char *s = id_token(i, t, &len);
+            unsigned v = 0;
+            while (value_lengths[v] != len || memcmp(values[v], s, len) != 0) { v++; }
+            byte_buffer_put_byte(&id_column, (unsigned char)v);
+        }
+    }
+    else
+    {
+        byte_buffer_put_byte(&id_out, id_column_text);
+        for (unsigned i = 0; i < id_block_n_names; i++)
+        {
+            if (id_name_patterns[i] != p) { continue; }
+            size_t len;
+            const unsigned char *s = id_token(i, t, &len);
+            byte_buffer_put_string(&id_column, s, len);
+        }
+    }
+
+    byte_buffer_put_number(&id_out, id_column.size);
+    byte_buffer_put_bytes(&id_out, id_column.data, id_column.size);
+}
+
+
+/*
+ * Block layout: number of ids, number of patterns, patterns (number of delimiters, delimiters),
+ * pattern index of each id (only if there is more than one pattern, or some ids are stored as text),
+ * then columns of each pattern (type byte, data size, data), then the ids stored as text.
+ */
+static void encode_id_block(void)
+{
+    if (id_block_n_names == 0) { return; }
+
+    id_n_patterns = 0;
+    bool has_raw = false;
+    for (unsigned i = 0; i < id_block_n_names; i++)
+    {
+        tokenize_id(i);
+        if (id_name_patterns[i] == id_raw_pattern) { has_raw = true; }
+    }
+
+    id_out.size = 0;
+    byte_buffer_put_number(&id_out, id_block_n_names);
+    byte_buffer_put_number(&id_out, id_n_patterns);
+    for (unsigned p = 0; p < id_n_patterns; p++)
+    {
+        byte_buffer_put_number(&id_out, id_patterns[p].n_delimiters);
+        byte_buffer_put_bytes(&id_out, id_patterns[p].delimiters, id_patterns[p].n_delimiters);
+    }
+
+    bool mixed = has_raw || id_n_patterns > 1;
+    byte_buffer_put_byte(&id_out, mixed);
+    if (mixed) { byte_buffer_put_bytes(&id_out, id_name_patterns, id_block_n_names); }
+
+    for (unsigned p = 0; p < id_n_patterns; p++)
+    {
+        for (unsigned t = 0; t <= id_patterns[p].n_delimiters; t++) { encode_id_column(p, t); }
+    }
+
+    id_column.size = 0;
+    for (unsigned i = 0; i < id_block_n_names; i++)
+    {
+        if (id_name_patterns[i] != id_raw_pattern) { continue; }
+        byte_buffer_put_bytes(&id_column, id_block + id_name_starts[i], id_name_starts[i + 1] - id_name_starts[i]);
+    }
+    byte_buffer_put_number(&id_out, id_column.size);
+    byte_buffer_put_bytes(&id_out, id_column.data, id_column.size);
+
+    compress(&IDS, id_out.data, id_out.size);
+
+    id_block_size = 0;
+    id_block_n_names = 0;
+}
+
+
+/*
+ * Receives a chunk of 0-terminated ids. The last id in the chunk may be incomplete, continued in the next chunk.
+ */
+static void tokenize_ids_chunk(const unsigned char *str, size_t size)
+{
+    ids_size_original += size;
+
+    const unsigned char *p = str, *end = str + size;
+    while (p < end)
+    {
+        const unsigned char *e = memchr(p, 0, (size_t)(end - p));
+        size_t len = e ? (size_t)(e - p) + 1 : (size_t)(end - p);
+
+        if (id_block_size + len > id_block_allocated)
+        {
+            size_t new_allocated = id_block_allocated * 2;
+            while (new_allocated < id_block_size + len) { new_allocated *= 2; }
+            unsigned char *new_block = (unsigned char *) malloc_or_die(new_allocated);
+            memcpy(new_block, id_block, id_block_size);
+            free(id_block);
+            id_block = new_block;
+            id_block_allocated = new_allocated;
+        }
+        memcpy(id_block + id_block_size, p, len);
+        id_block_size += len;
+        p += len;
+
+        if (e != NULL)
+        {
+            id_block_n_names++;
+            id_name_starts[id_block_n_names] = id_block_size;
+            if (id_block_n_names >= id_block_max_names || id_block_size >= id_block_max_size) { encode_id_block(); }
+        }
+    }
+}
+
+
+static void finish_id_tokenizer(void)
+{
+    if (id_block_size != id_name_starts[id_block_n_names]) { die("internal error - incomplete id in the tokenizer\n"); }
+    encode_id_block();
+    if (verbose) { msg("Tokenized ids: %llu bytes -> %llu bytes\n", ids_size_original, IDS.uncompressed_size); }
+}
+
+
+/*
+ * Id encoding record: encoding type, then the original size of the ids part.
+ */
+static void write_id_encoding_extension(FILE *F)
+{
+    assert(tokenize_ids);
+
+    size_t size = variable_length_encoded_number_size(id_encoding_tokens)
+                + variable_length_encoded_number_size(ids_size_original);
+
+    write_variable_length_encoded_number(F, ext_id_encoding);
+    write_variable_length_encoded_number(F, size);
+    write_variable_length_encoded_number(F, id_encoding_tokens);
+    write_variable_length_encoded_number(F, ids_size_original);
+}
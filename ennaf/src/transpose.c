@@ -0,0 +1,243 @@
+/*
+ * NAF compressor
+ * Copyright (c) 2018-2021 Kirill Kryukov
+ * See README.md and LICENSE files of this repository
+ */
+
+/*
+ * Transposed layout of a part ("--qual-transpose", "--msa").
+ * Records (rows) are grouped into blocks: a block is a run of consecutive rows of the same length L,
+ * of at most max(1, "max_block_size" / L) rows.
+ * Each block with more than one row is stored column by column: first bytes of all its rows, then second bytes, etc.
+ * Other blocks are stored as is, so variable length records fall back to the normal layout.
+ * The decoder makes the same decision from record lengths, so nothing is stored per block.
+ *
+ * Data arrives in pieces not aligned to rows, and row lengths arrive separately.
+ * A row's length is known before any data of the next row arrives,
+ * so all data past the known rows belongs to the row being parsed.
+ * A block is collected in a buffer until it's complete, unless it turns out to consist of a single row,
+ * in which case it is passed through directly, without buffering.
+ */
+
+typedef struct
+{
+    unsigned long long max_block_size;
+    void (*sink)(const unsigned char *, size_t);
+
+    unsigned long long *lengths;        // Known row lengths, starting from the first row of the current block.
+    size_t n_lengths;
+    size_t lengths_allocated;
+
+    byte_buffer_t buffer;               // Received data, starting from the first row of the current block.
+    unsigned char *transposed;
+    size_t transposed_allocated;
+
+    bool passthrough;                   // Current block is a single row, which goes directly to "sink".
+    bool passthrough_length_is_known;
+    unsigned long long passthrough_remaining;
+    unsigned long long passthrough_received;
+}
+transposer_t;
+
+#define transpose_tile 64
+#define qual_transpose_max_block_size (1ull << 22)
+#define msa_transpose_max_block_size (1ull << 25)
+
+static transposer_t qual_transposer = { qual_transpose_max_block_size, NULL, NULL, 0, 0, { 0, 0, NULL }, NULL, 0, false, false, 0, 0 };
+static transposer_t seq_transposer = { msa_transpose_max_block_size, NULL, NULL, 0, 0, { 0, 0, NULL }, NULL, 0, false, false, 0, 0 };
+
+
+static void transposer_free(transposer_t *t)
+{
+    if (t->buffer.data != NULL) { free(t->buffer.data); t->buffer.data = NULL; }
+    if (t->transposed != NULL) { free(t->transposed); t->transposed = NULL; }
+    if (t->lengths != NULL) { free(t->lengths); t->lengths = NULL; }
+}
+
+
+/*
+ * Transposes "n_rows" rows of "n_columns" bytes from "src" into "dst", in tiles small enough to stay in cache.
+ */
+static void transpose_bytes(const unsigned char *src, unsigned char *dst, size_t n_rows, size_t n_columns)
+{
+    for (size_t r0 = 0; r0 < n_rows; r0 += transpose_tile)
+    {
+        size_t r1 = (r0 + transpose_tile < n_rows) ? r0 + transpose_tile : n_rows;
+        for (size_t c0 = 0; c0 < n_columns; c0 += transpose_tile)
+        {
+            size_t c1 = (c0 + transpose_tile < n_columns) ? c0 + transpose_tile : n_columns;
+            for (size_t c = c0; c < c1; c++)
+            {
+                for (size_t r = r0; r < r1; r++) { dst[c * n_rows + r] = src[r * n_columns + c]; }
+            }
+        }
+    }
+}
+
+
+static void transposer_drop_rows(transposer_t *t, size_t n)
+{
+    if (n == 0) { return; }
+    t->n_lengths -= n;
+    memmove(t->lengths, t->lengths + n, sizeof(unsigned long long) * t->n_lengths);
+}
+
+
+static void transposer_start_passthrough(transposer_t *t, bool length_is_known, unsigned long long remaining)
+{
+    t->passthrough = true;
+    t->passthrough_length_is_known = length_is_known;
+    t->passthrough_remaining = remaining;
+    t->passthrough_received = 0;
+}
+
+
+/*
+ * Writes out all blocks that are complete, and decides what to do with the incomplete one.
+ * "final" indicates the end of input, when the last block is complete with whatever rows it has.
+ */
+static void transposer_process(transposer_t *t, bool final)
+{
+    size_t row = 0;     // First row of the current block.
+    size_t pos = 0;     // Start of the current block in the buffer.
+    size_t sent = 0;    // Data before this position in the buffer is already written out.
+
+    while (!t->passthrough)
+    {
+        if (row >= t->n_lengths)
+        {
+            // All remaining data belongs to the row being parsed. If it's too long for a block of two rows, pass it through.
+            if (t->buffer.size - pos > t->max_block_size / 2)
+            {
+                size_t row_start = pos;
+                pos = t->buffer.size;
+                transposer_start_passthrough(t, false, 0);
+                t->passthrough_received = pos - row_start;
+            }
+            break;
+        }
+
+        unsigned long long len = t->lengths[row];
+        unsigned long long max_rows = t->max_block_size / (len ? len : 1);
+        if (max_rows == 0) { max_rows = 1; }
+        size_t n = 1;
+        while (row + n < t->n_lengths && n < max_rows && t->lengths[row + n] == len) { n++; }
+
+        // Block is complete if it can't grow anymore, or if the row being parsed is already longer than its rows.
+        bool complete = final || n == max_rows || row + n < t->n_lengths || t->buffer.size - pos > n * len + len;
+        if (!complete) { break; }
+
+        unsigned long long block_size = n * len;
+        if (n == 1)
+        {
+            if (t->buffer.size - pos < block_size)
+            {
+                transposer_start_passthrough(t, true, block_size - (t->buffer.size - pos));
+                pos = t->buffer.size;
+                break;
+            }
+            pos += block_size;
+            row++;
+            continue;
+        }
+
+        if (t->buffer.size - pos < block_size) { break; }
+
+        if (pos > sent) { t->sink(t->buffer.data + sent, pos - sent); }
+        if (block_size > t->transposed_allocated)
+        {
+            if (t->transposed != NULL) { free(t->transposed); }
+            t->transposed = (unsigned char *) malloc_or_die(block_size);
+            t->transposed_allocated = block_size;
+        }
+        transpose_bytes(t->buffer.data + pos, t->transposed, n, len);
+        if (block_size > 0) { t->sink(t->transposed, block_size); }
+        pos += block_size;
+        sent = pos;
+        row += n;
+    }
+
+    if (pos > sent) { t->sink(t->buffer.data + sent, pos - sent); }
+    if (pos > 0)
+    {
+        t->buffer.size -= pos;
+        memmove(t->buffer.data, t->buffer.data + pos, t->buffer.size);
+    }
+    // Row being passed through stays in the list until it's complete.
+    transposer_drop_rows(t, row);
+}
+
+
+/*
+ * Called for each row, in order, with its length.
+ */
+static void transposer_add_length(transposer_t *t, unsigned long long len)
+{
+    if (t->n_lengths >= t->lengths_allocated)
+    {
+        size_t new_allocated = t->lengths_allocated ? t->lengths_allocated * 2 : 4096;
+        unsigned long long *new_lengths = (unsigned long long *) malloc_or_die(sizeof(unsigned long long) * new_allocated);
+        if (t->n_lengths > 0) { memcpy(new_lengths, t->lengths, sizeof(unsigned long long) * t->n_lengths); }
+        if (t->lengths != NULL) { free(t->lengths); }
+        t->lengths = new_lengths;
+        t->lengths_allocated = new_allocated;
+    }
+    t->lengths[t->n_lengths++] = len;
+
+    if (t->passthrough && !t->passthrough_length_is_known)
+    {
+        assert(t->n_lengths == 1);
+        assert(len >= t->passthrough_received);
+        t->passthrough_length_is_known = true;
+        t->passthrough_remaining = len - t->passthrough_received;
+        if (t->passthrough_remaining == 0) { t->passthrough = false; transposer_drop_rows(t, 1); }
+    }
+}
+
+
+static void transposer_put(transposer_t *t, const unsigned char *data, size_t size)
+{
+    while (t->passthrough && size > 0)
+    {
+        size_t n = size;
+        if (t->passthrough_length_is_known && t->passthrough_remaining < n) { n = (size_t)t->passthrough_remaining; }
+        t->sink(data, n);
+        data += n;
+        size -= n;
+        t->passthrough_received += n;
+        if (t->passthrough_length_is_known)
+        {
+            t->passthrough_remaining -= n;
+            if (t->passthrough_remaining == 0) { t->passthrough = false; transposer_drop_rows(t, 1); }
+        }
+    }
+
+    if (size > 0) { byte_buffer_put_bytes(&t->buffer, data, size); }
+    transposer_process(t, false);
+}
+
+
+/*
+ * Called at the end of input, writes out the last blocks.
+ */
+static void transposer_finish(transposer_t *t)
+{
+    transposer_process(t, true);
+    assert(!t->passthrough);
+    assert(t->buffer.size == 0);
+}
+
+
+/*
+ * Layout record: layout (1 = transposed), maximum block size.
+ */
+static void write_layout_extension(FILE *F, unsigned long long type, const transposer_t *t)
+{
+    size_t size = variable_length_encoded_number_size(layout_transposed)
+                + variable_length_encoded_number_size(t->max_block_size);
+
+    write_variable_length_encoded_number(F, type);
+    write_variable_length_encoded_number(F, size);
+    write_variable_length_encoded_number(F, layout_transposed);
+    write_variable_length_encoded_number(F, t->max_block_size);
+}
@@ -76,6 +76,14 @@ static void* malloc_or_die(const size_t size)
 }
 
 
+static void* realloc_or_die(void *ptr, const size_t size)
+{
+    void *buf = realloc(ptr, size);
+    if (buf == NULL) { out_of_memory(size); }
+    return buf;
+}
+
+
 static bool string_has_characters_unsafe_in_file_names(char *str)
 {
     assert(str != NULL);
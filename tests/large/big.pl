@@ -0,0 +1,24 @@
+#!/usr/bin/env perl
+#
+# Generates about 27 MB of FASTQ reads, for tests that need input larger than a few MB.
+# Reads are cut from a pseudo-random sequence, with some 'N' runs.
+#
+use strict;
+use warnings;
+
+my $seed = 12345;
+sub next_random { $seed = ($seed * 1103515245 + 12345) % 2147483648; return $seed >> 8; }
+
+my @nuc = ('A', 'C', 'G', 'T');
+my $pool = join('', map { $nuc[next_random() % 4] } 1 .. 1000000);
+my $qual_pool = join('', map { chr(33 + 2 + next_random() % 39) } 1 .. 1000000);
+
+binmode STDOUT;
+for my $i (1 .. 100000)
+{
+    my $len = 100 + next_random() % 51;
+    my $seq = substr($pool, next_random() % (1000000 - $len), $len);
+    if ($i % 11 == 0) { substr($seq, next_random() % ($len - 5), 5) = 'NNNNN'; }
+    my $qual = substr($qual_pool, next_random() % (1000000 - $len), $len);
+    print "\@read$i sample\n$seq\n+\n$qual\n";
+}
@@ -0,0 +1,261 @@
+/*
+ * NAF decompressor
+ * Copyright (c) 2018-2021 Kirill Kryukov
+ * See README.md and LICENSE files of this repository
+ */
+
+/*
+ * Decoder for context model codec of 4-bit encoded DNA sequence ("ennaf --seq-codec cm").
+ * Each nucleotide code is coded with a binary arithmetic coder:
+ * first a flag telling if it's one of A, C, G, T, then either the nucleotide as 2 bits,
+ * or (for any other code) the 4-bit code itself.
+ * Nucleotide bits are predicted by several models, each keyed by a different number of preceding nucleotides,
+ * from short contexts that learn base composition, to long ones that recognize repeats.
+ * Their predictions are combined by a small adaptive mixer.
+ * The model starts from scratch in each block, so blocks can be decoded independently.
+ * Model tables take about 100 MB, both in compression and decompression.
+ * This model must be exactly the same as in ennaf.
+ */
+
+#define cm_n_models 4
+#define cm_n_inputs (cm_n_models + 1)
+#define cm_hash_log 22
+#define cm_n_weight_sets (16 * 3)
+
+static const unsigned cm_orders[cm_n_models] = { 3, 11, 16, 22 };
+static const unsigned cm_rates[cm_n_models] = { 6, 4, 3, 3 };
+
+static const unsigned char cm_nuc_to_code[4] = { 8, 4, 2, 1 };
+
+static unsigned cm_table_log[cm_n_models];
+static unsigned short *cm_tables[cm_n_models] = { NULL, NULL, NULL, NULL };
+static unsigned short *cm_slots[cm_n_models];
+static int cm_weights[cm_n_weight_sets][cm_n_inputs];
+static int cm_inputs[cm_n_inputs];
+static short cm_stretch_table[4096];
+static unsigned long long cm_history = 0;
+
+static unsigned short cm_exception_prob[2];
+static unsigned short cm_exception_code_prob[16][16];
+static unsigned cm_prev_exception = 0;
+static unsigned cm_prev_exception_code = 0;
+
+static unsigned cm_x1 = 0, cm_x2 = 0, cm_x = 0;
+static const unsigned char *cm_in = NULL;
+static const unsigned char *cm_in_end = NULL;
+
+
+/*
+ * Logistic function, from stretched domain (-2047..2047) to 12-bit probability.
+ */
+static inline int cm_squash(int d)
+{
+    static const int t[33] = { 1, 2, 3, 6, 10, 16, 27, 45, 73, 120, 194, 310, 488, 747, 1101, 1546, 2047,
+                               2549, 2994, 3348, 3607, 3785, 3901, 3975, 4022, 4050, 4068, 4079, 4085, 4089, 4092, 4093, 4094 };
+    if (d > 2047) { return 4095; }
+    if (d < -2047) { return 1; }
+    int w = d & 127;
+    d = (d >> 7) + 16;
+    return (t[d] * (128 - w) + t[d + 1] * w + 64) >> 7;
+}
+
+
+static void cm_init(void)
+{
+    int next = 0;
+    for (int x = -2047; x <= 2047; x++)
+    {
+        int p = cm_squash(x);
+        for (int j = next; j <= p; j++) { cm_stretch_table[j] = (short)x; }
+        if (p + 1 > next) { next = p + 1; }
+    }
+    for (int j = next; j < 4096; j++) { cm_stretch_table[j] = 2047; }
+
+    for (unsigned m = 0; m < cm_n_models; m++)
+    {
+        cm_table_log[m] = (cm_orders[m] * 2 <= cm_hash_log) ? cm_orders[m] * 2 : cm_hash_log;
+        cm_tables[m] = (unsigned short *) malloc_or_die((sizeof(unsigned short) * 4) << cm_table_log[m]);
+    }
+}
+
+
+static void cm_free(void)
+{
+    for (unsigned m = 0; m < cm_n_models; m++)
+    {
+        if (cm_tables[m] != NULL) { free(cm_tables[m]); cm_tables[m] = NULL; }
+    }
+}
+
+
+static void cm_reset(void)
+{
+    if (cm_tables[0] == NULL) { cm_init(); }
+
+    for (unsigned m = 0; m < cm_n_models; m++)
+    {
+        size_t n = (size_t)4 << cm_table_log[m];
+        for (size_t i = 0; i < n; i++) { cm_tables[m][i] = 32768; }
+    }
+    for (unsigned s = 0; s < cm_n_weight_sets; s++)
+    {
+        for (unsigned i = 0; i < cm_n_inputs; i++) { cm_weights[s][i] = 16384; }
+    }
+    for (unsigned a = 0; a < 16; a++)
+    {
+        for (unsigned b = 0; b < 16; b++) { cm_exception_code_prob[a][b] = 32768; }
+    }
+    cm_exception_prob[0] = 64;
+    cm_exception_prob[1] = 61440;
+    cm_prev_exception = 0;
+    cm_prev_exception_code = 0;
+    cm_history = 0;
+}
+
+
+/*
+ * Slots of the 4 contexts that differ only in the last nucleotide are adjacent, sharing a cache line,
+ * which is fetched in advance, as soon as the nucleotide before it is known.
+ */
+static inline size_t cm_line_index(unsigned m, unsigned long long older)
+{
+    if (cm_orders[m] * 2 <= cm_hash_log) { return (size_t)older; }
+    return (size_t)(((older + cm_orders[m]) * 0x9E3779B97F4A7C15ull) >> (64 - cm_hash_log + 2));
+}
+
+
+static inline void cm_select_slots(void)
+{
+    for (unsigned m = 0; m < cm_n_models; m++)
+    {
+        unsigned long long older = (cm_history >> 2) & ((1ull << (cm_orders[m] * 2 - 2)) - 1);
+        size_t index = (cm_line_index(m, older) << 2) | (size_t)(cm_history & 3);
+        cm_slots[m] = cm_tables[m] + index * 4;
+    }
+}
+
+
+static inline void cm_push_nucleotide(unsigned nuc)
+{
+    cm_history = (cm_history << 2) | nuc;
+    for (unsigned m = 0; m < cm_n_models; m++)
+    {
+        unsigned long long older = cm_history & ((1ull << (cm_orders[m] * 2 - 2)) - 1);
+        __builtin_prefetch(cm_tables[m] + (cm_line_index(m, older) << 4));
+    }
+}
+
+
+/*
+ * Returns the 12-bit probability of bit 1 at "node" (1 for the first bit of nucleotide, 2 or 3 for the second one).
+ */
+static inline int cm_predict(unsigned node)
+{
+    const int *w = cm_weights[(cm_history & 15) * 3 + node - 1];
+    long long dot = 0;
+    for (unsigned m = 0; m < cm_n_models; m++)
+    {
+        cm_inputs[m] = cm_stretch_table[cm_slots[m][node] >> 4];
+        dot += (long long)cm_inputs[m] * w[m];
+    }
+    cm_inputs[cm_n_models] = 256;
+    dot += 256ll * w[cm_n_models];
+    return cm_squash((int)(dot >> 16));
+}
+
+
+static inline void cm_adapt(unsigned short *c, unsigned bit, unsigned rate)
+{
+    if (bit) { *c = (unsigned short)(*c + ((65536u - *c) >> rate)); }
+    else { *c = (unsigned short)(*c - (*c >> rate)); }
+}
+
+
+static inline void cm_update(unsigned node, int p, unsigned bit)
+{
+    for (unsigned m = 0; m < cm_n_models; m++) { cm_adapt(&cm_slots[m][node], bit, cm_rates[m]); }
+
+    int err = (((int)bit << 12) - p) * 6;
+    int *w = cm_weights[(cm_history & 15) * 3 + node - 1];
+    for (unsigned i = 0; i < cm_n_inputs; i++) { w[i] += (cm_inputs[i] * err + 0x2000) >> 14; }
+}
+
+
+static inline unsigned cm_prob12(unsigned short p)
+{
+    unsigned q = p >> 4;
+    return (q < 1) ? 1 : (q > 4095) ? 4095 : q;
+}
+
+
+// Past the end of input, zero bytes are read, which is also what the encoder flushes.
+static inline unsigned cm_decode_bit(unsigned p)
+{
+    unsigned xmid = cm_x1 + (unsigned)(((unsigned long long)(cm_x2 - cm_x1) * p) >> 12);
+    unsigned bit = (cm_x <= xmid);
+    if (bit) { cm_x2 = xmid; }
+    else { cm_x1 = xmid + 1; }
+    while (((cm_x1 ^ cm_x2) & 0xFF000000u) == 0)
+    {
+        cm_x1 <<= 8;
+        cm_x2 = (cm_x2 << 8) | 255;
+        cm_x = (cm_x << 8) | ((cm_in < cm_in_end) ? *cm_in++ : 0);
+    }
+    return bit;
+}
+
+
+static inline unsigned cm_decode_code(void)
+{
+    unsigned short *ep = &cm_exception_prob[cm_prev_exception];
+    unsigned exception = cm_decode_bit(cm_prob12(*ep));
+    cm_adapt(ep, exception, 4);
+    cm_prev_exception = exception;
+
+    if (exception)
+    {
+        unsigned node = 1;
+        for (int i = 3; i >= 0; i--)
+        {
+            unsigned short *c = &cm_exception_code_prob[cm_prev_exception_code][node];
+            unsigned bit = cm_decode_bit(cm_prob12(*c));
+            cm_adapt(c, bit, 4);
+            node = node * 2 + bit;
+        }
+        cm_prev_exception_code = node & 15;
+        return node & 15;
+    }
+
+    cm_select_slots();
+    int p = cm_predict(1);
+    unsigned b1 = cm_decode_bit((unsigned)p);
+    cm_update(1, p, b1);
+    p = cm_predict(2 + b1);
+    unsigned b2 = cm_decode_bit((unsigned)p);
+    cm_update(2 + b1, p, b2);
+    unsigned nuc = b1 * 2 + b2;
+    cm_push_nucleotide(nuc);
+    return cm_nuc_to_code[nuc];
+}
+
+
+/*
+ * Decodes a block from "src" into "dst", which receives exactly "dst_size" bytes.
+ */
+static void cm_decompress_block(const unsigned char *src, size_t src_size, unsigned char *dst, size_t dst_size)
+{
+    cm_reset();
+    cm_x1 = 0;
+    cm_x2 = 0xFFFFFFFFu;
+    cm_x = 0;
+    cm_in = src;
+    cm_in_end = src + src_size;
+    for (unsigned i = 0; i < 4; i++) { cm_x = (cm_x << 8) | ((cm_in < cm_in_end) ? *cm_in++ : 0); }
+
+    for (size_t i = 0; i < dst_size; i++)
+    {
+        unsigned low = cm_decode_code();
+        unsigned high = cm_decode_code();
+        dst[i] = (unsigned char)(low | (high << 4));
+    }
+}
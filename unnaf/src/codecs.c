@@ -0,0 +1,219 @@
+/*
+ * NAF decompressor
+ * Copyright (c) 2018-2021 Kirill Kryukov
+ * See README.md and LICENSE files of this repository
+ */
+
+/*
+ * Decoding of parts stored with codecs other than zstd ("ennaf --seq-codec", "--qual-codec").
+ * "store" part is the data itself.
+ * "lz4" part is a series of blocks, each: original size (4 bytes), stored size (4 bytes), stored data.
+ * Stored data is in LZ4 block format, or is the original data if both sizes are equal.
+ * "cm" and "fqz" parts have the same blocks, with stored data produced by their models (see "cm.c" and "fqz.c").
+ * A part reader takes the part either from the input file, or from memory, and returns the decoded data in portions.
+ */
+
+#define codec_block_size (4u * 1024 * 1024)
+
+// Decoding may write up to this many bytes past the end of a block, to copy in fixed-size pieces.
+#define codec_block_slack 32
+
+typedef struct
+{
+    int codec;
+    const unsigned char *mem;
+    unsigned long long remaining;
+    unsigned char *block;
+    unsigned char *stored;
+    size_t block_fill;
+    size_t block_pos;
+}
+part_reader_t;
+
+static part_reader_t seq_reader = { codec_zstd, NULL, 0, NULL, NULL, 0, 0 };
+static part_reader_t qual_reader = { codec_zstd, NULL, 0, NULL, NULL, 0, 0 };
+
+
+__attribute__ ((cold))
+__attribute__ ((noreturn))
+static void corrupted_codec_data(void)
+{
+    die("corrupted input - can't decode codec block\n");
+}
+
+
+static const char* codec_name(int codec)
+{
+    return (codec == codec_store) ? "store" : (codec == codec_lz4) ? "lz4" : (codec == codec_cm) ? "cm" : (codec == codec_fqz) ? "fqz" : "zstd";
+}
+
+
+static inline size_t lz4_read_length(const unsigned char **p, const unsigned char *end, size_t len)
+{
+    unsigned char c;
+    do {
+        if (*p >= end) { corrupted_codec_data(); }
+        c = *(*p)++;
+        len += c;
+    }
+    while (c == 255);
+    return len;
+}
+
+
+/*
+ * Decodes an LZ4 block from "src" into "dst", which must receive exactly "dst_size" bytes.
+ */
+static void lz4_decompress_block(const unsigned char *src, size_t src_size, unsigned char *dst, size_t dst_size)
+{
+    const unsigned char *p = src, *end = src + src_size;
+    unsigned char *out = dst, *out_end = dst + dst_size;
+
+    for (;;)
+    {
+        if (p >= end) { corrupted_codec_data(); }
+        unsigned token = *p++;
+
+        size_t n_literals = token >> 4;
+        if (n_literals == 15) { n_literals = lz4_read_length(&p, end, n_literals); }
+        if (n_literals > (size_t)(end - p) || n_literals > (size_t)(out_end - out)) { corrupted_codec_data(); }
+        if (n_literals <= 16 && end - p >= 16) { memcpy(out, p, 16); }
+        else { memcpy(out, p, n_literals); }
+        out += n_literals;
+        p += n_literals;
+
+        if (p == end) { break; }
+
+        if (end - p < 2) { corrupted_codec_data(); }
+        size_t offset = (size_t)p[0] | ((size_t)p[1] << 8);
+        p += 2;
+        size_t match_len = token & 15;
+        if (match_len == 15) { match_len = lz4_read_length(&p, end, match_len); }
+        match_len += 4;
+
+        if (offset == 0 || offset > (size_t)(out - dst) || match_len > (size_t)(out_end - out)) { corrupted_codec_data(); }
+        const unsigned char *ref = out - offset;
+        unsigned char *match_end = out + match_len;
+        if (offset >= 8)
+        {
+            for (; out < match_end; out += 8, ref += 8) { memcpy(out, ref, 8); }
+        }
+        else
+        {
+            for (; out < match_end; out++, ref++) { *out = *ref; }
+        }
+        out = match_end;
+    }
+
+    if (out != out_end) { corrupted_codec_data(); }
+}
+
+
+/*
+ * Prepares reading a part of "size" bytes, from memory at "mem", or from the input file if "mem" is NULL.
+ */
+static void part_reader_init(part_reader_t *r, int codec, const unsigned char *mem, unsigned long long size)
+{
+    assert(r != NULL);
+    assert(codec != codec_zstd);
+
+    r->codec = codec;
+    r->mem = mem;
+    r->remaining = size;
+    r->block_fill = 0;
+    r->block_pos = 0;
+    if (codec != codec_store && r->block == NULL)
+    {
+        r->block = (unsigned char *) malloc_or_die(codec_block_size + codec_block_slack);
+        r->stored = (unsigned char *) malloc_or_die(codec_block_size);
+    }
+}
+
+
+static void part_reader_free(part_reader_t *r)
+{
+    if (r->block != NULL) { free(r->block); r->block = NULL; }
+    if (r->stored != NULL) { free(r->stored); r->stored = NULL; }
+}
+
+
+/*
+ * Takes the next "size" bytes of the part, either pointing into memory, or reading them into "buffer".
+ */
+static const unsigned char* part_reader_take(part_reader_t *r, unsigned char *buffer, size_t size)
+{
+    if (size > r->remaining) { die("corrupted input - part is shorter than expected\n"); }
+    r->remaining -= size;
+
+    if (r->mem != NULL)
+    {
+        const unsigned char *p = r->mem;
+        r->mem += size;
+        return p;
+    }
+
+    if (fread(buffer, 1, size, IN) != size) { incomplete(); }
+    return buffer;
+}
+
+
+static void part_reader_next_block(part_reader_t *r)
+{
+    unsigned char header_buffer[8];
+    const unsigned char *header = part_reader_take(r, header_buffer, 8);
+
+    size_t size = 0, stored_size = 0;
+    for (unsigned i = 0; i < 4; i++)
+    {
+        size |= (size_t)header[i] << (i * 8);
+        stored_size |= (size_t)header[i + 4] << (i * 8);
+    }
+    if (size == 0 || size > codec_block_size || stored_size > size) { corrupted_codec_data(); }
+
+    if (stored_size == size)
+    {
+        const unsigned char *stored = part_reader_take(r, r->block, size);
+        if (stored != r->block) { memcpy(r->block, stored, size); }
+    }
+    else
+    {
+        const unsigned char *stored = part_reader_take(r, r->stored, stored_size);
+        if (r->codec == codec_cm) { cm_decompress_block(stored, stored_size, r->block, size); }
+        else if (r->codec == codec_fqz) { fqz_decompress_block(stored, stored_size, r->block, size); }
+        else { lz4_decompress_block(stored, stored_size, r->block, size); }
+    }
+
+    r->block_fill = size;
+    r->block_pos = 0;
+}
+
+
+/*
+ * Decodes the next portion of the part into "dest" (of "dest_size" bytes).
+ * Returns the number of bytes placed in "dest", or 0 at the end of the part.
+ */
+static size_t part_reader_read(part_reader_t *r, unsigned char *dest, size_t dest_size)
+{
+    assert(r != NULL);
+    assert(dest != NULL);
+
+    if (r->codec == codec_store)
+    {
+        size_t size = (dest_size < r->remaining) ? dest_size : (size_t)r->remaining;
+        const unsigned char *p = part_reader_take(r, dest, size);
+        if (p != dest) { memcpy(dest, p, size); }
+        return size;
+    }
+
+    if (r->block_pos >= r->block_fill)
+    {
+        if (r->remaining == 0) { return 0; }
+        part_reader_next_block(r);
+    }
+
+    size_t size = r->block_fill - r->block_pos;
+    if (size > dest_size) { size = dest_size; }
+    memcpy(dest, r->block + r->block_pos, size);
+    r->block_pos += size;
+    return size;
+}
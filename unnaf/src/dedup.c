@@ -0,0 +1,181 @@
+/*
+ * NAF decompressor
+ * Copyright (c) 2018-2021 Kirill Kryukov
+ * See README.md and LICENSE files of this repository
+ */
+
+/*
+ * Replays duplicate sequences, removed from the sequence stream by "ennaf --dedup".
+ * The stored sequence is walked record by record, following the lengths.
+ * Records that are referenced by later duplicates are copied aside while passing through,
+ * and each duplicate record is filled from the copy of its first occurrence.
+ * The result is the 4-bit encoded sequence of all records, the same as without deduplication.
+ */
+
+static unsigned long long *replay_sources = NULL;
+static unsigned long long n_replay_sources = 0;
+static unsigned char **replay_copies = NULL;
+static unsigned long long *replay_copy_lengths = NULL;
+
+static unsigned char *replay_stored = NULL;
+static size_t replay_stored_size = 0;
+static unsigned long long replay_stored_n_nucs = 0;
+static unsigned long long replay_stored_pos = 0;
+
+static unsigned long long replay_record = 0;
+static unsigned long long replay_remaining = 0;
+static unsigned long long replay_duplicate_index = 0;
+static unsigned long long replay_source_index = 0;
+static const unsigned char *replay_from = NULL;
+static unsigned char *replay_into = NULL;
+
+
+__attribute__ ((cold))
+__attribute__ ((noreturn))
+static void corrupted_duplicates(void)
+{
+    die("corrupted input - can't replay duplicate sequences\n");
+}
+
+
+static int compare_records(const void *a, const void *b)
+{
+    unsigned long long x = *(const unsigned long long *)a, y = *(const unsigned long long *)b;
+    return (x > y) - (x < y);
+}
+
+
+/*
+ * Prepares the sorted list of records that have to be copied for replaying the duplicates.
+ */
+static void init_replay(void)
+{
+    replay_sources = (unsigned long long *) malloc_or_die(sizeof(unsigned long long) * (n_duplicates + 1));
+    memcpy(replay_sources, duplicate_sources, sizeof(unsigned long long) * n_duplicates);
+    qsort(replay_sources, n_duplicates, sizeof(unsigned long long), compare_records);
+    for (unsigned long long i = 0; i < n_duplicates; i++)
+    {
+        if (i == 0 || replay_sources[i] != replay_sources[n_replay_sources - 1]) { replay_sources[n_replay_sources++] = replay_sources[i]; }
+    }
+
+    replay_copies = (unsigned char **) malloc_or_die(sizeof(unsigned char *) * (n_replay_sources + 1));
+    replay_copy_lengths = (unsigned long long *) malloc_or_die(sizeof(unsigned long long) * (n_replay_sources + 1));
+    for (unsigned long long i = 0; i < n_replay_sources; i++) { replay_copies[i] = NULL; replay_copy_lengths[i] = 0; }
+}
+
+
+static void free_replay(void)
+{
+    if (replay_copies != NULL)
+    {
+        for (unsigned long long i = 0; i < n_replay_sources; i++) { if (replay_copies[i] != NULL) { free(replay_copies[i]); } }
+        free(replay_copies);
+        replay_copies = NULL;
+    }
+    if (replay_copy_lengths != NULL) { free(replay_copy_lengths); replay_copy_lengths = NULL; }
+    if (replay_sources != NULL) { free(replay_sources); replay_sources = NULL; }
+    if (replay_stored != NULL) { free(replay_stored); replay_stored = NULL; }
+    if (duplicate_records != NULL) { free(duplicate_records); duplicate_records = NULL; }
+    if (duplicate_sources != NULL) { free(duplicate_sources); duplicate_sources = NULL; }
+}
+
+
+static unsigned long long find_replay_source(unsigned long long record)
+{
+    unsigned long long a = 0, b = n_replay_sources;
+    while (a < b)
+    {
+        unsigned long long m = a + (b - a) / 2;
+        if (replay_sources[m] < record) { a = m + 1; }
+        else { b = m; }
+    }
+    if (a >= n_replay_sources || replay_sources[a] != record) { corrupted_duplicates(); }
+    return a;
+}
+
+
+/*
+ * Advances to the next non-empty record. Returns false at the end of sequence.
+ */
+static bool replay_next_record(void)
+{
+    while (replay_record < N)
+    {
+        unsigned long long r = replay_record++;
+        unsigned long long len = stored_lengths[r];
+        replay_from = NULL;
+        replay_into = NULL;
+
+        if (replay_duplicate_index < n_duplicates && duplicate_records[replay_duplicate_index] == r)
+        {
+            unsigned long long k = find_replay_source(duplicate_sources[replay_duplicate_index++]);
+            if (replay_copies[k] == NULL || replay_copy_lengths[k] != len) { corrupted_duplicates(); }
+            replay_from = replay_copies[k];
+        }
+        else if (replay_source_index < n_replay_sources && replay_sources[replay_source_index] == r)
+        {
+            replay_copies[replay_source_index] = (unsigned char *) malloc_or_die(len + 1);
+            replay_copy_lengths[replay_source_index] = len;
+            replay_into = replay_copies[replay_source_index];
+            replay_source_index++;
+        }
+
+        if (len > 0) { replay_remaining = len; return true; }
+    }
+    return false;
+}
+
+
+/*
+ * Fills "dest" with the next portion of 4-bit encoded sequence of all records, taking stored sequence from "read_stored".
+ * Returns the number of bytes placed in "dest", or 0 at the end of sequence.
+ */
+static size_t replay_4bit_sequence(unsigned char *dest, size_t dest_size, size_t (*read_stored)(unsigned char *, size_t))
+{
+    assert(stored_lengths != NULL);
+
+    if (replay_stored == NULL)
+    {
+        replay_stored_size = dest_size;
+        replay_stored = (unsigned char *) malloc_or_die(replay_stored_size);
+    }
+
+    unsigned long long n = 0, capacity = (unsigned long long)dest_size * 2;
+    while (n < capacity)
+    {
+        if (replay_remaining == 0 && !replay_next_record()) { break; }
+
+        unsigned long long count = (replay_remaining < capacity - n) ? replay_remaining : capacity - n;
+        if (replay_from != NULL)
+        {
+            for (unsigned long long i = 0; i < count; i++, n++)
+            {
+                if (n & 1ull) { dest[n >> 1] |= (unsigned char)(*replay_from++ << 4); }
+                else { dest[n >> 1] = *replay_from++; }
+            }
+        }
+        else
+        {
+            if (replay_stored_pos >= replay_stored_n_nucs)
+            {
+                size_t size = read_stored(replay_stored, replay_stored_size);
+                if (size == 0) { die("corrupted input - sequence is shorter than the sum of lengths\n"); }
+                replay_stored_n_nucs = (unsigned long long)size * 2;
+                replay_stored_pos = 0;
+            }
+            if (count > replay_stored_n_nucs - replay_stored_pos) { count = replay_stored_n_nucs - replay_stored_pos; }
+
+            for (unsigned long long i = 0; i < count; i++, n++)
+            {
+                unsigned long long q = replay_stored_pos++;
+                unsigned char code = (unsigned char)((replay_stored[q >> 1] >> ((q & 1ull) << 2)) & 15);
+                if (replay_into != NULL) { *replay_into++ = code; }
+                if (n & 1ull) { dest[n >> 1] |= (unsigned char)(code << 4); }
+                else { dest[n >> 1] = code; }
+            }
+        }
+        replay_remaining -= count;
+    }
+
+    return (size_t)((n + 1) >> 1);
+}
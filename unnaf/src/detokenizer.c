@@ -0,0 +1,223 @@
+/*
+ * NAF decompressor
+ * Copyright (c) 2018-2021 Kirill Kryukov
+ * See README.md and LICENSE files of this repository
+ */
+
+/*
+ * Reconstructs sequence ids stored in tokenized encoding ("ennaf --tokenize-ids").
+ * Each block starts with its patterns and column directory, so that the cursors of all columns are known up front.
+ * Then the ids are rebuilt one by one, each taking the next value from every column of its pattern.
+ */
+
+#define id_max_tokens 16
+#define id_max_patterns 16
+#define id_max_enum_values 32
+#define id_raw_pattern 255
+
+enum { id_column_const = 0, id_column_number = 1, id_column_enum = 2, id_column_text = 3 };
+
+typedef struct
+{
+    unsigned type;
+    const unsigned char *p;
+    const unsigned char *end;
+    const unsigned char *prefix;
+    size_t prefix_len;
+    unsigned width;
+    unsigned long long value;
+    unsigned n_values;
+    const unsigned char *values[id_max_enum_values];
+    size_t value_lengths[id_max_enum_values];
+}
+id_column_t;
+
+typedef struct
+{
+    unsigned n_delimiters;
+    unsigned char delimiters[id_max_tokens - 1];
+    id_column_t columns[id_max_tokens];
+}
+id_pattern_t;
+
+
+__attribute__ ((cold))
+__attribute__ ((noreturn))
+static void corrupted_ids(void)
+{
+    die("corrupted input - can't decode tokenized ids\n");
+}
+
+
+static inline unsigned long long read_id_number(const unsigned char **p, const unsigned char *end)
+{
+    unsigned long long a = 0;
+    unsigned char c;
+    do {
+        if (*p >= end || (a & (127ull << 57))) { corrupted_ids(); }
+        c = *(*p)++;
+        a = (a << 7) | (c & 127);
+    }
+    while (c & 128);
+    return a;
+}
+
+
+static inline const unsigned char* read_id_string(const unsigned char **p, const unsigned char *end, size_t *len)
+{
+    const unsigned char *s = *p;
+    const unsigned char *e = memchr(s, 0, (size_t)(end - s));
+    if (e == NULL) { corrupted_ids(); }
+    *len = (size_t)(e - s);
+    *p = e + 1;
+    return s;
+}
+
+
+static void parse_id_column(id_column_t *col, const unsigned char **p, const unsigned char *end)
+{
+    if (*p >= end) { corrupted_ids(); }
+    col->type = *(*p)++;
+    unsigned long long size = read_id_number(p, end);
+    if (size > (unsigned long long)(end - *p)) { corrupted_ids(); }
+    col->p = *p;
+    col->end = *p + size;
+    *p += size;
+
+    if (col->type == id_column_const)
+    {
+        col->values[0] = read_id_string(&col->p, col->end, &col->value_lengths[0]);
+    }
+    else if (col->type == id_column_number)
+    {
+        col->prefix = read_id_string(&col->p, col->end, &col->prefix_len);
+        unsigned long long width = read_id_number(&col->p, col->end);
+        if (width > 20) { corrupted_ids(); }
+        col->width = (unsigned)width;
+        col->value = 0;
+    }
+    else if (col->type == id_column_enum)
+    {
+        unsigned long long n = read_id_number(&col->p, col->end);
+        if (n == 0 || n > id_max_enum_values) { corrupted_ids(); }
+        col->n_values = (unsigned)n;
+        for (unsigned v = 0; v < col->n_values; v++) { col->values[v] = read_id_string(&col->p, col->end, &col->value_lengths[v]); }
+    }
+    else if (col->type != id_column_text) { corrupted_ids(); }
+}
+
+
+static inline char* put_id_bytes(char *out, const char *out_end, const unsigned char *s, size_t len)
+{
+    if ((size_t)(out_end - out) < len) { corrupted_ids(); }
+    memcpy(out, s, len);
+    return out + len;
+}
+
+
+static inline char* put_id_token(char *out, const char *out_end, id_column_t *col)
+{
+    size_t len;
+    const unsigned char *s;
+
+    switch (col->type)
+    {
+        case id_column_const:
+            return put_id_bytes(out, out_end, col->values[0], col->value_lengths[0]);
+
+        case id_column_number:
+        {
+            unsigned long long zz = read_id_number(&col->p, col->end);
+            col->value += (zz >> 1) ^ (0ull - (zz & 1ull));
+
+            char digits[24];
+            char *d = digits + sizeof(digits);
+            unsigned long long a = col->value;
+            do { *--d = (char)('0' + a % 10); a /= 10; } while (a > 0);
+            while ((unsigned)(digits + sizeof(digits) - d) < col->width) { *--d = '0'; }
+
+            out = put_id_bytes(out, out_end, col->prefix, col->prefix_len);
+            return put_id_bytes(out, out_end, (const unsigned char *)d, (size_t)(digits + sizeof(digits) - d));
+        }
+
+        case id_column_enum:
+            if (col->p >= col->end || *col->p >= col->n_values) { corrupted_ids(); }
+            { unsigned v = *col->p++; return put_id_bytes(out, out_end, col->values[v], col->value_lengths[v]); }
+
+        default:
+            s = read_id_string(&col->p, col->end, &len);
+            return put_id_bytes(out, out_end, s, len);
+    }
+}
+
+
+/*
+ * Decodes tokenized ids from "src" into "dst", which must have exactly "dst_size" bytes of 0-terminated ids.
+ */
+static void detokenize_ids(char *dst, size_t dst_size, const unsigned char *src, size_t src_size)
+{
+    static id_pattern_t patterns[id_max_patterns];
+
+    const unsigned char *p = src, *end = src + src_size;
+    char *out = dst, *out_end = dst + dst_size;
+
+    while (p < end)
+    {
+        unsigned long long n_names = read_id_number(&p, end);
+        unsigned long long n_patterns = read_id_number(&p, end);
+        if (n_patterns > id_max_patterns) { corrupted_ids(); }
+
+        for (unsigned k = 0; k < n_patterns; k++)
+        {
+            unsigned long long n_delimiters = read_id_number(&p, end);
+            if (n_delimiters >= id_max_tokens || n_delimiters > (unsigned long long)(end - p)) { corrupted_ids(); }
+            patterns[k].n_delimiters = (unsigned)n_delimiters;
+            memcpy(patterns[k].delimiters, p, n_delimiters);
+            p += n_delimiters;
+        }
+
+        if (p >= end) { corrupted_ids(); }
+        const unsigned char *name_patterns = NULL;
+        if (*p++)
+        {
+            if (n_names > (unsigned long long)(end - p)) { corrupted_ids(); }
+            name_patterns = p;
+            p += n_names;
+        }
+        else if (n_patterns != 1) { corrupted_ids(); }
+
+        for (unsigned k = 0; k < n_patterns; k++)
+        {
+            for (unsigned t = 0; t <= patterns[k].n_delimiters; t++) { parse_id_column(&patterns[k].columns[t], &p, end); }
+        }
+
+        id_column_t raw;
+        raw.type = id_column_text;
+        unsigned long long raw_size = read_id_number(&p, end);
+        if (raw_size > (unsigned long long)(end - p)) { corrupted_ids(); }
+        raw.p = p;
+        raw.end = p + raw_size;
+        p += raw_size;
+
+        for (unsigned long long i = 0; i < n_names; i++)
+        {
+            unsigned k = name_patterns ? name_patterns[i] : 0;
+            if (k == id_raw_pattern) { out = put_id_token(out, out_end, &raw); }
+            else
+            {
+                if (k >= n_patterns) { corrupted_ids(); }
+                id_pattern_t *pattern = &patterns[k];
+                for (unsigned t = 0; t < pattern->n_delimiters; t++)
+                {
+                    out = put_id_token(out, out_end, &pattern->columns[t]);
+                    out = put_id_bytes(out, out_end, &pattern->delimiters[t], 1);
+                }
+                out = put_id_token(out, out_end, &pattern->columns[pattern->n_delimiters]);
+            }
+            if (out >= out_end) { corrupted_ids(); }
+            *out++ = 0;
+        }
+    }
+
+    if (out != out_end) { corrupted_ids(); }
+}
@@ -0,0 +1,182 @@
+/*
+ * NAF decompressor
+ * Copyright (c) 2018-2021 Kirill Kryukov
+ * See README.md and LICENSE files of this repository
+ */
+
+/*
+ * Decoder for quality codec ("ennaf --qual-codec fqz"), modeled after fqzcomp.
+ * Each quality value is coded with an adaptive frequency model, selected by the context of:
+ * two previous qualities of the same read, position in the read, and the amount of change in the read so far.
+ * Qualities are mapped to symbols 0..n-1 by sorted order, where n is the number of distinct values in the block.
+ * Frequencies are kept as cumulative tables summing to 2^15, adapting towards each coded symbol,
+ * quickly at first and then slower, as the context sees more data.
+ * Symbols are coded with two interleaved rANS states, to let the decoder overlap work on consecutive symbols.
+ * Read boundaries come from the read lengths, so the lengths must be loaded before decoding qualities.
+ * The model starts from scratch in each block, so blocks can be decoded independently.
+ * Stored block: number of symbols minus 1 (1 byte), the symbols (1 byte each), rANS states (2 x 4 bytes), rANS data.
+ * This model must be exactly the same as in ennaf.
+ */
+
+#define fqz_scale_bits 15
+#define fqz_total (1 << fqz_scale_bits)
+#define fqz_rans_low (1u << 23)
+#define fqz_n_positions 12
+#define fqz_n_deltas 4
+#define fqz_max_q2 16
+#define fqz_min_rate 3
+#define fqz_max_rate 7
+#define fqz_rate_step 8
+
+static const unsigned char fqz_delta_bucket[16] = { 0, 1, 1, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3 };
+
+static unsigned fqz_n = 0;
+static unsigned fqz_n_q2 = 0;
+static unsigned short *fqz_cdfs = NULL;
+static unsigned char *fqz_counts = NULL;
+static size_t fqz_allocated_contexts = 0;
+static size_t fqz_allocated_cdfs = 0;
+
+static unsigned fqz_q1 = 0, fqz_q2 = 0, fqz_delta = 0;
+static unsigned long long fqz_pos = 0;
+
+static unsigned long long fqz_read_index = 0;
+
+
+static void fqz_free(void)
+{
+    if (fqz_cdfs != NULL) { free(fqz_cdfs); fqz_cdfs = NULL; }
+    if (fqz_counts != NULL) { free(fqz_counts); fqz_counts = NULL; }
+}
+
+
+static void fqz_reset(unsigned n)
+{
+    fqz_n = n;
+    fqz_n_q2 = (n < fqz_max_q2) ? n : fqz_max_q2;
+
+    size_t n_contexts = (size_t)n * fqz_n_q2 * fqz_n_positions * fqz_n_deltas;
+    if (n_contexts > fqz_allocated_contexts)
+    {
+        if (fqz_counts != NULL) { free(fqz_counts); }
+        fqz_counts = (unsigned char *) malloc_or_die(n_contexts);
+        fqz_allocated_contexts = n_contexts;
+    }
+    if (n_contexts * (n + 1) > fqz_allocated_cdfs)
+    {
+        if (fqz_cdfs != NULL) { free(fqz_cdfs); }
+        fqz_cdfs = (unsigned short *) malloc_or_die(sizeof(unsigned short) * n_contexts * (n + 1));
+        fqz_allocated_cdfs = n_contexts * (n + 1);
+    }
+
+    for (unsigned i = 0; i <= n; i++) { fqz_cdfs[i] = (unsigned short)(i * fqz_total / n); }
+    for (size_t c = 1; c < n_contexts; c++) { memcpy(fqz_cdfs + c * (n + 1), fqz_cdfs, sizeof(unsigned short) * (n + 1)); }
+    memset(fqz_counts, 0, n_contexts);
+}
+
+
+static inline void fqz_start_read(void)
+{
+    fqz_q1 = 0;
+    fqz_q2 = 0;
+    fqz_delta = 0;
+    fqz_pos = 0;
+}
+
+
+static inline size_t fqz_context(void)
+{
+    unsigned q2 = (fqz_n_q2 == fqz_n) ? fqz_q2 : fqz_q2 * fqz_n_q2 / fqz_n;
+    unsigned pos = (fqz_pos < 160) ? (unsigned)(fqz_pos >> 4) : (fqz_pos < 512) ? 10 : 11;
+    unsigned delta = fqz_delta_bucket[(fqz_delta < 15) ? fqz_delta : 15];
+    return (((size_t)fqz_q1 * fqz_n_q2 + q2) * fqz_n_positions + pos) * fqz_n_deltas + delta;
+}
+
+
+/*
+ * Moves the cumulative table towards the one where every symbol other than "s" has frequency 1.
+ * Frequencies never drop below 1 with this rounding.
+ */
+static inline void fqz_update(size_t context, unsigned short *cdf, unsigned s)
+{
+    unsigned count = fqz_counts[context];
+    unsigned rate = fqz_min_rate + count / fqz_rate_step;
+    if (rate >= fqz_max_rate) { rate = fqz_max_rate; }
+    else { fqz_counts[context] = (unsigned char)(count + 1); }
+
+    int n = (int)fqz_n;
+    for (int i = 1; i <= (int)s; i++) { int v = cdf[i]; cdf[i] = (unsigned short)(v + ((i - v) >> rate)); }
+    for (int i = (int)s + 1; i < n; i++) { int v = cdf[i]; cdf[i] = (unsigned short)(v + ((fqz_total - (n - i) - v) >> rate)); }
+}
+
+
+static inline void fqz_advance(unsigned s)
+{
+    if (fqz_pos != 0) { fqz_delta += (s > fqz_q1) ? s - fqz_q1 : fqz_q1 - s; }
+    fqz_q2 = fqz_q1;
+    fqz_q1 = s;
+    fqz_pos++;
+}
+
+
+__attribute__ ((cold))
+__attribute__ ((noreturn))
+static void corrupted_fqz_data(void)
+{
+    die("corrupted input - can't decode quality block\n");
+}
+
+
+static inline unsigned char fqz_read_byte(const unsigned char **p, const unsigned char *end)
+{
+    if (*p >= end) { corrupted_fqz_data(); }
+    return *(*p)++;
+}
+
+
+/*
+ * Decodes a block from "src" into "dst", which receives exactly "dst_size" bytes.
+ */
+static void fqz_decompress_block(const unsigned char *src, size_t src_size, unsigned char *dst, size_t dst_size)
+{
+    assert(stored_lengths != NULL);
+
+    const unsigned char *p = src, *end = src + src_size;
+    unsigned n = (unsigned)fqz_read_byte(&p, end) + 1u;
+    if ((size_t)(end - p) < n + 8) { corrupted_fqz_data(); }
+    const unsigned char *symbols = p;
+    p += n;
+
+    unsigned x[2] = { 0, 0 };
+    for (int k = 0; k < 2; k++)
+    {
+        for (int b = 0; b < 4; b++) { x[k] |= (unsigned)(*p++) << (b * 8); }
+    }
+
+    fqz_reset(n);
+    unsigned long long pos = fqz_pos;
+    fqz_start_read();
+    fqz_pos = pos;
+
+    for (size_t i = 0; i < dst_size; i++)
+    {
+        while (fqz_read_index < N && fqz_pos == stored_lengths[fqz_read_index])
+        {
+            fqz_read_index++;
+            fqz_start_read();
+        }
+
+        size_t context = fqz_context();
+        unsigned short *cdf = fqz_cdfs + context * (n + 1);
+        unsigned *xs = &x[i & 1];
+        unsigned slot = *xs & (fqz_total - 1);
+        unsigned s = 0;
+        for (unsigned k = 1; k < n; k++) { s += (cdf[k] <= slot); }
+        *xs = (unsigned)(cdf[s + 1] - cdf[s]) * (*xs >> fqz_scale_bits) + slot - cdf[s];
+        while (*xs < fqz_rans_low) { *xs = (*xs << 8) | fqz_read_byte(&p, end); }
+
+        dst[i] = symbols[s];
+        fqz_update(context, cdf, s);
+        fqz_advance(s);
+    }
+}
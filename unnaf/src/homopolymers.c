@@ -0,0 +1,165 @@
+/*
+ * NAF decompressor
+ * Copyright (c) 2018-2021 Kirill Kryukov
+ * See README.md and LICENSE files of this repository
+ */
+
+/*
+ * Expands homopolymer runs, collapsed by "ennaf --hpc".
+ * Stored sequence has a single nucleotide for each run, and the runs stream has the length of each run:
+ * as many bytes 255 as needed, followed by the remainder (L - 1) % 255.
+ * Runs stream is kept compressed in memory, and is decompressed along with the sequence.
+ */
+
+static bool has_hpc = false;
+static unsigned long long hpc_n_stored = 0;
+
+static unsigned char *hpc_compressed_runs = NULL;
+static ZSTD_DStream *hpc_runs_stream = NULL;
+static ZSTD_inBuffer hpc_runs_in;
+static unsigned char *hpc_runs = NULL;
+static size_t hpc_runs_size = 0;
+static size_t hpc_runs_pos = 0;
+static size_t hpc_runs_end = 0;
+
+static unsigned char *hpc_codes = NULL;
+static unsigned char *hpc_stage = NULL;
+static size_t hpc_stage_size = 0;
+static unsigned long long hpc_stage_pos = 0;
+static unsigned long long hpc_stage_end = 0;
+static unsigned long long hpc_n_stored_done = 0;
+
+static unsigned char hpc_run_code = 0;
+static unsigned long long hpc_run_remaining = 0;
+
+
+__attribute__ ((cold))
+__attribute__ ((noreturn))
+static void corrupted_hpc_runs(void)
+{
+    die("corrupted input - can't expand homopolymer runs\n");
+}
+
+
+/*
+ * Prepares decompression of the runs stream, whose compressed data (without the zstd magic number) is at "data".
+ */
+static void init_hpc(const unsigned char *data, unsigned long long size)
+{
+    hpc_compressed_runs = (unsigned char *) malloc_or_die(size + 4);
+    put_magic_number(hpc_compressed_runs);
+    memcpy(hpc_compressed_runs + 4, data, size);
+
+    hpc_runs_stream = ZSTD_createDStream();
+    if (!hpc_runs_stream) { die("can't create homopolymer runs decompression stream\n"); }
+    size_t r = ZSTD_initDStream(hpc_runs_stream);
+    if (ZSTD_isError(r)) { die("can't initialize homopolymer runs decompression stream: %s\n", ZSTD_getErrorName(r)); }
+
+    hpc_runs_in.src = hpc_compressed_runs;
+    hpc_runs_in.size = (size_t)size + 4;
+    hpc_runs_in.pos = 0;
+
+    hpc_runs_size = ZSTD_DStreamOutSize();
+    hpc_runs = (unsigned char *) malloc_or_die(hpc_runs_size);
+    hpc_stage_size = ZSTD_DStreamOutSize();
+    hpc_stage = (unsigned char *) malloc_or_die(hpc_stage_size);
+    hpc_codes = (unsigned char *) malloc_or_die(hpc_stage_size * 2 + 8);
+
+    has_hpc = true;
+}
+
+
+static void free_hpc(void)
+{
+    if (hpc_runs_stream != NULL) { ZSTD_freeDStream(hpc_runs_stream); hpc_runs_stream = NULL; }
+    if (hpc_compressed_runs != NULL) { free(hpc_compressed_runs); hpc_compressed_runs = NULL; }
+    if (hpc_runs != NULL) { free(hpc_runs); hpc_runs = NULL; }
+    if (hpc_stage != NULL) { free(hpc_stage); hpc_stage = NULL; }
+    if (hpc_codes != NULL) { free(hpc_codes); hpc_codes = NULL; }
+}
+
+
+__attribute__ ((noinline))
+static unsigned char next_hpc_runs_byte(void)
+{
+    while (hpc_runs_pos >= hpc_runs_end)
+    {
+        ZSTD_outBuffer out = { hpc_runs, hpc_runs_size, 0 };
+        size_t r = ZSTD_decompressStream(hpc_runs_stream, &out, &hpc_runs_in);
+        if (ZSTD_isError(r)) { die("can't decompress homopolymer runs: %s\n", ZSTD_getErrorName(r)); }
+        if (out.pos == 0 && hpc_runs_in.pos >= hpc_runs_in.size) { corrupted_hpc_runs(); }
+        hpc_runs_pos = 0;
+        hpc_runs_end = out.pos;
+    }
+    return hpc_runs[hpc_runs_pos++];
+}
+
+
+static inline unsigned long long next_hpc_run_length(void)
+{
+    if (hpc_runs_pos < hpc_runs_end && hpc_runs[hpc_runs_pos] != 255) { return 1ull + hpc_runs[hpc_runs_pos++]; }
+
+    unsigned long long len = 1;
+    unsigned char b;
+    do { b = next_hpc_runs_byte(); len += b; } while (b == 255);
+    return len;
+}
+
+
+/*
+ * Starts the next run: takes the next stored nucleotide, and its run length.
+ * Returns false at the end of sequence.
+ */
+static bool next_hpc_run(size_t (*read)(unsigned char *, size_t))
+{
+    while (hpc_stage_pos >= hpc_stage_end)
+    {
+        size_t size = read(hpc_stage, hpc_stage_size);
+        if (size == 0) { return false; }
+        unsigned long long n_codes = (unsigned long long)size * 2;
+        if (n_codes > hpc_n_stored - hpc_n_stored_done) { n_codes = hpc_n_stored - hpc_n_stored_done; }
+        hpc_n_stored_done += n_codes;
+        hpc_stage_pos = 0;
+        hpc_stage_end = n_codes;
+    }
+
+    hpc_run_code = (hpc_stage[hpc_stage_pos >> 1] >> ((hpc_stage_pos & 1) << 2)) & 15;
+    hpc_stage_pos++;
+    hpc_run_remaining = next_hpc_run_length();
+    return true;
+}
+
+
+/*
+ * Reads the next portion of sequence into "dest" (of "dest_size" bytes), as 4-bit encoded data, with runs expanded.
+ * "read" reads the stored 4-bit encoded sequence, and must accept at least ZSTD_DStreamOutSize() bytes.
+ * Runs are expanded one nucleotide code per byte, then packed into 4 bits.
+ * Short runs are written as 8 bytes at once, since the codes buffer has room beyond its end.
+ * Returns the number of bytes placed in "dest", or 0 at the end of sequence.
+ */
+static size_t hpc_expand(unsigned char *dest, size_t dest_size, size_t (*read)(unsigned char *, size_t))
+{
+    assert(dest_size <= hpc_stage_size);
+
+    unsigned char *codes = hpc_codes;
+    size_t n = 0, max = dest_size * 2;
+
+    while (n < max)
+    {
+        if (hpc_run_remaining == 0 && !next_hpc_run(read)) { break; }
+
+        size_t k = (hpc_run_remaining < max - n) ? (size_t)hpc_run_remaining : max - n;
+        if (k <= 8)
+        {
+            unsigned long long pattern = hpc_run_code * 0x0101010101010101ull;
+            memcpy(codes + n, &pattern, 8);
+        }
+        else { memset(codes + n, hpc_run_code, k); }
+        n += k;
+        hpc_run_remaining -= k;
+    }
+
+    for (size_t i = 0; i < n / 2; i++) { dest[i] = (unsigned char)(codes[i * 2] | (codes[i * 2 + 1] << 4)); }
+    if (n & 1) { dest[n / 2] = codes[n - 1]; }
+    return (n + 1) / 2;
+}
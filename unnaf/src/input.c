@@ -64,6 +64,7 @@ static void read_header(void)
 
     unsigned char flags = fgetc_or_incomplete(IN);
 
+    has_extended_format = (flags >> 7) & 1;
     has_title   = (flags >> 6) & 1;
     has_ids     = (flags >> 5) & 1;
     has_names   = (flags >> 4) & 1;
@@ -77,6 +78,427 @@ static void read_header(void)
 }
 
 
+/*
+ * Reads a number in variable length encoding from memory, advancing "*p".
+ */
+static unsigned long long read_number_from_memory(const unsigned char **p, const unsigned char *end)
+{
+    unsigned long long a = 0;
+    unsigned char c;
+
+    do {
+        if (*p >= end) { die("invalid input: truncated variable length encoded number\n"); }
+        if (a & (127ull << 57)) { die("invalid input: overflow reading a variable length encoded number\n"); }
+        c = **p;
+        (*p)++;
+        a = (a << 7) | (c & 127);
+    }
+    while (c & 128);
+
+    return a;
+}
+
+
+static void parse_stats_extension(const unsigned char *data, unsigned long long size)
+{
+    const unsigned char *p = data, *end = data + size;
+
+    stats_total_length = read_number_from_memory(&p, end);
+    stats_min_length = read_number_from_memory(&p, end);
+    stats_max_length = read_number_from_memory(&p, end);
+    stats_n50 = read_number_from_memory(&p, end);
+    stats_masked_length = read_number_from_memory(&p, end);
+
+    unsigned long long n_chars = read_number_from_memory(&p, end);
+    if (n_chars > 256) { die("corrupted statistics record\n"); }
+    memset(stats_char_counts, 0, sizeof(stats_char_counts));
+    for (unsigned long long i = 0; i < n_chars; i++)
+    {
+        if (p >= end) { die("corrupted statistics record\n"); }
+        unsigned char c = *p++;
+        stats_char_counts[c] = read_number_from_memory(&p, end);
+    }
+
+    if (p != end) { die("corrupted statistics record\n"); }
+    has_stats = true;
+}
+
+
+static void parse_seq_encoding_extension(const unsigned char *data, unsigned long long size)
+{
+    const unsigned char *p = data, *end = data + size;
+
+    unsigned long long encoding = read_number_from_memory(&p, end);
+    if (encoding != seq_encoding_2bit) { die("unsupported sequence encoding %llu - input was created by a newer version of ennaf?\n", encoding); }
+    if (in_seq_type >= seq_type_protein) { die("corrupted input - 2-bit encoding of %s sequences\n", in_seq_type_name); }
+
+    exceptions_size = read_number_from_memory(&p, end);
+    unsigned long long compressed_exceptions_size = read_number_from_memory(&p, end);
+    if (compressed_exceptions_size != (unsigned long long)(end - p)) { die("corrupted sequence encoding record\n"); }
+
+    unsigned char *compressed_exceptions = (unsigned char *) malloc_or_die(compressed_exceptions_size + 4);
+    put_magic_number(compressed_exceptions);
+    memcpy(compressed_exceptions + 4, p, compressed_exceptions_size);
+
+    exceptions_buffer = (unsigned char *) malloc_or_die(exceptions_size + 1);
+    size_t n_dec_bytes = ZSTD_decompress(exceptions_buffer, exceptions_size, compressed_exceptions, compressed_exceptions_size + 4);
+    if (n_dec_bytes != exceptions_size) { die("can't decompress sequence exceptions\n"); }
+    free(compressed_exceptions);
+
+    has_2bit_seq = true;
+}
+
+
+/*
+ * Dictionary record: dictionary id, then size of embedded dictionary, followed by the dictionary itself, compressed with zstd.
+ * Embedded size of 0 means that the dictionary was provided to ennaf as file, and has to be provided again.
+ */
+static void parse_dictionary_extension(const unsigned char *data, unsigned long long size)
+{
+    const unsigned char *p = data, *end = data + size;
+
+    unsigned long long dict_id = read_number_from_memory(&p, end);
+    unsigned long long embedded_size = read_number_from_memory(&p, end);
+    if (embedded_size != (unsigned long long)(end - p)) { die("corrupted dictionary record\n"); }
+
+    if (embedded_size > 0)
+    {
+        unsigned long long dict_size = ZSTD_getFrameContentSize(p, embedded_size);
+        if (dict_size == ZSTD_CONTENTSIZE_ERROR || dict_size == ZSTD_CONTENTSIZE_UNKNOWN || dict_size == 0 || dict_size > max_dict_size)
+        {
+            die("corrupted dictionary record\n");
+        }
+
+        unsigned char *dict = (unsigned char *) malloc_or_die((size_t)dict_size);
+        size_t unpacked_size = ZSTD_decompress(dict, (size_t)dict_size, p, embedded_size);
+        if (ZSTD_isError(unpacked_size) || unpacked_size != dict_size) { die("can't decompress dictionary\n"); }
+        if (ZSTD_getDictID_fromDict(dict, (size_t)dict_size) != dict_id) { die("corrupted dictionary record\n"); }
+
+        names_ddict = ZSTD_createDDict(dict, (size_t)dict_size);
+        free(dict);
+    }
+    else
+    {
+        if (dict_file_path == NULL) { die("input was compressed with external dictionary (id %llu), please specify it with --dict\n", dict_id); }
+
+        FILE *F = fopen(dict_file_path, "rb");
+        if (F == NULL) { die("can't open dictionary file \"%s\"\n", dict_file_path); }
+        if (fseek(F, 0, SEEK_END) != 0) { die("can't read dictionary file \"%s\"\n", dict_file_path); }
+        long dict_size = ftell(F);
+        if (dict_size <= 0) { die("empty or unreadable dictionary file \"%s\"\n", dict_file_path); }
+        if (fseek(F, 0, SEEK_SET) != 0) { die("can't read dictionary file \"%s\"\n", dict_file_path); }
+
+        unsigned char *dict = (unsigned char *) malloc_or_die((size_t)dict_size);
+        if (fread(dict, 1, (size_t)dict_size, F) != (size_t)dict_size) { die("can't read dictionary file \"%s\"\n", dict_file_path); }
+        fclose_or_die(F);
+
+        unsigned file_dict_id = ZSTD_getDictID_fromDict(dict, (size_t)dict_size);
+        if (file_dict_id != dict_id) { die("dictionary \"%s\" has id %u, but input needs dictionary with id %llu\n", dict_file_path, file_dict_id, dict_id); }
+
+        names_ddict = ZSTD_createDDict(dict, (size_t)dict_size);
+        free(dict);
+    }
+
+    if (names_ddict == NULL) { die("can't create decompression dictionary\n"); }
+}
+
+
+static void parse_id_encoding_extension(const unsigned char *data, unsigned long long size)
+{
+    const unsigned char *p = data, *end = data + size;
+
+    unsigned long long encoding = read_number_from_memory(&p, end);
+    if (encoding != id_encoding_tokens) { die("unsupported id encoding %llu - input was created by a newer version of ennaf?\n", encoding); }
+    ids_size_original = read_number_from_memory(&p, end);
+    if (p != end) { die("corrupted id encoding record\n"); }
+
+    has_tokenized_ids = true;
+}
+
+
+static void parse_lengths_encoding_extension(const unsigned char *data, unsigned long long size)
+{
+    const unsigned char *p = data, *end = data + size;
+
+    lengths_encoding = read_number_from_memory(&p, end);
+    if (lengths_encoding == lengths_encoding_constant) { constant_length = read_number_from_memory(&p, end); }
+    else if (lengths_encoding != lengths_encoding_numbers) { die("unsupported lengths encoding %llu - input was created by a newer version of ennaf?\n", lengths_encoding); }
+    if (p != end) { die("corrupted lengths encoding record\n"); }
+}
+
+
+static void parse_mask_encoding_extension(const unsigned char *data, unsigned long long size)
+{
+    const unsigned char *p = data, *end = data + size;
+
+    mask_encoding = read_number_from_memory(&p, end);
+    if (mask_encoding != mask_encoding_numbers) { die("unsupported mask encoding %llu - input was created by a newer version of ennaf?\n", mask_encoding); }
+    if (p != end) { die("corrupted mask encoding record\n"); }
+}
+
+
+/*
+ * Duplicates record: number of duplicates, their total length, size of the list, and the list compressed by zstd.
+ * The list has a pair of numbers for each duplicate: its distance from the previous duplicate (or from 0 for the first one),
+ * and its distance back to the first occurrence of the same sequence.
+ */
+static void parse_dedup_extension(const unsigned char *data, unsigned long long size)
+{
+    const unsigned char *p = data, *end = data + size;
+
+    if (in_seq_type >= seq_type_protein) { die("corrupted input - deduplicated %s sequences\n", in_seq_type_name); }
+
+    n_duplicates = read_number_from_memory(&p, end);
+    deduplicated_seq_length = read_number_from_memory(&p, end);
+    unsigned long long list_size = read_number_from_memory(&p, end);
+    unsigned long long compressed_list_size = (unsigned long long)(end - p);
+    if (n_duplicates > N || list_size < n_duplicates * 2) { die("corrupted duplicates record\n"); }
+
+    unsigned char *compressed_list = (unsigned char *) malloc_or_die(compressed_list_size + 4);
+    put_magic_number(compressed_list);
+    memcpy(compressed_list + 4, p, compressed_list_size);
+
+    unsigned char *list = (unsigned char *) malloc_or_die(list_size + 1);
+    size_t n_dec_bytes = ZSTD_decompress(list, list_size, compressed_list, compressed_list_size + 4);
+    if (n_dec_bytes != list_size) { die("can't decompress list of duplicates\n"); }
+    free(compressed_list);
+
+    duplicate_records = (unsigned long long *) malloc_or_die(sizeof(unsigned long long) * (n_duplicates + 1));
+    duplicate_sources = (unsigned long long *) malloc_or_die(sizeof(unsigned long long) * (n_duplicates + 1));
+
+    const unsigned char *q = list, *list_end = list + list_size;
+    unsigned long long record = 0;
+    for (unsigned long long i = 0; i < n_duplicates; i++)
+    {
+        unsigned long long gap = read_number_from_memory(&q, list_end);
+        unsigned long long distance = read_number_from_memory(&q, list_end);
+        if (gap == 0 || gap >= N - record || distance == 0 || distance > record + gap) { die("corrupted list of duplicates\n"); }
+        record += gap;
+        duplicate_records[i] = record;
+        duplicate_sources[i] = record - distance;
+    }
+    if (q != list_end) { die("corrupted list of duplicates\n"); }
+    free(list);
+
+    init_replay();
+    has_duplicates = true;
+}
+
+
+/*
+ * Codecs record: number of entries, and for each part not compressed with zstd: its bit in the flags byte, and codec id.
+ */
+static void parse_codecs_extension(const unsigned char *data, unsigned long long size)
+{
+    const unsigned char *p = data, *end = data + size;
+
+    unsigned long long n = read_number_from_memory(&p, end);
+    for (unsigned long long i = 0; i < n; i++)
+    {
+        unsigned long long part = read_number_from_memory(&p, end);
+        unsigned long long codec = read_number_from_memory(&p, end);
+        if (codec > codec_fqz) { die("unsupported codec %llu\n", codec); }
+        if ((codec == codec_cm && part != 0x02) || (codec == codec_fqz && part != 0x01)) { die("unsupported codec %llu for part %llu\n", codec, part); }
+        if (part == 0x02) { seq_codec = (int)codec; }
+        else if (part == 0x01) { qual_codec = (int)codec; }
+        else { die("unsupported codec for part %llu\n", part); }
+        if (verbose) { msg("%s codec: %s\n", (part == 0x02) ? "Sequence" : "Quality", codec_name((int)codec)); }
+    }
+}
+
+
+/*
+ * Quality binning record: scheme, number of bins, and for each bin: low score, high score, value.
+ */
+static void parse_quality_binning_extension(const unsigned char *data, unsigned long long size)
+{
+    const unsigned char *p = data, *end = data + size;
+
+    unsigned long long scheme = read_number_from_memory(&p, end);
+    if (scheme != qual_binning_illumina8 && scheme != qual_binning_custom) { die("unsupported quality binning scheme %llu\n", scheme); }
+    qual_binning = (int)scheme;
+
+    qual_n_bins = read_number_from_memory(&p, end);
+    if (qual_n_bins > max_quality_bins) { die("corrupted quality binning record\n"); }
+    for (unsigned long long i = 0; i < qual_n_bins; i++)
+    {
+        for (unsigned k = 0; k < 3; k++) { qual_bins[i][k] = read_number_from_memory(&p, end); }
+    }
+}
+
+
+/*
+ * Parses layout record: layout (1 = transposed), maximum block size.
+ */
+static void parse_layout_extension(untransposer_t *u, const unsigned char *data, unsigned long long size, const char *part_name)
+{
+    const unsigned char *p = data, *end = data + size;
+
+    unsigned long long layout = read_number_from_memory(&p, end);
+    if (layout != layout_transposed) { die("unsupported %s layout %llu\n", part_name, layout); }
+    u->layout = layout_transposed;
+
+    u->max_block_size = read_number_from_memory(&p, end);
+    if (u->max_block_size == 0 || u->max_block_size > max_transpose_block_size) { die("corrupted %s layout record\n", part_name); }
+}
+
+
+/*
+ * Homopolymers record: number of stored nucleotides, then the compressed runs stream,
+ * stored as its original size, compressed size, and compressed data.
+ */
+static void parse_hpc_extension(const unsigned char *data, unsigned long long size)
+{
+    const unsigned char *p = data, *end = data + size;
+
+    if (in_seq_type >= seq_type_protein) { die("corrupted input - homopolymer compression of %s sequences\n", in_seq_type_name); }
+    if (has_duplicates || seq_untransposer.layout == layout_transposed) { die("corrupted input - homopolymer compression with duplicates or transposed sequence\n"); }
+
+    hpc_n_stored = read_number_from_memory(&p, end);
+    read_number_from_memory(&p, end);
+    unsigned long long compressed_runs_size = read_number_from_memory(&p, end);
+    if (compressed_runs_size != (unsigned long long)(end - p)) { die("corrupted homopolymers record\n"); }
+
+    init_hpc(p, compressed_runs_size);
+}
+
+
+/*
+ * Reference record: reference fingerprint, reference sequence length, and prefix layout (1 = with shifted copy).
+ */
+static void parse_reference_extension(const unsigned char *data, unsigned long long size)
+{
+    const unsigned char *p = data, *end = data + size;
+
+    if (in_seq_type >= seq_type_protein) { die("corrupted input - reference for %s sequences\n", in_seq_type_name); }
+
+    ref_expected_fingerprint = read_number_from_memory(&p, end);
+    ref_expected_length = read_number_from_memory(&p, end);
+    unsigned long long layout = read_number_from_memory(&p, end);
+    if (ref_expected_length == 0 || layout > 1 || p != end) { die("corrupted reference record\n"); }
+    ref_has_shifted_copy = (layout == 1);
+    has_reference = true;
+}
+
+
+/*
+ * Order record: size of the list, and the list compressed by zstd.
+ * The list has the original number of each stored record, as a zigzag encoded difference from the previous one plus one.
+ */
+static void parse_order_extension(const unsigned char *data, unsigned long long size)
+{
+    if (keep_stored_order) { return; }
+
+    const unsigned char *p = data, *end = data + size;
+
+    if (in_seq_type >= seq_type_protein) { die("corrupted input - reordered %s sequences\n", in_seq_type_name); }
+    if (!has_lengths) { die("corrupted input - reordered sequences without lengths\n"); }
+
+    unsigned long long list_size = read_number_from_memory(&p, end);
+    unsigned long long compressed_list_size = (unsigned long long)(end - p);
+    if (list_size < N || list_size > N * 10) { die("corrupted order record\n"); }
+
+    unsigned char *compressed_list = (unsigned char *) malloc_or_die(compressed_list_size + 4);
+    put_magic_number(compressed_list);
+    memcpy(compressed_list + 4, p, compressed_list_size);
+
+    unsigned char *list = (unsigned char *) malloc_or_die(list_size + 1);
+    size_t n_dec_bytes = ZSTD_decompress(list, list_size, compressed_list, compressed_list_size + 4);
+    if (n_dec_bytes != list_size) { die("can't decompress list of record numbers\n"); }
+    free(compressed_list);
+
+    order_stored_index = (unsigned long long *) malloc_or_die(sizeof(unsigned long long) * (N + 1));
+    order_original_index = (unsigned long long *) malloc_or_die(sizeof(unsigned long long) * (N + 1));
+    for (unsigned long long i = 0; i < N; i++) { order_stored_index[i] = N; }
+
+    const unsigned char *q = list, *list_end = list + list_size;
+    unsigned long long record = ULLONG_MAX;
+    for (unsigned long long i = 0; i < N; i++)
+    {
+        unsigned long long z = read_number_from_memory(&q, list_end);
+        record += 1 + ((z >> 1) ^ (0ull - (z & 1)));
+        if (record >= N || order_stored_index[record] != N) { die("corrupted list of record numbers\n"); }
+        order_stored_index[record] = i;
+        order_original_index[i] = record;
+    }
+    if (q != list_end) { die("corrupted list of record numbers\n"); }
+    free(list);
+
+    has_order = true;
+}
+
+
+/*
+ * Frames record: flags of parts that consist of several zstd frames, using the same bits as the header flags.
+ * Such parts are read until their compressed size is consumed, which is done for all parts anyway.
+ */
+static void parse_frames_extension(const unsigned char *data, unsigned long long size)
+{
+    const unsigned char *p = data, *end = data + size;
+    unsigned long long parts = read_number_from_memory(&p, end);
+    if (parts == 0 || parts > 0x3F || p != end) { die("corrupted frames record\n"); }
+}
+
+
+/*
+ * Decompresses ids or names, using the dictionary if the input has one.
+ */
+static size_t decompress_names_part(void *dst, size_t dst_size, const void *src, size_t src_size)
+{
+    if (names_ddict == NULL) { return ZSTD_decompress(dst, dst_size, src, src_size); }
+
+    ZSTD_DCtx *dctx = ZSTD_createDCtx();
+    if (dctx == NULL) { die("can't create decompression context\n"); }
+    ZSTD_TRY(ZSTD_DCtx_refDDict(dctx, names_ddict));
+    size_t n_dec_bytes = ZSTD_decompressDCtx(dctx, dst, dst_size, src, src_size);
+    ZSTD_freeDCtx(dctx);
+    return n_dec_bytes;
+}
+
+
+/*
+ * Reads the list of extension records, found after the header in the extended format.
+ */
+static void read_extensions(void)
+{
+    n_extensions = read_number(IN);
+    if (n_extensions > 1024) { die("invalid input: too many extension records\n"); }
+
+    extension_types = (unsigned long long *) malloc_or_die(sizeof(unsigned long long) * (n_extensions + 1));
+    extension_sizes = (unsigned long long *) malloc_or_die(sizeof(unsigned long long) * (n_extensions + 1));
+
+    for (unsigned long long i = 0; i < n_extensions; i++)
+    {
+        unsigned long long type = read_number(IN);
+        unsigned long long size = read_number(IN);
+        extension_types[i] = type;
+        extension_sizes[i] = size;
+
+        unsigned char *data = (unsigned char *) malloc_or_die(size + 1);
+        if (fread(data, 1, size, IN) != size) { incomplete(); }
+
+        if (type == ext_stats) { parse_stats_extension(data, size); }
+        else if (type == ext_seq_encoding) { parse_seq_encoding_extension(data, size); }
+        else if (type == ext_dictionary) { parse_dictionary_extension(data, size); }
+        else if (type == ext_id_encoding) { parse_id_encoding_extension(data, size); }
+        else if (type == ext_lengths_encoding) { parse_lengths_encoding_extension(data, size); }
+        else if (type == ext_mask_encoding) { parse_mask_encoding_extension(data, size); }
+        else if (type == ext_dedup) { parse_dedup_extension(data, size); }
+        else if (type == ext_codecs) { parse_codecs_extension(data, size); }
+        else if (type == ext_quality_binning) { parse_quality_binning_extension(data, size); }
+        else if (type == ext_quality_layout) { parse_layout_extension(&qual_untransposer, data, size, "quality"); }
+        else if (type == ext_seq_layout) { parse_layout_extension(&seq_untransposer, data, size, "sequence"); }
+        else if (type == ext_homopolymers) { parse_hpc_extension(data, size); }
+        else if (type == ext_reference) { parse_reference_extension(data, size); }
+        else if (type == ext_order) { parse_order_extension(data, size); }
+        else if (type == ext_frames) { parse_frames_extension(data, size); }
+        else { die("unsupported extension record type %llu - input was created by a newer version of ennaf?\n", type); }
+
+        free(data);
+    }
+}
+
+
 static void skip_title(void)
 {
     if (has_title)
@@ -152,13 +574,23 @@ static void load_ids(void)
     put_magic_number(compressed_ids_buffer);
     if (fread(compressed_ids_buffer + 4, 1, compressed_ids_size, IN) != compressed_ids_size) { incomplete(); }
 
-    size_t n_dec_bytes = ZSTD_decompress( (void*)ids_buffer, ids_size, (void*)compressed_ids_buffer, compressed_ids_size + 4);
+    size_t n_dec_bytes = decompress_names_part( (void*)ids_buffer, ids_size, (void*)compressed_ids_buffer, compressed_ids_size + 4);
     if (n_dec_bytes != ids_size) { die("can't decompress ids\n"); }
-    if (ids_buffer[ids_size-1] != 0) { die("corrupted ids - not 0-terminated\n"); }
 
     free(compressed_ids_buffer);
     compressed_ids_buffer = 0;
 
+    if (has_tokenized_ids)
+    {
+        char *tokens_buffer = ids_buffer;
+        ids_buffer = (char *) malloc_or_die(ids_size_original + 1);
+        detokenize_ids(ids_buffer, ids_size_original, (unsigned char *)tokens_buffer, ids_size);
+        free(tokens_buffer);
+        ids_size = ids_size_original;
+    }
+
+    if (ids_buffer[ids_size-1] != 0) { die("corrupted ids - not 0-terminated\n"); }
+
     ids = (char **) malloc_or_die(sizeof(char *) * N);
     ids[0] = ids_buffer;
     for (unsigned long long i = 1; i < N; i++)
@@ -167,6 +599,7 @@ static void load_ids(void)
         if (ep >= ids_buffer + ids_size - 1) { die("currupted ids - can't read id %llu\n", i); }
         ids[i] = ep + 1;
     }
+    if (has_order) { restore_pointer_order(ids); }
 }
 
 
@@ -180,7 +613,7 @@ static void load_names(void)
     put_magic_number(compressed_names_buffer);
     if (fread(compressed_names_buffer + 4, 1, compressed_names_size, IN) != compressed_names_size) { incomplete(); }
 
-    size_t n_dec_bytes = ZSTD_decompress( (void*)names_buffer, names_size, (void*)compressed_names_buffer, compressed_names_size + 4);
+    size_t n_dec_bytes = decompress_names_part( (void*)names_buffer, names_size, (void*)compressed_names_buffer, compressed_names_size + 4);
     if (n_dec_bytes != names_size) { die("can't decompress names\n"); }
     if (names_buffer[names_size-1] != 0) { die("corrupted names - not 0-terminated\n"); }
 
@@ -195,16 +628,21 @@ static void load_names(void)
         if (ep >= names_buffer + names_size - 1) { die("corrupted names - can't read name %llu\n", i); }
         names[i] = ep + 1;
     }
+    if (has_order) { restore_pointer_order(names); }
 }
 
 
+/*
+ * Loads sequence lengths into "lengths" array, one 64-bit entry per sequence.
+ * Lengths part consists of either 32-bit units, where each 0xFFFFFFFF unit continues into the next one,
+ * or (in the extended format) of variable length numbers, or is empty, if all sequences have the same length.
+ */
 static void load_lengths(void)
 {
     unsigned long long lengths_size = read_number(IN);
     unsigned long long compressed_lengths_size = read_number(IN);
-    n_lengths = lengths_size / 4;
 
-    lengths_buffer = (unsigned int *) malloc_or_die(lengths_size);
+    unsigned char *lengths_buffer = (unsigned char *) malloc_or_die(lengths_size + 1);
     compressed_lengths_buffer = (unsigned char *) malloc_or_die(compressed_lengths_size + 4);
     put_magic_number(compressed_lengths_buffer);
     if (fread(compressed_lengths_buffer + 4, 1, compressed_lengths_size, IN) != compressed_lengths_size) { incomplete(); }
@@ -214,15 +652,55 @@ static void load_lengths(void)
 
     free(compressed_lengths_buffer);
     compressed_lengths_buffer = 0;
+
+    lengths = (unsigned long long *) malloc_or_die(sizeof(unsigned long long) * (N + 1));
+    lengths[N] = 0;
+    unsigned long long n = 0;
+
+    if (lengths_encoding == lengths_encoding_constant)
+    {
+        if (lengths_size != 0) { die("corrupted lengths\n"); }
+        for (; n < N; n++) { lengths[n] = constant_length; }
+    }
+    else if (lengths_encoding == lengths_encoding_numbers)
+    {
+        const unsigned char *p = lengths_buffer, *end = lengths_buffer + lengths_size;
+        for (; n < N && p < end; n++) { lengths[n] = read_number_from_memory(&p, end); }
+        if (p != end) { die("corrupted lengths\n"); }
+    }
+    else
+    {
+        const unsigned int *units = (const unsigned int *)lengths_buffer;
+        unsigned long long n_units = lengths_size / 4;
+        unsigned long long len = 0;
+        for (unsigned long long i = 0; i < n_units && n < N; i++)
+        {
+            len += units[i];
+            if (units[i] != 4294967295u) { lengths[n++] = len; len = 0; }
+        }
+    }
+
+    if (n != N) { die("corrupted input - number of lengths does not match number of sequences\n"); }
+    free(lengths_buffer);
+
+    stored_lengths = lengths;
+    if (has_order) { restore_lengths_order(); }
 }
 
 
+/*
+ * Loads the mask into "mask_runs" array of interval lengths, alternating between non-masked and masked intervals,
+ * starting with non-masked one (which may be empty).
+ * Mask part consists of either bytes, where each 255 continues into the next byte,
+ * or (in the extended format) of variable length numbers.
+ * The array is terminated by an interval of maximum length, so that the mask state can advance without bound checks.
+ */
 static void load_mask(void)
 {
-    mask_size = read_number(IN);
+    unsigned long long mask_size = read_number(IN);
     unsigned long long compressed_mask_size = read_number(IN);
 
-    mask_buffer = (unsigned char *) malloc_or_die(mask_size);
+    unsigned char *mask_buffer = (unsigned char *) malloc_or_die(mask_size + 1);
     compressed_mask_buffer = (unsigned char *) malloc_or_die(compressed_mask_size + 4);
     put_magic_number(compressed_mask_buffer);
     if (fread(compressed_mask_buffer + 4, 1, compressed_mask_size, IN) != compressed_mask_size) { incomplete(); }
@@ -233,16 +711,42 @@ static void load_mask(void)
     free(compressed_mask_buffer);
     compressed_mask_buffer = 0;
 
-    if (mask_size > 0)
+    // Each byte or number of the mask part holds at least part of one interval.
+    mask_runs = (unsigned long long *) malloc_or_die(sizeof(unsigned long long) * (mask_size + 1));
+    n_mask_runs = 0;
+
+    if (mask_encoding == mask_encoding_numbers)
     {
-        if (mask_buffer[0] == 0)
+        const unsigned char *p = mask_buffer, *end = mask_buffer + mask_size;
+        while (p < end) { mask_runs[n_mask_runs++] = read_number_from_memory(&p, end); }
+    }
+    else
+    {
+        unsigned long long len = 0;
+        for (unsigned long long i = 0; i < mask_size; i++)
         {
-            mask_on = 1;
-            cur_mask = 1;
-            if (mask_size < 2) { die("corrupted mask\n"); }
+            len += mask_buffer[i];
+            if (mask_buffer[i] != 255u) { mask_runs[n_mask_runs++] = len; len = 0; }
         }
-        cur_mask_remaining = mask_buffer[cur_mask];
+        if (len != 0) { die("corrupted mask\n"); }
     }
+
+    free(mask_buffer);
+
+    if (has_order) { restore_mask_order(); }
+    mask_runs[n_mask_runs] = ULLONG_MAX;
+    cur_mask = 0;
+    cur_mask_remaining = mask_runs[0];
+    mask_on = 0;
+}
+
+
+__attribute__((always_inline))
+static inline void next_mask_run(void)
+{
+    mask_on = 1 - mask_on;
+    cur_mask++;
+    cur_mask_remaining = mask_runs[cur_mask];
 }
 
 
@@ -257,6 +761,79 @@ static void load_compressed_sequence(void)
 }
 
 
+/*
+ * Reads the next run of the 2-bit encoding exception list.
+ * After the last run, the run start is set beyond any sequence position.
+ */
+static void next_exception_run(void)
+{
+    if (exceptions_pos >= exceptions_size)
+    {
+        exception_run_start = exception_run_end = ULLONG_MAX;
+        return;
+    }
+
+    const unsigned char *p = exceptions_buffer + exceptions_pos;
+    const unsigned char *end = exceptions_buffer + exceptions_size;
+    unsigned long long gap = read_number_from_memory(&p, end);
+    unsigned long long length = read_number_from_memory(&p, end);
+    if (p >= end) { die("corrupted sequence exceptions\n"); }
+    exception_run_code = *p++ & 15;
+    exceptions_pos = (unsigned long long)(p - exceptions_buffer);
+
+    exception_run_start = exception_run_end + gap;
+    exception_run_end = exception_run_start + length;
+}
+
+
+static void initialize_2bit_decoding(void)
+{
+    seq_2bit_n_bases_done = 0;
+    exceptions_pos = 0;
+    exception_run_end = 0;
+    next_exception_run();
+}
+
+
+/*
+ * Expands 2-bit encoded bytes into 4-bit encoding, and puts the exceptions back in place.
+ * Padding at the end of sequence is removed, so that the result is identical to 4-bit encoded sequence.
+ * Returns the number of 4-bit encoded bytes produced.
+ */
+static size_t expand_2bit_sequence(const unsigned char *src, size_t size, unsigned char *dest)
+{
+    for (size_t i = 0; i < size; i++)
+    {
+        *(unsigned short *)(&dest[i * 2]) = nucs_2bit_to_4bit[src[i]];
+    }
+
+    unsigned long long first = seq_2bit_n_bases_done;
+    unsigned long long last = first + (unsigned long long)size * 4;
+    unsigned long long n_stored = has_hpc ? hpc_n_stored : total_seq_length - deduplicated_seq_length;
+    if (last > n_stored) { last = n_stored; }
+    if (first >= last) { return 0; }
+
+    while (exception_run_start < last)
+    {
+        unsigned long long a = (exception_run_start > first) ? exception_run_start : first;
+        unsigned long long b = (exception_run_end < last) ? exception_run_end : last;
+        for (unsigned long long q = a - first; q < b - first; q++)
+        {
+            unsigned shift = (unsigned)(q & 1ull) << 2;
+            dest[q >> 1] = (unsigned char)((dest[q >> 1] & ~(15u << shift)) | ((unsigned)exception_run_code << shift));
+        }
+        if (exception_run_end > last) { break; }
+        next_exception_run();
+    }
+
+    unsigned long long n_bases = last - first;
+    if (n_bases & 1ull) { dest[n_bases >> 1] &= 15; }
+
+    seq_2bit_n_bases_done = last;
+    return (size_t)((n_bases + 1) >> 1);
+}
+
+
 static size_t initialize_input_decompression(void)
 {
     in_buffer_size = ZSTD_DStreamInSize();
@@ -274,11 +851,14 @@ static size_t initialize_input_decompression(void)
     if (ZSTD_isError(bytes_to_read)) { die("can't initialize input decompression stream: %s\n", ZSTD_getErrorName(bytes_to_read)); }
 
     if (bytes_to_read < 5) { die("can't initialize decompression\n"); }
+    attach_reference(input_decompression_stream);
 
     put_magic_number((unsigned char *)in_buffer);
 
+    if (bytes_to_read - 4 > compressed_seq_size) { die("can't initialize decompression\n"); }
     size_t could_read = fread(in_buffer + 4, 1, bytes_to_read - 4, IN);
     if (could_read != bytes_to_read - 4) { incomplete(); }
+    compressed_part_remaining = compressed_seq_size - (bytes_to_read - 4);
     ZSTD_inBuffer in = { in_buffer, bytes_to_read, 0 };
     ZSTD_outBuffer out = { out_buffer, out_buffer_size, 0 };
 
@@ -297,6 +877,20 @@ static void initialize_memory_decompression(void)
     mem_out_buffer_size = ZSTD_DStreamOutSize();
     mem_out_buffer = (unsigned char *) malloc_or_die(mem_out_buffer_size);
 
+    if (has_2bit_seq)
+    {
+        seq_2bit_buffer_size = mem_out_buffer_size / 2;
+        seq_2bit_buffer = (unsigned char *) malloc_or_die(seq_2bit_buffer_size);
+        initialize_2bit_decoding();
+    }
+
+    if (seq_codec != codec_zstd)
+    {
+        part_reader_init(&seq_reader, seq_codec, compressed_seq_buffer + 4, compressed_seq_size);
+        memory_bytes_to_read = 0;
+        return;
+    }
+
     memory_decompression_stream = ZSTD_createDStream();
     if (!memory_decompression_stream) { die("can't create memory decompression stream\n"); }
 
@@ -304,11 +898,20 @@ static void initialize_memory_decompression(void)
 
     memory_bytes_to_read = ZSTD_initDStream(memory_decompression_stream);
     if (ZSTD_isError(memory_bytes_to_read)) { die("can't initialize memory decompression stream: %s\n", ZSTD_getErrorName(memory_bytes_to_read)); }
+    attach_reference(memory_decompression_stream);
 }
 
 
 static void initialize_quality_file_decompression(void)
 {
+    if (qual_codec != codec_zstd)
+    {
+        part_reader_init(&qual_reader, qual_codec, NULL, compressed_quality_size);
+        quality_buffer_filling_pos = 0;
+        quality_buffer_remaining = 0;
+        return;
+    }
+
     in_buffer_size = ZSTD_DStreamInSize();
     in_buffer = (char *) malloc_or_die(in_buffer_size);
 
@@ -322,8 +925,10 @@ static void initialize_quality_file_decompression(void)
 
     put_magic_number((unsigned char *)in_buffer);
 
+    if (file_bytes_to_read - 4 > compressed_quality_size) { die("can't initialize decompression\n"); }
     size_t could_read = fread(in_buffer + 4, 1, file_bytes_to_read - 4, IN);
     if (could_read != file_bytes_to_read - 4) { incomplete(); }
+    compressed_part_remaining = compressed_quality_size - (file_bytes_to_read - 4);
 
     zstd_file_in_buffer.src = in_buffer;
     zstd_file_in_buffer.size = file_bytes_to_read;
@@ -341,34 +946,282 @@ static void initialize_quality_file_decompression(void)
 }
 
 
+/*
+ * Reads the next portion of the part being decompressed from the input file into "in_buffer".
+ * "size" is the amount requested by zstd, which is 0 at the end of a frame.
+ * A part may consist of several frames ("ennaf --target-speed"), so reading continues until the end of the part.
+ * Returns the number of bytes read, or 0 at the end of the part.
+ */
 static inline size_t read_next_chunk(void* buffer, size_t size)
 {
+    if (size == 0) { size = in_buffer_size; }
+    if (size > compressed_part_remaining) { size = (size_t)compressed_part_remaining; }
+    if (size == 0) { return 0; }
+
     size_t could_read = fread(buffer, 1, size, IN);
     if (could_read != size) { incomplete(); }
+    compressed_part_remaining -= could_read;
     return could_read;
 }
 
 
-static void refill_dna_buffer_from_memory_4bit(void)
+/*
+ * Returns the amount of compressed sequence to pass to zstd next, when decompressing it from memory.
+ */
+static inline size_t next_memory_chunk_size(void)
 {
-    dna_buffer_filling_pos = 0;
+    // Compressed sequence buffer starts with 4 bytes of zstd magic number, not counted in "compressed_seq_size".
+    unsigned long long remaining = compressed_seq_size + 4 - compressed_seq_pos;
+    if (memory_bytes_to_read == 0 || memory_bytes_to_read > remaining) { return (size_t)remaining; }
+    return memory_bytes_to_read;
+}
+
+
+/*
+ * Prepares reading the sequence from the input file.
+ */
+static void initialize_sequence_input(void)
+{
+    if (seq_codec != codec_zstd)
+    {
+        out_buffer_size = ZSTD_DStreamOutSize();
+        out_buffer = (char *) malloc_or_die(out_buffer_size);
+        part_reader_init(&seq_reader, seq_codec, NULL, compressed_seq_size);
+    }
+    else
+    {
+        seq_file_bytes_to_read = initialize_input_decompression();
+        zstd_seq_in_buffer.src = in_buffer;
+        zstd_seq_in_buffer.size = 0;
+        zstd_seq_in_buffer.pos = 0;
+        seq_out_buffer_was_full = false;
+    }
+
+    if (has_2bit_seq)
+    {
+        seq_2bit_buffer_size = out_buffer_size / 2;
+        seq_2bit_buffer = (unsigned char *) malloc_or_die(seq_2bit_buffer_size);
+        initialize_2bit_decoding();
+    }
+
+    if (seq_untransposer.layout == layout_transposed && in_seq_type < seq_type_protein)
+    {
+        seq_4bit_stage = (unsigned char *) malloc_or_die(out_buffer_size);
+        seq_codes_stage = (unsigned char *) malloc_or_die(out_buffer_size * 2);
+        seq_codes = (unsigned char *) malloc_or_die(out_buffer_size * 2);
+    }
+}
+
+
+/*
+ * Decompresses the next portion of sequence part from the input file into "dest" (of "dest_size" bytes), as stored.
+ * Returns the number of bytes placed in "dest", or 0 at the end of sequence.
+ */
+static size_t read_stored_sequence_chunk(unsigned char *dest, size_t dest_size)
+{
+    if (seq_codec != codec_zstd) { return part_reader_read(&seq_reader, dest, dest_size); }
+
+    for (;;)
+    {
+        if (zstd_seq_in_buffer.pos >= zstd_seq_in_buffer.size && !seq_out_buffer_was_full)
+        {
+            zstd_seq_in_buffer.size = read_next_chunk(in_buffer, seq_file_bytes_to_read);
+            zstd_seq_in_buffer.pos = 0;
+            if (zstd_seq_in_buffer.size == 0) { return 0; }
+        }
+
+        ZSTD_outBuffer out = { dest, dest_size, 0 };
+        seq_file_bytes_to_read = ZSTD_decompressStream(input_decompression_stream, &out, &zstd_seq_in_buffer);
+        if (ZSTD_isError(seq_file_bytes_to_read)) { die("can't decompress sequence: %s\n", ZSTD_getErrorName(seq_file_bytes_to_read)); }
+        seq_out_buffer_was_full = (out.pos == out.size);
+
+        if (out.pos > 0) { return out.pos; }
+    }
+}
+
+
+/*
+ * Decompresses the next portion of stored sequence into "dest" (of "dest_size" bytes), as 4-bit encoded data,
+ * regardless of whether it's stored in 4-bit or 2-bit encoding.
+ * Returns the number of bytes placed in "dest", or 0 at the end of sequence.
+ */
+static size_t read_stored_4bit_sequence_chunk(unsigned char *dest, size_t dest_size)
+{
+    if (!has_2bit_seq) { return read_stored_sequence_chunk(dest, dest_size); }
+
+    size_t size;
+    while ( (size = read_stored_sequence_chunk(seq_2bit_buffer, seq_2bit_buffer_size)) )
+    {
+        size = expand_2bit_sequence(seq_2bit_buffer, size, dest);
+        if (size > 0) { return size; }
+    }
+    return 0;
+}
+
+
+/*
+ * Decompresses the next portion of text (protein or text) sequence into "dest" (of "dest_size" bytes).
+ * Returns the number of bytes placed in "dest", or 0 at the end of sequence.
+ */
+static size_t read_sequence_chunk(unsigned char *dest, size_t dest_size)
+{
+    if (seq_untransposer.layout == layout_transposed) { return untransposer_read(&seq_untransposer, dest, dest_size, &read_stored_sequence_chunk); }
+    return read_stored_sequence_chunk(dest, dest_size);
+}
+
+
+/*
+ * Decompresses the next portion of stored 4-bit encoded sequence into "dest" (of "dest_size" bytes),
+ * one nucleotide code per byte. Padding at the end of sequence is not included.
+ * Returns the number of codes placed in "dest", or 0 at the end of sequence.
+ */
+static size_t read_stored_sequence_codes(unsigned char *dest, size_t dest_size)
+{
+    if (seq_codes_stage_pos >= seq_codes_stage_end)
+    {
+        size_t size = read_stored_4bit_sequence_chunk(seq_4bit_stage, out_buffer_size);
+        if (size == 0) { return 0; }
+
+        for (size_t i = 0; i < size; i++)
+        {
+            seq_codes_stage[i * 2] = seq_4bit_stage[i] & 15;
+            seq_codes_stage[i * 2 + 1] = seq_4bit_stage[i] >> 4;
+        }
+
+        unsigned long long n = (unsigned long long)size * 2;
+        if (n > total_seq_length - seq_codes_done) { n = total_seq_length - seq_codes_done; }
+        seq_codes_done += n;
+        seq_codes_stage_pos = 0;
+        seq_codes_stage_end = (size_t)n;
+    }
+
+    size_t n = seq_codes_stage_end - seq_codes_stage_pos;
+    if (n > dest_size) { n = dest_size; }
+    memcpy(dest, seq_codes_stage + seq_codes_stage_pos, n);
+    seq_codes_stage_pos += n;
+    return n;
+}
+
 
-    while ( dna_buffer_filling_pos < dna_buffer_flush_size &&
-            (compressed_seq_pos < compressed_seq_size || zstd_mem_in_buffer.pos < zstd_mem_in_buffer.size) )
+/*
+ * Decompresses the next portion of transposed sequence ("ennaf --msa") into "dest" (of at most "out_buffer_size" bytes),
+ * as 4-bit encoded data.
+ * Returns the number of bytes placed in "dest", or 0 at the end of sequence.
+ */
+static size_t read_untransposed_4bit_sequence_chunk(unsigned char *dest, size_t dest_size)
+{
+    assert(dest_size <= out_buffer_size);
+
+    size_t n_codes = 0;
+    while (n_codes < dest_size * 2)
+    {
+        size_t n = untransposer_read(&seq_untransposer, seq_codes + n_codes, dest_size * 2 - n_codes, &read_stored_sequence_codes);
+        if (n == 0) { break; }
+        n_codes += n;
+    }
+
+    for (size_t i = 0; i < n_codes / 2; i++) { dest[i] = (unsigned char)(seq_codes[i * 2] | (seq_codes[i * 2 + 1] << 4)); }
+    if (n_codes & 1) { dest[n_codes / 2] = seq_codes[n_codes - 1]; }
+    return (n_codes + 1) / 2;
+}
+
+
+/*
+ * Decompresses the next portion of sequence into "dest" (of at most "out_buffer_size" bytes), as 4-bit encoded data,
+ * with records in the order they are stored. Duplicate sequences and homopolymer runs, if any, are put back in place.
+ * Returns the number of bytes placed in "dest", or 0 at the end of sequence.
+ */
+static size_t read_4bit_sequence_chunk_in_stored_order(unsigned char *dest, size_t dest_size)
+{
+    if (has_duplicates) { return replay_4bit_sequence(dest, dest_size, &read_stored_4bit_sequence_chunk); }
+    if (seq_untransposer.layout == layout_transposed) { return read_untransposed_4bit_sequence_chunk(dest, dest_size); }
+    if (has_hpc) { return hpc_expand(dest, dest_size, &read_stored_4bit_sequence_chunk); }
+    return read_stored_4bit_sequence_chunk(dest, dest_size);
+}
+
+
+/*
+ * Decompresses the next portion of sequence into "out_buffer", as 4-bit encoded data,
+ * with records in the original order.
+ * Returns the number of bytes placed in "out_buffer", or 0 at the end of sequence.
+ */
+static size_t read_4bit_sequence_chunk(void)
+{
+    if (has_order) { return reorder_4bit_sequence((unsigned char *)out_buffer, out_buffer_size, &read_4bit_sequence_chunk_in_stored_order); }
+    return read_4bit_sequence_chunk_in_stored_order((unsigned char *)out_buffer, out_buffer_size);
+}
+
+
+/*
+ * Decompresses the next portion of sequence part from memory into "dest" (of "dest_size" bytes), as stored.
+ * Returns the number of bytes placed in "dest", or 0 at the end of sequence.
+ */
+static size_t read_sequence_chunk_from_memory(unsigned char *dest, size_t dest_size)
+{
+    if (seq_codec != codec_zstd) { return part_reader_read(&seq_reader, dest, dest_size); }
+
+    // Compressed sequence buffer starts with 4 bytes of zstd magic number, not counted in "compressed_seq_size".
+    while (compressed_seq_pos < compressed_seq_size + 4 || zstd_mem_in_buffer.pos < zstd_mem_in_buffer.size)
     {
         if (zstd_mem_in_buffer.pos >= zstd_mem_in_buffer.size)
         {
             zstd_mem_in_buffer.src = compressed_seq_buffer + compressed_seq_pos;
-            zstd_mem_in_buffer.size = memory_bytes_to_read;
+            zstd_mem_in_buffer.size = next_memory_chunk_size();
             zstd_mem_in_buffer.pos = 0;
-            compressed_seq_pos += memory_bytes_to_read;
+            compressed_seq_pos += zstd_mem_in_buffer.size;
         }
 
-        ZSTD_outBuffer out = { mem_out_buffer, mem_out_buffer_size, 0 };
+        ZSTD_outBuffer out = { dest, dest_size, 0 };
         memory_bytes_to_read = ZSTD_decompressStream(memory_decompression_stream, &out, &zstd_mem_in_buffer);
         if (ZSTD_isError(memory_bytes_to_read)) { die("can't decompress sequence from memory: %s\n", ZSTD_getErrorName(memory_bytes_to_read)); }
+        if (out.pos > 0) { return out.pos; }
+    }
+    return 0;
+}
+
 
-        for (size_t i = 0; i < out.pos; i++)
+/*
+ * Decompresses the next portion of stored sequence from memory into "dest" (of "dest_size" bytes), as 4-bit encoded data.
+ * Returns the number of bytes placed in "dest", or 0 at the end of sequence.
+ */
+static size_t read_stored_4bit_sequence_chunk_from_memory(unsigned char *dest, size_t dest_size)
+{
+    if (!has_2bit_seq) { return read_sequence_chunk_from_memory(dest, dest_size); }
+
+    size_t size;
+    while ( (size = read_sequence_chunk_from_memory(seq_2bit_buffer, seq_2bit_buffer_size)) )
+    {
+        size = expand_2bit_sequence(seq_2bit_buffer, size, dest);
+        if (size > 0) { return size; }
+    }
+    return 0;
+}
+
+
+/*
+ * Decompresses the next portion of sequence from memory into "dest" (of at most "mem_out_buffer_size" bytes),
+ * as 4-bit encoded data, with records in the order they are stored.
+ * Duplicate sequences and homopolymer runs, if any, are put back in place.
+ * Returns the number of bytes placed in "dest", or 0 at the end of sequence.
+ */
+static size_t read_4bit_sequence_chunk_from_memory(unsigned char *dest, size_t dest_size)
+{
+    if (has_duplicates) { return replay_4bit_sequence(dest, dest_size, &read_stored_4bit_sequence_chunk_from_memory); }
+    if (has_hpc) { return hpc_expand(dest, dest_size, &read_stored_4bit_sequence_chunk_from_memory); }
+    return read_stored_4bit_sequence_chunk_from_memory(dest, dest_size);
+}
+
+
+static void refill_dna_buffer_from_memory_4bit(void)
+{
+    dna_buffer_filling_pos = 0;
+
+    while (dna_buffer_filling_pos < dna_buffer_flush_size)
+    {
+        size_t size = read_4bit_sequence_chunk_from_memory(mem_out_buffer, mem_out_buffer_size);
+        if (size == 0) { break; }
+
+        for (size_t i = 0; i < size; i++)
         {
             dna_buffer[dna_buffer_filling_pos++] = code_to_nuc[mem_out_buffer[i] & 15];
             dna_buffer[dna_buffer_filling_pos++] = code_to_nuc[mem_out_buffer[i] >> 4];
@@ -384,21 +1237,11 @@ static void refill_dna_buffer_from_memory(void)
 {
     dna_buffer_filling_pos = 0;
 
-    while ( dna_buffer_filling_pos < dna_buffer_flush_size &&
-            (compressed_seq_pos < compressed_seq_size || zstd_mem_in_buffer.pos < zstd_mem_in_buffer.size) )
+    while (dna_buffer_filling_pos < dna_buffer_flush_size)
     {
-        if (zstd_mem_in_buffer.pos >= zstd_mem_in_buffer.size)
-        {
-            zstd_mem_in_buffer.src = compressed_seq_buffer + compressed_seq_pos;
-            zstd_mem_in_buffer.size = memory_bytes_to_read;
-            zstd_mem_in_buffer.pos = 0;
-            compressed_seq_pos += memory_bytes_to_read;
-        }
-
-        ZSTD_outBuffer out = { dna_buffer + dna_buffer_filling_pos, dna_buffer_size - dna_buffer_filling_pos, 0 };
-        memory_bytes_to_read = ZSTD_decompressStream(memory_decompression_stream, &out, &zstd_mem_in_buffer);
-        if (ZSTD_isError(memory_bytes_to_read)) { die("can't decompress sequence from memory: %s\n", ZSTD_getErrorName(memory_bytes_to_read)); }
-        dna_buffer_filling_pos += (unsigned)out.pos;
+        size_t size = read_sequence_chunk_from_memory(dna_buffer + dna_buffer_filling_pos, dna_buffer_size - dna_buffer_filling_pos);
+        if (size == 0) { break; }
+        dna_buffer_filling_pos += (unsigned)size;
     }
 
     dna_buffer_remaining = dna_buffer_filling_pos;
@@ -406,28 +1249,60 @@ static void refill_dna_buffer_from_memory(void)
 }
 
 
-static void refill_quality_buffer_from_file(void)
+/*
+ * Decompresses the next portion of qualities into "dest" (of "size" bytes).
+ * Returns the number of bytes placed in "dest", or 0 at the end of the quality part.
+ */
+static size_t read_quality_chunk(unsigned char *dest, size_t size)
 {
-    quality_buffer_filling_pos = 0;
+    if (qual_codec != codec_zstd) { return part_reader_read(&qual_reader, dest, size); }
 
-    while ( quality_buffer_filling_pos < quality_buffer_flush_size &&
-            (file_bytes_to_read || zstd_file_in_buffer.pos < zstd_file_in_buffer.size) )
+    size_t filled = 0;
+    while ( filled == 0 &&
+            (file_bytes_to_read || compressed_part_remaining || zstd_file_in_buffer.pos < zstd_file_in_buffer.size) )
     {
         if (zstd_file_in_buffer.pos >= zstd_file_in_buffer.size)
         {
             size_t input_size = read_next_chunk(in_buffer, file_bytes_to_read);
-            if (input_size != file_bytes_to_read) { incomplete(); }
+            if (input_size == 0) { incomplete(); }
             zstd_file_in_buffer.src = in_buffer;
-            zstd_file_in_buffer.size = file_bytes_to_read;
+            zstd_file_in_buffer.size = input_size;
             zstd_file_in_buffer.pos = 0;
         }
 
-        ZSTD_outBuffer out = { quality_buffer + quality_buffer_filling_pos, quality_buffer_size - quality_buffer_filling_pos, 0 };
+        ZSTD_outBuffer out = { dest, size, 0 };
         file_bytes_to_read = ZSTD_decompressStream(input_decompression_stream, &out, &zstd_file_in_buffer);
         if (ZSTD_isError(file_bytes_to_read)) { die("can't decompress quality: %s\n", ZSTD_getErrorName(file_bytes_to_read)); }
+        filled = out.pos;
+    }
+    return filled;
+}
 
-        quality_buffer_filling_pos += (unsigned)out.pos;
+
+/*
+ * Decompresses the next portion of qualities into "dest" (of "size" bytes), with records in the order they are stored,
+ * untransposing them if necessary.
+ * Returns the number of bytes placed in "dest", or 0 at the end of the quality part.
+ */
+static size_t read_untransposed_quality_chunk(unsigned char *dest, size_t size)
+{
+    if (qual_untransposer.layout == layout_transposed) { return untransposer_read(&qual_untransposer, dest, size, &read_quality_chunk); }
+    return read_quality_chunk(dest, size);
+}
+
+
+static void refill_quality_buffer_from_file(void)
+{
+    quality_buffer_filling_pos = 0;
+    while (quality_buffer_filling_pos < quality_buffer_flush_size)
+    {
+        unsigned char *dest = (unsigned char *)quality_buffer + quality_buffer_filling_pos;
+        size_t dest_size = quality_buffer_size - quality_buffer_filling_pos;
+        size_t size = read_untransposed_quality_chunk(dest, dest_size);
+        if (size == 0) { break; }
+        quality_buffer_filling_pos += (unsigned)size;
     }
+    if (quality_buffer_filling_pos == 0) { incomplete(); }
 
     quality_buffer_remaining = quality_buffer_filling_pos;
     quality_buffer_printing_pos = 0;
@@ -4,9 +4,9 @@
  * See README.md and LICENSE files of this repository
  */
 
-static void print_dna_from_memory_4bit(unsigned int len)
+static void print_dna_from_memory_4bit(unsigned long long len)
 {
-    unsigned int remaining_bp = len;
+    unsigned long long remaining_bp = len;
     while (remaining_bp > 0)
     {
         if (dna_buffer_remaining == 0) { refill_dna_buffer_from_memory_4bit(); }
@@ -22,9 +22,9 @@ static void print_dna_from_memory_4bit(unsigned int len)
 }
 
 
-static void print_dna_from_memory(unsigned int len)
+static void print_dna_from_memory(unsigned long long len)
 {
-    unsigned int remaining_bp = len;
+    unsigned long long remaining_bp = len;
     while (remaining_bp > 0)
     {
         if (dna_buffer_remaining == 0) { refill_dna_buffer_from_memory(); }
@@ -42,12 +42,7 @@ static void print_dna_from_memory(unsigned int len)
 
 static void print_next_sequence_from_memory_4bit(void)
 {
-    while (lengths_buffer[cur_seq_len_index] == 4294967295u)
-    {
-        print_dna_from_memory_4bit(lengths_buffer[cur_seq_len_index]);
-        cur_seq_len_index++;
-    }
-    print_dna_from_memory_4bit(lengths_buffer[cur_seq_len_index]);
+    print_dna_from_memory_4bit(lengths[cur_seq_len_index]);
     cur_seq_len_index++;
     fputc('\n', OUT);
 }
@@ -55,20 +50,15 @@ static void print_next_sequence_from_memory_4bit(void)
 
 static void print_next_sequence_from_memory(void)
 {
-    while (lengths_buffer[cur_seq_len_index] == 4294967295u)
-    {
-        print_dna_from_memory(lengths_buffer[cur_seq_len_index]);
-        cur_seq_len_index++;
-    }
-    print_dna_from_memory(lengths_buffer[cur_seq_len_index]);
+    print_dna_from_memory(lengths[cur_seq_len_index]);
     cur_seq_len_index++;
     fputc('\n', OUT);
 }
 
 
-static void print_quality_from_file(unsigned int len)
+static void print_quality_from_file(unsigned long long len)
 {
-    unsigned int remaining_bp = len;
+    unsigned long long remaining_bp = len;
     while (remaining_bp > 0)
     {
         if (quality_buffer_remaining == 0) { refill_quality_buffer_from_file(); }
@@ -86,17 +76,47 @@ static void print_quality_from_file(unsigned int len)
 
 static void print_next_quality_from_file(void)
 {
-    while (lengths_buffer[cur_qual_len_index] == 4294967295u)
-    {
-        print_quality_from_file(lengths_buffer[cur_qual_len_index]);
-        cur_qual_len_index++;
-    }
-    print_quality_from_file(lengths_buffer[cur_qual_len_index]);
+    print_quality_from_file(lengths[cur_qual_len_index]);
     cur_qual_len_index++;
     fputc('\n', OUT);
 }
 
 
+/*
+ * Prints "len" 4-bit encoded nucleotides of "seq".
+ */
+static void print_4bit_nucleotides(const unsigned char *seq, unsigned long long len)
+{
+    unsigned long long pos = 0;
+    while (len > 0)
+    {
+        size_t n = (len < dna_buffer_size) ? (size_t)len : dna_buffer_size;
+        for (size_t i = 0; i < n; i++, pos++) { dna_buffer[i] = code_to_nuc[(seq[pos >> 1] >> ((pos & 1) << 2)) & 15]; }
+        fwrite(dna_buffer, 1, n, OUT);
+        len -= n;
+    }
+}
+
+
+/*
+ * Prints reads in the original order ("ennaf --reorder-reads"), one window of reads at a time.
+ */
+static void print_reordered_fastq(void)
+{
+    start_restoring_order(mem_out_buffer_size, &read_4bit_sequence_chunk_from_memory, &read_untransposed_quality_chunk);
+
+    for (unsigned long long ri = 0; ri < N; ri++)
+    {
+        const unsigned char *record = order_window_record(ri);
+        print_fastq_name(ri);
+        print_4bit_nucleotides(record, lengths[ri]);
+        fputs("\n+\n", OUT);
+        fwrite(record + (lengths[ri] + 1) / 2, 1, lengths[ri], OUT);
+        fputc('\n', OUT);
+    }
+}
+
+
 static void print_fastq(int masking)
 {
     if (has_data)
@@ -125,7 +145,8 @@ static void print_fastq(int masking)
 
         initialize_quality_file_decompression();
 
-        if (in_seq_type < seq_type_protein)
+        if (has_order) { print_reordered_fastq(); }
+        else if (in_seq_type < seq_type_protein)
         {
             for (unsigned long long ri = 0; ri < N; ri++)
             {
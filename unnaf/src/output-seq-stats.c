@@ -0,0 +1,189 @@
+/*
+ * NAF decompressor
+ * Copyright (c) 2018-2021 Kirill Kryukov
+ * See README.md and LICENSE files of this repository
+ */
+
+/*
+ * Per-sequence statistics are computed directly on the 4-bit encoded stream.
+ * Each nucleotide code is classified into four counters (GC, ACGT, N, other ambiguous),
+ * packed into 16-bit lanes of a 64-bit word, so that a whole byte is classified with one table lookup and one addition.
+ * Lanes are unpacked into full-width counters before they can overflow.
+ * Masked length of each sequence is obtained from mask run lengths alone, without looking at the sequence.
+ */
+
+enum { SEQ_STATS_LANE_GC = 0, SEQ_STATS_LANE_ACGT = 16, SEQ_STATS_LANE_N = 32, SEQ_STATS_LANE_AMBIGUOUS = 48 };
+enum { SEQ_STATS_MAX_PACKED_BYTES = 32767 };
+
+static unsigned long long seq_stats_nibble_class[16];
+static unsigned long long seq_stats_byte_class[256];
+
+static unsigned long long seq_stats_gc = 0;
+static unsigned long long seq_stats_acgt = 0;
+static unsigned long long seq_stats_n = 0;
+static unsigned long long seq_stats_ambiguous = 0;
+static unsigned long long seq_stats_length = 0;
+static unsigned long long seq_stats_masked = 0;
+
+
+static void init_seq_stats_tables(void)
+{
+    for (unsigned c = 0; c < 16; c++)
+    {
+        unsigned char nuc = code_to_nuc[c];
+        unsigned long long class = 0;
+        if (nuc == 'G' || nuc == 'C') { class |= 1ull << SEQ_STATS_LANE_GC; }
+        if (nuc == 'A' || nuc == 'C' || nuc == 'G' || nuc == 'T' || nuc == 'U') { class |= 1ull << SEQ_STATS_LANE_ACGT; }
+        else if (nuc == 'N') { class |= 1ull << SEQ_STATS_LANE_N; }
+        else if (nuc != '-') { class |= 1ull << SEQ_STATS_LANE_AMBIGUOUS; }
+        seq_stats_nibble_class[c] = class;
+    }
+
+    for (unsigned b = 0; b < 256; b++)
+    {
+        seq_stats_byte_class[b] = seq_stats_nibble_class[b & 15] + seq_stats_nibble_class[b >> 4];
+    }
+}
+
+
+static inline void unpack_seq_stats_lanes(unsigned long long packed)
+{
+    seq_stats_gc        += (packed >> SEQ_STATS_LANE_GC)        & 0xFFFFull;
+    seq_stats_acgt      += (packed >> SEQ_STATS_LANE_ACGT)      & 0xFFFFull;
+    seq_stats_n         += (packed >> SEQ_STATS_LANE_N)         & 0xFFFFull;
+    seq_stats_ambiguous += (packed >> SEQ_STATS_LANE_AMBIGUOUS) & 0xFFFFull;
+}
+
+
+/*
+ * Classifies nucleotides from "a" to "b" (exclusive) in 4-bit encoded buffer.
+ * Positions are in nucleotides, so "a" and "b" may point to the middle of a byte.
+ */
+static inline void classify_4bit_range(const unsigned char *buffer, unsigned long long a, unsigned long long b)
+{
+    unsigned long long packed = 0;
+
+    if (a < b && (a & 1ull)) { packed += seq_stats_nibble_class[buffer[a >> 1] >> 4]; a++; }
+
+    const unsigned char *p = buffer + (a >> 1);
+    const unsigned char *end = p + ((b - a) >> 1);
+    while (p < end)
+    {
+        const unsigned char *block_end = (end - p > SEQ_STATS_MAX_PACKED_BYTES) ? p + SEQ_STATS_MAX_PACKED_BYTES : end;
+        for (; p < block_end; p++) { packed += seq_stats_byte_class[*p]; }
+        unpack_seq_stats_lanes(packed);
+        packed = 0;
+    }
+
+    if ((b - a) & 1ull) { packed += seq_stats_nibble_class[buffer[b >> 1] & 15]; }
+    unpack_seq_stats_lanes(packed);
+}
+
+
+/*
+ * Returns the number of masked nucleotides among the next "length" nucleotides, advancing the mask state.
+ */
+static unsigned long long advance_mask_by(unsigned long long length)
+{
+    unsigned long long masked = 0;
+    while (length > 0)
+    {
+        unsigned long long advance = cur_mask_remaining;
+        if (advance > length) { advance = length; }
+        if (mask_on) { masked += advance; }
+        length -= advance;
+
+        cur_mask_remaining -= advance;
+        if (cur_mask_remaining == 0) { next_mask_run(); }
+    }
+    return masked;
+}
+
+
+static void start_seq_stats_sequence(int masking)
+{
+    seq_stats_length = lengths[cur_seq_index];
+    seq_stats_masked = masking ? advance_mask_by(seq_stats_length) : 0;
+    seq_stats_gc = seq_stats_acgt = seq_stats_n = seq_stats_ambiguous = 0;
+    cur_seq_len_n_bp_remaining = seq_stats_length;
+}
+
+
+static void print_seq_stats_row(void)
+{
+    if (has_ids) { fputs(ids[cur_seq_index], OUT); }
+    fprintf(OUT, "\t%llu\t%.3f\t%llu\t%llu\t%llu\n", seq_stats_length,
+            seq_stats_acgt ? (double)seq_stats_gc / (double)seq_stats_acgt * 100 : 0.0,
+            seq_stats_n, seq_stats_ambiguous, seq_stats_masked);
+}
+
+
+/*
+ * Prints rows of all sequences that end at this point, including any following empty sequences.
+ */
+static void finish_seq_stats_sequences(int masking)
+{
+    while (cur_seq_len_n_bp_remaining == 0 && cur_seq_index < N)
+    {
+        print_seq_stats_row();
+        cur_seq_index++;
+        if (cur_seq_index < N) { start_seq_stats_sequence(masking); }
+    }
+}
+
+
+static void seq_stats_4bit_buffer(const unsigned char *buffer, size_t size, int masking)
+{
+    unsigned long long n_bp = (unsigned long long)size * 2;
+    if (n_bp > total_seq_n_bp_remaining) { n_bp = total_seq_n_bp_remaining; }
+    total_seq_n_bp_remaining -= n_bp;
+
+    unsigned long long pos = 0;
+    while (pos < n_bp && cur_seq_index < N)
+    {
+        unsigned long long advance = cur_seq_len_n_bp_remaining;
+        if (advance > n_bp - pos) { advance = n_bp - pos; }
+
+        classify_4bit_range(buffer, pos, pos + advance);
+        pos += advance;
+        cur_seq_len_n_bp_remaining -= advance;
+
+        finish_seq_stats_sequences(masking);
+    }
+}
+
+
+static void print_seq_stats(int masking)
+{
+    if (!has_data) { return; }
+    if (!has_lengths) { die("input has no sequence lengths\n"); }
+
+    if (has_ids) { load_ids(); }
+    else { skip_ids(); }
+    skip_names();
+    load_lengths();
+
+    if (masking) { load_mask(); }
+    else { skip_mask(); }
+
+    total_seq_length = read_number(IN);
+    compressed_seq_size = read_number(IN);
+    total_seq_n_bp_remaining = total_seq_length;
+
+    init_seq_stats_tables();
+
+    fprintf(OUT, "ID\tLength\tGC\tN\tAmbiguous\tMasked\n");
+
+    start_seq_stats_sequence(masking);
+    finish_seq_stats_sequences(masking);
+    if (cur_seq_index >= N) { return; }
+
+    initialize_sequence_input();
+    size_t size;
+    while ( total_seq_n_bp_remaining > 0 && (size = read_4bit_sequence_chunk()) )
+    {
+        seq_stats_4bit_buffer((unsigned char *)out_buffer, size, masking);
+    }
+
+    if (cur_seq_index < N) { die("corrupted input - sequence data is shorter than sequence lengths\n"); }
+}
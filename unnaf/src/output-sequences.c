@@ -23,16 +23,11 @@ static inline void print_dna_buffer_as_sequences(int masking)
             total_seq_n_bp_remaining -= cur_seq_len_n_bp_remaining;
         }
 
-        if (lengths_buffer[cur_seq_len_index] != 4294967295u)
-        {
-            fputc('\n', OUT);
-            cur_seq_index++;
-        }
+        fputc('\n', OUT);
+        cur_seq_index++;
+        if (cur_seq_index >= N) { break; }
 
-        cur_seq_len_index++;
-        if (cur_seq_len_index >= n_lengths) { break; }
-
-        cur_seq_len_n_bp_remaining = lengths_buffer[cur_seq_len_index];
+        cur_seq_len_n_bp_remaining = lengths[cur_seq_index];
     }
 
     if (n_bp_to_print > 0)
@@ -72,39 +67,26 @@ static void print_sequences(int masking)
     total_seq_length = read_number(IN);
     compressed_seq_size = read_number(IN);
     total_seq_n_bp_remaining = total_seq_length;
-    cur_seq_len_n_bp_remaining = lengths_buffer[0];
-
-    size_t bytes_to_read = initialize_input_decompression();
-    size_t input_size;
+    cur_seq_len_n_bp_remaining = lengths[0];
 
     if (in_seq_type < seq_type_protein)
     {
-        while ( total_seq_n_bp_remaining > 0 && (input_size = read_next_chunk(in_buffer, bytes_to_read)) )
+        initialize_sequence_input();
+        size_t size;
+        while ( total_seq_n_bp_remaining > 0 && (size = read_4bit_sequence_chunk()) )
         {
-            ZSTD_inBuffer in = { in_buffer, input_size, 0 };
-            while (in.pos < in.size)
-            {
-                ZSTD_outBuffer out = { out_buffer, out_buffer_size, 0 };
-                bytes_to_read = ZSTD_decompressStream(input_decompression_stream, &out, &in);
-                if (ZSTD_isError(bytes_to_read)) { die("can't decompress sequence: %s\n", ZSTD_getErrorName(bytes_to_read)); }
-                write_4bit_as_sequences((unsigned char *)out_buffer, out.pos, masking);
-            }
+            write_4bit_as_sequences((unsigned char *)out_buffer, size, masking);
         }
     }
     else
     {
-        while ( total_seq_n_bp_remaining > 0 && (input_size = read_next_chunk(in_buffer, bytes_to_read)) )
+        initialize_sequence_input();
+        size_t size;
+        while ( total_seq_n_bp_remaining > 0 && (size = read_sequence_chunk(dna_buffer, dna_buffer_size)) )
         {
-            ZSTD_inBuffer in = { in_buffer, input_size, 0 };
-            while (in.pos < in.size)
-            {
-                ZSTD_outBuffer out = { dna_buffer, dna_buffer_size, 0 };
-                bytes_to_read = ZSTD_decompressStream(input_decompression_stream, &out, &in);
-                if (ZSTD_isError(bytes_to_read)) { die("can't decompress sequence: %s\n", ZSTD_getErrorName(bytes_to_read)); }
-                dna_buffer_pos = (unsigned)out.pos;
-                if (!use_mask) { uppercase_dna_buffer(); }
-                print_dna_buffer_as_sequences(masking);
-            }
+            dna_buffer_pos = (unsigned)size;
+            if (!use_mask) { uppercase_dna_buffer(); }
+            print_dna_buffer_as_sequences(masking);
         }
     }
 
@@ -4,10 +4,47 @@
  * See README.md and LICENSE files of this repository
  */
 
+static const char* extension_name(unsigned long long type)
+{
+    if (type == ext_stats) { return "Statistics"; }
+    if (type == ext_seq_encoding) { return "Sequence encoding"; }
+    if (type == ext_dictionary) { return "Dictionary"; }
+    if (type == ext_id_encoding) { return "Id encoding"; }
+    if (type == ext_lengths_encoding) { return "Lengths encoding"; }
+    if (type == ext_mask_encoding) { return "Mask encoding"; }
+    if (type == ext_dedup) { return "Duplicates"; }
+    if (type == ext_codecs) { return "Codecs"; }
+    if (type == ext_quality_binning) { return "Quality binning"; }
+    if (type == ext_quality_layout) { return "Quality layout"; }
+    if (type == ext_seq_layout) { return "Sequence layout"; }
+    if (type == ext_homopolymers) { return "Homopolymers"; }
+    if (type == ext_reference) { return "Reference"; }
+    if (type == ext_order) { return "Order"; }
+    if (type == ext_frames) { return "Frames"; }
+    return "Unknown";
+}
+
+
+static void print_quality_binning(void)
+{
+    fprintf(OUT, "%s", (qual_binning == qual_binning_illumina8) ? "illumina8" : "custom");
+    for (unsigned long long i = 0; i < qual_n_bins; i++)
+    {
+        fprintf(OUT, "%s%llu-%llu:%llu", i ? "," : " (", qual_bins[i][0], qual_bins[i][1], qual_bins[i][2]);
+    }
+    if (qual_n_bins > 0) { fputc(')', OUT); }
+}
+
+
 static void print_list_of_parts(void)
 {
     int printed = 0;
-    if (has_title)   { fprintf(OUT, "Title"); printed++; }
+    for (unsigned long long i = 0; i < n_extensions; i++)
+    {
+        fprintf(OUT, "%s%s", printed ? ", " : "", extension_name(extension_types[i]));
+        printed++;
+    }
+    if (has_title)   { fprintf(OUT, "%sTitle",   printed ? ", " : ""); printed++; }
     if (has_ids)     { fprintf(OUT, "%sIDs",     printed ? ", " : ""); printed++; }
     if (has_names)   { fprintf(OUT, "%sNames",   printed ? ", " : ""); printed++; }
     if (has_lengths) { fprintf(OUT, "%sLengths", printed ? ", " : ""); printed++; }
@@ -20,6 +57,11 @@ static void print_list_of_parts(void)
 
 static void print_part_sizes(void)
 {
+    for (unsigned long long i = 0; i < n_extensions; i++)
+    {
+        fprintf(OUT, "%s: %llu\n", extension_name(extension_types[i]), extension_sizes[i]);
+    }
+
     if (has_title)
     {
         unsigned long long title_size = read_number(IN);
@@ -72,11 +114,40 @@ static void print_part_sizes(void)
         unsigned long long quality_size = read_number(IN);
         compressed_quality_size = read_number(IN);
         fprintf(OUT, "Quality: %llu / %llu (%.3f%%)\n", compressed_quality_size, quality_size, (double)compressed_quality_size / (double)quality_size * 100);
+        if (qual_binning != qual_binning_none)
+        {
+            fprintf(OUT, "Quality binning: ");
+            print_quality_binning();
+            fputc('\n', OUT);
+        }
         skip_ahead(compressed_quality_size);
     }
 }
 
 
+static void print_stats(void)
+{
+    if (!has_stats) { die("input has no statistics - compress with \"ennaf --stats\" to store them\n"); }
+
+    fprintf(OUT, "Sequences: %llu\n", N);
+    fprintf(OUT, "Total length: %llu\n", stats_total_length);
+    fprintf(OUT, "Shortest: %llu\n", stats_min_length);
+    fprintf(OUT, "Longest: %llu\n", stats_max_length);
+    fprintf(OUT, "N50: %llu\n", stats_n50);
+
+    if (in_seq_type < seq_type_protein)
+    {
+        unsigned long long at = stats_char_counts['A'] + stats_char_counts['T'] + stats_char_counts['U'];
+        unsigned long long gc = stats_char_counts['G'] + stats_char_counts['C'];
+        fprintf(OUT, "GC: %.3f%%\n", (at + gc) ? (double)gc / (double)(at + gc) * 100 : 0.0);
+        fprintf(OUT, "N: %llu\n", stats_char_counts['N']);
+    }
+
+    fprintf(OUT, "Masked: %llu (%.3f%%)\n", stats_masked_length,
+            stats_total_length ? (double)stats_masked_length / (double)stats_total_length * 100 : 0.0);
+}
+
+
 static void print_title(void)
 {
     if (has_title)
@@ -182,18 +253,7 @@ static void print_lengths(void)
         skip_names();
         load_lengths();
 
-        for (unsigned long long i = 0; i < n_lengths; i++)
-        {
-            unsigned long long len = 0;
-            while (i < n_lengths && lengths_buffer[i] == 4294967295u)
-            { 
-                len += 4294967295llu;
-                i++;
-            }
-            if (i < n_lengths) { len += lengths_buffer[i]; }
-
-            fprintf(OUT, "%llu\n", len);
-        }
+        for (unsigned long long i = 0; i < N; i++) { fprintf(OUT, "%llu\n", lengths[i]); }
     }
 }
 
@@ -220,21 +280,11 @@ static void print_mask(void)
     {
         skip_ids();
         skip_names();
-        skip_lengths();
+        if (has_order) { load_lengths(); }
+        else { skip_lengths(); }
         load_mask();
 
-        for (unsigned long long i = 0; i < mask_size; i++)
-        {
-            unsigned long long len = 0;
-            while (i < mask_size && mask_buffer[i] == 255u)
-            { 
-                len += 255llu;
-                i++;
-            }
-            if (i < mask_size) { len += mask_buffer[i]; }
-
-            fprintf(OUT, "%llu\n", len);
-        }
+        for (unsigned long long i = 0; i < n_mask_runs; i++) { fprintf(OUT, "%llu\n", mask_runs[i]); }
     }
 }
 
@@ -250,10 +300,7 @@ static void print_total_mask_length(void)
 
         unsigned long long total_mask_length = 0;
 
-        for (unsigned long long i = 0; i < mask_size; i++)
-        {
-            total_mask_length += mask_buffer[i];
-        }
+        for (unsigned long long i = 1; i < n_mask_runs; i += 2) { total_mask_length += mask_runs[i]; }
         fprintf(OUT, "%llu\n", total_mask_length);
     }
     else
@@ -269,25 +316,16 @@ static void print_4bit(void)
     {
         skip_ids();
         skip_names();
-        skip_lengths();
+        if (has_duplicates || seq_untransposer.layout == layout_transposed || has_order) { load_lengths(); }
+        else { skip_lengths(); }
         skip_mask();
 
-        read_number(IN);
-        read_number(IN);
+        total_seq_length = read_number(IN);
+        compressed_seq_size = read_number(IN);
 
-        size_t bytes_to_read = initialize_input_decompression();
-        size_t input_size;
-        while ( (input_size = read_next_chunk(in_buffer, bytes_to_read)) )
-        {
-            ZSTD_inBuffer in = { in_buffer, input_size, 0 };
-            while (in.pos < in.size)
-            {
-                ZSTD_outBuffer out = { out_buffer, out_buffer_size, 0 };
-                bytes_to_read = ZSTD_decompressStream(input_decompression_stream, &out, &in);
-                if (ZSTD_isError(bytes_to_read)) { die("can't decompress: %s\n", ZSTD_getErrorName(bytes_to_read)); }
-                fwrite(out_buffer, 1, out.pos, OUT);
-            }
-        }
+        initialize_sequence_input();
+        size_t size;
+        while ( (size = read_4bit_sequence_chunk()) ) { fwrite(out_buffer, 1, size, OUT); }
     }
 }
 
@@ -297,8 +335,7 @@ static inline void mask_dna_buffer(unsigned char *buffer, unsigned size)
     unsigned pos = 0;
     while (pos < size)
     {
-        unsigned advance = cur_mask_remaining;
-        if (advance > size - pos) { advance = size - pos; }
+        unsigned advance = (cur_mask_remaining < size - pos) ? (unsigned)cur_mask_remaining : size - pos;
         unsigned end_pos = pos + advance;
 
         if (mask_on)
@@ -310,12 +347,7 @@ static inline void mask_dna_buffer(unsigned char *buffer, unsigned size)
         }
 
         cur_mask_remaining -= advance;
-        if (cur_mask_remaining == 0)
-        {
-            if (mask_buffer[cur_mask] != 255) { mask_on = 1 - mask_on; }
-            cur_mask++;
-            cur_mask_remaining = mask_buffer[cur_mask];
-        }
+        if (cur_mask_remaining == 0) { next_mask_run(); }
 
         pos = end_pos;
     }
@@ -387,34 +419,21 @@ static inline void print_dna_buffer_as_fasta(int masking)
             total_seq_n_bp_remaining -= cur_seq_len_n_bp_remaining;
         }
 
-        if (lengths_buffer[cur_seq_len_index] == 4294967295u)
-        {
-            cur_seq_len_index++;
-        }
-        else
+        fputc('\n', OUT);
+        cur_seq_index++;
+
+        // Print empty sequences without empty lines.
+        while (cur_seq_index < N && lengths[cur_seq_index] == 0)
         {
-            fputc('\n', OUT);
-            cur_seq_len_index++;
+            print_fasta_name(cur_seq_index);
             cur_seq_index++;
-
-            // Print empty sequences without empty lines.
-            while (cur_seq_len_index < n_lengths && cur_seq_index < N && lengths_buffer[cur_seq_len_index] == 0)
-            {
-                print_fasta_name(cur_seq_index);
-                cur_seq_len_index++;
-                cur_seq_index++;
-            }
-
-            if (cur_seq_index < N)
-            {
-                print_fasta_name(cur_seq_index);
-                cur_line_n_bp_remaining = max_line_length;
-            }
         }
 
-        if (cur_seq_len_index >= n_lengths) { break; }
+        if (cur_seq_index >= N) { break; }
 
-        cur_seq_len_n_bp_remaining = lengths_buffer[cur_seq_len_index];
+        print_fasta_name(cur_seq_index);
+        cur_line_n_bp_remaining = max_line_length;
+        cur_seq_len_n_bp_remaining = lengths[cur_seq_index];
     }
 
     if (n_bp_to_print > 0)
@@ -460,7 +479,8 @@ static void print_dna(int masking)
     {
         skip_ids();
         skip_names();
-        skip_lengths();
+        if (has_duplicates || seq_untransposer.layout == layout_transposed || has_order) { load_lengths(); }
+        else { skip_lengths(); }
 
         if (masking) { load_mask(); }
         else { skip_mask(); }
@@ -469,37 +489,21 @@ static void print_dna(int masking)
         compressed_seq_size = read_number(IN);
         total_seq_n_bp_remaining = total_seq_length;
 
-        size_t bytes_to_read = initialize_input_decompression();
-        size_t input_size;
-
         if (in_seq_type < seq_type_protein)
         {
-            while ( (input_size = read_next_chunk(in_buffer, bytes_to_read)) )
-            {
-                ZSTD_inBuffer in = { in_buffer, input_size, 0 };
-                while (in.pos < in.size)
-                {
-                    ZSTD_outBuffer out = { out_buffer, out_buffer_size, 0 };
-                    bytes_to_read = ZSTD_decompressStream(input_decompression_stream, &out, &in);
-                    if (ZSTD_isError(bytes_to_read)) { die("can't decompress sequence: %s\n", ZSTD_getErrorName(bytes_to_read)); }
-                    write_4bit_as_dna((unsigned char *)out_buffer, out.pos, masking);
-                }
-            }
+            initialize_sequence_input();
+            size_t size;
+            while ( (size = read_4bit_sequence_chunk()) ) { write_4bit_as_dna((unsigned char *)out_buffer, size, masking); }
         }
         else
         {
-            while ( (input_size = read_next_chunk(in_buffer, bytes_to_read)) )
+            initialize_sequence_input();
+            size_t size;
+            while ( (size = read_sequence_chunk(dna_buffer, dna_buffer_size)) )
             {
-                ZSTD_inBuffer in = { in_buffer, input_size, 0 };
-                while (in.pos < in.size)
-                {
-                    ZSTD_outBuffer out = { dna_buffer, dna_buffer_size, 0 };
-                    bytes_to_read = ZSTD_decompressStream(input_decompression_stream, &out, &in);
-                    if (ZSTD_isError(bytes_to_read)) { die("can't decompress sequence: %s\n", ZSTD_getErrorName(bytes_to_read)); }
-                    dna_buffer_pos = (unsigned)out.pos;
-                    if (!use_mask) { uppercase_dna_buffer(); }
-                    print_dna_buffer(masking);
-                }
+                dna_buffer_pos = (unsigned)size;
+                if (!use_mask) { uppercase_dna_buffer(); }
+                print_dna_buffer(masking);
             }
         }
 
@@ -512,32 +516,130 @@ static void print_dna(int masking)
 }
 
 
-static void count_dna_buffer_sequence_characters(unsigned long long *counts, int masking)
+/*
+ * Character counting works on histograms rather than on individual characters.
+ * Each histogram is split into 4 sub-tables, so that consecutive increments rarely hit the same counter
+ * (avoids store-to-load forwarding stalls on runs of identical bytes).
+ * Index 0 of the first dimension is for unmasked, and 1 for masked regions.
+ */
+static unsigned long long byte_hist[2][4][256];
+static unsigned long long nibble_hist[2][16];
+
+
+static inline void histogram_bytes(unsigned long long (*hist)[256], const unsigned char *buffer, size_t size)
+{
+    const unsigned char *p = buffer;
+    const unsigned char *end4 = buffer + (size & ~(size_t)3);
+    for (; p < end4; p += 4)
+    {
+        hist[0][p[0]]++;
+        hist[1][p[1]]++;
+        hist[2][p[2]]++;
+        hist[3][p[3]]++;
+    }
+    for (const unsigned char *end = buffer + size; p < end; p++) { hist[0][*p]++; }
+}
+
+
+/*
+ * Counts nucleotides from "a" to "b" (exclusive) in 4-bit encoded buffer.
+ * Positions are in nucleotides, so "a" and "b" may point to the middle of a byte.
+ */
+static inline void histogram_4bit_range(unsigned m, const unsigned char *buffer, unsigned long long a, unsigned long long b)
+{
+    if (b - a < 16)
+    {
+        // Short runs are typical for finely masked data, where walking bytes would cost more than counting nibbles.
+        for (unsigned long long i = a; i < b; i++) { nibble_hist[m][(buffer[i >> 1] >> ((i & 1ull) << 2)) & 15]++; }
+        return;
+    }
+    if (a & 1ull) { nibble_hist[m][buffer[a >> 1] >> 4]++; a++; }
+    histogram_bytes(byte_hist[m], buffer + (a >> 1), (size_t)((b - a) >> 1));
+    if ((b - a) & 1ull) { nibble_hist[m][buffer[b >> 1] & 15]++; }
+}
+
+
+static void count_4bit_sequence_characters(const unsigned char *buffer, size_t size, int masking)
+{
+    unsigned long long n_bp = (unsigned long long)size * 2;
+    if (n_bp > total_seq_n_bp_remaining) { n_bp = total_seq_n_bp_remaining; }
+
+    if (!masking) { histogram_4bit_range(0, buffer, 0, n_bp); }
+    else
+    {
+        // Mask state is kept in locals, as the compiler can't tell that histogram updates don't alias it.
+        unsigned long long mask_index = cur_mask;
+        unsigned long long mask_remaining = cur_mask_remaining;
+        int on = mask_on;
+
+        unsigned long long pos = 0;
+        while (pos < n_bp)
+        {
+            unsigned long long advance = mask_remaining;
+            if (advance > n_bp - pos) { advance = n_bp - pos; }
+
+            histogram_4bit_range((unsigned)on, buffer, pos, pos + advance);
+
+            mask_remaining -= advance;
+            if (mask_remaining == 0)
+            {
+                on = 1 - on;
+                mask_index++;
+                mask_remaining = mask_runs[mask_index];
+            }
+
+            pos += advance;
+        }
+
+        cur_mask = mask_index;
+        cur_mask_remaining = mask_remaining;
+        mask_on = on;
+    }
+
+    total_seq_n_bp_remaining -= n_bp;
+}
+
+
+static void count_dna_buffer_sequence_characters(int masking)
 {
     unsigned long long n_bp_to_print = dna_buffer_pos;
     if (n_bp_to_print > total_seq_n_bp_remaining) { n_bp_to_print = total_seq_n_bp_remaining; }
 
     if (masking) { mask_dna_buffer(dna_buffer, (unsigned)n_bp_to_print); }
 
-    unsigned char *end = dna_buffer + n_bp_to_print;
-    for (unsigned char *c = dna_buffer; c < end; c++)
-    {
-        counts[*c]++;
-    }
+    histogram_bytes(byte_hist[0], dna_buffer, n_bp_to_print);
 
     total_seq_n_bp_remaining -= n_bp_to_print;
     dna_buffer_pos = 0;
 }
 
 
-static void count_4bit_sequence_characters(unsigned long long *counts, unsigned char *buffer, size_t size, int masking)
+static void fold_4bit_histograms(unsigned long long *counts)
 {
-    for (unsigned int i = 0; i < size; i++)
+    for (unsigned m = 0; m < 2; m++)
     {
-        *(unsigned short *)(&dna_buffer[dna_buffer_pos]) = codes_to_nucs[buffer[i]];
-        dna_buffer_pos += 2;
+        unsigned char offset = (unsigned char)(m * 32);
+        for (unsigned b = 0; b < 256; b++)
+        {
+            unsigned long long n = byte_hist[m][0][b] + byte_hist[m][1][b] + byte_hist[m][2][b] + byte_hist[m][3][b];
+            counts[(unsigned char)(code_to_nuc[b & 15] + offset)] += n;
+            counts[(unsigned char)(code_to_nuc[b >> 4] + offset)] += n;
+        }
+        for (unsigned c = 0; c < 16; c++)
+        {
+            counts[(unsigned char)(code_to_nuc[c] + offset)] += nibble_hist[m][c];
+        }
+    }
+}
+
+
+static void fold_text_histograms(unsigned long long *counts)
+{
+    for (unsigned b = 0; b < 256; b++)
+    {
+        unsigned long long n = byte_hist[0][0][b] + byte_hist[0][1][b] + byte_hist[0][2][b] + byte_hist[0][3][b];
+        counts[use_mask ? b : (unsigned)toupper(b)] += n;
     }
-    count_dna_buffer_sequence_characters(counts, masking);
 }
 
 
@@ -547,7 +649,8 @@ static void print_charcount(int masking)
 
     skip_ids();
     skip_names();
-    skip_lengths();
+    if (has_duplicates || seq_untransposer.layout == layout_transposed || has_order) { load_lengths(); }
+    else { skip_lengths(); }
 
     if (masking) { load_mask(); }
     else { skip_mask(); }
@@ -559,44 +662,24 @@ static void print_charcount(int masking)
     compressed_seq_size = read_number(IN);
     total_seq_n_bp_remaining = total_seq_length;
 
-    size_t bytes_to_read = initialize_input_decompression();
-    size_t input_size;
-
     if (in_seq_type < seq_type_protein)
     {
-        while ( (input_size = read_next_chunk(in_buffer, bytes_to_read)) )
-        {
-            ZSTD_inBuffer in = { in_buffer, input_size, 0 };
-            while (in.pos < in.size)
-            {
-                ZSTD_outBuffer out = { out_buffer, out_buffer_size, 0 };
-                bytes_to_read = ZSTD_decompressStream(input_decompression_stream, &out, &in);
-                if (ZSTD_isError(bytes_to_read)) { die("can't decompress sequence: %s\n", ZSTD_getErrorName(bytes_to_read)); }
-                count_4bit_sequence_characters(counts, (unsigned char *)out_buffer, out.pos, masking);
-            }
-        }
+        initialize_sequence_input();
+        size_t size;
+        while ( (size = read_4bit_sequence_chunk()) ) { count_4bit_sequence_characters((unsigned char *)out_buffer, size, masking); }
+        fold_4bit_histograms(counts);
     }
     else
     {
-        while ( (input_size = read_next_chunk(in_buffer, bytes_to_read)) )
+        initialize_sequence_input();
+        size_t size;
+        while ( (size = read_sequence_chunk(dna_buffer, dna_buffer_size)) )
         {
-            ZSTD_inBuffer in = { in_buffer, input_size, 0 };
-            while (in.pos < in.size)
-            {
-                ZSTD_outBuffer out = { dna_buffer, dna_buffer_size, 0 };
-                bytes_to_read = ZSTD_decompressStream(input_decompression_stream, &out, &in);
-                if (ZSTD_isError(bytes_to_read)) { die("can't decompress sequence: %s\n", ZSTD_getErrorName(bytes_to_read)); }
-                dna_buffer_pos = (unsigned)out.pos;
-                if (!use_mask) { uppercase_dna_buffer(); }
-                count_dna_buffer_sequence_characters(counts, masking);
-            }
+            dna_buffer_pos = (unsigned)size;
+            count_dna_buffer_sequence_characters(masking);
         }
-    }
-
-    if (total_seq_n_bp_remaining > 0)
-    {
-        if (in_seq_type >= seq_type_protein && !use_mask) { uppercase_dna_buffer(); }
-        count_dna_buffer_sequence_characters(counts, masking);
+        if (total_seq_n_bp_remaining > 0) { count_dna_buffer_sequence_characters(masking); }
+        fold_text_histograms(counts);
     }
 
     for (unsigned i = 0; i < 33; i++) { if (counts[i] != 0) { fprintf(OUT, "\\x%02X\t%llu\n", i, counts[i]); } }
@@ -620,49 +703,35 @@ static void print_fasta(int masking)
     compressed_seq_size = read_number(IN);
     total_seq_n_bp_remaining = total_seq_length;
 
-    while (cur_seq_len_index < n_lengths && cur_seq_index < N && lengths_buffer[cur_seq_len_index] == 0)
+    while (cur_seq_index < N && lengths[cur_seq_index] == 0)
     {
         print_fasta_name(cur_seq_index);
-        cur_seq_len_index++;
         cur_seq_index++;
     }
     if (cur_seq_index >= N) { return; }
 
     print_fasta_name(cur_seq_index);
     cur_line_n_bp_remaining = max_line_length;
-    cur_seq_len_n_bp_remaining = lengths_buffer[cur_seq_len_index];
-
-    size_t bytes_to_read = initialize_input_decompression();
-    size_t input_size;
+    cur_seq_len_n_bp_remaining = lengths[cur_seq_index];
 
     if (in_seq_type < seq_type_protein)
     {
-        while ( total_seq_n_bp_remaining > 0 && (input_size = read_next_chunk(in_buffer, bytes_to_read)) )
+        initialize_sequence_input();
+        size_t size;
+        while ( total_seq_n_bp_remaining > 0 && (size = read_4bit_sequence_chunk()) )
         {
-            ZSTD_inBuffer in = { in_buffer, input_size, 0 };
-            while (in.pos < in.size)
-            {
-                ZSTD_outBuffer out = { out_buffer, out_buffer_size, 0 };
-                bytes_to_read = ZSTD_decompressStream(input_decompression_stream, &out, &in);
-                if (ZSTD_isError(bytes_to_read)) { die("can't decompress sequence: %s\n", ZSTD_getErrorName(bytes_to_read)); }
-                write_4bit_as_fasta((unsigned char *)out_buffer, out.pos, masking);
-            }
+            write_4bit_as_fasta((unsigned char *)out_buffer, size, masking);
         }
     }
     else
     {
-        while ( total_seq_n_bp_remaining > 0 && (input_size = read_next_chunk(in_buffer, bytes_to_read)) )
+        initialize_sequence_input();
+        size_t size;
+        while ( total_seq_n_bp_remaining > 0 && (size = read_sequence_chunk(dna_buffer, dna_buffer_size)) )
         {
-            ZSTD_inBuffer in = { in_buffer, input_size, 0 };
-            while (in.pos < in.size)
-            {
-                ZSTD_outBuffer out = { dna_buffer, dna_buffer_size, 0 };
-                bytes_to_read = ZSTD_decompressStream(input_decompression_stream, &out, &in);
-                if (ZSTD_isError(bytes_to_read)) { die("can't decompress sequence: %s\n", ZSTD_getErrorName(bytes_to_read)); }
-                dna_buffer_pos = (unsigned)out.pos;
-                if (!use_mask) { uppercase_dna_buffer(); }
-                print_dna_buffer_as_fasta(masking);
-            }
+            dna_buffer_pos = (unsigned)size;
+            if (!use_mask) { uppercase_dna_buffer(); }
+            print_dna_buffer_as_fasta(masking);
         }
     }
 
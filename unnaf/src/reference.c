@@ -0,0 +1,237 @@
+/*
+ * NAF decompressor
+ * Copyright (c) 2018-2021 Kirill Kryukov
+ * See README.md and LICENSE files of this repository
+ */
+
+/*
+ * Reference-based compression ("ennaf --ref FILE").
+ * Sequence part is compressed with zstd using the 4-bit encoded sequence of the reference NAF file as prefix,
+ * optionally followed by the same sequence shifted by one nucleotide.
+ * The reference is loaded only when the sequence is decompressed, and is verified by its length and fingerprint.
+ * Prefix is attached to the decompression stream as a raw content dictionary, which stays in use for all frames.
+ */
+
+static char *ref_path = NULL;
+static FILE *REF = NULL;
+static bool has_reference = false;
+static unsigned long long ref_expected_fingerprint = 0;
+static unsigned long long ref_expected_length = 0;
+static bool ref_has_shifted_copy = false;
+static unsigned char *ref_prefix = NULL;
+static size_t ref_prefix_size = 0;
+static ZSTD_DDict *ref_ddict = NULL;
+
+
+static void free_reference(void)
+{
+    if (REF != NULL) { fclose(REF); REF = NULL; }
+    if (ref_ddict != NULL) { ZSTD_freeDDict(ref_ddict); ref_ddict = NULL; }
+    if (ref_prefix != NULL) { free(ref_prefix); ref_prefix = NULL; }
+}
+
+
+__attribute__ ((cold))
+__attribute__ ((noreturn))
+static void unsupported_reference(const char *reason)
+{
+    die("can't use \"%s\" as reference: %s\n", ref_path, reason);
+}
+
+
+static unsigned char read_reference_byte(void)
+{
+    int c = fgetc(REF);
+    if (c == EOF) { unsupported_reference("truncated file"); }
+    return (unsigned char)c;
+}
+
+
+static unsigned long long read_reference_number(void)
+{
+    unsigned long long a = 0;
+    unsigned char c;
+    do {
+        if (a & (127ull << 57)) { unsupported_reference("corrupted file"); }
+        c = read_reference_byte();
+        a = (a << 7) | (c & 127);
+    }
+    while (c & 128);
+    return a;
+}
+
+
+static void skip_reference_bytes(unsigned long long n)
+{
+    if (fseek(REF, (long)n, SEEK_CUR) != 0) { unsupported_reference("truncated file"); }
+}
+
+
+static void skip_reference_part(void)
+{
+    read_reference_number();
+    skip_reference_bytes(read_reference_number());
+}
+
+
+/*
+ * Fingerprint of the reference 4-bit encoded sequence, same as computed by ennaf.
+ */
+static unsigned long long compute_reference_fingerprint(const unsigned char *data, size_t size)
+{
+    unsigned long long h = 0x9E3779B97F4A7C15ull ^ (unsigned long long)size;
+    const unsigned char *p = data, *end8 = data + (size & ~(size_t)7);
+    for (; p < end8; p += 8)
+    {
+        unsigned long long w;
+        memcpy(&w, p, 8);
+        h = (h ^ w) * 0xFF51AFD7ED558CCDull;
+        h ^= h >> 32;
+    }
+    for (const unsigned char *end = data + size; p < end; p++) { h = (h ^ *p) * 0xC4CEB9FE1A85EC53ull; }
+    h ^= h >> 29;
+    h *= 0xBF58476D1CE4E5B9ull;
+    h ^= h >> 32;
+    return h;
+}
+
+
+/*
+ * Extension records of the reference are skipped, unless they change how its sequence is stored.
+ */
+static void skip_reference_extensions(void)
+{
+    unsigned long long n = read_reference_number();
+    for (unsigned long long i = 0; i < n; i++)
+    {
+        unsigned long long type = read_reference_number();
+        unsigned long long size = read_reference_number();
+        if (type == ext_codecs)
+        {
+            long start = ftell(REF);
+            unsigned long long n_codecs = read_reference_number();
+            for (unsigned long long k = 0; k < n_codecs; k++)
+            {
+                unsigned long long part = read_reference_number();
+                unsigned long long codec = read_reference_number();
+                if (part == 0x02 && codec != codec_zstd) { unsupported_reference("its sequence is not compressed with zstd"); }
+            }
+            if (start < 0 || (unsigned long long)(ftell(REF) - start) != size) { unsupported_reference("corrupted file"); }
+            continue;
+        }
+        if (type == ext_seq_encoding || type == ext_dedup || type == ext_seq_layout || type == ext_homopolymers || type == ext_reference)
+        {
+            unsupported_reference("its sequence is not stored in plain 4-bit encoding");
+        }
+        if (type > ext_reference && type != ext_frames) { unsupported_reference("unsupported extension record"); }
+        skip_reference_bytes(size);
+    }
+}
+
+
+/*
+ * Decompresses "compressed_size" bytes of the reference sequence part into "dest" of "size" bytes.
+ */
+static void decompress_reference_sequence(unsigned long long compressed_size, unsigned char *dest, size_t size)
+{
+    ZSTD_DStream *stream = ZSTD_createDStream();
+    if (stream == NULL) { die("can't create reference decompression stream\n"); }
+    ZSTD_TRY(ZSTD_DCtx_setParameter(stream, ZSTD_d_windowLogMax, ZSTD_WINDOWLOG_MAX));
+
+    size_t in_size = ZSTD_DStreamInSize();
+    unsigned char *in = (unsigned char *) malloc_or_die(in_size);
+    put_magic_number(in);
+    size_t in_fill = 4;
+
+    ZSTD_outBuffer out = { dest, size, 0 };
+    unsigned long long remaining = compressed_size;
+    size_t r = 1;
+    while (remaining > 0 || in_fill > 0)
+    {
+        size_t n = (remaining < in_size - in_fill) ? (size_t)remaining : in_size - in_fill;
+        if (fread(in + in_fill, 1, n, REF) != n) { unsupported_reference("truncated file"); }
+        remaining -= n;
+
+        ZSTD_inBuffer input = { in, in_fill + n, 0 };
+        r = ZSTD_decompressStream(stream, &out, &input);
+        if (ZSTD_isError(r)) { die("can't decompress reference sequence: %s\n", ZSTD_getErrorName(r)); }
+        if (input.pos == 0 && out.pos == out.size) { unsupported_reference("sequence is longer than stated"); }
+        in_fill = input.size - input.pos;
+        memmove(in, in + input.pos, in_fill);
+    }
+    if (r != 0 || out.pos != size) { unsupported_reference("corrupted sequence"); }
+
+    free(in);
+    ZSTD_freeDStream(stream);
+}
+
+
+/*
+ * Loads the reference sequence, verifies it, and prepares the prefix.
+ */
+static void load_reference(void)
+{
+    if (ref_path == NULL) { die("input was compressed using a reference, specify it with \"--ref FILE\"\n"); }
+
+    REF = fopen(ref_path, "rb");
+    if (REF == NULL) { die("can't open reference \"%s\"\n", ref_path); }
+
+    unsigned char magic[3];
+    if (fread(magic, 1, 3, REF) != 3 || magic[0] != 0x01 || magic[1] != 0xF9 || magic[2] != 0xEC) { unsupported_reference("not a NAF file"); }
+    unsigned char version = read_reference_byte();
+    if (version < 1 || version > 2) { unsupported_reference("unknown version of NAF format"); }
+    if (version > 1 && read_reference_byte() != seq_type_rna) { unsupported_reference("it's not DNA or RNA"); }
+
+    unsigned char flags = read_reference_byte();
+    read_reference_byte();
+    read_reference_number();
+    read_reference_number();
+    if (!(flags & 0x02)) { unsupported_reference("it has no sequence"); }
+
+    if (flags & 0x80) { skip_reference_extensions(); }
+    if (flags & 0x40) { skip_reference_bytes(read_reference_number()); }
+    if (flags & 0x20) { skip_reference_part(); }
+    if (flags & 0x10) { skip_reference_part(); }
+    if (flags & 0x08) { skip_reference_part(); }
+    if (flags & 0x04) { skip_reference_part(); }
+
+    unsigned long long length = read_reference_number();
+    unsigned long long compressed_size = read_reference_number();
+    if (length != ref_expected_length) { unsupported_reference("its sequence length differs from the one used for compression"); }
+
+    unsigned long long size = (length + 1) / 2;
+    ref_prefix_size = (size_t)(ref_has_shifted_copy ? size * 2 : size);
+    ref_prefix = (unsigned char *) malloc_or_die(ref_prefix_size);
+
+    decompress_reference_sequence(compressed_size, ref_prefix, (size_t)size);
+    fclose(REF);
+    REF = NULL;
+
+    if (compute_reference_fingerprint(ref_prefix, (size_t)size) != ref_expected_fingerprint)
+    {
+        unsupported_reference("its sequence differs from the one used for compression");
+    }
+
+    if (ref_has_shifted_copy)
+    {
+        unsigned char *shifted = ref_prefix + size;
+        for (size_t i = 0; i + 1 < size; i++) { shifted[i] = (unsigned char)((ref_prefix[i] >> 4) | (ref_prefix[i + 1] << 4)); }
+        shifted[size - 1] = ref_prefix[size - 1] >> 4;
+    }
+
+    ref_ddict = ZSTD_createDDict_advanced(ref_prefix, ref_prefix_size, ZSTD_dlm_byRef, ZSTD_dct_rawContent, ZSTD_defaultCMem);
+    if (ref_ddict == NULL) { die("can't create reference dictionary\n"); }
+
+    if (verbose) { msg("Reference: %llu nucleotides, prefix: %zu bytes\n", length, ref_prefix_size); }
+}
+
+
+/*
+ * Attaches the reference to the sequence decompression stream, loading it first if necessary.
+ */
+static void attach_reference(ZSTD_DStream *stream)
+{
+    if (!has_reference) { return; }
+    if (ref_ddict == NULL) { load_reference(); }
+    ZSTD_TRY(ZSTD_DCtx_refDDict(stream, ref_ddict));
+}
@@ -0,0 +1,532 @@
+/*
+ * NAF decompressor
+ * Copyright (c) 2018-2021 Kirill Kryukov
+ * See README.md and LICENSE files of this repository
+ */
+
+/*
+ * Restores the original order of records, changed by "ennaf --reorder" or "ennaf --reorder-reads".
+ * Order record has the original number of each stored record, from which the stored number of each original record is found.
+ * Ids, names and lengths are put in the original order when loaded, and the mask is rebuilt for the original order.
+ *
+ * Sequence (and qualities, for FASTQ output) is restored one window at a time. Windows are consecutive runs of records
+ * in the original order, each fitting within the memory limit set by "--reorder-memory".
+ * If everything fits in one window, it is filled directly while decompressing the stored data.
+ * Otherwise the stored records are first distributed into a temporary file, which has a region for each window,
+ * and the windows are then loaded from that file one by one. Record larger than the limit gets a window of its own.
+ * In the window each record takes a whole number of bytes for its 4-bit encoded sequence, followed by its qualities.
+ * In the temporary file each record is also preceded by its original number.
+ *
+ * With "--stored-order" the order record is ignored, and records are output in the order they are stored.
+ */
+
+#define order_default_memory (1024ull * 1024 * 1024)
+#define order_piece_size 65536
+#define order_max_write_buffer_size (1024 * 1024)
+
+static bool keep_stored_order = false;
+static bool has_order = false;
+static unsigned long long order_memory = 0;
+static unsigned long long *order_stored_index = NULL;   // Stored number of each original record.
+static unsigned long long *order_original_index = NULL; // Original number of each stored record.
+static unsigned long long *order_offsets = NULL;        // Start of each stored record in the stored sequence.
+
+static bool order_with_qualities = false;
+static size_t (*order_read_sequence)(unsigned char *, size_t) = NULL;
+static size_t (*order_read_qualities)(unsigned char *, size_t) = NULL;
+
+static unsigned long long *order_window_first = NULL;   // First original record of each window, and N at the end.
+static unsigned long long order_n_windows = 0;
+static unsigned long long order_window = 0;             // Currently loaded window.
+static bool order_window_loaded = false;
+static unsigned char *order_window_data = NULL;
+static unsigned long long *order_window_offsets = NULL; // Start of each record of the window in "order_window_data".
+
+static unsigned char *order_seq_stage = NULL;
+static size_t order_seq_stage_size = 0;
+static size_t order_seq_stage_fill = 0;
+static unsigned long long order_seq_stage_pos = 0;      // In nucleotides.
+static unsigned char *order_qual_stage = NULL;
+static size_t order_qual_stage_fill = 0;
+static size_t order_qual_stage_pos = 0;
+
+static char *order_temp_path = NULL;
+static FILE *order_temp_file = NULL;
+static unsigned long long *order_region_start = NULL;   // Region of each window in the temporary file.
+
+static unsigned long long order_record = 0;
+static unsigned long long order_record_pos = 0;
+
+
+static void free_order(void)
+{
+    if (stored_lengths != NULL && stored_lengths != lengths) { free(stored_lengths); }
+    stored_lengths = NULL;
+    if (order_stored_index != NULL) { free(order_stored_index); order_stored_index = NULL; }
+    if (order_original_index != NULL) { free(order_original_index); order_original_index = NULL; }
+    if (order_offsets != NULL) { free(order_offsets); order_offsets = NULL; }
+    if (order_window_first != NULL) { free(order_window_first); order_window_first = NULL; }
+    if (order_window_data != NULL) { free(order_window_data); order_window_data = NULL; }
+    if (order_window_offsets != NULL) { free(order_window_offsets); order_window_offsets = NULL; }
+    if (order_seq_stage != NULL) { free(order_seq_stage); order_seq_stage = NULL; }
+    if (order_qual_stage != NULL) { free(order_qual_stage); order_qual_stage = NULL; }
+    if (order_region_start != NULL) { free(order_region_start); order_region_start = NULL; }
+    if (order_temp_file != NULL) { fclose(order_temp_file); order_temp_file = NULL; }
+    if (order_temp_path != NULL)
+    {
+        if (remove(order_temp_path) != 0) { err("can't remove temporary file \"%s\"\n", order_temp_path); }
+        free(order_temp_path);
+        order_temp_path = NULL;
+    }
+}
+
+
+/*
+ * Puts an array of N pointers, loaded in stored order, in the original order.
+ */
+static void restore_pointer_order(char **a)
+{
+    char **stored = (char **) malloc_or_die(sizeof(char *) * N);
+    memcpy(stored, a, sizeof(char *) * N);
+    for (unsigned long long i = 0; i < N; i++) { a[i] = stored[order_stored_index[i]]; }
+    free(stored);
+}
+
+
+/*
+ * Puts the lengths in the original order, keeping the stored ones in "stored_lengths".
+ */
+static void restore_lengths_order(void)
+{
+    order_offsets = (unsigned long long *) malloc_or_die(sizeof(unsigned long long) * (N + 1));
+    unsigned long long pos = 0;
+    for (unsigned long long i = 0; i < N; i++)
+    {
+        order_offsets[i] = pos;
+        if (stored_lengths[i] > ULLONG_MAX - pos) { die("corrupted input - total sequence length is too large\n"); }
+        pos += stored_lengths[i];
+    }
+    order_offsets[N] = pos;
+
+    lengths = (unsigned long long *) malloc_or_die(sizeof(unsigned long long) * (N + 1));
+    for (unsigned long long i = 0; i < N; i++) { lengths[i] = stored_lengths[order_stored_index[i]]; }
+    lengths[N] = 0;
+}
+
+
+static inline void append_mask_run(unsigned long long *runs, unsigned long long *n_runs, unsigned long long state, unsigned long long len)
+{
+    if (len == 0) { return; }
+    if (((*n_runs - 1) & 1) == state) { runs[*n_runs - 1] += len; }
+    else { runs[(*n_runs)++] = len; }
+}
+
+
+/*
+ * Rebuilds "mask_runs" (not yet terminated) for the original order of records. Requires the lengths to be loaded.
+ * Run k of the stored mask has state k & 1 (1 = masked), and the mask continues past its last run with the next state.
+ * Each record boundary splits at most one run, so the new mask has at most N more runs.
+ */
+static void restore_mask_order(void)
+{
+    assert(order_offsets != NULL);
+
+    unsigned long long *starts = (unsigned long long *) malloc_or_die(sizeof(unsigned long long) * (n_mask_runs + 1));
+    unsigned long long pos = 0;
+    for (unsigned long long k = 0; k < n_mask_runs; k++)
+    {
+        starts[k] = pos;
+        if (mask_runs[k] > ULLONG_MAX - pos) { die("corrupted mask\n"); }
+        pos += mask_runs[k];
+    }
+    starts[n_mask_runs] = pos;
+
+    unsigned long long *runs = (unsigned long long *) malloc_or_die(sizeof(unsigned long long) * (n_mask_runs + N + 2));
+    unsigned long long n_runs = 1;
+    runs[0] = 0;
+
+    for (unsigned long long i = 0; i < N; i++)
+    {
+        unsigned long long start = order_offsets[order_stored_index[i]];
+        unsigned long long remaining = lengths[i];
+
+        // Last run starting at or before the record start.
+        unsigned long long lo = 0, hi = n_mask_runs;
+        while (lo < hi)
+        {
+            unsigned long long mid = lo + (hi - lo + 1) / 2;
+            if (starts[mid] <= start) { lo = mid; } else { hi = mid - 1; }
+        }
+
+        for (unsigned long long k = lo; remaining > 0; k++)
+        {
+            unsigned long long n = remaining;
+            if (k < n_mask_runs && starts[k + 1] - start < n) { n = starts[k + 1] - start; }
+            append_mask_run(runs, &n_runs, k & 1, n);
+            start += n;
+            remaining -= n;
+        }
+    }
+
+    free(starts);
+    free(mask_runs);
+    mask_runs = runs;
+    n_mask_runs = n_runs;
+}
+
+
+/*
+ * Copies "n" nucleotides from position "src_pos" of 4-bit encoded "src" to position "dst_pos" of "dst".
+ * Destination is written sequentially, so its byte is started at even positions, and completed at odd ones.
+ */
+static void copy_nucleotides(unsigned char *dst, size_t dst_pos, const unsigned char *src, unsigned long long src_pos, size_t n)
+{
+#define COPY_ONE_NUCLEOTIDE \
+    do { \
+        unsigned char c = (src[src_pos >> 1] >> ((src_pos & 1) << 2)) & 15; \
+        if (dst_pos & 1) { dst[dst_pos >> 1] |= (unsigned char)(c << 4); } else { dst[dst_pos >> 1] = c; } \
+        dst_pos++; src_pos++; n--; \
+    } while (0)
+
+    if (n > 0 && (dst_pos & 1)) { COPY_ONE_NUCLEOTIDE; }
+
+    size_t n_bytes = n / 2;
+    const unsigned char *s = src + (src_pos >> 1);
+    unsigned char *d = dst + (dst_pos >> 1);
+    if (!(src_pos & 1)) { memcpy(d, s, n_bytes); }
+    else { for (size_t i = 0; i < n_bytes; i++) { d[i] = (unsigned char)((s[i] >> 4) | (s[i + 1] << 4)); } }
+    dst_pos += n_bytes * 2;
+    src_pos += n_bytes * 2;
+    n -= n_bytes * 2;
+
+    if (n > 0) { COPY_ONE_NUCLEOTIDE; }
+
+#undef COPY_ONE_NUCLEOTIDE
+}
+
+
+static inline unsigned long long order_record_size(unsigned long long ri)
+{
+    return (lengths[ri] + 1) / 2 + (order_with_qualities ? lengths[ri] : 0);
+}
+
+
+/*
+ * Divides the records into windows, each fitting within "order_memory", together with its record offsets.
+ */
+static void order_plan_windows(void)
+{
+    order_window_first = (unsigned long long *) malloc_or_die(sizeof(unsigned long long) * (N + 1));
+    order_n_windows = 0;
+
+    unsigned long long used = 0, size = 0, max_size = 0, max_n = 0;
+    for (unsigned long long ri = 0; ri < N; ri++)
+    {
+        unsigned long long cost = sizeof(unsigned long long) + order_record_size(ri);
+        if (ri == 0 || (used > 0 && cost > order_memory - used))
+        {
+            order_window_first[order_n_windows++] = ri;
+            used = 0;
+            size = 0;
+        }
+        used += (cost < order_memory) ? cost : order_memory;
+        size += order_record_size(ri);
+        unsigned long long n = ri + 1 - order_window_first[order_n_windows - 1];
+        if (size > max_size) { max_size = size; }
+        if (n > max_n) { max_n = n; }
+    }
+    order_window_first[order_n_windows] = N;
+
+    if (max_size >= ~(size_t)0 || max_n >= ~(size_t)0 / sizeof(unsigned long long)) { die("sequence is too large to restore the order of records\n"); }
+    order_window_data = (unsigned char *) malloc_or_die((size_t)max_size + 1);
+    order_window_offsets = (unsigned long long *) malloc_or_die(sizeof(unsigned long long) * (size_t)(max_n + 1));
+    if (verbose) { msg("Restoring the order of records in %llu windows\n", order_n_windows); }
+}
+
+
+/*
+ * Copies the next "n" nucleotides of the stored sequence to position "dst_pos" of "dst".
+ */
+static void order_take_nucleotides(unsigned char *dst, size_t dst_pos, unsigned long long n)
+{
+    while (n > 0)
+    {
+        if (order_seq_stage_pos >= (unsigned long long)order_seq_stage_fill * 2)
+        {
+            order_seq_stage_fill = order_read_sequence(order_seq_stage, order_seq_stage_size);
+            if (order_seq_stage_fill == 0) { die("corrupted input - sequence data is shorter than sequence lengths\n"); }
+            order_seq_stage_pos = 0;
+        }
+        unsigned long long available = (unsigned long long)order_seq_stage_fill * 2 - order_seq_stage_pos;
+        size_t k = (n < available) ? (size_t)n : (size_t)available;
+        copy_nucleotides(dst, dst_pos, order_seq_stage, order_seq_stage_pos, k);
+        dst_pos += k;
+        order_seq_stage_pos += k;
+        n -= k;
+    }
+}
+
+
+/*
+ * Copies the next "n" stored qualities to "dst".
+ */
+static void order_take_qualities(unsigned char *dst, unsigned long long n)
+{
+    while (n > 0)
+    {
+        if (order_qual_stage_pos >= order_qual_stage_fill)
+        {
+            order_qual_stage_fill = order_read_qualities(order_qual_stage, order_seq_stage_size);
+            if (order_qual_stage_fill == 0) { incomplete(); }
+            order_qual_stage_pos = 0;
+        }
+        size_t available = order_qual_stage_fill - order_qual_stage_pos;
+        size_t k = (n < available) ? (size_t)n : available;
+        memcpy(dst, order_qual_stage + order_qual_stage_pos, k);
+        dst += k;
+        order_qual_stage_pos += k;
+        n -= k;
+    }
+}
+
+
+static void order_compute_window_offsets(unsigned long long w)
+{
+    unsigned long long pos = 0;
+    for (unsigned long long ri = order_window_first[w]; ri < order_window_first[w + 1]; ri++)
+    {
+        order_window_offsets[ri - order_window_first[w]] = pos;
+        pos += order_record_size(ri);
+    }
+}
+
+
+/*
+ * Fills the only window directly from the stored data.
+ */
+static void order_fill_single_window(void)
+{
+    order_compute_window_offsets(0);
+    for (unsigned long long si = 0; si < N; si++)
+    {
+        unsigned long long ri = order_original_index[si];
+        unsigned char *record = order_window_data + order_window_offsets[ri];
+        order_take_nucleotides(record, 0, lengths[ri]);
+        if (order_with_qualities) { order_take_qualities(record + (lengths[ri] + 1) / 2, lengths[ri]); }
+    }
+}
+
+
+static void order_seek(unsigned long long pos)
+{
+    if (fseek(order_temp_file, (long)pos, SEEK_SET) != 0) { die("can't seek in temporary file \"%s\"\n", order_temp_path); }
+}
+
+
+static void order_create_temp_file(void)
+{
+    if (temp_dir == NULL) { temp_dir = getenv("TMPDIR"); }
+    if (temp_dir == NULL) { temp_dir = getenv("TMP"); }
+    if (temp_dir == NULL)
+    {
+        die("temporary directory is not specified.\n"
+            "Please either set TMPDIR or TMP environment variable, or add '--temp-dir DIR' to command line.\n");
+    }
+
+    long long pid = getpid();  // Some C std libs define pid_t as 'int', some as 'long long'.
+    size_t size = strlen(temp_dir) + 40;
+    order_temp_path = (char *) malloc_or_die(size);
+    snprintf(order_temp_path, size, "%s/unnaf-%lld.order", temp_dir, pid);
+    if (verbose) { msg("Temp order file: \"%s\"\n", order_temp_path); }
+    order_temp_file = fopen(order_temp_path, "wb+");
+    if (order_temp_file == NULL) { die("can't create temporary file \"%s\"\n", order_temp_path); }
+}
+
+
+/*
+ * Writes all stored records into the regions of their windows in the temporary file.
+ * Each region has a write buffer, all buffers together fitting within "order_memory".
+ */
+static void order_distribute_records(void)
+{
+    order_create_temp_file();
+
+    unsigned long long *region_pos = (unsigned long long *) malloc_or_die(sizeof(unsigned long long) * order_n_windows);
+    order_region_start = (unsigned long long *) malloc_or_die(sizeof(unsigned long long) * (order_n_windows + 1));
+    unsigned long long pos = 0;
+    for (unsigned long long w = 0; w < order_n_windows; w++)
+    {
+        order_region_start[w] = pos;
+        region_pos[w] = pos;
+        for (unsigned long long ri = order_window_first[w]; ri < order_window_first[w + 1]; ri++)
+        {
+            pos += sizeof(unsigned long long) + order_record_size(ri);
+        }
+    }
+    order_region_start[order_n_windows] = pos;
+
+    unsigned long long buffer_size_ull = order_memory / order_n_windows;
+    size_t buffer_size = (buffer_size_ull < order_max_write_buffer_size) ? (size_t)buffer_size_ull : order_max_write_buffer_size;
+    unsigned char *buffers = (unsigned char *) malloc_or_die(buffer_size * order_n_windows + 1);
+    size_t *fill = (size_t *) malloc_or_die(sizeof(size_t) * order_n_windows);
+    for (unsigned long long w = 0; w < order_n_windows; w++) { fill[w] = 0; }
+
+    unsigned char *piece = (unsigned char *) malloc_or_die(order_piece_size);
+
+#define ORDER_WRITE(w, data, size) \
+    do { \
+        unsigned char *buffer = buffers + buffer_size * (w); \
+        if (fill[w] + (size) > buffer_size && fill[w] > 0) \
+        { \
+            order_seek(region_pos[w]); \
+            fwrite_or_die(buffer, 1, fill[w], order_temp_file); \
+            region_pos[w] += fill[w]; \
+            fill[w] = 0; \
+        } \
+        if ((size) > buffer_size) \
+        { \
+            order_seek(region_pos[w]); \
+            fwrite_or_die((data), 1, (size), order_temp_file); \
+            region_pos[w] += (size); \
+        } \
+        else { memcpy(buffer + fill[w], (data), (size)); fill[w] += (size); } \
+    } while (0)
+
+    for (unsigned long long si = 0; si < N; si++)
+    {
+        unsigned long long ri = order_original_index[si];
+        unsigned long long lo = 0, hi = order_n_windows - 1;
+        while (lo < hi)
+        {
+            unsigned long long mid = lo + (hi - lo + 1) / 2;
+            if (order_window_first[mid] <= ri) { lo = mid; } else { hi = mid - 1; }
+        }
+
+        ORDER_WRITE(lo, &ri, sizeof(unsigned long long));
+        for (unsigned long long done = 0; done < lengths[ri]; )
+        {
+            unsigned long long left = lengths[ri] - done;
+            size_t n = (left < order_piece_size * 2) ? (size_t)left : order_piece_size * 2;
+            order_take_nucleotides(piece, 0, n);
+            ORDER_WRITE(lo, piece, (n + 1) / 2);
+            done += n;
+        }
+        if (order_with_qualities)
+        {
+            for (unsigned long long done = 0; done < lengths[ri]; )
+            {
+                unsigned long long left = lengths[ri] - done;
+                size_t n = (left < order_piece_size) ? (size_t)left : order_piece_size;
+                order_take_qualities(piece, n);
+                ORDER_WRITE(lo, piece, n);
+                done += n;
+            }
+        }
+    }
+
+    for (unsigned long long w = 0; w < order_n_windows; w++)
+    {
+        if (fill[w] > 0)
+        {
+            order_seek(region_pos[w]);
+            fwrite_or_die(buffers + buffer_size * w, 1, fill[w], order_temp_file);
+        }
+    }
+    fflush_or_die(order_temp_file);
+
+#undef ORDER_WRITE
+
+    free(piece);
+    free(fill);
+    free(buffers);
+    free(region_pos);
+}
+
+
+/*
+ * Loads window "w" from its region of the temporary file.
+ */
+static void order_load_window_from_file(unsigned long long w)
+{
+    order_compute_window_offsets(w);
+    order_seek(order_region_start[w]);
+
+    unsigned long long first = order_window_first[w], n = order_window_first[w + 1] - first;
+    for (unsigned long long i = 0; i < n; i++)
+    {
+        unsigned long long ri;
+        if (fread(&ri, sizeof(unsigned long long), 1, order_temp_file) != 1) { die("can't read temporary file \"%s\"\n", order_temp_path); }
+        if (ri < first || ri - first >= n) { die("corrupted temporary file \"%s\"\n", order_temp_path); }
+        size_t size = (size_t)order_record_size(ri);
+        if (fread(order_window_data + order_window_offsets[ri - first], 1, size, order_temp_file) != size) { die("can't read temporary file \"%s\"\n", order_temp_path); }
+    }
+}
+
+
+/*
+ * Prepares to restore the order of records. "read_sequence" reads the sequence in stored order,
+ * and is given at most "chunk_size" bytes at a time. "read_qualities" reads the qualities in stored order (if needed).
+ */
+static void start_restoring_order(size_t chunk_size, size_t (*read_sequence)(unsigned char *, size_t),
+                                  size_t (*read_qualities)(unsigned char *, size_t))
+{
+    assert(order_offsets != NULL);
+
+    order_with_qualities = (read_qualities != NULL);
+    if (order_with_qualities && total_quality_length != order_offsets[N]) { die("corrupted input - quality length does not match sequence lengths\n"); }
+    if (order_memory == 0) { order_memory = order_default_memory; }
+
+    order_read_sequence = read_sequence;
+    order_read_qualities = read_qualities;
+    order_seq_stage_size = chunk_size;
+    order_seq_stage = (unsigned char *) malloc_or_die(chunk_size);
+    if (order_with_qualities) { order_qual_stage = (unsigned char *) malloc_or_die(chunk_size); }
+
+    order_plan_windows();
+    if (order_n_windows > 1) { order_distribute_records(); }
+    order_window = 0;
+    order_window_loaded = false;
+}
+
+
+/*
+ * Returns the start of original record "ri" in the window, loading the next window if needed.
+ * Records must be requested in the original order.
+ */
+static const unsigned char* order_window_record(unsigned long long ri)
+{
+    while (!order_window_loaded || ri >= order_window_first[order_window + 1])
+    {
+        if (order_window_loaded) { order_window++; }
+        assert(order_window < order_n_windows);
+        if (order_n_windows == 1) { order_fill_single_window(); }
+        else { order_load_window_from_file(order_window); }
+        order_window_loaded = true;
+    }
+    return order_window_data + order_window_offsets[ri - order_window_first[order_window]];
+}
+
+
+/*
+ * Reads the next portion of sequence in the original order of records into "dest" (of "dest_size" bytes),
+ * as 4-bit encoded data. "read" reads the sequence in stored order. Requires the lengths to be loaded.
+ * Returns the number of bytes placed in "dest", or 0 at the end of sequence.
+ */
+static size_t reorder_4bit_sequence(unsigned char *dest, size_t dest_size, size_t (*read)(unsigned char *, size_t))
+{
+    assert(order_offsets != NULL);
+
+    if (order_window_first == NULL) { start_restoring_order(dest_size, read, NULL); }
+
+    size_t n = 0, max = dest_size * 2;
+    while (n < max && order_record < N)
+    {
+        unsigned long long remaining = lengths[order_record] - order_record_pos;
+        size_t k = (remaining < max - n) ? (size_t)remaining : max - n;
+        if (k > 0) { copy_nucleotides(dest, n, order_window_record(order_record), order_record_pos, k); }
+        n += k;
+        order_record_pos += k;
+        if (order_record_pos == lengths[order_record]) { order_record++; order_record_pos = 0; }
+    }
+    return (n + 1) / 2;
+}
@@ -0,0 +1,117 @@
+/*
+ * NAF decompressor
+ * Copyright (c) 2018-2021 Kirill Kryukov
+ * See README.md and LICENSE files of this repository
+ */
+
+/*
+ * Transposed layout of a part ("ennaf --qual-transpose", "ennaf --msa").
+ * Records are grouped into blocks: a block is a run of consecutive records of the same length L,
+ * of at most max(1, "max_block_size" / L) records.
+ * Each block with more than one record is stored column by column, and is decompressed as a whole and transposed back.
+ * Other blocks are passed through.
+ */
+
+typedef struct
+{
+    int layout;
+    unsigned long long max_block_size;
+    unsigned long long next_record;
+    unsigned long long block_remaining;
+    bool block_is_transposed;
+    unsigned char *block;
+    unsigned char *records;
+    size_t allocated;
+    size_t pos;
+}
+untransposer_t;
+
+static untransposer_t qual_untransposer = { layout_normal, 0, 0, 0, false, NULL, NULL, 0, 0 };
+static untransposer_t seq_untransposer = { layout_normal, 0, 0, 0, false, NULL, NULL, 0, 0 };
+
+
+static void untransposer_free(untransposer_t *u)
+{
+    if (u->block != NULL) { free(u->block); u->block = NULL; }
+    if (u->records != NULL) { free(u->records); u->records = NULL; }
+}
+
+
+/*
+ * Transposes "n_rows" rows of "n_columns" bytes from "src" into "dst", in tiles small enough to stay in cache.
+ */
+static void transpose_bytes(const unsigned char *src, unsigned char *dst, size_t n_rows, size_t n_columns)
+{
+    for (size_t r0 = 0; r0 < n_rows; r0 += 64)
+    {
+        size_t r1 = (r0 + 64 < n_rows) ? r0 + 64 : n_rows;
+        for (size_t c0 = 0; c0 < n_columns; c0 += 64)
+        {
+            size_t c1 = (c0 + 64 < n_columns) ? c0 + 64 : n_columns;
+            for (size_t c = c0; c < c1; c++)
+            {
+                for (size_t r = r0; r < r1; r++) { dst[c * n_rows + r] = src[r * n_columns + c]; }
+            }
+        }
+    }
+}
+
+
+/*
+ * Reads the next portion of the part into "dest" (of "dest_size" bytes), in the original order.
+ * "read" reads the part as stored.
+ * Returns the number of bytes placed in "dest", or 0 at the end of the part.
+ */
+static size_t untransposer_read(untransposer_t *u, unsigned char *dest, size_t dest_size, size_t (*read)(unsigned char *, size_t))
+{
+    while (u->block_remaining == 0)
+    {
+        if (u->next_record >= N) { return 0; }
+
+        unsigned long long len = stored_lengths[u->next_record];
+        unsigned long long max_records = u->max_block_size / (len ? len : 1);
+        if (max_records == 0) { max_records = 1; }
+        unsigned long long n = 1;
+        while (u->next_record + n < N && n < max_records && stored_lengths[u->next_record + n] == len) { n++; }
+
+        u->next_record += n;
+        u->block_remaining = n * len;
+        u->block_is_transposed = (n > 1);
+        if (!u->block_is_transposed || u->block_remaining == 0) { continue; }
+
+        size_t block_size = (size_t)u->block_remaining;
+        if (block_size > u->allocated)
+        {
+            untransposer_free(u);
+            u->block = (unsigned char *) malloc_or_die(block_size);
+            u->records = (unsigned char *) malloc_or_die(block_size);
+            u->allocated = block_size;
+        }
+
+        size_t filled = 0;
+        while (filled < block_size)
+        {
+            size_t size = read(u->block + filled, block_size - filled);
+            if (size == 0) { incomplete(); }
+            filled += size;
+        }
+
+        transpose_bytes(u->block, u->records, (size_t)len, (size_t)n);
+        u->pos = 0;
+    }
+
+    size_t size = (u->block_remaining < dest_size) ? (size_t)u->block_remaining : dest_size;
+    if (u->block_is_transposed)
+    {
+        memcpy(dest, u->records + u->pos, size);
+        u->pos += size;
+    }
+    else
+    {
+        size = read(dest, size);
+        if (size == 0) { incomplete(); }
+    }
+
+    u->block_remaining -= size;
+    return size;
+}
@@ -17,7 +17,7 @@ typedef enum { UNDECIDED, FORMAT_NAME, PART_LIST, PART_SIZES, NUMBER_OF_SEQUENCE
                TITLE, IDS, NAMES, LENGTHS, TOTAL_LENGTH, MASK, TOTAL_MASK_LENGTH,
                FOUR_BIT,
                DNA, MASKED_DNA, UNMASKED_DNA,
-               SEQ, SEQUENCES, CHARCOUNT,
+               SEQ, SEQUENCES, CHARCOUNT, STATS, SEQ_STATS,
                FASTA, MASKED_FASTA, UNMASKED_FASTA,
                FASTQ
              } OUTPUT_TYPE;
@@ -28,6 +28,18 @@ enum { seq_type_dna, seq_type_rna, seq_type_protein, seq_type_text };
 static int in_seq_type = seq_type_dna;
 static const char *in_seq_type_name = "DNA";
 
+enum { ext_stats = 1, ext_seq_encoding = 2, ext_dictionary = 3, ext_id_encoding = 4, ext_lengths_encoding = 5,
+       ext_mask_encoding = 6, ext_dedup = 7, ext_codecs = 8, ext_quality_binning = 9,
+       ext_quality_layout = 10, ext_seq_layout = 11, ext_homopolymers = 12, ext_reference = 13,
+       ext_order = 14, ext_frames = 15 };
+enum { seq_encoding_4bit = 0, seq_encoding_2bit = 1 };
+enum { id_encoding_plain = 0, id_encoding_tokens = 1 };
+enum { lengths_encoding_units = 0, lengths_encoding_numbers = 1, lengths_encoding_constant = 2 };
+enum { mask_encoding_units = 0, mask_encoding_numbers = 1 };
+enum { codec_zstd = 0, codec_store = 1, codec_lz4 = 2, codec_cm = 3, codec_fqz = 4 };
+enum { qual_binning_none = 0, qual_binning_illumina8 = 1, qual_binning_custom = 2 };
+enum { layout_normal = 0, layout_transposed = 1 };
+
 static bool verbose = false;
 static bool binary_stderr = false;
 static bool use_mask = true;
@@ -54,9 +66,72 @@ static int has_lengths = 0;
 static int has_mask = 0;
 static int has_data = 0;
 static int has_quality = 0;
+static int has_extended_format = 0;
 static unsigned long long max_line_length;
 static unsigned long long N;
 
+static unsigned long long n_extensions = 0;
+static unsigned long long *extension_types = NULL;
+static unsigned long long *extension_sizes = NULL;
+
+static bool has_stats = false;
+static unsigned long long stats_total_length = 0;
+static unsigned long long stats_min_length = 0;
+static unsigned long long stats_max_length = 0;
+static unsigned long long stats_n50 = 0;
+static unsigned long long stats_masked_length = 0;
+static unsigned long long stats_char_counts[256];
+
+static bool has_2bit_seq = false;
+static unsigned short nucs_2bit_to_4bit[256];
+static unsigned char *seq_2bit_buffer = NULL;
+static size_t seq_2bit_buffer_size = 0;
+static unsigned long long seq_2bit_n_bases_done = 0;
+
+static unsigned char *exceptions_buffer = NULL;
+static unsigned long long exceptions_size = 0;
+static unsigned long long exceptions_pos = 0;
+static unsigned long long exception_run_start = 0;
+static unsigned long long exception_run_end = 0;
+static unsigned char exception_run_code = 0;
+
+#define max_dict_size (1ull << 24)
+static char *dict_file_path = NULL;
+static char *temp_dir = NULL;
+static ZSTD_DDict *names_ddict = NULL;
+
+static bool has_tokenized_ids = false;
+static unsigned long long ids_size_original = 0;
+
+static unsigned long long lengths_encoding = lengths_encoding_units;
+static unsigned long long constant_length = 0;
+
+static unsigned long long mask_encoding = mask_encoding_units;
+
+static bool has_duplicates = false;
+static unsigned long long n_duplicates = 0;
+static unsigned long long deduplicated_seq_length = 0;
+static unsigned long long *duplicate_records = NULL;
+static unsigned long long *duplicate_sources = NULL;
+
+static int seq_codec = codec_zstd;
+static int qual_codec = codec_zstd;
+
+#define max_quality_bins 94
+static int qual_binning = qual_binning_none;
+static unsigned long long qual_n_bins = 0;
+static unsigned long long qual_bins[max_quality_bins][3];
+
+#define max_transpose_block_size (1ull << 28)
+
+// Transposed sequence ("ennaf --msa") is untransposed one nucleotide code per byte, then packed back to 4 bits.
+static unsigned char *seq_4bit_stage = NULL;
+static unsigned char *seq_codes_stage = NULL;
+static unsigned char *seq_codes = NULL;
+static size_t seq_codes_stage_pos = 0;
+static size_t seq_codes_stage_end = 0;
+static unsigned long long seq_codes_done = 0;
+
 
 static char *ids_buffer = NULL;
 static unsigned char *compressed_ids_buffer = NULL;
@@ -66,12 +141,12 @@ static char *names_buffer = NULL;
 static unsigned char *compressed_names_buffer = NULL;
 static char **names = NULL;
 
-static unsigned int *lengths_buffer = NULL;
+static unsigned long long *lengths = NULL;
+static unsigned long long *stored_lengths = NULL;     // Lengths in stored order, same as "lengths" unless the order of records is restored.
 static unsigned char *compressed_lengths_buffer = NULL;
-static unsigned long long n_lengths = 0;
 
-static unsigned long long mask_size = 0;
-static unsigned char *mask_buffer = NULL;
+static unsigned long long n_mask_runs = 0;
+static unsigned long long *mask_runs = NULL;
 static unsigned char *compressed_mask_buffer = NULL;
 
 static unsigned long long total_seq_length = 0;
@@ -96,9 +171,14 @@ static size_t out_print_buffer_size = 0;
 static unsigned char *out_print_buffer = NULL;
 
 static ZSTD_DStream *input_decompression_stream = NULL;
+static unsigned long long compressed_part_remaining = 0;
 static size_t file_bytes_to_read;
 static ZSTD_inBuffer zstd_file_in_buffer;
 
+static size_t seq_file_bytes_to_read;
+static ZSTD_inBuffer zstd_seq_in_buffer;
+static bool seq_out_buffer_was_full = false;
+
 static ZSTD_DStream *memory_decompression_stream = NULL;
 static size_t memory_bytes_to_read;
 static ZSTD_inBuffer zstd_mem_in_buffer;
@@ -129,7 +209,7 @@ static unsigned long long cur_seq_len_n_bp_remaining = 0;
 static unsigned long long cur_qual_len_index = 0;
 
 static unsigned long long cur_mask = 0;
-static unsigned int cur_mask_remaining = 0;
+static unsigned long long cur_mask_remaining = 0;
 static int mask_on = 0;
 
 static unsigned long long cur_line_n_bp_remaining = 0;
@@ -142,9 +222,19 @@ static bool success = false;
 
 #include "utils.c"
 #include "files.c"
+#include "detokenizer.c"
+#include "cm.c"
+#include "fqz.c"
+#include "codecs.c"
+#include "dedup.c"
+#include "transpose.c"
+#include "homopolymers.c"
+#include "reference.c"
+#include "reorder.c"
 #include "input.c"
 #include "output.c"
 #include "output-sequences.c"
+#include "output-seq-stats.c"
 #include "output-fastq.c"
 
 
@@ -159,6 +249,25 @@ static void done(void)
     close_input_file();
     close_output_file();
 
+    FREE(extension_types);
+    FREE(extension_sizes);
+    FREE(exceptions_buffer);
+    FREE(seq_2bit_buffer);
+    if (names_ddict != NULL) { ZSTD_freeDDict(names_ddict); names_ddict = NULL; }
+    free_replay();
+    part_reader_free(&seq_reader);
+    part_reader_free(&qual_reader);
+    cm_free();
+    fqz_free();
+
+    untransposer_free(&qual_untransposer);
+    untransposer_free(&seq_untransposer);
+    free_hpc();
+    free_reference();
+    free_order();
+    FREE(seq_4bit_stage);
+    FREE(seq_codes_stage);
+    FREE(seq_codes);
     FREE(ids);
     FREE(ids_buffer);
     FREE(compressed_ids_buffer);
@@ -167,10 +276,10 @@ static void done(void)
     FREE(names_buffer);
     FREE(compressed_names_buffer);
 
-    FREE(lengths_buffer);
+    FREE(lengths);
     FREE(compressed_lengths_buffer);
 
-    FREE(mask_buffer);
+    FREE(mask_runs);
     FREE(compressed_mask_buffer);
 
     FREE(compressed_seq_buffer);
@@ -221,6 +330,52 @@ static void set_output_file_path(char *new_path)
 }
 
 
+static void set_dict_file_path(char *new_path)
+{
+    assert(new_path != NULL);
+
+    if (dict_file_path != NULL) { die("double --dict parameter\n"); }
+    if (*new_path == '\0') { die("empty --dict parameter\n"); }
+    dict_file_path = new_path;
+}
+
+static void set_temp_dir(char *new_temp_dir)
+{
+    assert(new_temp_dir != NULL);
+
+    if (temp_dir != NULL) { die("double --temp-dir parameter\n"); }
+    if (*new_temp_dir == '\0') { die("empty --temp-dir parameter\n"); }
+    temp_dir = new_temp_dir;
+}
+
+
+static void set_reorder_memory(char *str)
+{
+    assert(str != NULL);
+
+    char *end;
+    long long a = strtoll(str, &end, 10);
+    unsigned long long unit = 1;
+    if (*end == 'K') { unit = 1024ull; end++; }
+    else if (*end == 'M') { unit = 1024ull * 1024; end++; }
+    else if (*end == 'G') { unit = 1024ull * 1024 * 1024; end++; }
+    if (*end != '\0' || end == str || a < 1 || (unsigned long long)a > (~0ull >> 1) / unit)
+    {
+        die("invalid value of --reorder-memory, should be a positive number of bytes, optionally followed by K, M or G\n");
+    }
+    order_memory = (unsigned long long)a * unit;
+}
+
+static void set_ref_path(char *new_path)
+{
+    assert(new_path != NULL);
+
+    if (ref_path != NULL) { die("double --ref parameter\n"); }
+    if (*new_path == '\0') { die("empty --ref parameter\n"); }
+    ref_path = new_path;
+}
+
+
 static void set_line_length(char *str)
 {
     assert(str != NULL);
@@ -260,6 +415,8 @@ static void show_help(void)
         "  --lengths       - Sequence lengths\n"
         "  --total-length  - Sum of sequence lengths\n"
         "  --mask          - Masked region lengths\n"
+        "  --stats         - Summary statistics stored at compression time\n"
+        "  --seq-stats     - Per-sequence statistics (length, GC, N, ambiguous, masked)\n"
         "  --4bit          - 4bit-encoded nucleotide sequence (binary data)\n"
         "  --seq           - Continuous concatenated sequence\n"
         "  --sequences     - One sequence per line, no names\n"
@@ -269,7 +426,12 @@ static void show_help(void)
         "  -o FILE         - Decompress into FILE\n"
         "  -c              - Write to standard output\n"
         "  --line-length N - Use lines of width N for FASTA output\n"
+        "  --dict FILE     - Use dictionary from FILE for ids and names\n"
+        "  --ref FILE      - Use NAF FILE as reference for sequence\n"
         "  --no-mask       - Ignore mask\n"
+        "  --stored-order  - Output records in the order they are stored\n"
+        "  --reorder-memory N - Restore the original order in windows of at most N bytes (K, M, G suffixes allowed, default: 1G)\n"
+        "  --temp-dir DIR  - Use DIR as temporary directory, when windows don't fit in memory\n"
         "  --binary-stdout - Set stdout stream to binary mode.\n"
         "  --binary-stderr - Set stderr stream to binary mode.\n"
         "  --binary        - Shortcut for \"--binary-stdout --binary-stderr\"\n"
@@ -292,6 +454,10 @@ static void parse_command_line(int argc, char **argv)
                 if (i < argc - 1)
                 {
                     if (!strcmp(argv[i], "--line-length")) { i++; set_line_length(argv[i]); continue; }
+                    if (!strcmp(argv[i], "--dict")) { i++; set_dict_file_path(argv[i]); continue; }
+                    if (!strcmp(argv[i], "--ref")) { i++; set_ref_path(argv[i]); continue; }
+                    if (!strcmp(argv[i], "--temp-dir")) { i++; set_temp_dir(argv[i]); continue; }
+                    if (!strcmp(argv[i], "--reorder-memory")) { i++; set_reorder_memory(argv[i]); continue; }
                 }
                 if (!strcmp(argv[i], "--format"           )) { set_out_type(FORMAT_NAME        ); continue; }
                 if (!strcmp(argv[i], "--part-list"        )) { set_out_type(PART_LIST          ); continue; }
@@ -308,9 +474,12 @@ static void parse_command_line(int argc, char **argv)
                 if (!strcmp(argv[i], "--seq"              )) { set_out_type(SEQ                ); continue; }
                 if (!strcmp(argv[i], "--sequences"        )) { set_out_type(SEQUENCES          ); continue; }
                 if (!strcmp(argv[i], "--charcount"        )) { set_out_type(CHARCOUNT          ); continue; }
+                if (!strcmp(argv[i], "--stats"            )) { set_out_type(STATS              ); continue; }
+                if (!strcmp(argv[i], "--seq-stats"        )) { set_out_type(SEQ_STATS          ); continue; }
                 if (!strcmp(argv[i], "--fasta"            )) { set_out_type(FASTA              ); continue; }
                 if (!strcmp(argv[i], "--fastq"            )) { set_out_type(FASTQ              ); continue; }
                 if (!strcmp(argv[i], "--no-mask")) { use_mask = false; continue; }
+                if (!strcmp(argv[i], "--stored-order")) { keep_stored_order = true; continue; }
                 if (!strcmp(argv[i], "--binary-stdout")) { binary_stdout = true; continue; }
                 if (!strcmp(argv[i], "--binary-stderr")) { if (!binary_stderr) { binary_stderr = true; change_stderr_to_binary(); } continue; }
                 if (!strcmp(argv[i], "--binary")) { binary_stdout = true; if (!binary_stderr) { binary_stderr = true; change_stderr_to_binary(); } continue; }
@@ -374,11 +543,14 @@ int main(int argc, char **argv)
         out_type = has_quality ? FASTQ : FASTA;
     }
 
+    // These outputs don't depend on the order of records.
+    if (out_type == CHARCOUNT || out_type == TOTAL_MASK_LENGTH) { keep_stored_order = true; }
+
     if ((out_type == DNA || out_type == MASKED_DNA || out_type == UNMASKED_DNA) && (in_seq_type != seq_type_dna))
     {
         die("input has not DNA, but %s data\n", in_seq_type_name);
     }
-    if (out_type == FOUR_BIT && in_seq_type >= seq_type_protein)
+    if ((out_type == FOUR_BIT || out_type == SEQ_STATS) && in_seq_type >= seq_type_protein)
     {
         die("input has no 4-bit encoded data, but %s sequences\n", in_seq_type_name);
     }
@@ -394,16 +566,30 @@ int main(int argc, char **argv)
 
     if (out_type == FORMAT_NAME)
     {
-        fprintf(OUT, "%s sequences%s in NAF format version %d\n", in_seq_type_name, has_quality ? " with qualities" : "", format_version);
+        if (has_quality && has_extended_format)
+        {
+            max_line_length = read_number(IN);
+            N = read_number(IN);
+            read_extensions();
+        }
+        fprintf(OUT, "%s sequences%s", in_seq_type_name, has_quality ? " with qualities" : "");
+        if (qual_binning != qual_binning_none)
+        {
+            fprintf(OUT, " binned as ");
+            print_quality_binning();
+        }
+        fprintf(OUT, " in NAF format version %d%s\n", format_version, has_extended_format ? " (extended)" : "");
     }
-    else if (out_type == PART_LIST) { print_list_of_parts(); }
     else
     {
         max_line_length = read_number(IN);
         if (line_length_is_specified) { max_line_length = requested_line_length; }
         N = read_number(IN);
+        if (has_extended_format) { read_extensions(); }
 
-        if (out_type == NUMBER_OF_SEQUENCES) { fprintf(OUT, "%llu\n", N); }
+        if (out_type == PART_LIST) { print_list_of_parts(); }
+        else if (out_type == STATS) { print_stats(); }
+        else if (out_type == NUMBER_OF_SEQUENCES) { fprintf(OUT, "%llu\n", N); }
         else if (out_type == PART_SIZES) { print_part_sizes(); }
         else if (out_type == TITLE) { print_title(); }
         else if (N != 0)
@@ -417,6 +603,7 @@ int main(int argc, char **argv)
             else if (out_type == MASK) { print_mask(); }
             else if (out_type == TOTAL_MASK_LENGTH) { print_total_mask_length(); }
             else if (out_type == FOUR_BIT) { print_4bit(); }
+            else if (out_type == SEQ_STATS) { print_seq_stats(use_mask && has_mask); }
             else
             {
                 dna_buffer_flush_size = ZSTD_DStreamOutSize() * 2;
@@ -80,6 +80,15 @@ static void init_tables(void)
             codes_to_nucs[(i << 4) | j] = (unsigned short) ( ((unsigned short)code_to_nuc[i] << 8) | code_to_nuc[j] );
         }
     }
+
+    // 2-bit codes of A, C, G, T, mapped to 4-bit codes. Each 2-bit byte becomes two 4-bit bytes.
+    static const unsigned char code_2bit_to_4bit[4] = { 8, 4, 2, 1 };
+    for (unsigned b = 0; b < 256; b++)
+    {
+        unsigned lo = code_2bit_to_4bit[b & 3] | (code_2bit_to_4bit[(b >> 2) & 3] << 4);
+        unsigned hi = code_2bit_to_4bit[(b >> 4) & 3] | (code_2bit_to_4bit[b >> 6] << 4);
+        nucs_2bit_to_4bit[b] = (unsigned short)((hi << 8) | lo);
+    }
 }
 
 
@@ -93,6 +102,15 @@ static unsigned char fgetc_or_incomplete(FILE *F)
 }
 
 
+static void fwrite_or_die(const void *ptr, size_t element_size, size_t n_elements, FILE *F)
+{
+    assert(ptr != NULL);
+    assert(F != NULL);
+    size_t elements_written = fwrite(ptr, element_size, n_elements, F);
+    if (elements_written != n_elements) { die("can't write to file - disk full?\n"); }
+}
+
+
 static void fflush_or_die(FILE *F)
 {
     assert(F != NULL);